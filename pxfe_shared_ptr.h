@@ -14,6 +14,18 @@ public:
     int use_count(void) const {
         return std::atomic_load(&__pxfe_sp_refcount);
     }
+    /** for owners which track ownership themselves (for instance
+     * a unique pointer, which may later _give the object to a
+     * pxfe_shared_ptr): set the count with a plain store instead of
+     * an atomic increment. only valid while nobody else can see
+     * the object. */
+    void _set_use_count(int c) {
+        __pxfe_sp_refcount.store(c, std::memory_order_relaxed);
+    }
+    /** called when the last reference is dropped. by default this
+     * deletes the object; a derived class may override it to put
+     * off the destructor (and the delete) until later. */
+    virtual void _last_ref_dropped(void) { delete this; }
 };
 
 /** a shared pointer object, like std::shared_ptr but different.
@@ -25,68 +37,112 @@ public:
  * 3. has casting methods so it's easy to manage heirarchicaly-derived
  *    classes, just copy-construct or assign, and if it comes out
  *    NULL, then it wasn't a polymorphic base type (dynamic_cast
- *    failed). */
+ *    failed). casts to a base class are resolved at compile time
+ *    (static_cast), only casts to a derived class pay for the
+ *    dynamic_cast.
+ * 4. taking a ref is a relaxed increment (whoever copies the pointer
+ *    already has a ref, so there's nothing to order); dropping one is
+ *    acq_rel, so all the users' writes to the object happen before
+ *    the last one deletes it. */
 template <class T>
 class pxfe_shared_ptr {
+    template <typename U> friend class pxfe_shared_ptr;
     T * ptr;
-    void ref(void)
+    static void ref(T * p)
     {
-        if (ptr)
-            ptr->__pxfe_sp_refcount ++;
+        if (p)
+            p->__pxfe_sp_refcount.fetch_add(1, std::memory_order_relaxed);
+    }
+    static void deref(T * p)
+    {
+        if (p && p->__pxfe_sp_refcount.fetch_sub(
+                1, std::memory_order_acq_rel) <= 1)
+            p->_last_ref_dropped();
+    }
+    // U* to T*: free if U is T or derived from it, else dynamic_cast.
+    template <class U>
+    static T * cast(U * p, std::true_type /*is_convertible*/)
+    {
+        return p;
     }
-    void deref(void)
+    template <class U>
+    static T * cast(U * p, std::false_type /*is_convertible*/)
     {
-        if (ptr && ptr->__pxfe_sp_refcount-- <= 1)
-        {
-            delete ptr;
-            ptr = NULL;
-        }
+        return dynamic_cast<T*>(p);
+    }
+    template <class U>
+    static T * cast(U * p)
+    {
+        return cast(p, typename std::is_convertible<U*,T*>::type());
+    }
+    // take a new ref before dropping the old one,
+    // in case they're the same object.
+    void assign(T * _ptr)
+    {
+        ref(_ptr);
+        T * old = ptr;
+        ptr = _ptr;
+        deref(old);
     }
 public:
     /** normal constructor, adds a ref to the object */
-    pxfe_shared_ptr<T>(T * _ptr = NULL)
+    pxfe_shared_ptr(T * _ptr = NULL)
     {
         ptr = _ptr;
-        ref();
+        ref(ptr);
+    }
+    /** copy constructor, adds a ref to the object */
+    pxfe_shared_ptr(const pxfe_shared_ptr<T> &other)
+    {
+        ptr = other.ptr;
+        ref(ptr);
     }
-    /** casting constructor, if dynamic_cast to the new type
+    /** casting constructor, if the cast to the new type
      * succeeds, takes a ref, otherwise sets to empty/NULL */
     template <class BaseT>
-    pxfe_shared_ptr<T>(const pxfe_shared_ptr<BaseT> &other)
+    pxfe_shared_ptr(const pxfe_shared_ptr<BaseT> &other)
     {
-        ptr = dynamic_cast<T*>(*other);
-        ref();
+        ptr = cast(other.ptr);
+        ref(ptr);
     }
     /** move constructor, transfers ownership */
-    pxfe_shared_ptr<T>(pxfe_shared_ptr<T> &&other)
+    pxfe_shared_ptr(pxfe_shared_ptr<T> &&other)
     {
         ptr = other.ptr;
         other.ptr = NULL;
     }
+    /** casting move constructor; if the cast succeeds, transfers
+     * ownership, otherwise this is empty and other keeps its ref. */
+    template <class BaseT>
+    pxfe_shared_ptr(pxfe_shared_ptr<BaseT> &&other)
+    {
+        ptr = cast(other.ptr);
+        if (ptr)
+            other.ptr = NULL;
+    }
     /** destructor which derefs the object (deleting it if ref==0) */
-    ~pxfe_shared_ptr<T>(void)
+    ~pxfe_shared_ptr(void)
     {
-        deref();
+        deref(ptr);
     }
     /** point this object to something else,
      *  deref the old and ref the new */
     void reset(T * _ptr = NULL)
     {
-        deref();
-        ptr = _ptr;
-        ref();
+        assign(_ptr);
     }
     /** give an object to this class for safe keeping; assumes
      * the reference count is already set properly and does not
      * change it (but does deref anything this class previously held) */
     void _give(T * _ptr)
     {
-        deref();
+        T * old = ptr;
         ptr = _ptr;
         // the caller is passing ownership to us,
         // presumably they had a refcount,
         // which they are giving to us,
         // so don't modify the refcount here.
+        deref(old);
     }
     /** takes an object away from this class (does not deref it) */
     T * _take(void)
@@ -98,22 +154,25 @@ public:
         ptr = NULL;
         return ret;
     }
-    /** casting assignment operator, attempts dynamic_cast. if
+    /** copy assignment operator */
+    pxfe_shared_ptr<T> &operator=(const pxfe_shared_ptr<T> &other)
+    {
+        assign(other.ptr);
+        return *this;
+    }
+    /** casting assignment operator, attempts the cast. if
      * casting fails, this object is now empty (NULL) */
     template <class BaseT>
     pxfe_shared_ptr<T> &operator=(const pxfe_shared_ptr<BaseT> &other)
     {
-        deref();
-        ptr = dynamic_cast<T*>(*other);
-        ref();
+        assign(cast(other.ptr));
         return *this;
     }
     /** move assignment operator, takes over ownership */
     pxfe_shared_ptr<T> &operator=(pxfe_shared_ptr<T> &&other)
     {
-        deref();
-        ptr = other.ptr;
-        other.ptr = NULL;
+        if (&other != this)
+            _give(other._take());
         return *this;
     }
     /** if this is the only shared ptr referencing this object */
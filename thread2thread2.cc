@@ -1,5 +1,15 @@
 
 #include "thread2thread2.h"
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef T2T2_LEAK_TRACKING
+#include <unordered_map>
+#include <sys/syscall.h>
+#endif
 
 namespace Thread2Thread2 {
 
@@ -17,6 +27,10 @@ const char * t2t2_error_types[] = {
     "QUEUE_IN_A_SET",
     "QUEUE_SET_EMPTY",
     "ENQUEUE_EMPTY_POINTER",
+    "DEQUEUE_UNIQUE_SHARED_MSG",
+    "RT_HEAP_GROWTH",
+    "RT_BLOCKING_WAIT",
+    "RT_WAKEUP_SYSCALL",
 
     // the following errors are most likely internal bugs.
     "LINKS_MAGIC_CORRUPT",
@@ -61,8 +75,402 @@ void t2t2_pool_stats :: init(int _buffer_size)
     alloc_fails = 0;
     grows = 0;
     double_frees = 0;
+    payload_capacity = 0;
+    payload_bytes_in_use = 0;
+    memset(&lock, 0, sizeof(lock));
 }
 
+//////////////////////////// T2T2_HISTOGRAM ////////////////////////////
+
+void t2t2_histogram :: reset(void)
+{
+    memset(counts, 0, sizeof(counts));
+    count = 0;
+    sum_ns = 0;
+    min_ns = 0;
+    max_ns = 0;
+}
+
+uint64_t t2t2_histogram :: percentile(double pct) const
+{
+    if (count == 0)
+        return 0;
+    uint64_t target = (uint64_t) (count * pct / 100.0 + 0.999999);
+    if (target < 1)
+        target = 1;
+    uint64_t seen = 0;
+    int ind;
+    for (ind = 0; ind < NUM_BUCKETS - 1; ind++)
+    {
+        seen += counts[ind];
+        if (seen >= target)
+            break;
+    }
+    // report the top of the bucket, but never outside what was seen.
+    uint64_t v = (ind < NUM_BUCKETS - 1) ? bucket_low(ind + 1) - 1 : max_ns;
+    if (v > max_ns)
+        v = max_ns;
+    if (v < min_ns)
+        v = min_ns;
+    return v;
+}
+
+void __t2t2_histogram :: snapshot(t2t2_histogram &h, bool reset)
+{
+    h.count = 0;
+    for (int ind = 0; ind < t2t2_histogram::NUM_BUCKETS; ind++)
+    {
+        h.counts[ind] = reset ?
+            counts[ind].exchange(0, std::memory_order_relaxed) :
+            counts[ind].load(std::memory_order_relaxed);
+        h.count += h.counts[ind];
+    }
+    if (reset)
+    {
+        h.sum_ns = sum_ns.exchange(0, std::memory_order_relaxed);
+        h.min_ns = min_ns.exchange(UINT64_MAX, std::memory_order_relaxed);
+        h.max_ns = max_ns.exchange(0, std::memory_order_relaxed);
+    }
+    else
+    {
+        h.sum_ns = sum_ns.load(std::memory_order_relaxed);
+        h.min_ns = min_ns.load(std::memory_order_relaxed);
+        h.max_ns = max_ns.load(std::memory_order_relaxed);
+    }
+    if (h.count == 0)
+        h.min_ns = 0;
+}
+
+//////////////////////////// T2T2_TRACE ////////////////////////////
+
+#ifdef T2T2_TRACING
+
+static_assert((T2T2_TRACE_RING_RECORDS & (T2T2_TRACE_RING_RECORDS-1)) == 0,
+              "T2T2_TRACE_RING_RECORDS must be a power of two");
+
+std::atomic<bool> __t2t2_trace_on(false);
+
+// each thread writes its own ring and nobody else does, so a record
+// is just four relaxed stores and a release of head. a reader copies
+// without stopping the writer, then drops whatever the writer may
+// have lapped meanwhile (see t2t2_trace_snapshot). rings outlive
+// their threads, so their records can still be read, and are
+// handed on to new threads.
+struct __t2t2_trace_ring
+{
+    static const int WORDS = 4;
+    std::atomic<uint64_t>  head;
+    std::atomic<bool>      owned;
+    __t2t2_trace_ring    * next;
+    std::atomic<uint64_t>  words[T2T2_TRACE_RING_RECORDS * WORDS];
+};
+
+static pthread_mutex_t          trace_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __t2t2_trace_ring      * trace_rings = NULL;
+static std::atomic<uint32_t>    trace_next_tid(1);
+
+struct __t2t2_trace_thread
+{
+    __t2t2_trace_ring * ring;
+    uint32_t  tid;
+    __t2t2_trace_thread(void) : ring(NULL), tid(0) { }
+    ~__t2t2_trace_thread(void)
+    {
+        if (ring)
+            ring->owned.store(false, std::memory_order_release);
+    }
+    void attach(void)
+    {
+        tid = trace_next_tid.fetch_add(1);
+        pthread_mutex_lock(&trace_rings_mutex);
+        for (ring = trace_rings; ring; ring = ring->next)
+            if (!ring->owned.load(std::memory_order_acquire))
+                break;
+        if (ring == NULL)
+        {
+            ring = new __t2t2_trace_ring;
+            ring->head.store(0);
+            for (int ind = 0;
+                 ind < T2T2_TRACE_RING_RECORDS * __t2t2_trace_ring::WORDS;
+                 ind++)
+                ring->words[ind].store(0);
+            ring->next = trace_rings;
+            trace_rings = ring;
+        }
+        ring->owned.store(true, std::memory_order_relaxed);
+        pthread_mutex_unlock(&trace_rings_mutex);
+    }
+};
+
+static thread_local __t2t2_trace_thread  trace_me;
+
+void __t2t2_trace(int event, const void *object, const void *msg)
+{
+    if (trace_me.ring == NULL)
+        trace_me.attach();
+    __t2t2_trace_ring * r = trace_me.ring;
+    uint64_t ind = r->head.load(std::memory_order_relaxed);
+    std::atomic<uint64_t> * w = &r->words[
+        (ind & (T2T2_TRACE_RING_RECORDS-1)) * __t2t2_trace_ring::WORDS];
+    // pairs with the fence in t2t2_trace_snapshot: a reader which
+    // sees any of these stores also sees head at least ind.
+    std::atomic_thread_fence(std::memory_order_release);
+    w[0].store(__t2t2_now_ns(), std::memory_order_relaxed);
+    w[1].store((uint64_t) object, std::memory_order_relaxed);
+    w[2].store((uint64_t) msg, std::memory_order_relaxed);
+    w[3].store(((uint64_t) trace_me.tid << 32) | (uint32_t) event,
+               std::memory_order_relaxed);
+    r->head.store(ind + 1, std::memory_order_release);
+}
+
+bool t2t2_trace_enable(bool on /*= true*/)
+{
+    __t2t2_trace_on.store(on, std::memory_order_relaxed);
+    return true;
+}
+
+void t2t2_trace_snapshot(std::vector<t2t2_trace_record> &records)
+{
+    const uint64_t N = T2T2_TRACE_RING_RECORDS;
+    records.clear();
+    pthread_mutex_lock(&trace_rings_mutex);
+    for (__t2t2_trace_ring * r = trace_rings; r; r = r->next)
+    {
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        uint64_t first = (head > N) ? head - N : 0;
+        size_t start = records.size();
+        for (uint64_t ind = first; ind < head; ind++)
+        {
+            std::atomic<uint64_t> * w =
+                &r->words[(ind & (N-1)) * __t2t2_trace_ring::WORDS];
+            t2t2_trace_record  rec;
+            rec.ts_ns  = w[0].load(std::memory_order_relaxed);
+            rec.object = w[1].load(std::memory_order_relaxed);
+            rec.msg    = w[2].load(std::memory_order_relaxed);
+            uint64_t  w3 = w[3].load(std::memory_order_relaxed);
+            rec.tid    = (uint32_t) (w3 >> 32);
+            rec.event  = (uint32_t) w3;
+            records.push_back(rec);
+        }
+        // anything at or before head_now - N may have been
+        // overwritten (or be half written) while we copied.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t head_now = r->head.load(std::memory_order_relaxed);
+        if (head_now + 1 > first + N)
+        {
+            size_t drop = head_now + 1 - N - first;
+            if (drop > records.size() - start)
+                drop = records.size() - start;
+            records.erase(records.begin() + start,
+                          records.begin() + start + drop);
+        }
+    }
+    pthread_mutex_unlock(&trace_rings_mutex);
+    std::stable_sort(records.begin(), records.end(),
+                     [](const t2t2_trace_record &a,
+                        const t2t2_trace_record &b) {
+                         return a.ts_ns < b.ts_ns;
+                     });
+}
+
+#else // T2T2_TRACING
+
+bool t2t2_trace_enable(bool on /*= true*/)
+{
+    (void) on;
+    return false;
+}
+
+void t2t2_trace_snapshot(std::vector<t2t2_trace_record> &records)
+{
+    records.clear();
+}
+
+#endif // T2T2_TRACING
+
+// the file is this header, then count records as they are in memory.
+struct __t2t2_trace_file_hdr
+{
+    char      magic[8];
+    uint32_t  record_size;
+    uint32_t  pad;
+    uint64_t  count;
+};
+
+static const char trace_file_magic[8] = { 'T','2','T','2','T','R','C','1' };
+
+bool t2t2_trace_save(const char *path)
+{
+    std::vector<t2t2_trace_record>  records;
+    t2t2_trace_snapshot(records);
+    FILE * f = fopen(path, "wb");
+    if (f == NULL)
+        return false;
+    __t2t2_trace_file_hdr  hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, trace_file_magic, sizeof(hdr.magic));
+    hdr.record_size = sizeof(t2t2_trace_record);
+    hdr.count = records.size();
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    if (ok && records.size() > 0)
+        ok = fwrite(records.data(), sizeof(t2t2_trace_record),
+                    records.size(), f) == records.size();
+    if (fclose(f) != 0)
+        ok = false;
+    return ok;
+}
+
+bool t2t2_trace_load(const char *path,
+                     std::vector<t2t2_trace_record> &records)
+{
+    records.clear();
+    FILE * f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+    __t2t2_trace_file_hdr  hdr;
+    bool ok = fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+        memcmp(hdr.magic, trace_file_magic, sizeof(hdr.magic)) == 0 &&
+        hdr.record_size == sizeof(t2t2_trace_record);
+    if (ok)
+    {
+        records.resize(hdr.count);
+        if (hdr.count > 0)
+            ok = fread(records.data(), sizeof(t2t2_trace_record),
+                       hdr.count, f) == hdr.count;
+    }
+    fclose(f);
+    if (!ok)
+        records.clear();
+    return ok;
+}
+
+void t2t2_trace_write_chrome(const std::vector<t2t2_trace_record> &records,
+                             std::ostream &out)
+{
+    static const char * names[] = {
+        "?", "alloc", "enqueue", "dequeue", "release"
+    };
+    // each message's life, alloc to release, is one flow; a message
+    // whose alloc fell off the ring starts one at its first event.
+    std::map<uint64_t, uint64_t>  flows; // msg -> flow id
+    std::set<uint32_t>  tids;
+    uint64_t  next_flow = 1;
+    uint64_t  t0 = records.empty() ? 0 : records[0].ts_ns;
+    char  buf[256];
+    bool  first = true;
+
+    out << "{\"traceEvents\":[\n";
+    for (const t2t2_trace_record &r : records)
+    {
+        const char * name = (r.event < sizeof(names)/sizeof(names[0])) ?
+            names[r.event] : names[0];
+        double ts = (r.ts_ns - t0) / 1000.0;
+        snprintf(buf, sizeof(buf),
+                 "%s{\"name\":\"%s\",\"cat\":\"t2t2\",\"ph\":\"X\","
+                 "\"ts\":%.3f,\"dur\":0.05,\"pid\":1,\"tid\":%u,"
+                 "\"args\":{\"object\":\"0x%llx\",\"msg\":\"0x%llx\"}}",
+                 first ? "" : ",\n", name, ts, r.tid,
+                 (unsigned long long) r.object,
+                 (unsigned long long) r.msg);
+        out << buf;
+        first = false;
+        tids.insert(r.tid);
+
+        const char * ph;
+        std::map<uint64_t, uint64_t>::iterator  it = flows.find(r.msg);
+        if (r.event == T2T2_TRACE_ALLOC || it == flows.end())
+        {
+            if (r.event == T2T2_TRACE_RELEASE)
+                // nothing else of this message's is left.
+                continue;
+            flows[r.msg] = next_flow;
+            it = flows.find(r.msg);
+            next_flow ++;
+            ph = "s";
+        }
+        else
+            ph = (r.event == T2T2_TRACE_RELEASE) ? "f" : "t";
+        snprintf(buf, sizeof(buf),
+                 ",\n{\"name\":\"msg\",\"cat\":\"t2t2\",\"ph\":\"%s\","
+                 "\"bp\":\"e\",\"id\":%llu,\"ts\":%.3f,"
+                 "\"pid\":1,\"tid\":%u}",
+                 ph, (unsigned long long) it->second, ts, r.tid);
+        out << buf;
+        if (r.event == T2T2_TRACE_RELEASE)
+            flows.erase(it);
+    }
+    for (uint32_t tid : tids)
+    {
+        snprintf(buf, sizeof(buf),
+                 "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"tid\":%u,\"args\":{\"name\":\"t2t2 thread %u\"}}",
+                 first ? "" : ",\n", tid, tid);
+        out << buf;
+        first = false;
+    }
+    out << "\n]}\n";
+}
+
+//////////////////////////// T2T2_RT_AUDIT ////////////////////////////
+
+#ifdef T2T2_RT_AUDIT
+
+thread_local int __t2t2_rt_depth = 0;
+static thread_local t2t2_rt_audit_stats  rt_audit_stats;
+static std::atomic<bool>  rt_audit_assert(false);
+
+void __t2t2_rt_violation(t2t2_error_t e, const void *object,
+                         const char *filename, int lineno)
+{
+    switch (e)
+    {
+    case t2t2_error_t::RT_HEAP_GROWTH:
+        rt_audit_stats.heap_growths ++;
+        break;
+    case t2t2_error_t::RT_BLOCKING_WAIT:
+        rt_audit_stats.blocking_waits ++;
+        break;
+    default:
+        rt_audit_stats.wakeups ++;
+        break;
+    }
+    rt_audit_stats.last_error = e;
+    rt_audit_stats.last_object = object;
+    if (rt_audit_assert.load(std::memory_order_relaxed))
+        t2t2_assert_handler(e, false, filename, lineno);
+}
+
+bool t2t2_rt_audit_assert(bool on /*= true*/)
+{
+    rt_audit_assert.store(on, std::memory_order_relaxed);
+    return true;
+}
+
+bool t2t2_rt_get_audit_stats(t2t2_rt_audit_stats &stats,
+                             bool reset /*= false*/)
+{
+    stats = rt_audit_stats;
+    if (reset)
+        memset(&rt_audit_stats, 0, sizeof(rt_audit_stats));
+    return true;
+}
+
+#else // T2T2_RT_AUDIT
+
+bool t2t2_rt_audit_assert(bool /*on = true*/)
+{
+    return false;
+}
+
+bool t2t2_rt_get_audit_stats(t2t2_rt_audit_stats &stats,
+                             bool /*reset = false*/)
+{
+    memset(&stats, 0, sizeof(stats));
+    return false;
+}
+
+#endif // T2T2_RT_AUDIT
+
 //////////////////////////// __T2T2_MEMORY_BLOCK ////////////////////////////
 
 struct __t2t2_memory_block
@@ -88,15 +496,202 @@ struct __t2t2_memory_block
     __T2T2_EVIL_NEW(__t2t2_memory_block);
 };
 
+//////////////////////////// __T2T2_LEAK_TABLE ////////////////////////////
+
+#ifdef T2T2_LEAK_TRACKING
+
+thread_local const char * __t2t2_leak_site_name = NULL;
+
+struct __t2t2_leak_info
+{
+    const char  * site_name;  // from a t2t2_leak_site, or NULL
+    const void  * site_addr;  // if not, where the public alloc returns to
+    uint64_t      alloc_ns;
+    pid_t         tid;
+};
+
+// split by buffer address like the pool stats are split by thread,
+// so allocs and releases on different threads rarely share a lock.
+struct __t2t2_leak_table
+{
+    struct shard {
+        pthread_mutex_t  mutex;
+        std::unordered_map<const void *, __t2t2_leak_info>  bufs;
+        shard(void) { pthread_mutex_init(&mutex, NULL); }
+        ~shard(void) { pthread_mutex_destroy(&mutex); }
+    } shards[T2T2_POOL_STAT_SHARDS];
+    shard &find(const void *ptr)
+    {
+        // buffers are at least 64 bytes apart.
+        return shards[((uintptr_t) ptr >> 6) % T2T2_POOL_STAT_SHARDS];
+    }
+};
+
+static pid_t __t2t2_gettid(void)
+{
+    static thread_local pid_t  tid = 0;
+    if (tid == 0)
+        tid = (pid_t) syscall(SYS_gettid);
+    return tid;
+}
+
+void __t2t2_pool :: _leak_alloc(void *ptr, const void *site_addr)
+{
+    __t2t2_leak_info  info;
+    info.site_name = __t2t2_leak_site_name;
+    info.site_addr = site_addr;
+    info.alloc_ns = __t2t2_now_ns();
+    info.tid = __t2t2_gettid();
+    __t2t2_leak_table::shard &sh = leaks->find(ptr);
+    pthread_mutex_lock(&sh.mutex);
+    sh.bufs[ptr] = info;
+    pthread_mutex_unlock(&sh.mutex);
+}
+
+void __t2t2_pool :: _leak_release(void *ptr)
+{
+    __t2t2_leak_table::shard &sh = leaks->find(ptr);
+    pthread_mutex_lock(&sh.mutex);
+    sh.bufs.erase(ptr);
+    pthread_mutex_unlock(&sh.mutex);
+}
+
+int __t2t2_pool :: dump_outstanding(int older_than_ms,
+                                    std::ostream &out /*= std::cout*/) const
+{
+    // most buffers listed under each site; the rest are only counted.
+    static const size_t MAX_PER_SITE = 8;
+    struct outstanding {
+        const void * ptr;
+        __t2t2_leak_info info;
+        bool operator<(const outstanding &o) const
+        { return info.alloc_ns < o.info.alloc_ns; }
+    };
+    uint64_t now = __t2t2_now_ns();
+    uint64_t older_than_ns = (uint64_t) older_than_ms * 1000000;
+    // sites are told apart by name if they have one, else by address.
+    std::map<std::pair<const char *, const void *>,
+             std::vector<outstanding> >  sites;
+    for (int ind = 0; ind < T2T2_POOL_STAT_SHARDS; ind++)
+    {
+        __t2t2_leak_table::shard &sh = leaks->shards[ind];
+        pthread_mutex_lock(&sh.mutex);
+        for (auto &b : sh.bufs)
+        {
+            if (now - b.second.alloc_ns < older_than_ns)
+                continue;
+            outstanding  o;
+            o.ptr = b.first;
+            o.info = b.second;
+            const void * addr = o.info.site_name ? NULL : o.info.site_addr;
+            sites[std::make_pair(o.info.site_name, addr)].push_back(o);
+        }
+        pthread_mutex_unlock(&sh.mutex);
+    }
+    std::vector<std::vector<outstanding> *>  order;
+    int count = 0;
+    for (auto &site : sites)
+    {
+        std::sort(site.second.begin(), site.second.end());
+        order.push_back(&site.second);
+        count += (int) site.second.size();
+    }
+    std::sort(order.begin(), order.end(),
+              [](std::vector<outstanding> *a, std::vector<outstanding> *b)
+              { return a->front() < b->front(); });
+
+    out << "pool " << (const void *) this << ": " << count
+        << " buffers out for " << older_than_ms << " ms or more\n";
+    for (auto site : order)
+    {
+        const __t2t2_leak_info &first = site->front().info;
+        out << "  site ";
+        if (first.site_name)
+            out << first.site_name;
+        else
+            out << first.site_addr;
+        out << ": " << site->size() << " buffers, oldest "
+            << (now - first.alloc_ns) / 1000000 << " ms\n";
+        for (size_t ind = 0; ind < site->size(); ind++)
+        {
+            if (ind == MAX_PER_SITE)
+            {
+                out << "    (and " << site->size() - ind << " more)\n";
+                break;
+            }
+            const outstanding &o = (*site)[ind];
+            out << "    " << o.ptr << " thread " << o.info.tid
+                << " age " << (now - o.info.alloc_ns) / 1000000 << " ms\n";
+        }
+    }
+    return count;
+}
+
+#else // T2T2_LEAK_TRACKING
+
+int __t2t2_pool :: dump_outstanding(int, std::ostream &) const
+{
+    return 0;
+}
+
+#endif // T2T2_LEAK_TRACKING
+
 //////////////////////////// __T2T2_POOL ////////////////////////////
 
-__t2t2_pool :: __t2t2_pool(int buffer_size,
+thread_local int __t2t2_stat_shard = -1;
+
+int __t2t2_assign_stat_shard(void)
+{
+    static std::atomic<unsigned>  next(0);
+    __t2t2_stat_shard = next.fetch_add(1) % T2T2_POOL_STAT_SHARDS;
+    return __t2t2_stat_shard;
+}
+
+__t2t2_pool :: __t2t2_pool(int _buffer_size,
                          int _num_bufs_init,
                          int _bufs_to_add_when_growing,
                          pthread_mutexattr_t *pmattr,
-                         pthread_condattr_t *pcattr)
-    : stats(buffer_size), q(pmattr, pcattr)
+                         pthread_condattr_t *pcattr,
+                         int _payload_capacity /*= 0*/)
+    : q(pmattr, pcattr)
 {
+    q._set_traced(false);
+    q._set_owner(this);
+    type_tags = NULL;
+    arena = false;
+    fair = false;
+    buffer_size = _buffer_size;
+    payload_capacity = 0;
+    for (int ind = 0; ind < T2T2_POOL_STAT_SHARDS; ind++)
+        for (int c = 0; c < __t2t2_pool_counts::NUM; c++)
+            shards[ind].c[c].store(0);
+    total_buffers = 0;
+    pthread_mutex_init(&grow_mutex, pmattr);
+    num_classes = 0;
+    shared_total = 0;
+    shared_in_use = 0;
+    quota_waiters = 0;
+    memset(class_stats, 0, sizeof(class_stats));
+    lifetime_timing.store(false);
+    lifetime_hist.store(NULL);
+    registered = false;
+#ifdef T2T2_LEAK_TRACKING
+    leaks = new __t2t2_leak_table;
+#endif
+    pthread_mutex_init(&quota_mutex, pmattr);
+    pthread_cond_init(&quota_cond, pcattr);
+    if (pcattr)
+        pthread_condattr_getclock(pcattr, &quota_clk_id);
+    else
+        quota_clk_id = CLOCK_REALTIME;
+    // the payload goes after the largest message type; both are
+    // rounded up to keep the next buffer's header aligned.
+    payload_offset = (buffer_size + 7) & ~7;
+    if (_payload_capacity > 0)
+    {
+        payload_capacity = (_payload_capacity + 7) & ~7;
+        buffer_size = payload_offset + payload_capacity;
+    }
     bufs_to_add_when_growing = _bufs_to_add_when_growing;
     add_bufs(_num_bufs_init);
 }
@@ -104,25 +699,229 @@ __t2t2_pool :: __t2t2_pool(int buffer_size,
 //virtual
 __t2t2_pool :: ~__t2t2_pool(void)
 {
+    if (registered)
+        __t2t2_registry_set(__T2T2_REGISTRY_POOL, this, NULL);
+    delete lifetime_hist.load();
+#ifdef T2T2_LEAK_TRACKING
+    delete leaks;
+#endif
+    pthread_mutex_destroy(&grow_mutex);
+    pthread_mutex_destroy(&quota_mutex);
+    pthread_cond_destroy(&quota_cond);
 }
 
 void __t2t2_pool :: add_bufs(int num_bufs)
 {
     if (num_bufs <= 0)
         return;
-    int real_buffer_size = stats.buffer_size + sizeof(__t2t2_buffer_hdr);
+    __T2T2_RT_CHECK(true, RT_HEAP_GROWTH, this);
+    int real_buffer_size = buffer_size + sizeof(__t2t2_buffer_hdr);
     int memory_block_size = num_bufs * real_buffer_size;
     __t2t2_memory_block * c = new(memory_block_size) __t2t2_memory_block;
+    pthread_mutex_lock(&grow_mutex);
     memory_pool.push_back(std::unique_ptr<__t2t2_memory_block>(c));
+    total_buffers += num_bufs;
+    pthread_mutex_unlock(&grow_mutex);
     uint8_t * ptr = (uint8_t *) c->data;
     for (int ind = 0; ind < num_bufs; ind++)
     {
         __t2t2_buffer_hdr * h = (__t2t2_buffer_hdr *) ptr;
         h->init();
-        stats.total_buffers ++;
         q._enqueue(h);
         ptr += real_buffer_size;
     }
+    if (num_classes > 0)
+    {
+        __t2t2_links_head<__t2t2_async_waiter>  served;
+        pthread_mutex_lock(&quota_mutex);
+        shared_total += num_bufs;
+        _quota_serve_async(&served);
+        if (quota_waiters > 0)
+            pthread_cond_broadcast(&quota_cond);
+        pthread_mutex_unlock(&quota_mutex);
+        _quota_wake_async(&served);
+    }
+}
+
+bool __t2t2_pool :: set_class_quotas(int _num_classes, const int *reserved)
+{
+    if (_num_classes < 1 || _num_classes > T2T2_MAX_PRIO_CLASSES)
+        return false;
+    int total_reserved = 0;
+    for (int ind = 0; ind < _num_classes; ind++)
+    {
+        if (reserved[ind] < 0)
+            return false;
+        total_reserved += reserved[ind];
+    }
+    pthread_mutex_lock(&quota_mutex);
+    int total = total_buffers;
+    // buffers already out weren't charged to any class (or were
+    // charged under the old quotas), so their releases would leave
+    // the new counts wrong; only a pool with nothing out may change.
+    int in_use;
+    if (num_classes > 0)
+    {
+        in_use = 0;
+        for (int ind = 0; ind < num_classes; ind++)
+            in_use += class_stats[ind].in_use;
+    }
+    else
+        in_use = total - q._depth();
+    bool ok = (total_reserved <= total && in_use == 0);
+    if (ok)
+    {
+        memset(class_stats, 0, sizeof(class_stats));
+        for (int ind = 0; ind < _num_classes; ind++)
+            class_stats[ind].reserved = reserved[ind];
+        shared_total = total - total_reserved;
+        shared_in_use = 0;
+        num_classes = _num_classes;
+    }
+    pthread_mutex_unlock(&quota_mutex);
+    return ok;
+}
+
+void __t2t2_pool :: get_class_stats(int prio_class,
+                                    t2t2_pool_class_stats &_stats) const
+{
+    memset(&_stats, 0, sizeof(_stats));
+    pthread_mutex_lock(&quota_mutex);
+    if (prio_class >= 0 && prio_class < num_classes)
+    {
+        _stats = class_stats[prio_class];
+        _stats.shared_free = shared_total - shared_in_use;
+    }
+    pthread_mutex_unlock(&quota_mutex);
+}
+
+// this function assumes quota_mutex is locked.
+bool __t2t2_pool :: _quota_take(int prio_class)
+{
+    t2t2_pool_class_stats &cs = class_stats[prio_class];
+    if (cs.in_use < cs.reserved)
+    {
+        cs.in_use ++;
+        return true;
+    }
+    if (shared_in_use < shared_total)
+    {
+        shared_in_use ++;
+        cs.shared_in_use ++;
+        cs.in_use ++;
+        return true;
+    }
+    return false;
+}
+
+bool __t2t2_pool :: _quota_charge(int prio_class, int wait_ms)
+{
+    pthread_mutex_lock(&quota_mutex);
+    bool ok = _quota_take(prio_class);
+    if (!ok && wait_ms == T2T2_GROW)
+    {
+        // add_bufs takes quota_mutex to grow the shared region.
+        while (!ok)
+        {
+            pthread_mutex_unlock(&quota_mutex);
+            add_bufs(bufs_to_add_when_growing);
+            _count(GROWS);
+            pthread_mutex_lock(&quota_mutex);
+            ok = _quota_take(prio_class);
+        }
+    }
+    else if (!ok && wait_ms != 0)
+    {
+        __t2t2_timespec  ts;
+        if (wait_ms > 0)
+        {
+            __t2t2_timespec t(wait_ms);
+            ts.getNow(quota_clk_id);
+            ts += t;
+        }
+        __T2T2_RT_CHECK(true, RT_BLOCKING_WAIT, this);
+        class_stats[prio_class].waits ++;
+        quota_waiters ++;
+        while (!ok)
+        {
+            if (__t2t2_reclaim_pending())
+            {
+                // see __t2t2_queue::_dequeue.
+                pthread_mutex_unlock(&quota_mutex);
+                __t2t2_reclaim_flush_pending();
+                pthread_mutex_lock(&quota_mutex);
+            }
+            else if (wait_ms < 0)
+                pthread_cond_wait(&quota_cond, &quota_mutex);
+            else if (pthread_cond_timedwait(&quota_cond, &quota_mutex,
+                                            &ts) == ETIMEDOUT)
+            {
+                ok = _quota_take(prio_class);
+                break;
+            }
+            ok = _quota_take(prio_class);
+        }
+        quota_waiters --;
+    }
+    if (!ok)
+        class_stats[prio_class].alloc_fails ++;
+    pthread_mutex_unlock(&quota_mutex);
+    return ok;
+}
+
+void __t2t2_pool :: _quota_uncharge(int prio_class)
+{
+    pthread_mutex_lock(&quota_mutex);
+    t2t2_pool_class_stats &cs = class_stats[prio_class];
+    cs.in_use --;
+    if (cs.shared_in_use > 0)
+    {
+        cs.shared_in_use --;
+        shared_in_use --;
+    }
+    __t2t2_links_head<__t2t2_async_waiter>  served;
+    _quota_serve_async(&served);
+    // a waiter may be in any class, and a reserved buffer
+    // coming back is only any use to its own class.
+    if (quota_waiters > 0)
+    {
+        __T2T2_RT_CHECK(true, RT_WAKEUP_SYSCALL, this);
+        pthread_cond_broadcast(&quota_cond);
+    }
+    pthread_mutex_unlock(&quota_mutex);
+    _quota_wake_async(&served);
+}
+
+// this function assumes quota_mutex is locked.
+void __t2t2_pool :: _quota_serve_async(
+    __t2t2_links_head<__t2t2_async_waiter> *served)
+{
+    __t2t2_async_waiter * w = quota_async_waiters.get_head();
+    while (w != quota_async_waiters.head())
+    {
+        // a waiter whose class is still full doesn't hold up
+        // the ones behind it.
+        __t2t2_async_waiter * next = w->get_next();
+        if (_quota_take(w->id))
+        {
+            w->remove();
+            served->add_prev(w);
+        }
+        w = next;
+    }
+}
+
+void __t2t2_pool :: _quota_wake_async(
+    __t2t2_links_head<__t2t2_async_waiter> *served)
+{
+    while (!served->empty())
+    {
+        __t2t2_async_waiter * w = served->get_head();
+        w->remove();
+        w->h = q._dequeue(0);
+        __T2T2_RT_CHECK(true, RT_WAKEUP_SYSCALL, this);
+        w->wake(w);
+    }
 }
 
 // wait_ms (see enum wait_flag):
@@ -130,33 +929,91 @@ void __t2t2_pool :: add_bufs(int num_bufs)
 // -1 = T2T2_WAIT_FOREVER : wait forever,
 //  0 = T2T2_NO_WAIT      : dont wait
 // >0                     : wait for some mS
-void * __t2t2_pool :: _alloc(int wait_ms)
+void * __t2t2_pool :: _alloc(int wait_ms, int payload_len /*= 0*/,
+                             int prio_class /*= 0*/,
+                             const void *site /*= NULL*/)
 {
     __t2t2_buffer_hdr * h = NULL;
-    if (wait_ms == T2T2_GROW)
+    if (num_classes > 0)
+    {
+        // once charged, a buffer is sure to be on q.
+        if (_quota_charge(prio_class, wait_ms))
+        {
+            h = q._dequeue(0);
+            if (h == NULL)
+                _quota_uncharge(prio_class);
+        }
+    }
+    else if (wait_ms == T2T2_GROW)
     {
         if (q._empty())
         {
             add_bufs(bufs_to_add_when_growing);
-            stats.grows ++;
+            _count(GROWS);
         }
         h = q._dequeue(0);
     }
+    else if (fair)
+    {
+        h = q._dequeue_fifo(wait_ms);
+    }
     else
     {
         h = q._dequeue(wait_ms);
     }
     if (h == NULL)
     {
-        stats.alloc_fails ++;
+        _count(ALLOC_FAILS);
         return NULL;
     }
-    stats.buffers_in_use++;
+    _count(ALLOCS);
+    if (payload_len > 0)
+        _count(ALLOC_BYTES, payload_len);
+    _stamp_alloc(h);
+    h++;
+    __T2T2_TRACE(true, T2T2_TRACE_ALLOC, this, h);
+    _leak_alloc(h, site);
+    if (arena)
+        _get_arena(h)->init(payload_capacity);
+    return h;
+}
+
+bool __t2t2_pool :: _alloc_async(__t2t2_async_waiter *w,
+                                 int prio_class /*= 0*/)
+{
+    if (num_classes == 0)
+        return q._dequeue_async(w);
+    // the wait is for the quota rather than on q: once charged
+    // (here or by a release), a buffer is sure to be on q.
+    pthread_mutex_lock(&quota_mutex);
+    bool ok = _quota_take(prio_class);
+    if (!ok)
+    {
+        class_stats[prio_class].waits ++;
+        w->id = prio_class;
+        quota_async_waiters.add_prev(w);
+    }
+    pthread_mutex_unlock(&quota_mutex);
+    if (ok)
+        w->h = q._dequeue(0);
+    return ok;
+}
+
+void * __t2t2_pool :: _alloc_async_done(__t2t2_buffer_hdr *h,
+                                        const void *site /*= NULL*/)
+{
+    _count(ALLOCS);
+    _stamp_alloc(h);
     h++;
+    __T2T2_TRACE(true, T2T2_TRACE_ALLOC, this, h);
+    _leak_alloc(h, site);
+    if (arena)
+        _get_arena(h)->init(payload_capacity);
     return h;
 }
 
-void __t2t2_pool :: release(void * ptr)
+void __t2t2_pool :: release(void * ptr, int payload_len /*= 0*/,
+                            int prio_class /*= 0*/)
 {
     __t2t2_buffer_hdr * h = (__t2t2_buffer_hdr *) ptr;
     h--;
@@ -165,52 +1022,437 @@ void __t2t2_pool :: release(void * ptr)
         if (q._onthislist(h))
         {
             __T2T2_ASSERT(DOUBLE_FREE,false);
-            stats.double_frees ++;
+            _count(DOUBLE_FREES);
         }
         else
         {
             __T2T2_ASSERT(POOL_RELEASE_ALREADY_ON_LIST,true);
         }
+        // a refused release isn't counted, doesn't go back on the
+        // free list, and doesn't give back its class's quota: the
+        // release that already happened (or will) did all that.
+        return;
     }
+    _record_lifetime(h);
+    __T2T2_TRACE(true, T2T2_TRACE_RELEASE, this, ptr);
+    _leak_release(ptr);
+    _count(RELEASES);
+    if (payload_len > 0)
+        _count(RELEASE_BYTES, payload_len);
     // ignoring return value because we've already
     // checked the h->list condition above.
     q._enqueue(h);
-    stats.buffers_in_use --;
+    if (num_classes > 0)
+        _quota_uncharge(prio_class);
+}
+
+void __t2t2_pool :: _collect(__t2t2_pool_counts &counts) const
+{
+    uint64_t sums[__t2t2_pool_counts::NUM] = { 0 };
+    for (int ind = 0; ind < T2T2_POOL_STAT_SHARDS; ind++)
+        for (int c = 0; c < __t2t2_pool_counts::NUM; c++)
+            sums[c] += shards[ind].c[c].load(std::memory_order_acquire);
+    counts.allocs        = sums[ALLOCS];
+    counts.releases      = sums[RELEASES];
+    counts.alloc_bytes   = sums[ALLOC_BYTES];
+    counts.release_bytes = sums[RELEASE_BYTES];
+    counts.alloc_fails   = sums[ALLOC_FAILS];
+    counts.grows         = sums[GROWS];
+    counts.double_frees  = sums[DOUBLE_FREES];
 }
 
 void __t2t2_pool :: get_stats(t2t2_pool_stats &_stats) const
 {
-    _stats = stats;
+    _peek_stats(_stats);
+    q._get_lock_stats(_stats.lock);
 }
 
-//////////////////////////// __T2T2_QUEUE ////////////////////////////
+void __t2t2_pool :: _peek_stats(t2t2_pool_stats &_stats) const
+{
+    // collect until two passes in a row agree. every counter only
+    // goes up, so if the sums agree, no shard changed between its
+    // two reads, and there was a moment between the passes when
+    // they all held these values at once. a pool too busy to
+    // settle gets the last pass, with in_use kept in bounds.
+    __t2t2_pool_counts  a, b;
+    _collect(a);
+    for (int tries = 0; tries < 8; tries++)
+    {
+        _collect(b);
+        bool same = memcmp(&a, &b, sizeof(a)) == 0;
+        a = b;
+        if (same)
+            break;
+    }
+    _stats.init(buffer_size);
+    _stats.payload_capacity = payload_capacity;
+    _stats.total_buffers = total_buffers;
+    int64_t in_use = (int64_t) (a.allocs - a.releases);
+    if (in_use < 0)
+        in_use = 0;
+    if (in_use > _stats.total_buffers)
+        in_use = _stats.total_buffers;
+    _stats.buffers_in_use = (int) in_use;
+    _stats.payload_bytes_in_use =
+        (a.alloc_bytes > a.release_bytes) ?
+        a.alloc_bytes - a.release_bytes : 0;
+    _stats.alloc_fails = (int) a.alloc_fails;
+    _stats.grows = (int) a.grows;
+    _stats.double_frees = (int) a.double_frees;
+}
 
-__t2t2_queue :: __t2t2_queue(pthread_mutexattr_t *pmattr,
-                           pthread_condattr_t *pcattr)
+bool __t2t2_pool :: set_registry_name(const char *name)
 {
-    __t2t2_links::init();
-    pthread_mutex_init(&mutex, pmattr);
+    bool ok = __t2t2_registry_set(__T2T2_REGISTRY_POOL, this, name);
+    if (ok)
+        registered = (name != NULL);
+    return ok;
+}
+
+bool __t2t2_pool :: enable_lifetime_histogram(bool enable /*= true*/)
+{
+#ifdef T2T2_TIMESTAMPS
+    if (enable && lifetime_hist.load() == NULL)
+    {
+        __t2t2_histogram * h = new __t2t2_histogram;
+        __t2t2_histogram * expected = NULL;
+        if (!lifetime_hist.compare_exchange_strong(expected, h))
+            // another thread beat us to it.
+            delete h;
+    }
+    lifetime_timing.store(enable, std::memory_order_release);
+    return true;
+#else
+    (void) enable;
+    return false;
+#endif
+}
+
+void __t2t2_pool :: get_lifetime_histogram(t2t2_histogram &hist,
+                                           bool reset /*= false*/)
+{
+    __t2t2_histogram * h = lifetime_hist.load(std::memory_order_acquire);
+    if (h)
+        h->snapshot(hist, reset);
+    else
+        hist.reset();
+}
+
+void __t2t2_pool :: release_list(__t2t2_links_head<__t2t2_buffer_hdr> *bufs,
+                                int count, int payload_bytes)
+{
+#ifdef T2T2_LEAK_TRACKING
+    for (__t2t2_buffer_hdr * h = bufs->get_head();
+         h != bufs->head(); h = h->get_next())
+        _leak_release(h + 1);
+#endif
+    q._enqueue_list(bufs, false);
+    _count(RELEASES, count);
+    if (payload_bytes > 0)
+        _count(RELEASE_BYTES, payload_bytes);
+}
+
+//////////////////////////// __T2T2_QUEUE ////////////////////////////
+
+__t2t2_queue :: __t2t2_queue(pthread_mutexattr_t *pmattr,
+                           pthread_condattr_t *pcattr,
+                           bool _deadline_ordered /*= false*/,
+                           int _num_key_buckets /*= 0*/)
+{
+    __t2t2_links::init();
+    pthread_mutex_init(&mutex, pmattr);
     pthread_cond_init(&cond, pcattr);
     if (pcattr)
         pthread_condattr_getclock(pcattr, &clk_id);
     else
         // the default condattr clock appears to be REALTIME
         clk_id = CLOCK_REALTIME;
-    psetmutex = NULL;
-    psetcond = NULL;
+    pset = NULL;
+    notifying.store(0);
     id = 0;
+    deadline_ordered = _deadline_ordered;
+    due_seq = 0;
+    key_buckets = NULL;
+    key_mask = 0;
+    keyed_enqueues = 0;
+    conflated = 0;
+    depth.store(0);
+    high_water = 0;
+    enqueues = 0;
+    dequeues = 0;
+    timeouts = 0;
+    wait_ns = 0;
+    timing.store(false);
+    delay_hist = NULL;
+    traced = true;
+    registered = false;
+    watched.store(false);
+    watchdog = NULL;
+    head.init();
+    owner = this;
+    if (_num_key_buckets > 0)
+    {
+        uint32_t  nb = 1;
+        while ((int) nb < _num_key_buckets)
+            nb <<= 1;
+        key_buckets = new __t2t2_buffer_hdr*[nb];
+        for (uint32_t ind = 0; ind < nb; ind++)
+            key_buckets[ind] = NULL;
+        key_mask = nb - 1;
+    }
 }
 
 __t2t2_queue :: ~__t2t2_queue(void)
 {
+    if (registered)
+        __t2t2_registry_set(__T2T2_REGISTRY_QUEUE, this, NULL);
+    if (watchdog)
+        watchdog->_unwatch(this);
+    delete[] key_buckets;
+    delete delay_hist;
     pthread_mutex_destroy(&mutex);
     pthread_cond_destroy(&cond);
 }
 
-bool __t2t2_queue :: _empty(void)
+void __t2t2_queue :: set_pset(__t2t2_queue_set *s /*= NULL*/)
+{
+    Lock l(&mutex, &prof);
+    int d = depth.load(std::memory_order_relaxed);
+    if (pset)
+        pset->_depth_changed(-d);
+    pset = s;
+    if (pset)
+        pset->_depth_changed(d);
+}
+
+void __t2t2_queue :: _get_stats(t2t2_queue_stats &_stats)
+{
+    Lock l(&mutex, &prof);
+    prof.get(_stats.lock);
+    _peek_stats(_stats);
+}
+
+void __t2t2_queue :: _peek_stats(t2t2_queue_stats &_stats) const
+{
+    _stats.depth = depth.load(std::memory_order_relaxed);
+    _stats.high_water = high_water;
+    _stats.enqueues = enqueues;
+    _stats.dequeues = dequeues;
+    _stats.timeouts = timeouts;
+    _stats.wait_ns = wait_ns;
+}
+
+void __t2t2_queue :: _get_lock_stats(t2t2_lock_stats &_stats) const
+{
+    Lock l(&mutex, &prof);
+    prof.get(_stats);
+}
+
+bool __t2t2_queue :: _enable_delay_histogram(bool enable)
+{
+#ifdef T2T2_TIMESTAMPS
+    Lock l(&mutex, &prof);
+    if (enable && delay_hist == NULL)
+        delay_hist = new __t2t2_histogram;
+    timing.store(enable, std::memory_order_relaxed);
+    return true;
+#else
+    (void) enable;
+    return false;
+#endif
+}
+
+void __t2t2_queue :: _get_delay_histogram(t2t2_histogram &hist, bool reset)
+{
+    Lock l(&mutex, &prof);
+    if (delay_hist)
+        delay_hist->snapshot(hist, reset);
+    else
+        hist.reset();
+}
+
+// this function assumes mutex is locked.
+void __t2t2_queue :: _publish_head(void)
+{
+    if (buffers.empty())
+    {
+        head.write(0, NULL);
+        return;
+    }
+    __t2t2_buffer_hdr * h = buffers.get_head();
+#ifdef T2T2_TIMESTAMPS
+    // a buffer enqueued before the watch began wasn't stamped;
+    // it has been waiting at least since now.
+    if (h->enqueue_ns == 0)
+        h->enqueue_ns = __t2t2_now_ns();
+    head.write(h->enqueue_ns, h + 1);
+#else
+    // buffers aren't stamped, so the age is how long h has been at
+    // the head; enqueues behind it mustn't restart that.
+    uint64_t since;
+    const void * msg;
+    head.read(&since, &msg);
+    if (msg != h + 1)
+        head.write(__t2t2_now_ns(), h + 1);
+#endif
+}
+
+// this function assumes mutex is locked.
+void __t2t2_queue :: _count_enqueues(int n)
+{
+    int d = depth.load(std::memory_order_relaxed) + n;
+    depth.store(d, std::memory_order_release);
+    if (d > high_water)
+        high_water = d;
+    enqueues += n;
+    if (pset)
+        pset->_depth_changed(n, true);
+    _head_changed();
+}
+
+// this function assumes mutex is locked.
+void __t2t2_queue :: _count_wait(const __t2t2_timespec &blocked_at)
+{
+    __t2t2_timespec  now;
+    now.getNow(clk_id);
+    wait_ns += now.to_ns() - blocked_at.to_ns();
+}
+
+// this function assumes mutex is locked.
+__t2t2_buffer_hdr *
+__t2t2_queue :: _get_ready(__t2t2_timespec *next_due, bool *have_due)
+{
+    if (buffers.empty())
+        return NULL;
+    __t2t2_buffer_hdr * h = buffers.get_head();
+    if (deadline_ordered)
+    {
+        const due_entry &top = due.front();
+        h = top.h;
+        __t2t2_timespec  now;
+        now.getNow(clk_id);
+        if (now < top.deliver_at)
+        {
+            // the heap's top is the earliest, so if it isn't due,
+            // nothing else is either.
+            if (!*have_due ||
+                __t2t2_timespec::before(top.deliver_at, *next_due))
+            {
+                next_due->tv_sec  = top.deliver_at.tv_sec;
+                next_due->tv_nsec = top.deliver_at.tv_nsec;
+            }
+            *have_due = true;
+            return NULL;
+        }
+    }
+    return h;
+}
+
+//static
+bool __t2t2_queue :: _due_after(const due_entry &a, const due_entry &b)
+{
+    if (__t2t2_timespec::before(b.deliver_at, a.deliver_at))
+        return true;
+    if (__t2t2_timespec::before(a.deliver_at, b.deliver_at))
+        return false;
+    return a.seq > b.seq;
+}
+
+// this function assumes mutex is locked.
+void __t2t2_queue :: _due_up(size_t ind)
+{
+    due_entry  e = due[ind];
+    while (ind > 0)
+    {
+        size_t parent = (ind - 1) / 2;
+        if (!_due_after(due[parent], e))
+            break;
+        due[ind] = due[parent];
+        due[ind].h->due_index = ind;
+        ind = parent;
+    }
+    due[ind] = e;
+    e.h->due_index = ind;
+}
+
+// this function assumes mutex is locked.
+void __t2t2_queue :: _due_down(size_t ind)
+{
+    due_entry  e = due[ind];
+    size_t n = due.size();
+    while (1)
+    {
+        size_t child = 2 * ind + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && _due_after(due[child], due[child + 1]))
+            child ++;
+        if (!_due_after(e, due[child]))
+            break;
+        due[ind] = due[child];
+        due[ind].h->due_index = ind;
+        ind = child;
+    }
+    due[ind] = e;
+    e.h->due_index = ind;
+}
+
+void __t2t2_queue :: _reserve_due(int capacity)
 {
-    Lock  l(&mutex);
-    return buffers.empty();
+    Lock l(&mutex, &prof);
+    if (capacity > 0)
+        due.reserve(capacity);
+}
+
+// this function assumes mutex is locked.
+void __t2t2_queue :: _remove(__t2t2_buffer_hdr *h)
+{
+    if (deadline_ordered)
+    {
+        // the dequeue path only ever removes the top, but any entry
+        // can go: the last one takes its place and is moved up or
+        // down from there.
+        size_t ind = h->due_index;
+        due[ind] = due.back();
+        due[ind].h->due_index = ind;
+        due.pop_back();
+        if (ind < due.size())
+        {
+            if (ind > 0 && _due_after(due[(ind - 1) / 2], due[ind]))
+                _due_up(ind);
+            else
+                _due_down(ind);
+        }
+    }
+    if (key_buckets)
+    {
+        // a buffer that was enqueued without a key won't be found,
+        // which is fine.
+        __t2t2_buffer_hdr ** pp;
+        for (pp = _key_bucket(h->conflate.key); *pp;
+             pp = &(*pp)->conflate.next)
+        {
+            if (*pp == h)
+            {
+                *pp = h->conflate.next;
+                break;
+            }
+        }
+    }
+    h->remove();
+    depth.store(depth.load(std::memory_order_relaxed) - 1,
+                std::memory_order_release);
+    dequeues ++;
+    __T2T2_TRACE(traced, T2T2_TRACE_DEQUEUE, this, h + 1);
+#ifdef T2T2_TIMESTAMPS
+    // (a watched queue stamps buffers even when not timing.)
+    if (h->enqueue_ns != 0 && delay_hist &&
+        timing.load(std::memory_order_relaxed))
+        delay_hist->record(__t2t2_now_ns() - h->enqueue_ns);
+#endif
+    if (pset)
+        pset->_depth_changed(-1);
+    _head_changed();
 }
 
 // -1 : wait forever
@@ -219,8 +1461,8 @@ bool __t2t2_queue :: _empty(void)
 __t2t2_buffer_hdr * __t2t2_queue :: _dequeue(int wait_ms)
 {
     __t2t2_buffer_hdr * h = NULL;
-    Lock  l(&mutex);
-    if (psetmutex != NULL)
+    Lock  l(&mutex, &prof);
+    if (pset != NULL)
     {
         __T2T2_ASSERT(QUEUE_IN_A_SET,false);
         return NULL;
@@ -229,43 +1471,228 @@ __t2t2_buffer_hdr * __t2t2_queue :: _dequeue(int wait_ms)
     bool first = true;
     __t2t2_timespec  ts;
     // if wait_ms == 0, just short circuit the
-    // while loop and check buffers.empty only once.
+    // while loop and check buffers only once.
     bool timed_out = (wait_ms == 0);
-    bool empty = buffers.empty();
+    __t2t2_timespec  due;
+    bool have_due = false;
+    __t2t2_timespec  blocked_at;
+    bool blocked = false;
 
-    while (empty && !timed_out)
+    h = _get_ready(&due, &have_due);
+    while (!h && !timed_out)
     {
-        if (wait_ms < 0)
+        if (__t2t2_reclaim_pending())
+        {
+            // this thread may be holding the very buffers it would
+            // wait for (e.g. all of a pool), so hand them over first.
+            l.unlock();
+            __t2t2_reclaim_flush_pending();
+            l.relock();
+            have_due = false;
+            h = _get_ready(&due, &have_due);
+            continue;
+        }
+        if (!blocked)
+        {
+            __T2T2_RT_CHECK(true, RT_BLOCKING_WAIT, owner);
+            blocked_at.getNow(clk_id);
+            blocked = true;
+            sleepers ++;
+        }
+        if (wait_ms > 0 && first)
+        {
+            __t2t2_timespec t(wait_ms);
+            ts = blocked_at;
+            ts += t;
+            first = false;
+        }
+        if (have_due && (wait_ms < 0 || due < ts))
+        {
+            // a deadline queue's head comes due before the caller's
+            // timeout. an enqueue of an earlier deadline also wakes
+            // us, so 'due' gets recalculated every time around.
+            l.timedwait(&cond, &due);
+        }
+        else if (wait_ms < 0)
         {
             // we never set timed_out.
-            pthread_cond_wait(&cond, &mutex);
+            l.wait(&cond);
         }
         else // wait_ms > 0 (note ==0 was already checked)
         {
-            if (first)
-            {
-                __t2t2_timespec t(wait_ms);
-                ts.getNow(clk_id);
-                ts += t;
-                first = false;
-            }
-            int ret = pthread_cond_timedwait(&cond, &mutex, &ts);
+            int ret = l.timedwait(&cond, &ts);
             if (ret == ETIMEDOUT)
                 timed_out = true;
         }
-        empty = buffers.empty();
+        have_due = false;
+        h = _get_ready(&due, &have_due);
+    }
+    if (blocked)
+    {
+        sleepers --;
+        _count_wait(blocked_at);
+        if (h == NULL)
+            timeouts ++;
     }
-    if (!empty)
+    if (h)
     {
-        h = buffers.get_head();
         h->ok();
         if (!_validate(h))
             __T2T2_ASSERT(QUEUE_DEQUEUE_NOT_ON_THIS_LIST,true);
-        h->remove();
+        _remove(h);
     }
     return h;
 }
 
+bool __t2t2_queue :: _dequeue_async(__t2t2_async_waiter *w)
+{
+    Lock  l(&mutex, &prof);
+    if (pset != NULL)
+    {
+        __T2T2_ASSERT(QUEUE_IN_A_SET,false);
+        // complete it right away, with nothing.
+        w->h = NULL;
+        return true;
+    }
+    __t2t2_timespec  due;
+    bool have_due = false;
+    w->h = _get_ready(&due, &have_due);
+    if (w->h)
+    {
+        if (!_validate(w->h))
+            __T2T2_ASSERT(QUEUE_DEQUEUE_NOT_ON_THIS_LIST,true);
+        _remove(w->h);
+        return true;
+    }
+    async_waiters.add_prev(w);
+    return false;
+}
+
+// a thread blocked in _dequeue_fifo. the waker takes the queue
+// mutex to signal, and the waiter doesn't return until it has, so
+// cond is never signalled after the waiter's stack is gone.
+struct __t2t2_thread_waiter : public __t2t2_async_waiter
+{
+    __t2t2_queue    * q;
+    pthread_cond_t    cond;
+    bool              signalled;
+    static void signal(__t2t2_async_waiter *_w)
+    {
+        __t2t2_thread_waiter * w = (__t2t2_thread_waiter *) _w;
+        __t2t2_queue::Lock  l(&w->q->mutex, &w->q->prof);
+        w->signalled = true;
+        pthread_cond_signal(&w->cond);
+    }
+};
+
+__t2t2_buffer_hdr * __t2t2_queue :: _dequeue_fifo(int wait_ms)
+{
+    __t2t2_buffer_hdr * h = NULL;
+    Lock  l(&mutex, &prof);
+    // anything ready would have gone to a waiter,
+    // so if there are waiters, there's nothing to take.
+    if (async_waiters.empty())
+    {
+        __t2t2_timespec  due;
+        bool have_due = false;
+        h = _get_ready(&due, &have_due);
+        if (h)
+        {
+            if (!_validate(h))
+                __T2T2_ASSERT(QUEUE_DEQUEUE_NOT_ON_THIS_LIST,true);
+            _remove(h);
+            return h;
+        }
+    }
+    if (wait_ms == 0)
+        return NULL;
+    __T2T2_RT_CHECK(true, RT_BLOCKING_WAIT, owner);
+
+    __t2t2_thread_waiter  w;
+    w.init();
+    w.wake = &__t2t2_thread_waiter::signal;
+    w.q = this;
+    w.signalled = false;
+    pthread_condattr_t  cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, clk_id);
+    pthread_cond_init(&w.cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    __t2t2_timespec  blocked_at;
+    blocked_at.getNow(clk_id);
+    __t2t2_timespec  ts;
+    if (wait_ms > 0)
+    {
+        __t2t2_timespec t(wait_ms);
+        ts = blocked_at;
+        ts += t;
+    }
+    async_waiters.add_prev(&w);
+    if (__t2t2_reclaim_pending())
+    {
+        // see _dequeue. w is already in line, so anything the
+        // flush gives back can be handed straight to it.
+        l.unlock();
+        __t2t2_reclaim_flush_pending();
+        l.relock();
+    }
+    bool timed_out = false;
+    while (!w.signalled)
+    {
+        if (timed_out)
+        {
+            // if a buffer was handed over in the meantime,
+            // the wake is on its way; take the buffer.
+            if (w.h == NULL)
+            {
+                w.remove();
+                break;
+            }
+            l.wait(&w.cond);
+        }
+        else if (wait_ms < 0)
+            l.wait(&w.cond);
+        else if (l.timedwait(&w.cond, &ts) == ETIMEDOUT)
+            timed_out = true;
+    }
+    pthread_cond_destroy(&w.cond);
+    _count_wait(blocked_at);
+    if (w.h == NULL)
+        timeouts ++;
+    return w.h;
+}
+
+// this function assumes mutex is locked.
+__t2t2_async_waiter * __t2t2_queue :: _serve_async(void)
+{
+    if (async_waiters.empty())
+        return NULL;
+    __t2t2_timespec  due;
+    bool have_due = false;
+    __t2t2_buffer_hdr * h = _get_ready(&due, &have_due);
+    if (h == NULL)
+        return NULL;
+    __t2t2_async_waiter * w = async_waiters.get_head();
+    w->remove();
+    _remove(h);
+    w->h = h;
+    return w;
+}
+
+void __t2t2_queue :: _notify(__t2t2_async_waiter *w, __t2t2_queue_set *s)
+{
+    // the set is told after our mutex is released: the set locks
+    // set_mutex before any member's mutex, so holding ours while
+    // taking set_mutex could deadlock against a set dequeue.
+    __T2T2_RT_CHECK(w != NULL || sleepers > 0, RT_WAKEUP_SYSCALL, owner);
+    if (s)
+        s->_notify(this);
+    pthread_cond_signal(&cond);
+    if (w)
+        w->wake(w);
+}
+
 bool __t2t2_queue :: _enqueue(__t2t2_buffer_hdr *h)
 {
     h->ok();
@@ -274,40 +1701,221 @@ bool __t2t2_queue :: _enqueue(__t2t2_buffer_hdr *h)
         __T2T2_ASSERT(QUEUE_ENQUEUE_ALREADY_ON_A_LIST,false);
         return false;
     }
+    _stamp(h);
+    __T2T2_TRACE(traced, T2T2_TRACE_ENQUEUE, this, h + 1);
+    __t2t2_async_waiter * w;
+    __t2t2_queue_set * s;
     {
-        Lock l(&mutex);
+        Lock l(&mutex, &prof);
         buffers.add_next(h);
-        if (psetmutex)
-        {
-            Lock l2(psetmutex);
-            pthread_cond_signal(psetcond);
-        }
+        _count_enqueues(1);
+        w = _serve_async();
+        s = _notify_set();
     }
-    pthread_cond_signal(&cond);
+    _notify(w, s);
     return true;
 }
 
 bool __t2t2_queue :: _enqueue_tail(__t2t2_buffer_hdr *h)
 {
+    if (deadline_ordered)
+    {
+        __t2t2_timespec  now;
+        now.getNow(clk_id);
+        return _enqueue_deadline(h, now);
+    }
     h->ok();
     if (h->list != NULL)
     {
         __T2T2_ASSERT(QUEUE_ENQUEUE_ALREADY_ON_A_LIST,false);
         return false;
     }
+    _stamp(h);
+    __T2T2_TRACE(traced, T2T2_TRACE_ENQUEUE, this, h + 1);
+    __t2t2_async_waiter * w;
+    __t2t2_queue_set * s;
     {
-        Lock l(&mutex);
+        Lock l(&mutex, &prof);
         buffers.add_prev(h);
-        if (psetmutex)
+        _count_enqueues(1);
+        w = _serve_async();
+        s = _notify_set();
+    }
+    _notify(w, s);
+    return true;
+}
+
+void __t2t2_queue :: _enqueue_list(
+    __t2t2_links_head<__t2t2_buffer_hdr> *bufs, bool tail)
+{
+    __t2t2_buffer_hdr * h;
+    if (deadline_ordered)
+    {
+        while (!bufs->empty())
         {
-            Lock l2(psetmutex);
-            pthread_cond_signal(psetcond);
+            h = bufs->get_head();
+            h->remove();
+            _enqueue_tail(h);
         }
+        return;
     }
-    pthread_cond_signal(&cond);
+    int count = 0;
+#ifdef T2T2_TIMESTAMPS
+    uint64_t now = (timing.load(std::memory_order_relaxed) ||
+                    watched.load(std::memory_order_relaxed)) ?
+        __t2t2_now_ns() : 0;
+#endif
+    __t2t2_links_head<__t2t2_async_waiter>  served;
+    __t2t2_async_waiter * w;
+    __t2t2_queue_set * s = NULL;
+    {
+        Lock l(&mutex, &prof);
+        while (!bufs->empty())
+        {
+            h = bufs->get_head();
+            h->remove();
+#ifdef T2T2_TIMESTAMPS
+            h->enqueue_ns = now;
+#endif
+            __T2T2_TRACE(traced, T2T2_TRACE_ENQUEUE, this, h + 1);
+            if (tail)
+                buffers.add_prev(h);
+            else
+                buffers.add_next(h);
+            count++;
+        }
+        if (count > 0)
+            _count_enqueues(count);
+        while ((w = _serve_async()) != NULL)
+            served.add_prev(w);
+        if (count > 0)
+            s = _notify_set();
+    }
+    if (count == 0)
+        return;
+    // same as _notify, but for count buffers.
+    __T2T2_RT_CHECK(!served.empty() || sleepers > 0,
+                    RT_WAKEUP_SYSCALL, owner);
+    if (s)
+        for (int ind = 0; ind < count; ind++)
+            s->_notify((ind == count - 1) ? this : NULL);
+    if (count > 1)
+        pthread_cond_broadcast(&cond);
+    else
+        pthread_cond_signal(&cond);
+    while (!served.empty())
+    {
+        w = served.get_head();
+        w->remove();
+        w->wake(w);
+    }
+}
+
+bool __t2t2_queue :: _enqueue_deadline(__t2t2_buffer_hdr *h,
+                                      const timespec &deliver_at)
+{
+    h->ok();
+    if (h->list != NULL)
+    {
+        __T2T2_ASSERT(QUEUE_ENQUEUE_ALREADY_ON_A_LIST,false);
+        return false;
+    }
+    _stamp(h);
+    __T2T2_TRACE(traced, T2T2_TRACE_ENQUEUE, this, h + 1);
+    __t2t2_async_waiter * w;
+    __t2t2_queue_set * s;
+    {
+        Lock l(&mutex, &prof);
+        buffers.add_prev(h);
+        due_entry  e;
+        e.deliver_at = deliver_at;
+        e.seq = due_seq++;
+        e.h = h;
+        // only once it outgrows the capacity it was constructed with.
+        __T2T2_RT_CHECK(due.size() == due.capacity(), RT_HEAP_GROWTH, this);
+        due.push_back(e);
+        _due_up(due.size() - 1);
+        _count_enqueues(1);
+        w = _serve_async();
+        s = _notify_set();
+    }
+    _notify(w, s);
+    return true;
+}
+
+bool __t2t2_queue :: _enqueue_keyed(__t2t2_buffer_hdr *h, uint64_t key,
+                                   __t2t2_buffer_hdr **replaced)
+{
+    *replaced = NULL;
+    h->ok();
+    if (h->list != NULL)
+    {
+        __T2T2_ASSERT(QUEUE_ENQUEUE_ALREADY_ON_A_LIST,false);
+        return false;
+    }
+    h->conflate.key = key;
+    _stamp(h);
+    __T2T2_TRACE(traced, T2T2_TRACE_ENQUEUE, this, h + 1);
+    __t2t2_async_waiter * w;
+    __t2t2_queue_set * s;
+    {
+        Lock l(&mutex, &prof);
+        keyed_enqueues ++;
+        __t2t2_buffer_hdr ** pp;
+        for (pp = _key_bucket(key); *pp; pp = &(*pp)->conflate.next)
+        {
+            __t2t2_buffer_hdr * old = *pp;
+            if (old->conflate.key == key)
+            {
+                // take over the old buffer's spot in both the hash
+                // chain and the queue, so the key keeps its original
+                // position. the queue depth doesn't change, so
+                // there's nobody new to wake up.
+                h->conflate.next = old->conflate.next;
+                *pp = h;
+                old->add_next(h);
+                old->remove();
+                conflated ++;
+                enqueues ++;
+                *replaced = old;
+                // h also inherits how long the key has waited there,
+                // for the delay histogram and the watchdog.
+#ifdef T2T2_TIMESTAMPS
+                h->enqueue_ns = old->enqueue_ns;
+#else
+                if (watched.load(std::memory_order_relaxed))
+                {
+                    uint64_t since;
+                    const void * msg;
+                    head.read(&since, &msg);
+                    if (msg == old + 1)
+                        head.write(since, h + 1);
+                }
+#endif
+                _head_changed();
+                return true;
+            }
+        }
+        // pp now points at the end of the chain.
+        h->conflate.next = NULL;
+        *pp = h;
+        buffers.add_prev(h);
+        _count_enqueues(1);
+        w = _serve_async();
+        s = _notify_set();
+    }
+    _notify(w, s);
     return true;
 }
 
+void __t2t2_queue :: _get_conflate_counts(uint64_t *_keyed_enqueues,
+                                         uint64_t *_conflated)
+{
+    Lock  l(&mutex, &prof);
+    *_keyed_enqueues = keyed_enqueues;
+    *_conflated = conflated;
+}
+
 //////////////////////////// __T2T2_QUEUE_SET ////////////////////////////
 
 __t2t2_queue_set ::__t2t2_queue_set(pthread_mutexattr_t *pmattr /*= NULL*/,
@@ -323,10 +1931,21 @@ __t2t2_queue_set ::__t2t2_queue_set(pthread_mutexattr_t *pmattr /*= NULL*/,
         clk_id = CLOCK_REALTIME;
 
     set_size = 0;
+    depth.store(0);
+    high_water.store(0);
+    enqueues.store(0);
+    dequeues = 0;
+    timeouts = 0;
+    wait_ns = 0;
+    registered = false;
+    sleepers = 0;
+    removers = 0;
 }
 
 __t2t2_queue_set :: ~__t2t2_queue_set(void)
 {
+    if (registered)
+        __t2t2_registry_set(__T2T2_REGISTRY_QUEUE_SET, this, NULL);
     __t2t2_queue * q;
     while ((q = qs.get_next()) != qs.head())
         _remove_queue(q);
@@ -337,7 +1956,7 @@ __t2t2_queue_set :: ~__t2t2_queue_set(void)
 bool
 __t2t2_queue_set :: _add_queue(__t2t2_queue *q, int id)
 {
-    __t2t2_queue::Lock l(&set_mutex);
+    __t2t2_queue::Lock l(&set_mutex, &set_prof);
 
     if (q->list != NULL)
     {
@@ -355,7 +1974,7 @@ __t2t2_queue_set :: _add_queue(__t2t2_queue *q, int id)
     for (tq = qs.get_head(); tq != qs.head(); tq = tq->get_next())
         if (tq->id > id)
             break;
-    q->set_pmutexpcond(&set_mutex, &set_cond);
+    q->set_pset(this);
     q->id = id;
     tq->add_prev(q);
     set_size ++;
@@ -365,28 +1984,37 @@ __t2t2_queue_set :: _add_queue(__t2t2_queue *q, int id)
 void
 __t2t2_queue_set :: _remove_queue(__t2t2_queue *q)
 {
-    __t2t2_queue::Lock l(&set_mutex);
+    __t2t2_queue::Lock l(&set_mutex, &set_prof);
     q->remove();
-    q->set_pmutexpcond();
+    q->set_pset();
     set_size --;
+    // set_pset took q's mutex, so no new enqueue can pick up this
+    // set; but one that already did may still be on its way to
+    // _notify. wait for it, so the caller can destroy the set.
+    removers ++;
+    while (q->notifying.load() > 0)
+        l.wait(&set_cond);
+    removers --;
 }
 
 // this function assumes set_mutex is locked.
 __t2t2_buffer_hdr *
-__t2t2_queue_set :: check_qs(int *id)
+__t2t2_queue_set :: check_qs(int *id,
+                             __t2t2_timespec *next_due, bool *have_due)
 {
     __t2t2_buffer_hdr * h = NULL;
     for (__t2t2_queue * q = qs.get_head();
          q != qs.head();
          q = q->get_next())
     {
-        __t2t2_queue::Lock l(&q->mutex);
-        if (q->buffers.empty() == false)
+        __t2t2_queue::Lock l(&q->mutex, &q->prof);
+        h = q->_get_ready(next_due, have_due);
+        if (h)
         {
-            h = q->buffers.get_head();
             if (!q->_validate(h))
                 __T2T2_ASSERT(QUEUE_DEQUEUE_NOT_ON_THIS_LIST,true);
-            h->remove();
+            q->_remove(h);
+            dequeues ++;
             if (id)
                 *id = q->id;
             break;
@@ -413,51 +2041,1180 @@ __t2t2_queue_set :: _dequeue(int wait_ms, int *id)
         return NULL;
     }
 
-    __t2t2_queue::Lock  l(&set_mutex);
+    __t2t2_queue::Lock  l(&set_mutex, &set_prof);
+
+    // if any member is a deadline queue with messages not yet
+    // due, due is the earliest of those deliver_at times.
+    __t2t2_timespec  due;
+    bool have_due = false;
+    __t2t2_timespec  blocked_at;
+    bool blocked = false;
 
-    h = check_qs(id);
+    h = check_qs(id, &due, &have_due);
     while (!h && !timed_out)
     {
-        if (wait_ms < 0)
+        if (__t2t2_reclaim_pending())
+        {
+            // see __t2t2_queue::_dequeue.
+            l.unlock();
+            __t2t2_reclaim_flush_pending();
+            l.relock();
+            have_due = false;
+            h = check_qs(id, &due, &have_due);
+            continue;
+        }
+        if (!blocked)
+        {
+            __T2T2_RT_CHECK(true, RT_BLOCKING_WAIT, this);
+            blocked_at.getNow(clk_id);
+            blocked = true;
+            sleepers ++;
+        }
+        if (wait_ms > 0 && first)
+        {
+            __t2t2_timespec t(wait_ms);
+            ts = blocked_at;
+            ts += t;
+            first = false;
+        }
+        if (have_due && (wait_ms < 0 || due < ts))
+        {
+            // wake up when the earliest pending deadline comes due;
+            // an enqueue of anything earlier will signal us anyway.
+            l.timedwait(&set_cond, &due);
+        }
+        else if (wait_ms < 0)
         {
             // never set timed_out.
-            pthread_cond_wait(&set_cond, &set_mutex);
+            l.wait(&set_cond);
         }
         else // wait_ms > 0 (note ==0 was already checked)
         {
-            if (first)
-            {
-                __t2t2_timespec t(wait_ms);
-                ts.getNow(clk_id);
-                ts += t;
-                first = false;
-            }
-            int ret = pthread_cond_timedwait(&set_cond, &set_mutex, &ts);
+            int ret = l.timedwait(&set_cond, &ts);
             if (ret == ETIMEDOUT)
                 timed_out = true;
         }
         // always check again after cond wait returns,
         // if there's a race on expiry vs enqueue,
         // always win on the side of the enqueue.
-        h = check_qs(id);
+        have_due = false;
+        h = check_qs(id, &due, &have_due);
+    }
+    if (blocked)
+    {
+        sleepers --;
+        __t2t2_timespec  now;
+        now.getNow(clk_id);
+        wait_ns += now.to_ns() - blocked_at.to_ns();
+        if (h == NULL)
+            timeouts ++;
     }
     return h;
 }
 
-}; // namespace Thread2Thread2
+bool __t2t2_queue_set :: _dequeue_async(__t2t2_async_waiter *w)
+{
+    if (qs.empty())
+    {
+        __T2T2_ASSERT(QUEUE_SET_EMPTY,false);
+        w->h = NULL;
+        w->id = -1;
+        return true;
+    }
+    __t2t2_queue::Lock  l(&set_mutex, &set_prof);
+    __t2t2_timespec  due;
+    bool have_due = false;
+    w->h = check_qs(&w->id, &due, &have_due);
+    if (w->h)
+        return true;
+    async_waiters.add_prev(w);
+    return false;
+}
 
-///////////////////////// STREAM OPS /////////////////////////
+void __t2t2_queue_set :: _depth_changed(int n, bool enqueued /*= false*/)
+{
+    int d = depth.fetch_add(n, std::memory_order_acq_rel) + n;
+    if (enqueued)
+        enqueues.fetch_add(n, std::memory_order_relaxed);
+    if (n <= 0)
+        return;
+    int hw = high_water.load(std::memory_order_relaxed);
+    while (d > hw &&
+           !high_water.compare_exchange_weak(hw, d,
+                                             std::memory_order_relaxed))
+        ;
+}
 
-// this has to be outside the namespace
-std::ostream &
-operator<<(std::ostream &strm,
-           const Thread2Thread2::t2t2_pool_stats &stats)
+void __t2t2_queue_set :: _get_stats(t2t2_queue_stats &_stats)
 {
-    strm << "bufsz " << stats.buffer_size
-         << " total " << stats.total_buffers
-         << " inuse " << stats.buffers_in_use
-         << " allocfails " << stats.alloc_fails
-         << " grows " << stats.grows
-         << " doublefrees " << stats.double_frees;
+    __t2t2_queue::Lock  l(&set_mutex, &set_prof);
+    set_prof.get(_stats.lock);
+    _peek_stats(_stats);
+}
+
+void __t2t2_queue_set :: _peek_stats(t2t2_queue_stats &_stats) const
+{
+    _stats.depth = depth.load(std::memory_order_relaxed);
+    _stats.high_water = high_water.load(std::memory_order_relaxed);
+    _stats.enqueues = enqueues.load(std::memory_order_relaxed);
+    _stats.dequeues = dequeues;
+    _stats.timeouts = timeouts;
+    _stats.wait_ns = wait_ns;
+}
+
+void __t2t2_queue_set :: _notify(__t2t2_queue *from)
+{
+    __t2t2_async_waiter * w = NULL;
+    {
+        __t2t2_queue::Lock  l(&set_mutex, &set_prof);
+        if (!async_waiters.empty())
+        {
+            __t2t2_timespec  due;
+            bool have_due = false;
+            int id = -1;
+            __t2t2_buffer_hdr * h = check_qs(&id, &due, &have_due);
+            if (h)
+            {
+                w = async_waiters.get_head();
+                w->remove();
+                w->h = h;
+                w->id = id;
+            }
+        }
+        __T2T2_RT_CHECK(w != NULL || sleepers > 0, RT_WAKEUP_SYSCALL, this);
+        pthread_cond_signal(&set_cond);
+        // the unlock is this enqueue's last touch of the set.
+        if (from && from->notifying.fetch_sub(1) == 1 && removers > 0)
+            pthread_cond_broadcast(&set_cond);
+    }
+    if (w)
+        w->wake(w);
+}
+
+//////////////////////////// __T2T2_RPC_CLIENT ////////////////////////////
+
+__t2t2_rpc_client :: __t2t2_rpc_client(int _num_slots,
+                                       pthread_mutexattr_t *pmattr,
+                                       pthread_condattr_t *pcattr)
+{
+    pthread_mutex_init(&mutex, pmattr);
+    if (pcattr)
+        pthread_condattr_getclock(pcattr, &clk_id);
+    else
+        // the default condattr clock appears to be REALTIME
+        clk_id = CLOCK_REALTIME;
+    num_slots = _num_slots;
+    slots = new slot[num_slots];
+    free_slots = NULL;
+    // build the free list backwards so slot 0 is used first.
+    for (int ind = num_slots-1; ind >= 0; ind--)
+    {
+        slot * s = &slots[ind];
+        pthread_cond_init(&s->cond, pcattr);
+        s->generation = 0;
+        s->state = SLOT_FREE;
+        s->sleeping = false;
+        s->reply = NULL;
+        s->next_free = free_slots;
+        free_slots = s;
+    }
+    memset(&stats, 0, sizeof(stats));
+}
+
+__t2t2_rpc_client :: ~__t2t2_rpc_client(void)
+{
+    for (int ind = 0; ind < num_slots; ind++)
+        pthread_cond_destroy(&slots[ind].cond);
+    delete[] slots;
+    pthread_mutex_destroy(&mutex);
+}
+
+// this function assumes mutex is locked.
+void __t2t2_rpc_client :: _free_slot(slot *s)
+{
+    s->generation ++;
+    s->state = SLOT_FREE;
+    s->reply = NULL;
+    s->next_free = free_slots;
+    free_slots = s;
+}
+
+bool __t2t2_rpc_client :: _start(uint32_t *slot_index, uint32_t *generation,
+                                 int timeout_ms, completion_t completion,
+                                 __t2t2_generic_fn fn, void *arg)
+{
+    __t2t2_queue::Lock  l(&mutex);
+    slot * s = free_slots;
+    if (s == NULL)
+    {
+        stats.no_slots ++;
+        return false;
+    }
+    free_slots = s->next_free;
+    s->next_free = NULL;
+    s->state = completion ? SLOT_ASYNC : SLOT_SYNC;
+    s->completion = completion;
+    s->fn = fn;
+    s->arg = arg;
+    s->expires = (timeout_ms >= 0);
+    if (s->expires)
+    {
+        __t2t2_timespec  t(timeout_ms);
+        s->expire_at.getNow(clk_id);
+        s->expire_at += t;
+    }
+    stats.calls ++;
+    *slot_index = s - slots;
+    *generation = s->generation;
+    return true;
+}
+
+void __t2t2_rpc_client :: _cancel(uint32_t slot_index, uint32_t generation)
+{
+    __t2t2_queue::Lock  l(&mutex);
+    slot * s = &slots[slot_index];
+    if (s->generation == generation)
+        _free_slot(s);
+}
+
+void * __t2t2_rpc_client :: _wait(uint32_t slot_index, uint32_t generation,
+                                  int timeout_ms)
+{
+    __t2t2_queue::Lock  l(&mutex);
+    slot * s = NULL;
+    if ((int) slot_index < num_slots)
+        s = &slots[slot_index];
+    // a stale token must not wait on, or free, somebody else's call.
+    if (s == NULL || s->generation != generation ||
+        (s->state != SLOT_SYNC && s->state != SLOT_DONE))
+        return NULL;
+    bool timed_out = false;
+    __T2T2_RT_CHECK(s->state != SLOT_DONE && timeout_ms != 0,
+                    RT_BLOCKING_WAIT, this);
+    s->sleeping = (timeout_ms != 0);
+    while (s->state != SLOT_DONE && !timed_out)
+    {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&s->cond, &mutex);
+        else if (timeout_ms == 0 ||
+                 pthread_cond_timedwait(&s->cond, &mutex,
+                                        &s->expire_at) == ETIMEDOUT)
+            timed_out = true;
+    }
+    s->sleeping = false;
+    void * reply = NULL;
+    if (s->state == SLOT_DONE)
+        reply = s->reply;
+    else
+        stats.timeouts ++;
+    // this also invalidates the token if the reply hasn't come yet.
+    _free_slot(s);
+    return reply;
+}
+
+bool __t2t2_rpc_client :: _complete(uint32_t slot_index,
+                                    uint32_t generation, void *reply)
+{
+    completion_t       completion;
+    __t2t2_generic_fn  fn;
+    void             * arg;
+    {
+        __t2t2_queue::Lock  l(&mutex);
+        slot * s = NULL;
+        if ((int) slot_index < num_slots)
+            s = &slots[slot_index];
+        if (s == NULL || s->generation != generation ||
+            (s->state != SLOT_SYNC && s->state != SLOT_ASYNC))
+        {
+            stats.late_replies ++;
+            return false;
+        }
+        stats.replies ++;
+        if (s->state == SLOT_SYNC)
+        {
+            s->reply = reply;
+            s->state = SLOT_DONE;
+            __T2T2_RT_CHECK(s->sleeping, RT_WAKEUP_SYSCALL, this);
+            pthread_cond_signal(&s->cond);
+            return true;
+        }
+        completion = s->completion;
+        fn = s->fn;
+        arg = s->arg;
+        _free_slot(s);
+    }
+    // async; run the callback without the lock held.
+    completion(reply, fn, arg);
+    return true;
+}
+
+int __t2t2_rpc_client :: _expire(void)
+{
+    int count = 0;
+    __t2t2_timespec  now;
+    now.getNow(clk_id);
+    // callbacks must run unlocked, so find and expire
+    // one at a time.
+    while (1)
+    {
+        completion_t       completion = NULL;
+        __t2t2_generic_fn  fn = NULL;
+        void             * arg = NULL;
+        {
+            __t2t2_queue::Lock  l(&mutex);
+            for (int ind = 0; ind < num_slots; ind++)
+            {
+                slot * s = &slots[ind];
+                if (s->state == SLOT_ASYNC && s->expires &&
+                    !(now < s->expire_at))
+                {
+                    completion = s->completion;
+                    fn = s->fn;
+                    arg = s->arg;
+                    stats.timeouts ++;
+                    _free_slot(s);
+                    break;
+                }
+            }
+        }
+        if (completion == NULL)
+            break;
+        completion(NULL, fn, arg);
+        count ++;
+    }
+    return count;
+}
+
+void __t2t2_rpc_client :: _get_stats(t2t2_rpc_stats &_stats)
+{
+    __t2t2_queue::Lock  l(&mutex);
+    _stats = stats;
+}
+
+//////////////////////////// T2T2_RECLAIMER ////////////////////////////
+
+thread_local __t2t2_reclaim_thread * __t2t2_reclaim_current = NULL;
+thread_local __t2t2_release_batch * __t2t2_release_current = NULL;
+
+void __t2t2_reclaim_thread :: defer(__t2t2_buffer_hdr *h)
+{
+    pending.add_prev(h);
+    num_pending ++;
+    deferred ++;
+    if (flush_at > 0 && num_pending >= flush_at)
+        r->flush();
+}
+
+void __t2t2_reclaim_flush_pending(void)
+{
+    __t2t2_reclaim_thread * rt = __t2t2_reclaim_current;
+    if (rt != NULL)
+        rt->r->flush();
+}
+
+void __t2t2_release_batch :: add(__t2t2_pool *pool, void *ptr,
+                                 int payload_len, int prio_class)
+{
+    __t2t2_buffer_hdr * h = (__t2t2_buffer_hdr *) ptr;
+    h--;
+    // a pool with quotas has to uncharge each buffer after
+    // it is back on the pool's queue, so it can't batch.
+    if (pool->has_quotas())
+    {
+        pool->release(ptr, payload_len, prio_class);
+        pool_locks ++;
+        return;
+    }
+    int ind;
+    for (ind = 0; ind < num_entries; ind++)
+        if (entries[ind].pool == pool)
+            break;
+    if (ind == num_entries)
+    {
+        if (num_entries == MAX_POOLS)
+            ind = -1;
+        else
+        {
+            entries[ind].pool = pool;
+            entries[ind].count = 0;
+            entries[ind].payload_bytes = 0;
+            num_entries ++;
+        }
+    }
+    // (release checks for double frees, so let it.)
+    if (ind < 0 || h->list != NULL)
+    {
+        pool->release(ptr, payload_len, prio_class);
+        pool_locks ++;
+        return;
+    }
+    pool->_record_lifetime(h);
+    __T2T2_TRACE(true, T2T2_TRACE_RELEASE, pool, ptr);
+    entries[ind].bufs.add_next(h);
+    entries[ind].count ++;
+    entries[ind].payload_bytes += payload_len;
+}
+
+void __t2t2_release_batch :: release_all(void)
+{
+    for (int ind = 0; ind < num_entries; ind++)
+    {
+        entry &e = entries[ind];
+        e.pool->release_list(&e.bufs, e.count, e.payload_bytes);
+        pool_locks ++;
+    }
+    num_entries = 0;
+}
+
+t2t2_reclaimer :: t2t2_reclaimer(int _batch_size /*= 64*/,
+                                 bool _use_thread /*= true*/,
+                                 pthread_mutexattr_t *pmattr /*= NULL*/,
+                                 pthread_condattr_t *pcattr /*= NULL*/)
+{
+    pthread_mutex_init(&mutex, pmattr);
+    pthread_cond_init(&cond, pcattr);
+    pthread_cond_init(&idle_cond, pcattr);
+    batch_size = (_batch_size > 0) ? _batch_size : 1;
+    use_thread = _use_thread;
+    stopping = false;
+    busy = false;
+    memset(&stats, 0, sizeof(stats));
+    if (use_thread)
+        pthread_create(&thread_id, NULL, &thread_entry, this);
+}
+
+t2t2_reclaimer :: ~t2t2_reclaimer(void)
+{
+    if (use_thread)
+    {
+        pthread_mutex_lock(&mutex);
+        stopping = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thread_id, NULL);
+    }
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+    pthread_cond_destroy(&idle_cond);
+}
+
+void t2t2_reclaimer :: attach(void)
+{
+    if (__t2t2_reclaim_current != NULL)
+        return;
+    __t2t2_reclaim_current = new __t2t2_reclaim_thread(this, batch_size);
+}
+
+void t2t2_reclaimer :: detach(void)
+{
+    __t2t2_reclaim_thread * rt = __t2t2_reclaim_current;
+    if (rt == NULL || rt->r != this)
+        return;
+    flush();
+    __t2t2_reclaim_current = NULL;
+    delete rt;
+}
+
+void t2t2_reclaimer :: flush(void)
+{
+    __t2t2_reclaim_thread * rt = __t2t2_reclaim_current;
+    if (rt == NULL || rt->r != this || rt->num_pending == 0)
+        return;
+    if (!use_thread)
+    {
+        reclaim(rt);
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    while (!rt->pending.empty())
+    {
+        __t2t2_buffer_hdr * h = rt->pending.get_head();
+        h->remove();
+        handed_off.add_prev(h);
+    }
+    stats.deferred += rt->deferred;
+    // the thread only sleeps on cond once it's out of work.
+    __T2T2_RT_CHECK(!busy, RT_WAKEUP_SYSCALL, this);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    rt->num_pending = 0;
+    rt->deferred = 0;
+}
+
+void t2t2_reclaimer :: sync(void)
+{
+    flush();
+    if (!use_thread)
+        return;
+    pthread_mutex_lock(&mutex);
+    while (busy || !handed_off.empty())
+        pthread_cond_wait(&idle_cond, &mutex);
+    pthread_mutex_unlock(&mutex);
+}
+
+void t2t2_reclaimer :: reclaim(__t2t2_reclaim_thread *rt)
+{
+    // don't let flush_at recurse into here from a destructor;
+    // anything dropped now just joins the list being drained.
+    int save_flush_at = rt->flush_at;
+    rt->flush_at = 0;
+    while (!rt->pending.empty())
+    {
+        __t2t2_release_batch  batch;
+        __t2t2_release_current = &batch;
+        int count;
+        for (count = 0; count < batch_size && !rt->pending.empty(); count++)
+        {
+            __t2t2_buffer_hdr * h = rt->pending.get_head();
+            h->remove();
+            rt->num_pending --;
+            // the virtual destructor, then the message's
+            // operator delete, which puts h in the batch.
+            delete h->reclaim_obj;
+        }
+        __t2t2_release_current = NULL;
+        batch.release_all();
+        pthread_mutex_lock(&mutex);
+        // (including any dropped by those destructors.)
+        stats.deferred += rt->deferred;
+        rt->deferred = 0;
+        stats.reclaimed += count;
+        stats.batches ++;
+        stats.pool_locks += batch.pool_locks;
+        pthread_mutex_unlock(&mutex);
+    }
+    rt->flush_at = save_flush_at;
+}
+
+//static
+void * t2t2_reclaimer :: thread_entry(void *arg)
+{
+    t2t2_reclaimer * r = (t2t2_reclaimer *) arg;
+    r->thread_main();
+    return NULL;
+}
+
+void t2t2_reclaimer :: thread_main(void)
+{
+    // this thread is attached to itself, so a message dropped
+    // by a destructor here is deferred into the current pass.
+    __t2t2_reclaim_thread  rt(this, 0);
+    __t2t2_reclaim_current = &rt;
+    while (1)
+    {
+        pthread_mutex_lock(&mutex);
+        if (handed_off.empty())
+        {
+            busy = false;
+            pthread_cond_broadcast(&idle_cond);
+        }
+        while (handed_off.empty() && !stopping)
+            pthread_cond_wait(&cond, &mutex);
+        bool done = handed_off.empty();
+        busy = !done;
+        while (!handed_off.empty())
+        {
+            __t2t2_buffer_hdr * h = handed_off.get_head();
+            h->remove();
+            rt.pending.add_prev(h);
+            rt.num_pending ++;
+        }
+        pthread_mutex_unlock(&mutex);
+        if (done)
+            break;
+        reclaim(&rt);
+    }
+    __t2t2_reclaim_current = NULL;
+}
+
+void t2t2_reclaimer :: get_stats(t2t2_reclaim_stats &_stats)
+{
+    pthread_mutex_lock(&mutex);
+    _stats = stats;
+    pthread_mutex_unlock(&mutex);
+}
+
+//////////////////////////// T2T2_METRICS ////////////////////////////
+
+struct __t2t2_registry_entry
+{
+    __t2t2_registry_kind  kind;
+    const void          * obj;
+    std::string           name;
+};
+
+// objects unregister themselves from their destructors, which may
+// run during static destruction, so these are never destroyed.
+static pthread_mutex_t __t2t2_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::list<__t2t2_registry_entry> &__t2t2_registry(void)
+{
+    static std::list<__t2t2_registry_entry> * entries =
+        new std::list<__t2t2_registry_entry>;
+    return *entries;
+}
+
+bool __t2t2_registry_set(__t2t2_registry_kind kind, const void *obj,
+                         const char *name)
+{
+    bool ok = true;
+    pthread_mutex_lock(&__t2t2_registry_mutex);
+    std::list<__t2t2_registry_entry> &reg = __t2t2_registry();
+    std::list<__t2t2_registry_entry>::iterator  it, mine = reg.end();
+    for (it = reg.begin(); it != reg.end(); it++)
+    {
+        if (it->obj == obj)
+            mine = it;
+        else if (name && it->kind == kind && it->name == name)
+            ok = false;
+    }
+    if (ok && name == NULL)
+    {
+        if (mine != reg.end())
+            reg.erase(mine);
+    }
+    else if (ok && mine != reg.end())
+        mine->name = name;
+    else if (ok)
+    {
+        __t2t2_registry_entry  e;
+        e.kind = kind;
+        e.obj = obj;
+        e.name = name;
+        reg.push_back(e);
+    }
+    pthread_mutex_unlock(&__t2t2_registry_mutex);
+    return ok;
+}
+
+// a label value may hold anything but a backslash, a double quote
+// or a newline, which have to be escaped.
+static std::string __t2t2_label(const char *label, const std::string &value)
+{
+    std::string  ret = label;
+    ret += "=\"";
+    for (size_t ind = 0; ind < value.size(); ind++)
+    {
+        char c = value[ind];
+        if (c == '\\')
+            ret += "\\\\";
+        else if (c == '"')
+            ret += "\\\"";
+        else if (c == '\n')
+            ret += "\\n";
+        else
+            ret += c;
+    }
+    ret += "\"";
+    return ret;
+}
+
+template <class statsT, class valueT>
+static void __t2t2_metric(std::ostream &out,
+                          const char *name, const char *type,
+                          const char *help,
+                          const std::vector<std::string> &labels,
+                          const std::vector<statsT> &stats,
+                          valueT (*get)(const statsT &))
+{
+    if (stats.empty())
+        return;
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n";
+    for (size_t ind = 0; ind < stats.size(); ind++)
+        out << name << "{" << labels[ind] << "} "
+            << get(stats[ind]) << "\n";
+}
+
+#define __T2T2_METRIC(out, name, type, help, labels, stats, statsT, expr) \
+    __t2t2_metric(out, name, type, help, labels, stats,                 \
+                  +[](const statsT &s) { return expr; })
+
+void t2t2_metrics_write(std::ostream &out)
+{
+    std::vector<std::string>  pool_labels, queue_labels, set_labels;
+    std::vector<t2t2_pool_stats>  pools;
+    std::vector<t2t2_queue_stats> queues, sets;
+    // only the registry's lock; each object is read with its
+    // _peek_stats, and can't be destroyed while we hold this.
+    pthread_mutex_lock(&__t2t2_registry_mutex);
+    {
+        std::list<__t2t2_registry_entry> &reg = __t2t2_registry();
+        std::list<__t2t2_registry_entry>::iterator  it;
+        for (it = reg.begin(); it != reg.end(); it++)
+        {
+            switch (it->kind)
+            {
+            case __T2T2_REGISTRY_POOL:
+                pools.push_back(t2t2_pool_stats());
+                ((const __t2t2_pool *) it->obj)->_peek_stats(pools.back());
+                pool_labels.push_back(__t2t2_label("pool", it->name));
+                break;
+            case __T2T2_REGISTRY_QUEUE:
+                queues.push_back(t2t2_queue_stats());
+                ((const __t2t2_queue *) it->obj)->_peek_stats(queues.back());
+                queue_labels.push_back(__t2t2_label("queue", it->name));
+                break;
+            case __T2T2_REGISTRY_QUEUE_SET:
+                sets.push_back(t2t2_queue_stats());
+                ((const __t2t2_queue_set *) it->obj)->_peek_stats(sets.back());
+                set_labels.push_back(__t2t2_label("queue_set", it->name));
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&__t2t2_registry_mutex);
+
+    typedef t2t2_pool_stats  ps;
+    __T2T2_METRIC(out, "t2t2_pool_buffers", "gauge",
+                  "Buffers in the pool.",
+                  pool_labels, pools, ps, s.total_buffers);
+    __T2T2_METRIC(out, "t2t2_pool_buffers_in_use", "gauge",
+                  "Buffers allocated and not yet released.",
+                  pool_labels, pools, ps, s.buffers_in_use);
+    __T2T2_METRIC(out, "t2t2_pool_payload_bytes_in_use", "gauge",
+                  "Payload bytes requested by the buffers in use.",
+                  pool_labels, pools, ps, s.payload_bytes_in_use);
+    __T2T2_METRIC(out, "t2t2_pool_alloc_fails_total", "counter",
+                  "Allocs which returned no buffer.",
+                  pool_labels, pools, ps, s.alloc_fails);
+    __T2T2_METRIC(out, "t2t2_pool_grows_total", "counter",
+                  "Times the pool has grown.",
+                  pool_labels, pools, ps, s.grows);
+    __T2T2_METRIC(out, "t2t2_pool_double_frees_total", "counter",
+                  "Releases of a buffer which was already free.",
+                  pool_labels, pools, ps, s.double_frees);
+
+    typedef t2t2_queue_stats  qs;
+    const char * prefix[2] = { "t2t2_queue_", "t2t2_queue_set_" };
+    std::vector<std::string> * labels[2] = { &queue_labels, &set_labels };
+    std::vector<qs> * stats[2] = { &queues, &sets };
+    for (int ind = 0; ind < 2; ind++)
+    {
+        std::string  p = prefix[ind];
+        __T2T2_METRIC(out, (p + "depth").c_str(), "gauge",
+                      "Messages waiting now.",
+                      *labels[ind], *stats[ind], qs, s.depth);
+        __T2T2_METRIC(out, (p + "high_water").c_str(), "gauge",
+                      "The most messages ever waiting at once.",
+                      *labels[ind], *stats[ind], qs, s.high_water);
+        __T2T2_METRIC(out, (p + "enqueues_total").c_str(), "counter",
+                      "Messages enqueued.",
+                      *labels[ind], *stats[ind], qs, s.enqueues);
+        __T2T2_METRIC(out, (p + "dequeues_total").c_str(), "counter",
+                      "Messages dequeued.",
+                      *labels[ind], *stats[ind], qs, s.dequeues);
+        __T2T2_METRIC(out, (p + "timeouts_total").c_str(), "counter",
+                      "Dequeues which waited and gave up.",
+                      *labels[ind], *stats[ind], qs, s.timeouts);
+        __T2T2_METRIC(out, (p + "wait_seconds_total").c_str(), "counter",
+                      "Time dequeuers have spent blocked.",
+                      *labels[ind], *stats[ind], qs, s.wait_ns / 1e9);
+    }
+}
+
+t2t2_metrics_exporter :: t2t2_metrics_exporter(const char *_path,
+                                               int _period_sec /*= 10*/,
+                                               bool _unix_socket /*= false*/)
+{
+    pthread_condattr_t  cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+    path = _path;
+    period_sec = (_period_sec > 0) ? _period_sec : 1;
+    unix_socket = _unix_socket;
+    stopping = false;
+    exports = 0;
+    failures = 0;
+    pthread_create(&thread_id, NULL, &thread_entry, this);
+}
+
+t2t2_metrics_exporter :: ~t2t2_metrics_exporter(void)
+{
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread_id, NULL);
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+}
+
+bool t2t2_metrics_exporter :: export_now(void)
+{
+    std::ostringstream  text;
+    t2t2_metrics_write(text);
+    bool ok = unix_socket ? write_socket(text.str()) : write_file(text.str());
+    pthread_mutex_lock(&mutex);
+    exports ++;
+    if (!ok)
+        failures ++;
+    pthread_mutex_unlock(&mutex);
+    return ok;
+}
+
+void t2t2_metrics_exporter :: get_counts(uint64_t *_exports,
+                                         uint64_t *_failures)
+{
+    pthread_mutex_lock(&mutex);
+    if (_exports)
+        *_exports = exports;
+    if (_failures)
+        *_failures = failures;
+    pthread_mutex_unlock(&mutex);
+}
+
+bool t2t2_metrics_exporter :: write_file(const std::string &text)
+{
+    // write a new file and rename it over the old one, so a
+    // collector never reads half an export.
+    std::string  tmp = path + ".tmp";
+    FILE * f = fopen(tmp.c_str(), "w");
+    if (f == NULL)
+        return false;
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    if (fclose(f) != 0)
+        ok = false;
+    if (ok && rename(tmp.c_str(), path.c_str()) != 0)
+        ok = false;
+    if (!ok)
+        unlink(tmp.c_str());
+    return ok;
+}
+
+bool t2t2_metrics_exporter :: write_socket(const std::string &text)
+{
+    struct sockaddr_un  sa;
+    if (path.size() >= sizeof(sa.sun_path))
+        return false;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path, path.c_str(), path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    bool ok = connect(fd, (struct sockaddr *) &sa, sizeof(sa)) == 0;
+    size_t done = 0;
+    while (ok && done < text.size())
+    {
+        // MSG_NOSIGNAL, so a reader going away isn't a SIGPIPE.
+        ssize_t cc = send(fd, text.data() + done, text.size() - done,
+                          MSG_NOSIGNAL);
+        if (cc <= 0)
+            ok = false;
+        else
+            done += cc;
+    }
+    close(fd);
+    return ok;
+}
+
+//static
+void * t2t2_metrics_exporter :: thread_entry(void *arg)
+{
+    t2t2_metrics_exporter * e = (t2t2_metrics_exporter *) arg;
+    e->thread_main();
+    return NULL;
+}
+
+void t2t2_metrics_exporter :: thread_main(void)
+{
+    __t2t2_timespec  due;
+    due.getNow(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&mutex);
+    while (!stopping)
+    {
+        due.tv_sec += period_sec;
+        while (!stopping &&
+               pthread_cond_timedwait(&cond, &mutex, &due) != ETIMEDOUT)
+            ;
+        if (stopping)
+            break;
+        pthread_mutex_unlock(&mutex);
+        export_now();
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+//////////////////////////// T2T2_HOL_WATCHDOG ////////////////////////////
+
+t2t2_hol_watchdog :: t2t2_hol_watchdog(int _period_ms /*= 100*/,
+                                       callback_t _callback /*= NULL*/,
+                                       void *_arg /*= NULL*/)
+{
+    pthread_condattr_t  cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+    period_ms = (_period_ms > 0) ? _period_ms : 1;
+    callback = _callback ? _callback : &log_alert;
+    arg = _arg;
+    stopping = false;
+    alerts = 0;
+    pthread_create(&thread_id, NULL, &thread_entry, this);
+}
+
+t2t2_hol_watchdog :: ~t2t2_hol_watchdog(void)
+{
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread_id, NULL);
+    while (!queues.empty())
+        _unwatch(queues.front().q);
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+}
+
+bool t2t2_hol_watchdog :: _watch(__t2t2_queue *q, int threshold_ms,
+                                 const char *name)
+{
+    std::ostringstream  addr;
+    if (name == NULL)
+        addr << (const void *) q;
+    pthread_mutex_lock(&mutex);
+    bool ok = true;
+    {
+        __t2t2_queue::Lock  l(&q->mutex, &q->prof);
+        if (q->watchdog != NULL && q->watchdog != this)
+            ok = false;
+        else if (q->watchdog == NULL)
+        {
+            q->watchdog = this;
+            q->watched.store(true, std::memory_order_relaxed);
+            q->_publish_head();
+            watched_queue  w;
+            w.q = q;
+            w.alerted_ns = 0;
+            w.alerted_msg = NULL;
+            queues.push_back(w);
+        }
+    }
+    if (ok)
+        for (auto &w : queues)
+            if (w.q == q)
+            {
+                w.name = name ? name : addr.str();
+                w.threshold_ns = (uint64_t) threshold_ms * 1000000;
+            }
+    pthread_mutex_unlock(&mutex);
+    return ok;
+}
+
+void t2t2_hol_watchdog :: _unwatch(__t2t2_queue *q)
+{
+    pthread_mutex_lock(&mutex);
+    for (auto it = queues.begin(); it != queues.end(); it++)
+        if (it->q == q)
+        {
+            __t2t2_queue::Lock  l(&q->mutex, &q->prof);
+            q->watched.store(false, std::memory_order_relaxed);
+            q->watchdog = NULL;
+            queues.erase(it);
+            break;
+        }
+    pthread_mutex_unlock(&mutex);
+}
+
+int t2t2_hol_watchdog :: check_now(void)
+{
+    std::vector<t2t2_hol_alert>  found;
+    std::vector<std::string>     names;
+    pthread_mutex_lock(&mutex);
+    uint64_t now = __t2t2_now_ns();
+    for (auto &w : queues)
+    {
+        uint64_t enqueue_ns;
+        const void * msg;
+        w.q->head.read(&enqueue_ns, &msg);
+        if (msg == NULL || now < enqueue_ns ||
+            now - enqueue_ns < w.threshold_ns)
+            continue;
+        if (enqueue_ns == w.alerted_ns && msg == w.alerted_msg)
+            continue;
+        w.alerted_ns = enqueue_ns;
+        w.alerted_msg = msg;
+        t2t2_hol_alert  a;
+        a.name = NULL;
+        a.queue = w.q;
+        a.msg = msg;
+        a.age_ns = now - enqueue_ns;
+        a.threshold_ns = w.threshold_ns;
+        a.depth = w.q->_depth();
+        found.push_back(a);
+        names.push_back(w.name);
+    }
+    alerts += found.size();
+    pthread_mutex_unlock(&mutex);
+    // the callback may watch or unwatch, so it's called unlocked.
+    for (size_t ind = 0; ind < found.size(); ind++)
+    {
+        found[ind].name = names[ind].c_str();
+        callback(found[ind], arg);
+    }
+    return (int) found.size();
+}
+
+uint64_t t2t2_hol_watchdog :: get_alerts(void)
+{
+    pthread_mutex_lock(&mutex);
+    uint64_t ret = alerts;
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+//static
+void t2t2_hol_watchdog :: log_alert(const t2t2_hol_alert &alert, void *)
+{
+    fprintf(stderr, "t2t2: queue %s: head message %p has waited %llu ms "
+            "(threshold %llu ms), depth %d\n",
+            alert.name, alert.msg,
+            (unsigned long long) (alert.age_ns / 1000000),
+            (unsigned long long) (alert.threshold_ns / 1000000),
+            alert.depth);
+}
+
+//static
+void * t2t2_hol_watchdog :: thread_entry(void *arg)
+{
+    t2t2_hol_watchdog * w = (t2t2_hol_watchdog *) arg;
+    w->thread_main();
+    return NULL;
+}
+
+void t2t2_hol_watchdog :: thread_main(void)
+{
+    __t2t2_timespec  due;
+    __t2t2_timespec  period(period_ms);
+    due.getNow(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&mutex);
+    while (!stopping)
+    {
+        due += period;
+        while (!stopping &&
+               pthread_cond_timedwait(&cond, &mutex, &due) != ETIMEDOUT)
+            ;
+        if (stopping)
+            break;
+        pthread_mutex_unlock(&mutex);
+        check_now();
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+}; // namespace Thread2Thread2
+
+///////////////////////// STREAM OPS /////////////////////////
+
+// this has to be outside the namespace
+std::ostream &
+operator<<(std::ostream &strm,
+           const Thread2Thread2::t2t2_lock_stats &stats)
+{
+    strm << "locks " << stats.acquisitions
+         << " contended " << stats.contended
+         << " waitus " << stats.wait_ns / 1000.0
+         << " maxwaitus " << stats.max_wait_ns / 1000.0
+         << " holdus " << stats.hold_ns / 1000.0;
+    return strm;
+}
+
+std::ostream &
+operator<<(std::ostream &strm,
+           const Thread2Thread2::t2t2_pool_stats &stats)
+{
+    strm << "bufsz " << stats.buffer_size
+         << " total " << stats.total_buffers
+         << " inuse " << stats.buffers_in_use
+         << " allocfails " << stats.alloc_fails
+         << " grows " << stats.grows
+         << " doublefrees " << stats.double_frees;
+    if (stats.payload_capacity > 0)
+        strm << " payloadcap " << stats.payload_capacity
+             << " payloadinuse " << stats.payload_bytes_in_use;
+    if (stats.lock.acquisitions > 0)
+        strm << " " << stats.lock;
+    return strm;
+}
+
+std::ostream &
+operator<<(std::ostream &strm,
+           const Thread2Thread2::t2t2_pool_class_stats &stats)
+{
+    strm << "reserved " << stats.reserved
+         << " inuse " << stats.in_use
+         << " sharedinuse " << stats.shared_in_use
+         << " sharedfree " << stats.shared_free
+         << " allocfails " << stats.alloc_fails
+         << " waits " << stats.waits;
+    return strm;
+}
+
+std::ostream &
+operator<<(std::ostream &strm,
+           const Thread2Thread2::t2t2_conflate_stats &stats)
+{
+    strm << "enqueues " << stats.keyed_enqueues
+         << " conflated " << stats.conflated;
+    return strm;
+}
+
+std::ostream &
+operator<<(std::ostream &strm,
+           const Thread2Thread2::t2t2_queue_stats &stats)
+{
+    strm << "depth " << stats.depth
+         << " highwater " << stats.high_water
+         << " enqueues " << stats.enqueues
+         << " dequeues " << stats.dequeues
+         << " timeouts " << stats.timeouts
+         << " waitms " << stats.wait_ns / 1000000.0;
+    if (stats.lock.acquisitions > 0)
+        strm << " " << stats.lock;
+    return strm;
+}
+
+std::ostream &
+operator<<(std::ostream &strm,
+           const Thread2Thread2::t2t2_histogram &hist)
+{
+    strm << "count " << hist.count
+         << " us: min " << hist.min_ns / 1000.0
+         << " mean " << hist.mean_ns() / 1000.0
+         << " p50 " << hist.percentile(50) / 1000.0
+         << " p90 " << hist.percentile(90) / 1000.0
+         << " p99 " << hist.percentile(99) / 1000.0
+         << " p999 " << hist.percentile(99.9) / 1000.0
+         << " max " << hist.max_ns / 1000.0;
+    return strm;
+}
+
+std::ostream &
+operator<<(std::ostream &strm,
+           const Thread2Thread2::t2t2_rpc_stats &stats)
+{
+    strm << "calls " << stats.calls
+         << " replies " << stats.replies
+         << " timeouts " << stats.timeouts
+         << " latereplies " << stats.late_replies
+         << " noslots " << stats.no_slots;
+    return strm;
+}
+
+std::ostream &
+operator<<(std::ostream &strm,
+           const Thread2Thread2::t2t2_reclaim_stats &stats)
+{
+    strm << "deferred " << stats.deferred
+         << " reclaimed " << stats.reclaimed
+         << " batches " << stats.batches
+         << " poollocks " << stats.pool_locks;
     return strm;
 }
@@ -8,13 +8,27 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <iostream>
 #include <memory>
 #include <vector>
 #include <list>
+#include <string>
+#include <sstream>
 #include <atomic>
 #include <type_traits>
+#include <sched.h>
+#include <sys/uio.h>
+
+#ifdef T2T2_ENABLE_COROUTINES
+#ifndef __cpp_impl_coroutine
+#error "T2T2_ENABLE_COROUTINES requires a C++20 compiler (-std=c++20)"
+#endif
+#include <coroutine>
+#include <tuple>
+#include <deque>
+#endif
 
 #include "pxfe_shared_ptr.h"
 
@@ -40,6 +54,10 @@ enum class t2t2_error_t {
     QUEUE_IN_A_SET,   //!< queue is currently in a set
     QUEUE_SET_EMPTY,    //!< queue set empty
     ENQUEUE_EMPTY_POINTER,    //!< enqueue empty pointer
+    DEQUEUE_UNIQUE_SHARED_MSG, //!< dequeue_unique of a shared message
+    RT_HEAP_GROWTH,    //!< a pool grew inside a t2t2_rt_section
+    RT_BLOCKING_WAIT,  //!< a wait blocked inside a t2t2_rt_section
+    RT_WAKEUP_SYSCALL, //!< woke a blocked thread inside a t2t2_rt_section
 
     // the following errors are most likely internal bugs.
     LINKS_MAGIC_CORRUPT,        //!< (internal) magic sig corrupt
@@ -71,6 +89,21 @@ typedef void (*t2t2_assert_handler_t)(t2t2_error_t e, bool fatal,
  * is to invite SEGV or other errors. */
 extern t2t2_assert_handler_t t2t2_assert_handler;
 
+//////////////////////////// T2T2_LOCK_STATS ////////////////////////////
+
+/** contention statistics for one of the library's mutexes. these are
+ * only kept when the library (and everything including this header)
+ * is built with -DT2T2_LOCK_PROFILING; otherwise they are all zero.
+ * see t2t2_pool_stats::lock and t2t2_queue_stats::lock. */
+struct t2t2_lock_stats {
+    uint64_t acquisitions; //!< times the mutex was locked
+    uint64_t contended;    //!< times it was already held by someone
+    uint64_t wait_ns;      //!< total time spent waiting for it
+    uint64_t max_wait_ns;  //!< the longest single wait
+    uint64_t hold_ns;      //!< total time it was held, not counting
+                           //!< condition waits
+};
+
 //////////////////////////// T2T2_POOL_STATS ////////////////////////////
 
 /** statistics for buffer pools */
@@ -84,6 +117,126 @@ struct t2t2_pool_stats {
     int alloc_fails;      //!< how many times alloc/get returned null
     int grows;            //!< how many times pool has been grown
     int double_frees;     //!< how many times free buffer freed again
+    int payload_capacity; //!< trailing payload bytes in each buffer
+                          //!< (only in a t2t2_var_pool bucket)
+    uint64_t payload_bytes_in_use; //!< payload bytes actually requested
+                          //!< by the buffers in use; compare with
+                          //!< buffers_in_use * payload_capacity
+    t2t2_lock_stats lock; //!< the mutex guarding the free list
+};
+
+/** statistics for one priority class of a pool with quotas;
+ * see __t2t2_pool::set_class_quotas. */
+struct t2t2_pool_class_stats {
+    int reserved;         //!< buffers set aside for this class only
+    int in_use;           //!< buffers this class holds now
+    int shared_in_use;    //!< how many of those came from the shared region
+    int shared_free;      //!< shared buffers nobody holds right now
+    int alloc_fails;      //!< allocs refused because the class was at quota
+    int waits;            //!< allocs which had to wait for a release
+};
+
+//////////////////////////// T2T2_PAYLOAD ////////////////////////////
+
+/** the trailing payload area of a variable-length message;
+ * see t2t2_var_pool and t2t2_message_base::get_payload. */
+struct t2t2_payload {
+    uint8_t * data;   //!< start of the payload, NULL if none
+    size_t    len;    //!< the payload_len requested at alloc time
+};
+
+////////////////////////// T2T2_CONFLATE_STATS //////////////////////////
+
+/** statistics for conflating queues */
+struct t2t2_conflate_stats {
+    uint64_t keyed_enqueues; //!< how many messages were enqueued
+    uint64_t conflated;      //!< how many replaced a pending message
+};
+
+//////////////////////////// T2T2_QUEUE_STATS ////////////////////////////
+
+/** statistics for queues and queue sets; see t2t2_queue::get_stats
+ * and t2t2_queue_set::get_stats. */
+struct t2t2_queue_stats {
+    int depth;            //!< messages on the queue now
+    int high_water;       //!< the most there have ever been at once
+    uint64_t enqueues;    //!< messages enqueued; on a conflating queue
+                          //!< this includes those which replaced one
+    uint64_t dequeues;    //!< messages dequeued
+    uint64_t timeouts;    //!< dequeues which waited and gave up
+    uint64_t wait_ns;     //!< total time dequeuers spent blocked
+    t2t2_lock_stats lock; //!< the queue's mutex, or the set's own
+};
+
+//////////////////////////// T2T2_HISTOGRAM ////////////////////////////
+
+/** a snapshot of a log-linear histogram of times in nanoseconds, in
+ * the style of HdrHistogram: each power of two is split into
+ * SUB_BUCKETS linear buckets, so any value is known to within about
+ * 6%; values under SUB_BUCKETS are exact. see
+ * t2t2_queue::get_delay_histogram and
+ * __t2t2_pool::get_lifetime_histogram. */
+struct t2t2_histogram {
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    /** values of 2^MAX_EXP ns (about 18 minutes) or more all land
+     * in the last bucket. */
+    static const int MAX_EXP = 40;
+    static const int NUM_BUCKETS = (MAX_EXP - SUB_BITS + 2) * SUB_BUCKETS;
+    uint64_t counts[NUM_BUCKETS]; //!< how many values in each bucket
+    uint64_t count;               //!< how many values in all
+    uint64_t sum_ns;              //!< the sum of all the values
+    uint64_t min_ns;              //!< the smallest value, 0 if none
+    uint64_t max_ns;              //!< the largest value, 0 if none
+    t2t2_histogram(void) { reset(); }
+    /** empty this snapshot. */
+    void reset(void);
+    /** the value which pct percent of the values are at or below,
+     * e.g. percentile(99.9); 0 if there are no values. */
+    uint64_t percentile(double pct) const;
+    /** the average value, 0 if there are none. */
+    uint64_t mean_ns(void) const { return count ? sum_ns / count : 0; }
+    /** which bucket a value goes in. */
+    static int bucket_of(uint64_t ns)
+    {
+        if (ns < (uint64_t) SUB_BUCKETS)
+            return (int) ns;
+        int e = 63 - __builtin_clzll(ns);
+        if (e > MAX_EXP)
+            return NUM_BUCKETS - 1;
+        return (e - SUB_BITS + 1) * SUB_BUCKETS +
+            (int) (ns >> (e - SUB_BITS)) - SUB_BUCKETS;
+    }
+    /** the smallest value in a bucket. */
+    static uint64_t bucket_low(int bucket)
+    {
+        if (bucket < SUB_BUCKETS)
+            return bucket;
+        int e = bucket / SUB_BUCKETS + SUB_BITS - 1;
+        return (uint64_t) (SUB_BUCKETS + bucket % SUB_BUCKETS)
+            << (e - SUB_BITS);
+    }
+};
+
+//////////////////////////// T2T2_RPC_STATS ////////////////////////////
+
+/** statistics for request/reply clients */
+struct t2t2_rpc_stats {
+    uint64_t calls;         //!< how many calls were started
+    uint64_t replies;       //!< how many replies were delivered
+    uint64_t timeouts;      //!< how many calls gave up waiting
+    uint64_t late_replies;  //!< how many replies arrived too late
+    uint64_t no_slots;      //!< how many calls failed, all slots busy
+};
+
+//////////////////////////// T2T2_RECLAIM_STATS ////////////////////////////
+
+/** statistics for a t2t2_reclaimer */
+struct t2t2_reclaim_stats {
+    uint64_t deferred;    //!< how many messages were handed over
+    uint64_t reclaimed;   //!< how many have been destroyed and released
+    uint64_t batches;     //!< how many batches that took
+    uint64_t pool_locks;  //!< pool lock acquisitions to release them
 };
 
 //////////////////////////// T2T2_WAIT_FLAG ////////////////////////////
@@ -99,10 +252,342 @@ enum wait_flag
     T2T2_ONE_SEC = 1000     //!< any value >0 is # of milliseconds to wait
 };
 
+/** the most priority classes a pool's quotas may have; see
+ * __t2t2_pool::set_class_quotas. */
+static const int T2T2_MAX_PRIO_CLASSES = 8;
+
+//////////////////////////// T2T2_TRACE ////////////////////////////
+
+/** the events a trace records; see t2t2_trace_enable. */
+enum t2t2_trace_event
+{
+    T2T2_TRACE_ALLOC = 1,  //!< a pool handed out a buffer
+    T2T2_TRACE_ENQUEUE,    //!< a message was put on a queue
+    T2T2_TRACE_DEQUEUE,    //!< a message was taken off a queue
+    T2T2_TRACE_RELEASE     //!< a buffer went back to its pool
+};
+
+/** one traced event, as returned by t2t2_trace_snapshot and stored
+ * by t2t2_trace_save. */
+struct t2t2_trace_record {
+    uint64_t ts_ns;   //!< CLOCK_MONOTONIC time of the event
+    uint64_t object;  //!< address of the pool or queue
+    uint64_t msg;     //!< address of the message
+    uint32_t tid;     //!< which thread; numbered from 1 as they trace
+    uint32_t event;   //!< a t2t2_trace_event
+};
+
+/** the number of records kept per thread; the oldest are overwritten.
+ * define this (to a power of two) when building to change it. */
+#ifndef T2T2_TRACE_RING_RECORDS
+#define T2T2_TRACE_RING_RECORDS 16384
+#endif
+
+/** start or stop tracing. tracing is only compiled in when the
+ * library (and everything including this header) is built with
+ * -DT2T2_TRACING; otherwise each trace point is gone altogether.
+ * when compiled in, a trace point costs one well-predicted branch
+ * while tracing is off; while it is on, it reads the clock and writes
+ * a record into a ring owned by the calling thread, with no locks.
+ * \return false if tracing isn't compiled in. */
+bool t2t2_trace_enable(bool on = true);
+
+/** copy out everything still in every thread's ring, oldest first.
+ * this may be called while other threads are tracing; records they
+ * overwrite during the copy are left out. */
+void t2t2_trace_snapshot(std::vector<t2t2_trace_record> &records);
+
+/** write a snapshot to a file, for t2t2trace to convert later.
+ * \return false if the file couldn't be written. */
+bool t2t2_trace_save(const char *path);
+
+/** read a file written by t2t2_trace_save.
+ * \return false if it couldn't be read or isn't a trace. */
+bool t2t2_trace_load(const char *path,
+                     std::vector<t2t2_trace_record> &records);
+
+/** write records (sorted by time) as Chrome trace event JSON, which
+ * chrome://tracing and ui.perfetto.dev can both open. each event is
+ * a short slice on its thread's track, and each message's events
+ * from alloc to release are joined by a flow arrow, so a message
+ * can be followed from thread to thread. */
+void t2t2_trace_write_chrome(const std::vector<t2t2_trace_record> &records,
+                             std::ostream &out);
+
+//////////////////////////// T2T2_RT_AUDIT ////////////////////////////
+
+/** what t2t2_rt_section has caught on one thread. */
+struct t2t2_rt_audit_stats {
+    uint64_t heap_growths;    //!< pools grown (by T2T2_GROW or add_bufs)
+    uint64_t blocking_waits;  //!< waits which actually blocked
+    uint64_t wakeups;         //!< enqueues or releases which woke a
+                              //!< blocked thread, a system call
+    t2t2_error_t last_error;  //!< the latest of these, or NO_ERROR
+    const void * last_object; //!< the pool, queue, queue set or rpc
+                              //!< client which caused it
+};
+
+#ifdef T2T2_RT_AUDIT
+extern thread_local int __t2t2_rt_depth;
+#endif
+
+/** marks a real-time section of a thread: while one is in scope, the
+ * library audits everything the thread does for things a real-time
+ * thread mustn't do, and counts them in the thread's
+ * t2t2_rt_audit_stats: growing a pool (a malloc), a pool, queue,
+ * queue set or rpc wait which actually blocks, and an enqueue or
+ * release which wakes a blocked thread (a futex system call). waits
+ * which didn't have to block, or contention for a mutex, aren't
+ * counted. sections may nest.
+ * this is only compiled in when the library (and everything
+ * including this header) is built with -DT2T2_RT_AUDIT; otherwise
+ * this does nothing and costs nothing. */
+class t2t2_rt_section
+{
+public:
+#ifdef T2T2_RT_AUDIT
+    t2t2_rt_section(void) { __t2t2_rt_depth ++; }
+    ~t2t2_rt_section(void) { __t2t2_rt_depth --; }
+#else
+    t2t2_rt_section(void) { }
+#endif
+};
+
+/** also report each violation through t2t2_assert_handler (as not
+ * fatal), with the RT_ error codes in t2t2_error_t; a handler which
+ * aborts makes an audit build stop at the first one.
+ * \return false if auditing isn't compiled in. */
+bool t2t2_rt_audit_assert(bool on = true);
+
+/** retrieve what the calling thread's real-time sections have caught.
+ * \param reset  if true, start over from zero.
+ * \return false if auditing isn't compiled in (stats are all zero). */
+bool t2t2_rt_get_audit_stats(t2t2_rt_audit_stats &stats, bool reset = false);
+
+//////////////////////////// T2T2_LEAK_SITE ////////////////////////////
+
+#ifdef T2T2_LEAK_TRACKING
+extern thread_local const char * __t2t2_leak_site_name;
+#endif
+
+/** with T2T2_LEAK_TRACKING, every buffer a pool hands out is charged
+ * to a call site, which __t2t2_pool::dump_outstanding groups by. by
+ * default that is the return address of the alloc, emplace or
+ * async_alloc call (a code address in the caller, for addr2line);
+ * while one of these is in scope on a thread, it is the name given
+ * instead. see T2T2_LEAK_SITE. without T2T2_LEAK_TRACKING, this does
+ * nothing. */
+class t2t2_leak_site
+{
+#ifdef T2T2_LEAK_TRACKING
+    const char * prev;
+public:
+    t2t2_leak_site(const char *name)
+    {
+        prev = __t2t2_leak_site_name;
+        __t2t2_leak_site_name = name;
+    }
+    ~t2t2_leak_site(void) { __t2t2_leak_site_name = prev; }
+#else
+public:
+    t2t2_leak_site(const char *) { }
+#endif
+};
+
+#define __T2T2_LEAK_STR2(x) #x
+#define __T2T2_LEAK_STR(x) __T2T2_LEAK_STR2(x)
+#define __T2T2_LEAK_CAT2(a,b) a##b
+#define __T2T2_LEAK_CAT(a,b) __T2T2_LEAK_CAT2(a,b)
+/** charge allocs in the rest of this scope to this file and line. */
+#define T2T2_LEAK_SITE()                                                \
+    Thread2Thread2::t2t2_leak_site                                      \
+        __T2T2_LEAK_CAT(__t2t2_leak_site_, __LINE__)(                   \
+            __FILE__ ":" __T2T2_LEAK_STR(__LINE__))
+
 #define __T2T2_INCLUDE_INTERNAL__ 1
 #include "thread2thread2_internal.h"
 #undef  __T2T2_INCLUDE_INTERNAL__
 
+#ifdef T2T2_ENABLE_COROUTINES
+template <class BaseT> class t2t2_dequeue_awaitable; // forward
+template <class PoolT, class T,
+          class... ArgTs> class t2t2_alloc_awaitable; // forward
+#endif
+
+//////////////////////////// T2T2_UNIQUE_MSG ////////////////////////////
+
+/** a move-only owner of a message, for the common case where a message
+ * has exactly one owner at a time. unlike pxfe_shared_ptr, nothing it
+ * does touches the reference count atomically: t2t2_pool::alloc,
+ * t2t2_queue::enqueue(&&) and t2t2_queue::dequeue_unique just pass
+ * the pointer along, and the destructor returns the message to its
+ * pool directly.
+ * \param T  a message type (derived from t2t2_message_base).
+ * \note while owned by one of these, the message's use_count() is 1,
+ *    so it may be converted to a pxfe_shared_ptr (with share()) when
+ *    it does need to be shared, and back again (with the explicit
+ *    constructor) once the other references are gone. */
+template <class T>
+class t2t2_unique_msg
+{
+    T * ptr;
+    void drop(void)
+    {
+        if (ptr)
+        {
+            // no other owners, so no need to look at the count.
+            ptr->_last_ref_dropped();
+            ptr = NULL;
+        }
+    }
+public:
+    /** construct an empty pointer. */
+    t2t2_unique_msg(void) : ptr(NULL) { }
+    /** move constructor, transfers ownership. */
+    t2t2_unique_msg(t2t2_unique_msg &&other)
+        : ptr(other._take()) { }
+    /** moving from a pointer to a derived type, transfers ownership.
+     * (the conversion is checked at compile time, so this costs
+     * nothing.) */
+    template <class U>
+    t2t2_unique_msg(t2t2_unique_msg<U> &&other)
+        : ptr(other._take()) { }
+    /** take ownership from a shared pointer, if it is the only
+     * reference; otherwise this is left empty and sp is untouched. */
+    explicit t2t2_unique_msg(pxfe_shared_ptr<T> &&sp)
+        : ptr(sp.unique() ? sp._take() : NULL) { }
+    /** releases the message to its pool, if still holding one. */
+    ~t2t2_unique_msg(void) { drop(); }
+    /** move assignment, releases anything previously held. */
+    t2t2_unique_msg &operator=(t2t2_unique_msg &&other)
+    {
+        if (&other != this)
+            _give(other._take());
+        return *this;
+    }
+    /** release the message back to its pool, leaving this empty. */
+    void reset(void) { drop(); }
+    /** convert to a pxfe_shared_ptr (with a use_count of 1),
+     * leaving this empty. */
+    pxfe_shared_ptr<T> share(void)
+    {
+        pxfe_shared_ptr<T>  ret;
+        ret._give(_take());
+        return ret;
+    }
+    /** if the message is actually a U (checked with dynamic_cast),
+     * move ownership into the returned pointer; otherwise return an
+     * empty pointer, and this keeps the message. */
+    template <class U>
+    t2t2_unique_msg<U> cast(void)
+    {
+        t2t2_unique_msg<U>  ret;
+        U * u = dynamic_cast<U*>(ptr);
+        if (u)
+        {
+            ptr = NULL;
+            ret._give(u);
+        }
+        return ret;
+    }
+    /** take ownership of an object whose use_count is already 1;
+     * releases anything previously held. */
+    void _give(T * _ptr)
+    {
+        drop();
+        ptr = _ptr;
+    }
+    /** take the object away from this class, without releasing it. */
+    T * _take(void)
+    {
+        T * ret = ptr;
+        ptr = NULL;
+        return ret;
+    }
+    /** true if this is holding a message. */
+    operator bool() const { return (ptr != NULL); }
+    /** accessor that returns the pointer within */
+    T * operator->(void) const { return ptr; }
+    /** accessor that returns the pointer within */
+    T * operator*(void) const { return ptr; }
+    /** accessor that returns the pointer within */
+    T * get(void) const { return ptr; }
+
+    t2t2_unique_msg(const t2t2_unique_msg &) = delete;
+    t2t2_unique_msg &operator=(const t2t2_unique_msg &) = delete;
+};
+
+//////////////////////////// T2T2_ARENA ////////////////////////////
+
+/** a bump allocator over the arena of one message from a
+ * t2t2_arena_pool (see t2t2_message_base::get_arena). child objects
+ * allocated here cost no pool lock, header, or refcount of their
+ * own; they all go away when the message is released.
+ * \note a message's arena must only be used by whoever is building
+ *    the message; it isn't thread safe.
+ * \note objects which aren't trivially destructible have their
+ *    destructors run, newest first, after the message's own. */
+class t2t2_arena
+{
+    __t2t2_arena_hdr * hdr;
+    template <class T>
+    static void destroy_one(void *obj) { ((T*) obj)->~T(); }
+public:
+    t2t2_arena(__t2t2_arena_hdr *_hdr = NULL) : hdr(_hdr) { }
+    /** false if the message has no arena. */
+    operator bool() const { return (hdr != NULL); }
+    /** raw memory. \return NULL if the arena is full. */
+    void * alloc(size_t size, size_t align = sizeof(void*))
+    {
+        return hdr ? hdr->alloc(size, align) : NULL;
+    }
+    /** construct a T in the arena.
+     * \return NULL if the arena is full. */
+    template <class T, typename... ConstructorArgs>
+    T * make(ConstructorArgs&&... args);
+    /** an array of n value-initialized T's; T must be trivially
+     * destructible. \return NULL if the arena is full. */
+    template <class T>
+    T * make_array(size_t n);
+    /** bytes used so far (including a small header). */
+    size_t used(void) const { return hdr ? hdr->used : 0; }
+    /** total size of the arena (including a small header). */
+    size_t capacity(void) const { return hdr ? hdr->capacity : 0; }
+};
+
+/** a small vector whose elements live in a message's arena; for use
+ * as a member of the message. growing it moves the elements to a new
+ * array and abandons the old one (until the message is released), so
+ * reserve() the right size if it's known.
+ * \param T  element type; must be trivially destructible. */
+template <class T>
+class t2t2_arena_vector
+{
+    static_assert(std::is_trivially_destructible<T>::value == true,
+                  "arena vector elements must be trivially destructible");
+    t2t2_arena  arena;
+    T         * items;
+    size_t      len;
+    size_t      cap;
+public:
+    t2t2_arena_vector(t2t2_arena _arena)
+        : arena(_arena), items(NULL), len(0), cap(0) { }
+    /** \return false if the arena is full. */
+    bool push_back(const T &v);
+    /** \return false if the arena is full. */
+    bool reserve(size_t n);
+    size_t size(void) const { return len; }
+    size_t capacity(void) const { return cap; }
+    bool empty(void) const { return (len == 0); }
+    void clear(void) { len = 0; }
+    T &operator[](size_t ind) { return items[ind]; }
+    const T &operator[](size_t ind) const { return items[ind]; }
+    T * begin(void) { return items; }
+    T * end(void) { return items + len; }
+    const T * begin(void) const { return items; }
+    const T * end(void) const { return items + len; }
+};
+
 //////////////////////////// T2T2_POOL ////////////////////////////
 
 /** template for a user's pool.
@@ -121,6 +606,9 @@ public:
     // note largest_type<> also verifies all the derivedTs
     // are derived from BaseT.
     static const int buffer_size = largest_type<BaseT,derivedTs...>::size;
+    /** a unique tag for each type in this pool's type list, in order;
+     * a message's type index is its position in this list. */
+    static const void * const type_list_tags[1 + sizeof...(derivedTs)];
     /** \brief constructor for a pool.
      * \param _num_bufs_init  how many buffers to put in pool initially.
      * \param _bufs_to_add_when_growing  if you use get(wait==-2) and it
@@ -136,7 +624,27 @@ public:
              pthread_condattr_t *pcattr = NULL)
         : __t2t2_pool(buffer_size, _num_bufs_init,
                      _bufs_to_add_when_growing,
-                     pmattr, pcattr) { }
+                     pmattr, pcattr)
+    {
+        type_tags = type_list_tags;
+    }
+protected:
+    // a t2t2_var_pool bucket: each buffer also has room
+    // for _payload_capacity bytes after the largest type.
+    t2t2_pool(pthread_mutexattr_t *pmattr,
+              pthread_condattr_t *pcattr,
+              int _payload_capacity,
+              int _num_bufs_init,
+              int _bufs_to_add_when_growing)
+        : __t2t2_pool(buffer_size, _num_bufs_init,
+                     _bufs_to_add_when_growing,
+                     pmattr, pcattr, _payload_capacity)
+    {
+        type_tags = type_list_tags;
+    }
+    template <class varBaseT,
+              class... varDerivedTs> friend class t2t2_var_pool;
+public:
     virtual ~t2t2_pool(void) { }
 
     /** get a new message from the pool and specify how long to wait.
@@ -165,10 +673,179 @@ public:
     bool alloc(pxfe_shared_ptr<T> * ptr, int wait_ms,
                ConstructorArgs&&... args);
 
+    /** same as above, but return the new message (or an empty
+     * pointer if the pool is empty), e.g.
+     *   auto msg = pool.alloc<T>(T2T2_NO_WAIT, args...);
+     * this also sets the refcount without an atomic increment. */
+    template <class T, typename... ConstructorArgs>
+    pxfe_shared_ptr<T> alloc(int wait_ms, ConstructorArgs&&... args);
+
+    /** same as above, but for a message with a single owner; this
+     * does no atomic operations on the message's reference count.
+     * see t2t2_unique_msg. */
+    template <class T, typename... ConstructorArgs>
+    bool alloc(t2t2_unique_msg<T> * ptr, int wait_ms,
+               ConstructorArgs&&... args);
+
+    /** same as alloc, but charge the buffer to a priority class of a
+     * pool partitioned with set_class_quotas: the alloc may use only
+     * the class's own reserved buffers or the shared region, so a
+     * flood in one class can't take the buffers reserved for another.
+     * a plain alloc is charged to class 0.
+     * \param wait_ms  as for alloc; a wait is for a buffer this class
+     *     may use, even if the pool has free buffers reserved for
+     *     other classes. T2T2_GROW adds to the shared region.
+     * \param prio_class  0 to num_classes-1; others are charged to
+     *     the nearest class. ignored if the pool has no quotas. */
+    template <class T, typename... ConstructorArgs>
+    pxfe_shared_ptr<T> alloc_prio(int wait_ms, int prio_class,
+                                  ConstructorArgs&&... args);
+
+#ifdef T2T2_ENABLE_COROUTINES
+    /** awaitable version of alloc: co_await the return value to get
+     * a pxfe_shared_ptr<T>. if the pool is empty, the coroutine is
+     * suspended (without blocking the thread) and resumed on the
+     * current executor when a buffer is released. waiting coroutines
+     * get buffers in the order they started waiting.
+     * \param args  the args to T's constructor; they are copied into
+     *     the awaitable, since the constructor may run much later.
+     * \note T2T2_GROW does not apply; add_bufs does wake waiters.
+     * \note on a pool with quotas, this is charged to class 0, and
+     *     waits until class 0 may use a buffer. */
+    template <class T, typename... ConstructorArgs>
+    t2t2_alloc_awaitable<t2t2_pool, T,
+                         typename std::decay<ConstructorArgs>::type...>
+    async_alloc(ConstructorArgs&&... args);
+
+    /** same as async_alloc, but charged to a priority class as for
+     * alloc_prio; the coroutine waits until that class may use a
+     * buffer. waiting coroutines of one class get buffers in the
+     * order they started waiting. */
+    template <class T, typename... ConstructorArgs>
+    t2t2_alloc_awaitable<t2t2_pool, T,
+                         typename std::decay<ConstructorArgs>::type...>
+    async_alloc_prio(int prio_class, ConstructorArgs&&... args);
+
+    /** same as async_alloc, but resume on a specified executor
+     * instead of the current one. */
+    template <class T, typename... ConstructorArgs>
+    t2t2_alloc_awaitable<t2t2_pool, T,
+                         typename std::decay<ConstructorArgs>::type...>
+    async_alloc_on(t2t2_executor *ex, ConstructorArgs&&... args);
+#endif
+
+    // construct a T in a buffer already taken from this pool.
+    template <class T, typename... ConstructorArgs>
+    T * _construct(void *buf, ConstructorArgs&&... args);
+
     __T2T2_EVIL_CONSTRUCTORS(t2t2_pool);
     __T2T2_EVIL_DEFAULT_CONSTRUCTOR(t2t2_pool);
 };
 
+//////////////////////////// T2T2_VAR_POOL ////////////////////////////
+
+/** template for a pool of variable-length messages: each message is
+ * a normal message object, followed by a trailing payload area whose
+ * length is chosen at alloc time (see t2t2_message_base::get_payload).
+ * the pool is a set of t2t2_pool buckets with payload capacities of
+ * min_payload, 2*min_payload, 4*min_payload, ... up to max_payload,
+ * and each alloc draws from the smallest bucket that fits; so a 60
+ * byte packet need not use a buffer sized for the worst case.
+ * \param BaseT      see t2t2_pool
+ * \param derivedTs  see t2t2_pool */
+template <class BaseT, class... derivedTs>
+class t2t2_var_pool
+{
+public:
+    typedef t2t2_pool<BaseT,derivedTs...> bucket_t;
+private:
+    std::vector<std::unique_ptr<bucket_t>>  buckets;
+    bucket_t * find_bucket(int payload_len);
+public:
+    /** constructor.
+     * \param min_payload  payload capacity of the smallest bucket.
+     * \param max_payload  the largest payload that can be allocated.
+     * \param _num_bufs_init  how many buffers to put in each bucket
+     *                        initially.
+     * \param _bufs_to_add_when_growing  see t2t2_pool (per bucket).
+     * \param pmattr  see t2t2_pool
+     * \param pcattr  see t2t2_pool */
+    t2t2_var_pool(int min_payload, int max_payload,
+                  int _num_bufs_init,
+                  int _bufs_to_add_when_growing = 1,
+                  pthread_mutexattr_t *pmattr = NULL,
+                  pthread_condattr_t *pcattr = NULL);
+    ~t2t2_var_pool(void) { }
+
+    /** get a new message with a trailing payload of payload_len bytes.
+     * the arguments are the same as for t2t2_pool::alloc, except
+     * payload_len; wait_ms applies to the one bucket that fits.
+     * \return false if the bucket is empty, or payload_len is bigger
+     *     than max_payload (which is also an assertion). */
+    template <class T, typename... ConstructorArgs>
+    bool alloc_var(pxfe_shared_ptr<T> * ptr, int wait_ms,
+                   int payload_len, ConstructorArgs&&... args);
+
+    /** the number of buckets in this pool. */
+    int get_num_buckets(void) const { return (int) buckets.size(); }
+    /** retrieve statistics for one bucket; utilization of the payload
+     * areas is payload_bytes_in_use over
+     * (buffers_in_use * payload_capacity). */
+    void get_stats(int bucket, t2t2_pool_stats &_stats) const
+    {
+        buckets[bucket]->get_stats(_stats);
+    }
+    /** __t2t2_pool::dump_outstanding for every bucket.
+     * \return how many buffers were listed, in all. */
+    int dump_outstanding(int older_than_ms, std::ostream &out = std::cout) const
+    {
+        int count = 0;
+        for (size_t ind = 0; ind < buckets.size(); ind++)
+            count += buckets[ind]->dump_outstanding(older_than_ms, out);
+        return count;
+    }
+    /** register each bucket as a pool named name_N, where N is its
+     * payload capacity; see __t2t2_pool::set_registry_name.
+     * \return false if any of those names was taken. */
+    bool set_registry_name(const char *name);
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_var_pool);
+    __T2T2_EVIL_DEFAULT_CONSTRUCTOR(t2t2_var_pool);
+};
+
+//////////////////////////// T2T2_ARENA_POOL ////////////////////////////
+
+/** a t2t2_pool whose buffers each have an arena of arena_size bytes
+ * after the message object, which the message can allocate its child
+ * objects from (see t2t2_message_base::get_arena). the arena is empty
+ * again each time a message is allocated.
+ * \param BaseT      see t2t2_pool
+ * \param derivedTs  see t2t2_pool */
+template <class BaseT, class... derivedTs>
+class t2t2_arena_pool : public t2t2_pool<BaseT,derivedTs...>
+{
+public:
+    /** constructor.
+     * \param arena_size  bytes of arena per message.
+     * the rest of the arguments are the same as for t2t2_pool. */
+    t2t2_arena_pool(int arena_size,
+                    int _num_bufs_init = 0,
+                    int _bufs_to_add_when_growing = 1,
+                    pthread_mutexattr_t *pmattr = NULL,
+                    pthread_condattr_t *pcattr = NULL)
+        : t2t2_pool<BaseT,derivedTs...>(
+            pmattr, pcattr,
+            arena_size + (int) sizeof(__t2t2_arena_hdr),
+            _num_bufs_init, _bufs_to_add_when_growing)
+    {
+        this->arena = true;
+    }
+    virtual ~t2t2_arena_pool(void) { }
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_arena_pool);
+    __T2T2_EVIL_DEFAULT_CONSTRUCTOR(t2t2_arena_pool);
+};
+
 //////////////////////////// T2T2_QUEUE ////////////////////////////
 
 /** template for a FIFO queue of messages.
@@ -177,7 +854,14 @@ template <class BaseT>
 class t2t2_queue
 {
     template <class queuesetBaseT> friend class t2t2_queue_set;
+    friend class t2t2_hol_watchdog;
+protected:
     __t2t2_queue q;
+    // for derived queue types that change the ordering.
+    t2t2_queue(bool deadline_ordered,
+               int num_key_buckets,
+               pthread_mutexattr_t *pmattr,
+               pthread_condattr_t *pcattr);
 public:
     /** constructor for a queue.
      *  a queue has a linked list, a mutex to protect updates to the list,
@@ -203,9 +887,68 @@ public:
      *     to a single queue. that is an expected use case. */
     template <class T> bool enqueue(pxfe_shared_ptr<T> &msg);
 
-    /** return true if this queue has no messages. */
+    /** same as above, for a temporary or std::move()d pointer. */
+    template <class T> bool enqueue(pxfe_shared_ptr<T> &&msg);
+
+    /** enqueue a singly-owned message; msg is left empty.
+     * use as q.enqueue(std::move(msg)). */
+    template <class T> bool enqueue(t2t2_unique_msg<T> &&msg);
+
+    /** allocate a T from a pool, construct it, and enqueue it, all
+     * in one call; the same as alloc followed by enqueue, but there is
+     * no pxfe_shared_ptr in between, so no atomic refcount operations.
+     * e.g.  q.emplace<MY_MSG>(&pool, T2T2_NO_WAIT, args...);
+     * \param pool     the t2t2_pool to allocate from.
+     * \param wait_ms  how long to wait for a buffer, see
+     *                 t2t2_pool::alloc.
+     * \param args     args to T's constructor.
+     * \return false if the pool had no buffer available. */
+    template <class T, class PoolT, typename... ConstructorArgs>
+    bool emplace(PoolT *pool, int wait_ms, ConstructorArgs&&... args);
+
+    /** same as emplace, but allocate n messages (each constructed
+     * from the same args) and enqueue them all with one lock of
+     * the queue; a consumer sees them back to back.
+     * \param wait_ms  applies to each alloc; if the pool runs out,
+     *     the messages already allocated are still enqueued.
+     * \return the number of messages enqueued. */
+    template <class T, class PoolT, typename... ConstructorArgs>
+    int emplace_n(PoolT *pool, int n, int wait_ms,
+                  ConstructorArgs&&... args);
+
+    /** return true if this queue has no messages.
+     * this doesn't take the queue's mutex. */
     bool empty(void);
 
+    /** the number of messages on this queue (on a deadline queue,
+     * including those not due yet). this doesn't take the queue's
+     * mutex, so it is cheap to poll. */
+    int depth(void) const;
+
+    /** retrieve statistics about this queue. */
+    void get_stats(t2t2_queue_stats &stats);
+
+    /** register this queue under name, so its stats are written by
+     * t2t2_metrics_write and t2t2_metrics_exporter; NULL unregisters
+     * it. it is unregistered when destroyed.
+     * \return false if another queue has this name. */
+    bool set_registry_name(const char *name);
+
+    /** start (or stop) recording how long each message waits on
+     * this queue, from enqueue to dequeue, in a t2t2_histogram.
+     * while on, each enqueue and dequeue reads the clock once.
+     * \note on a deadline queue this includes the time before each
+     *     message was due.
+     * \return false (and does nothing) if the library wasn't built
+     *     with T2T2_TIMESTAMPS, without which buffers carry no
+     *     enqueue time. */
+    bool enable_delay_histogram(bool enable = true);
+
+    /** retrieve the queueing delays recorded so far (all zeroes if
+     * enable_delay_histogram was never called).
+     * \param reset  if true, start over from empty. */
+    void get_delay_histogram(t2t2_histogram &hist, bool reset = false);
+
     /** dequeue a message from this queue in FIFO order.
      * \param wait_ms  how long to wait: \ref wait_flag
      *           <ul> <li> -1 = T2T2_WAIT_FOREVER : wait forever </li>
@@ -227,9 +970,154 @@ public:
      *       an assertion. */
     pxfe_shared_ptr<BaseT>  dequeue(int wait_ms);
 
-    __T2T2_EVIL_CONSTRUCTORS(t2t2_queue<BaseT>);
-    __T2T2_EVIL_NEW(t2t2_queue<BaseT>);
-    __T2T2_EVIL_DEFAULT_CONSTRUCTOR(t2t2_queue<BaseT>);
+    /** same as dequeue, but return a singly-owned message, without
+     * touching its reference count.
+     * \note the message must not be shared with anyone else, i.e.
+     *    it was enqueued from a t2t2_unique_msg, or from the only
+     *    pxfe_shared_ptr referencing it. if it is shared, that is an
+     *    assertion (DEQUEUE_UNIQUE_SHARED_MSG), this queue's
+     *    reference is dropped, and an empty pointer is returned. */
+    t2t2_unique_msg<BaseT>  dequeue_unique(int wait_ms);
+
+#ifdef T2T2_ENABLE_COROUTINES
+    /** awaitable version of dequeue: co_await the return value to
+     * get the next message. if the queue is empty, the coroutine is
+     * suspended (without blocking the thread) and resumed on an
+     * executor when a message is enqueued.
+     * \param ex  the executor to resume on; NULL means the executor
+     *     the coroutine is running on now (t2t2_executor::current()),
+     *     and if there is none, the coroutine is resumed directly by
+     *     the thread doing the enqueue.
+     * \note unlike dequeue(), any number of coroutines may wait on
+     *     the same queue; each message goes to one of them, in the
+     *     order they started waiting.
+     * \note a coroutine must not be destroyed while it is
+     *     suspended here. */
+    t2t2_dequeue_awaitable<BaseT> async_dequeue(t2t2_executor *ex = NULL);
+#endif
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_queue);
+    __T2T2_EVIL_NEW(t2t2_queue);
+    __T2T2_EVIL_DEFAULT_CONSTRUCTOR(t2t2_queue);
+};
+
+//////////////////////////// T2T2_DEADLINE_QUEUE ////////////////////////////
+
+/** template for a queue of messages delivered in order of deadline
+ * (earliest deadline first), where a message is not delivered until
+ * its deadline has arrived. useful for retry back-offs and paced sends.
+ * \param BaseT  the user's base message class
+ * \note deadlines are absolute times in the clock of the pcattr given
+ *    to the constructor (CLOCK_REALTIME if pcattr is NULL); use now()
+ *    to read that clock.
+ * \note a deadline queue may be added to a t2t2_queue_set along with
+ *    ordinary queues; the set must be constructed with the same
+ *    pcattr clock as this queue.
+ * \note the plain enqueue(msg) inherited from t2t2_queue means
+ *    "deliver now", i.e. after anything already due. */
+template <class BaseT>
+class t2t2_deadline_queue : public t2t2_queue<BaseT>
+{
+public:
+    /** constructor for a deadline queue; pmattr and pcattr are the
+     * same as for t2t2_queue.
+     * \param capacity  how many messages may wait before the queue
+     *     has to allocate more room for its deadline index; make it
+     *     at least the buffers of the pools which feed this queue.
+     *     (growing it is counted as RT_HEAP_GROWTH in a
+     *     t2t2_rt_section.) */
+    t2t2_deadline_queue(pthread_mutexattr_t *pmattr = NULL,
+                        pthread_condattr_t *pcattr = NULL,
+                        int capacity = 256);
+    virtual ~t2t2_deadline_queue(void) { }
+
+    using t2t2_queue<BaseT>::enqueue;
+
+    /** enqueue a message which must not be delivered before a
+     * specified time.
+     * \param msg  message to enqueue; as with t2t2_queue::enqueue,
+     *     this does a take() so the user's pxfe_shared_ptr is now empty.
+     * \param deliver_at  absolute time at which the message becomes
+     *     eligible for dequeue. messages with equal times are
+     *     delivered in the order they were enqueued.
+     * \return true if success, false if not */
+    template <class T> bool enqueue(pxfe_shared_ptr<T> &msg,
+                                    const timespec &deliver_at);
+
+    /** enqueue a message to be delivered some milliseconds from now.
+     * \param msg  message to enqueue (see above)
+     * \param delay_ms  how many milliseconds from now to deliver it.
+     * \return true if success, false if not */
+    template <class T> bool enqueue_in(pxfe_shared_ptr<T> &msg,
+                                       int delay_ms);
+
+    /** return the current time in the clock used by this queue,
+     * suitable for computing deliver_at arguments. */
+    void now(timespec *ts) const { t2t2_queue<BaseT>::q._now(ts); }
+
+    // dequeue() is inherited from t2t2_queue; it blocks until the
+    // earliest message is due or wait_ms expires, whichever is first.
+
+#ifdef T2T2_ENABLE_COROUTINES
+    // nothing would resume a coroutine when a deadline comes due.
+    t2t2_dequeue_awaitable<BaseT> async_dequeue(
+        t2t2_executor *ex = NULL) = delete;
+#endif
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_deadline_queue);
+    __T2T2_EVIL_NEW(t2t2_deadline_queue);
+    __T2T2_EVIL_DEFAULT_CONSTRUCTOR(t2t2_deadline_queue);
+};
+
+//////////////////////// T2T2_CONFLATING_QUEUE ////////////////////////
+
+/** template for a last-value queue, where each message carries a key,
+ * and the consumer only sees the latest message for any key.
+ * enqueueing a key which is already pending replaces the pending
+ * message in place (keeping its original position in the queue) and
+ * releases the stale message back to its pool. useful for feeds where
+ * only the latest update per item matters, so a slow consumer does
+ * not work through a backlog of stale updates.
+ * \param BaseT  the user's base message class
+ * \note a conflating queue may be added to a t2t2_queue_set. */
+template <class BaseT>
+class t2t2_conflating_queue : public t2t2_queue<BaseT>
+{
+public:
+    /** constructor for a conflating queue.
+     * \param num_key_buckets  size of the hash index of pending keys,
+     *     rounded up to a power of two; should be about the number of
+     *     distinct keys expected to be pending at once.
+     * \param pmattr  see t2t2_queue
+     * \param pcattr  see t2t2_queue */
+    t2t2_conflating_queue(int num_key_buckets = 256,
+                          pthread_mutexattr_t *pmattr = NULL,
+                          pthread_condattr_t *pcattr = NULL);
+    virtual ~t2t2_conflating_queue(void) { }
+
+    /** enqueue a message with a key.
+     * \param msg  message to enqueue; as with t2t2_queue::enqueue,
+     *     this does a take() so the user's pxfe_shared_ptr is now empty.
+     * \param key  the key; if a message with this key is already
+     *     pending, msg replaces it.
+     * \return true if success, false if not */
+    template <class T> bool enqueue(pxfe_shared_ptr<T> &msg,
+                                    uint64_t key);
+
+    /** retrieve counters for this queue. */
+    void get_stats(t2t2_conflate_stats &stats);
+    using t2t2_queue<BaseT>::get_stats;
+
+    // every message on a conflating queue needs a key.
+    template <class T, class PoolT, typename... ConstructorArgs>
+    bool emplace(PoolT *pool, int wait_ms,
+                 ConstructorArgs&&... args) = delete;
+    template <class T, class PoolT, typename... ConstructorArgs>
+    int emplace_n(PoolT *pool, int n, int wait_ms,
+                  ConstructorArgs&&... args) = delete;
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_conflating_queue);
+    __T2T2_EVIL_NEW(t2t2_conflating_queue);
 };
 
 //////////////////////////// T2T2_QUEUE_SET ////////////////////////////
@@ -286,11 +1174,28 @@ public:
     bool add_queue(t2t2_queue<BaseT> *q, int id);
 
     /** remove a queue from this set. may be done at any time.
+     *  an enqueue to q running at the same time may still be
+     *  telling this set about its message; this waits for it to
+     *  finish, so once this returns, the set may be destroyed.
      * \note this class is not multi-thread safe, that is you should
      *       not allow one thread to do add/remove while another does
      *       dequeue. that would be very bad. */
     void remove_queue(t2t2_queue<BaseT> *q);
 
+    /** the number of messages on all the queues in this set; this
+     * doesn't take any mutex. */
+    int depth(void) const;
+
+    /** retrieve statistics about this set, as a whole: depth and
+     * high_water count the messages on all its queues, enqueues
+     * counts enqueues to any of them while they were in this set,
+     * and the rest count dequeues from the set. */
+    void get_stats(t2t2_queue_stats &stats);
+
+    /** register this set under name; see
+     * t2t2_queue::set_registry_name. */
+    bool set_registry_name(const char *name);
+
     /** monitor all queues added to this set, and dequeue a message
      * as soon as one becomes available in any queues in this set.
      * \param wait_ms  how long to wait: \ref wait_flag
@@ -313,6 +1218,21 @@ public:
      * \note it is NOT safe to call an individual queue's dequeue
      *       method if that queue has been added to a set. */
     pxfe_shared_ptr<BaseT> dequeue(int wait_ms, int *id = NULL);
+
+    /** same as dequeue, but return a singly-owned message; see
+     * t2t2_queue::dequeue_unique. */
+    t2t2_unique_msg<BaseT> dequeue_unique(int wait_ms, int *id = NULL);
+
+#ifdef T2T2_ENABLE_COROUTINES
+    /** awaitable version of dequeue; see t2t2_queue::async_dequeue.
+     * \param id  if not NULL, receives the id of the queue the message
+     *     came from, when the coroutine resumes.
+     * \param ex  the executor to resume on (see t2t2_queue).
+     * \note deadline queues in this set must not hold messages which
+     *     aren't due yet while a coroutine waits here. */
+    t2t2_dequeue_awaitable<BaseT> async_dequeue(int *id = NULL,
+                                                t2t2_executor *ex = NULL);
+#endif
 };
 
 //////////////////////////// T2T2_MESSAGE_BASE ////////////////////////////
@@ -325,28 +1245,783 @@ class t2t2_message_base : public pxfe_shared_ptr_base
 public:
     // users don't delete; users should be using pxfe_shared_ptr.
     static void operator delete(void *ptr);
+    /** the trailing payload of a message allocated with
+     * t2t2_var_pool::alloc_var; empty for any other message. */
+    t2t2_payload get_payload(void);
+    /** the arena of a message allocated from a t2t2_arena_pool;
+     * an empty arena for any other message. */
+    t2t2_arena get_arena(void);
+    // if this thread is attached to a t2t2_reclaimer, defer the
+    // destructor to it, otherwise delete now.
+    void _last_ref_dropped(void) override;
 protected:
     t2t2_message_base(void) { }
     virtual ~t2t2_message_base(void) { }
 
 private:
+    // (the order of these keeps the ints in padding: __type_index
+    // and __prio_class in pxfe_shared_ptr_base's, and __payload_len leaves the
+    // 4 at the end for the user's class to use.)
+    // position of this message's type in its pool's type list (see
+    // t2t2_pool::type_list_tags), or -1 if it wasn't listed.
+    int16_t __type_index;
+    // the priority class this message's buffer was charged to
+    // (see t2t2_pool::alloc_prio), else 0.
+    uint16_t __prio_class;
     __t2t2_pool * __pool;
+    // the payload_len given to t2t2_var_pool::alloc_var, else 0.
+    uint32_t __payload_len;
 
     // this is a 'no-throw' version of operator new,
     // which returns NULL instead of throwing.
     // this is important, because it prevents calling
     // the constructor function on a NULL.
+    // (site is for T2T2_LEAK_TRACKING; see __t2t2_pool::_alloc.)
     static void * operator new(size_t wanted_sz,
                                __t2t2_pool *pool,
-                               int wait_ms) throw ();
+                               int wait_ms,
+                               const void *site) throw ();
+    // for a buffer which was already taken from the pool; only
+    // for t2t2_pool::_construct, which checks the size at compile time.
+    static void * operator new(size_t wanted_sz,
+                               __t2t2_pool *pool,
+                               void *buf) throw ();
     // t2t2_pool.alloc is what invokes new().
     template <class poolBaseT,
               class... poolDerivedTs> friend class t2t2_pool;
+    template <class dispBaseT,
+              class... dispDerivedTs> friend class t2t2_dispatcher;
+    template <class varBaseT,
+              class... varDerivedTs> friend class t2t2_var_pool;
+#ifdef T2T2_ENABLE_COROUTINES
+    template <class awaitPoolT, class awaitT,
+              class... awaitArgTs> friend class t2t2_alloc_awaitable;
+#endif
 
     __T2T2_EVIL_CONSTRUCTORS(t2t2_message_base);
     __T2T2_EVIL_NEW(t2t2_message_base);
 };
 
+//////////////////////////// T2T2_DISPATCHER ////////////////////////////
+
+/** routes messages to an overloaded handler according to their
+ * derived type, using a jump table and static_cast instead of a
+ * hand-maintained type field and a dynamic_cast per message.
+ * \param BaseT  the user's base message class
+ * \param derivedTs  the same list of derived types used to declare
+ *     the t2t2_pool the messages come from.
+ * \note the handler is any object with an operator() overload per
+ *     message type, e.g. <tt>void operator()(MY_MSG_DERIVED_TYPE1 &)</tt>.
+ *     a type without its own overload goes to the closest base
+ *     overload, by the usual C++ overloading rules.
+ * \note messages from a pool declared with a different type list
+ *     are still routed correctly but take a slower path; types not
+ *     in this dispatcher's list go to the BaseT handler. */
+template <class BaseT, class... derivedTs>
+class t2t2_dispatcher
+{
+    typedef t2t2_pool<BaseT, derivedTs...> pool_t;
+    template <class HandlerT, class T>
+    static void invoke(HandlerT &handler, BaseT *msg);
+public:
+    /** call the handler overload matching the message's type.
+     * \return false if the message is NULL. */
+    template <class HandlerT>
+    static bool dispatch(HandlerT &handler, BaseT *msg);
+
+    /** call the handler overload matching the message's type.
+     * \return false if the message is empty. */
+    template <class HandlerT>
+    static bool dispatch(HandlerT &handler,
+                         const pxfe_shared_ptr<BaseT> &msg)
+    {
+        return dispatch(handler, msg.get());
+    }
+};
+
+//////////////////////////// T2T2_DELIVERY ////////////////////////////
+
+/** a delivery node, used by t2t2_topic to put one message on many
+ * subscribers' queues at once without copying it. each node holds a
+ * ref on the message, so the message goes back to its pool when the
+ * last subscriber is done with it. users normally don't see these,
+ * t2t2_subscriber::dequeue unwraps them.
+ * \param BaseT  the user's base message class */
+template <class BaseT>
+class t2t2_delivery : public t2t2_message_base<t2t2_delivery<BaseT>>
+{
+public:
+    t2t2_delivery(BaseT *_msg) : msg(_msg) { }
+    virtual ~t2t2_delivery(void) { }
+    pxfe_shared_ptr<BaseT>  msg; //!< the message being delivered
+};
+
+//////////////////////////// T2T2_SEGMENT ////////////////////////////
+
+/** a refcounted block of payload bytes, for zero-copy I/O. segments
+ * come from a t2t2_segment_pool, and go back to it when the last
+ * pxfe_shared_ptr (or t2t2_seg_chain) referencing them is dropped.
+ * fill a segment in before sharing it; after that, treat it as read
+ * only, since other messages may be pointing into it. */
+class t2t2_segment : public t2t2_message_base<t2t2_segment>
+{
+public:
+    t2t2_segment(void) { }
+    virtual ~t2t2_segment(void) { }
+    /** the bytes in this segment. */
+    uint8_t * data(void) { return get_payload().data; }
+    /** how many bytes this segment holds (the size asked for
+     * when it was allocated). */
+    size_t size(void) { return get_payload().len; }
+};
+
+/** a pool of segments; allocate one with e.g.
+ *   segpool.alloc_var(&seg, T2T2_NO_WAIT, nbytes);
+ * which draws from the smallest bucket that fits nbytes. */
+typedef t2t2_var_pool<t2t2_segment> t2t2_segment_pool;
+
+////////////////////////// T2T2_SEG_CHAIN //////////////////////////
+
+/** an ordered list of byte ranges within t2t2_segments, to be
+ * used as a member of a message. each range holds a ref on its
+ * segment, so copying a chain (or appending part of one chain to
+ * another) shares the bytes rather than copying them. the chain's
+ * storage is fixed, so it never calls malloc.
+ * \param max_segs  the most ranges this chain can hold. */
+template <int max_segs>
+class t2t2_seg_chain
+{
+    template <int otherMax> friend class t2t2_seg_chain;
+    struct range {
+        pxfe_shared_ptr<t2t2_segment>  seg;
+        size_t  offset;
+        size_t  len;
+    };
+    range  ranges[max_segs];
+    int    num_ranges;
+    size_t total_len;
+public:
+    t2t2_seg_chain(void) : num_ranges(0), total_len(0) { }
+    ~t2t2_seg_chain(void) { }
+
+    /** add a range of a segment to the end of the chain.
+     * \return false if the chain is full, or if the range does
+     *     not lie within the segment. */
+    bool append(const pxfe_shared_ptr<t2t2_segment> &seg,
+                size_t offset, size_t len);
+    /** add the whole segment to the end of the chain. */
+    bool append(const pxfe_shared_ptr<t2t2_segment> &seg)
+    {
+        return seg ? append(seg, 0, seg->size()) : false;
+    }
+    /** add len bytes of another chain, starting offset bytes in,
+     * to the end of this chain; no bytes are copied.
+     * \return false if the range does not lie within other, or this
+     *     chain fills up (in which case this chain is unchanged). */
+    template <int otherMax>
+    bool append(const t2t2_seg_chain<otherMax> &other,
+                size_t offset, size_t len);
+    /** drop n bytes from the front of the chain, e.g. after a partial
+     * writev; segments no longer referenced go back to their pool. */
+    void consume(size_t n);
+    /** drop all ranges. */
+    void clear(void);
+
+    /** total bytes in the chain. */
+    size_t length(void) const { return total_len; }
+    /** number of ranges in the chain. */
+    int num_segs(void) const { return num_ranges; }
+    /** fill in an iovec array for writev or sendmsg.
+     * \return the number of iovecs filled in, at most max_iov;
+     *     if that's less than num_segs, the rest didn't fit. */
+    int get_iovec(struct iovec *iov, int max_iov) const;
+    /** copy up to len bytes starting offset bytes into the chain,
+     * out to buf.
+     * \return the number of bytes copied. */
+    size_t copy_out(void *buf, size_t offset, size_t len) const;
+};
+
+//////////////////////////// T2T2_RECLAIMER ////////////////////////////
+
+/** moves message destruction off of a latency-sensitive thread.
+ * normally when the last reference to a message is dropped, its
+ * destructor runs and it is released to its pool right there, which
+ * takes the pool's lock; a message with heavy destructors (e.g. other
+ * messages it holds references to) makes that slow. a thread which
+ * attach()es to a reclaimer instead just puts such messages on a
+ * private list, and at the next flush() they are destroyed in
+ * batches, each batch returning its buffers to each pool under one
+ * lock. the destructors run either on the reclaimer's own thread, or
+ * (without a thread) inside flush(), at a safe point of the user's
+ * choosing.
+ * \note messages dropped by a destructor during a batch (e.g. members
+ *    of a message being reclaimed) are reclaimed in the same pass.
+ * \note a message's destructor may run on a different thread than
+ *    the one that dropped it.
+ * \note deferred messages still hold their buffers, up to batch_size
+ *    of them per attached thread, which may be all of a small pool.
+ *    so an attached thread flushes on its own before it blocks in a
+ *    dequeue or an alloc; before blocking anywhere else (e.g. on an
+ *    rpc or its own condition) it should call flush() itself. */
+class t2t2_reclaimer
+{
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+    // signalled when the thread runs out of work.
+    pthread_cond_t   idle_cond;
+    // flushed from attached threads, waiting for the reclaim thread.
+    __t2t2_links_head<__t2t2_buffer_hdr> handed_off;
+    int              batch_size;
+    bool             use_thread;
+    bool             stopping;
+    bool             busy;
+    pthread_t        thread_id;
+    t2t2_reclaim_stats  stats;
+    static void * thread_entry(void *arg);
+    void thread_main(void);
+    // destroy everything on rt->pending (including anything their
+    // destructors drop), releasing buffers a batch at a time.
+    void reclaim(__t2t2_reclaim_thread *rt);
+    friend struct __t2t2_reclaim_thread;
+public:
+    /** constructor.
+     * \param _batch_size  how many messages to destroy per batch;
+     *     an attached thread also flushes on its own when it has
+     *     this many waiting.
+     * \param _use_thread  if true, start a thread which runs the
+     *     destructors; if false, flush() runs them.
+     * \param pmattr  see t2t2_queue
+     * \param pcattr  see t2t2_queue */
+    t2t2_reclaimer(int _batch_size = 64,
+                   bool _use_thread = true,
+                   pthread_mutexattr_t *pmattr = NULL,
+                   pthread_condattr_t *pcattr = NULL);
+    /** stops the thread, after it has reclaimed everything flushed.
+     * \note all threads must detach before this.
+     * \note pools must outlive the reclaimer, or a sync(). */
+    ~t2t2_reclaimer(void);
+
+    /** from now on, messages whose last reference is dropped on the
+     * calling thread are deferred to this reclaimer. does nothing if
+     * this thread is already attached to a reclaimer. */
+    void attach(void);
+    /** flush, and stop deferring on the calling thread; a thread
+     * must detach before it exits. */
+    void detach(void);
+    /** a safe point: hand this thread's deferred messages to the
+     * reclaim thread, or if there isn't one, destroy them now. */
+    void flush(void);
+    /** flush, then wait for the reclaim thread to finish everything
+     * flushed so far (by any thread); e.g. before destroying a pool
+     * whose messages may still be waiting. */
+    void sync(void);
+
+    /** retrieve statistics; deferred doesn't count messages
+     * which haven't been flushed yet. */
+    void get_stats(t2t2_reclaim_stats &_stats);
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_reclaimer);
+    __T2T2_EVIL_DEFAULT_CONSTRUCTOR(t2t2_reclaimer);
+};
+
+//////////////////////////// T2T2_METRICS ////////////////////////////
+
+/** write the stats of every registered pool, queue and queue set
+ * (see set_registry_name) in the Prometheus text exposition format.
+ * this takes none of their locks, so it never holds up their users;
+ * each object's numbers may be from slightly different moments.
+ * lock stats (see T2T2_LOCK_PROFILING) aren't included, since they
+ * can't be read without the lock. */
+void t2t2_metrics_write(std::ostream &out);
+
+/** a thread which writes t2t2_metrics_write's output every so often,
+ * either to a file (replaced whole each time, for a Prometheus
+ * textfile collector) or to a local Unix socket (connecting, writing
+ * and disconnecting each time). */
+class t2t2_metrics_exporter
+{
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+    std::string      path;
+    int              period_sec;
+    bool             unix_socket;
+    bool             stopping;
+    pthread_t        thread_id;
+    uint64_t         exports;
+    uint64_t         failures;
+    static void * thread_entry(void *arg);
+    void thread_main(void);
+    bool write_file(const std::string &text);
+    bool write_socket(const std::string &text);
+public:
+    /** constructor; starts the thread, which first exports after
+     * one period.
+     * \param _path  the file or socket to write to.
+     * \param _period_sec  seconds between exports.
+     * \param _unix_socket  if true, _path is a Unix socket. */
+    t2t2_metrics_exporter(const char *_path, int _period_sec = 10,
+                          bool _unix_socket = false);
+    /** stops the thread. */
+    ~t2t2_metrics_exporter(void);
+    /** export right now, on the calling thread.
+     * \return false if the file or socket couldn't be written. */
+    bool export_now(void);
+    /** how many exports have been attempted, and how many failed. */
+    void get_counts(uint64_t *_exports, uint64_t *_failures);
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_metrics_exporter);
+    __T2T2_EVIL_DEFAULT_CONSTRUCTOR(t2t2_metrics_exporter);
+};
+
+//////////////////////////// T2T2_HOL_WATCHDOG ////////////////////////////
+
+/** what a t2t2_hol_watchdog reports about a stuck queue. */
+struct t2t2_hol_alert {
+    const char * name;      //!< the name the queue was watched under
+    const void * queue;     //!< the t2t2_queue
+    const void * msg;       //!< the message at the head of it
+    uint64_t age_ns;        //!< how long that message has been waiting
+    uint64_t threshold_ns;  //!< the queue's threshold
+    int depth;              //!< messages on the queue
+};
+
+/** a thread which watches for head-of-line blocking: every so often
+ * it looks at how long the oldest message on each watched queue has
+ * been waiting, and reports any queue where that is over the queue's
+ * threshold, so a stuck consumer is noticed before its senders' pools
+ * run dry. each queue publishes its head's enqueue time under a
+ * seqlock, so sampling never takes a queue's mutex; while a queue is
+ * watched, each enqueue reads the clock once. without T2T2_TIMESTAMPS
+ * buffers carry no enqueue time, so the age is instead how long the
+ * message has been at the head, and only head changes read the clock.
+ * a stuck head is reported once, not on every sample; the next
+ * message to be stuck at the head of the same queue is reported
+ * again.
+ * \note a queue unwatches itself when destroyed, but don't destroy
+ *    a queue and its watchdog at the same time. */
+class t2t2_hol_watchdog
+{
+public:
+    /** called on the watchdog's thread for each alert; it must not
+     * destroy the watchdog. */
+    typedef void (*callback_t)(const t2t2_hol_alert &alert, void *arg);
+private:
+    struct watched_queue {
+        __t2t2_queue * q;
+        std::string    name;
+        uint64_t       threshold_ns;
+        // the head last reported, so it isn't reported again.
+        uint64_t       alerted_ns;
+        const void   * alerted_msg;
+    };
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+    int              period_ms;
+    callback_t       callback;
+    void           * arg;
+    bool             stopping;
+    pthread_t        thread_id;
+    uint64_t         alerts;
+    std::list<watched_queue>  queues;
+    static void * thread_entry(void *arg);
+    void thread_main(void);
+    bool _watch(__t2t2_queue *q, int threshold_ms, const char *name);
+    static void log_alert(const t2t2_hol_alert &alert, void *arg);
+    friend class __t2t2_queue;
+    // called by a watched queue's destructor.
+    void _unwatch(__t2t2_queue *q);
+public:
+    /** constructor; starts the thread.
+     * \param _period_ms  how often to look at the queues.
+     * \param _callback  called with each alert; NULL means print a
+     *     line about it on stderr.
+     * \param _arg  passed to _callback. */
+    t2t2_hol_watchdog(int _period_ms = 100, callback_t _callback = NULL,
+                      void *_arg = NULL);
+    /** stops the thread and unwatches every queue. */
+    ~t2t2_hol_watchdog(void);
+    /** start watching q.
+     * \param threshold_ms  report when the head message has waited
+     *     this long.
+     * \param name  for the reports; NULL means use q's address.
+     * \return false if another watchdog is watching q. watching q
+     *     again just changes its threshold and name. */
+    template <class BaseT>
+    bool watch(t2t2_queue<BaseT> *q, int threshold_ms,
+               const char *name = NULL)
+    {
+        return _watch(&q->q, threshold_ms, name);
+    }
+    /** stop watching q. */
+    template <class BaseT>
+    void unwatch(t2t2_queue<BaseT> *q) { _unwatch(&q->q); }
+    /** look at every queue now, on the calling thread, and report
+     * (through the callback) any which are over their thresholds.
+     * \return how many were reported. */
+    int check_now(void);
+    /** how many alerts have been reported in all. */
+    uint64_t get_alerts(void);
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_hol_watchdog);
+    __T2T2_EVIL_DEFAULT_CONSTRUCTOR(t2t2_hol_watchdog);
+};
+
+//////////////////////////// T2T2_SUBSCRIBER ////////////////////////////
+
+template <class BaseT> class t2t2_topic; // forward
+
+/** a subscriber to a t2t2_topic. it has its own pool of delivery
+ * nodes, so a slow subscriber can only exhaust its own backlog
+ * and cannot hold up the publisher or the other subscribers.
+ * \param BaseT  the user's base message class */
+template <class BaseT>
+class t2t2_subscriber
+{
+    template <class topicBaseT> friend class t2t2_topic;
+    typedef t2t2_delivery<BaseT> delivery_t;
+    t2t2_pool<delivery_t>   nodes;
+    t2t2_queue<delivery_t>  q;
+    std::atomic_int         drops;
+    // publishers which may still call deliver: raised for each
+    // publisher holding a snapshot with this subscriber in it, and
+    // lowered (with close_mutex locked) once its deliver is done.
+    std::atomic_int         in_flight;
+    // set by unsubscribe; makes deliver give up waiting for a node.
+    std::atomic_bool        closing;
+    // publishers waiting on close_cond for a free node.
+    std::atomic_int         node_waiters;
+    pthread_mutex_t         close_mutex;
+    pthread_cond_t          close_cond;
+    clockid_t               clk_id;
+    bool deliver(BaseT *msg, int wait_ms);
+    // wait on close_cond for a node, until one is free, wait_ms runs
+    // out, or unsubscribe sets closing.
+    bool wait_node(pxfe_shared_ptr<delivery_t> *d, BaseT *msg, int wait_ms);
+    // unsubscribe's half: stop deliveries and wait for in_flight
+    // to drain.
+    void close(void);
+public:
+    /** constructor for a subscriber.
+     * \param num_nodes  how many delivery nodes this subscriber has,
+     *     i.e. how many published messages may be pending in this
+     *     subscriber at once (unless the publisher uses T2T2_GROW).
+     * \param pmattr  see t2t2_queue
+     * \param pcattr  see t2t2_queue */
+    t2t2_subscriber(int num_nodes,
+                    pthread_mutexattr_t *pmattr = NULL,
+                    pthread_condattr_t *pcattr = NULL);
+    /** destructor releases any messages never dequeued.
+     * \note unsubscribe before destroying a subscriber. */
+    ~t2t2_subscriber(void);
+
+    /** dequeue the next published message.
+     * \param wait_ms  how long to wait: \ref wait_flag
+     * \note the returned message is shared with the other subscribers,
+     *     so treat it as read-only. */
+    pxfe_shared_ptr<BaseT> dequeue(int wait_ms);
+
+    /** how many published messages this subscriber missed because
+     * it had no free delivery nodes. */
+    int get_drops(void) const { return drops.load(); }
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_subscriber);
+    __T2T2_EVIL_NEW(t2t2_subscriber);
+    __T2T2_EVIL_DEFAULT_CONSTRUCTOR(t2t2_subscriber);
+};
+
+//////////////////////////// T2T2_TOPIC ////////////////////////////
+
+/** a publish/subscribe topic: publish() delivers the same pooled
+ * message to every subscriber without copying it.
+ * \param BaseT  the user's base message class
+ * \note subscribers may join or leave at any time, from any thread.
+ *    the subscriber list is copy-on-write, so publishers never wait
+ *    for subscribe/unsubscribe, and any number of threads may
+ *    publish at once. */
+template <class BaseT>
+class t2t2_topic
+{
+    // snap_mutex is only held long enough to copy or swap the
+    // pointer to the current snapshot. writer_mutex serializes
+    // subscribe and unsubscribe.
+    pthread_mutex_t   snap_mutex;
+    pthread_mutex_t   writer_mutex;
+    pxfe_shared_ptr<__t2t2_topic_snapshot>  current;
+    // if publishing, also counts the caller in_flight on every
+    // subscriber in the snapshot.
+    pxfe_shared_ptr<__t2t2_topic_snapshot>  get_snapshot(
+        bool publishing = false);
+    pxfe_shared_ptr<__t2t2_topic_snapshot>  swap_snapshot(
+        __t2t2_topic_snapshot *next);
+public:
+    /** constructor for a topic.
+     * \param pmattr  pthread mutex attributes; may pass NULL. */
+    t2t2_topic(pthread_mutexattr_t *pmattr = NULL);
+    ~t2t2_topic(void);
+
+    /** add a subscriber to this topic; it will receive every message
+     * published from now on.
+     * \return false if it was already subscribed. */
+    bool subscribe(t2t2_subscriber<BaseT> *sub);
+
+    /** remove a subscriber from this topic. when this returns, no
+     * publisher is delivering to the subscriber any more, so it is
+     * safe to destroy it. publishers blocked waiting for one of the
+     * subscriber's delivery nodes give up (and count a drop), so
+     * this never waits on the subscriber's own dequeues.
+     * \note this waits for every publish which has already picked
+     *    up the subscriber to be done with it, so it must not be
+     *    called from inside a publish to this topic, e.g. from a
+     *    message's constructor or destructor.
+     * \return false if it was not subscribed. */
+    bool unsubscribe(t2t2_subscriber<BaseT> *sub);
+
+    /** return the current number of subscribers. */
+    int num_subscribers(void);
+
+    /** deliver a message to all current subscribers.
+     * \param msg  message to publish; like t2t2_queue::enqueue, this
+     *    does a take() so the user's pxfe_shared_ptr is now empty.
+     *    the message goes back to its pool after the last subscriber
+     *    releases it.
+     * \param wait_ms  how long to wait for each subscriber's delivery
+     *    node, \ref wait_flag ; T2T2_GROW grows the subscriber's node
+     *    pool, T2T2_NO_WAIT skips (and counts a drop for) any
+     *    subscriber which is full.
+     * \return the number of subscribers the message was delivered to. */
+    template <class T> int publish(pxfe_shared_ptr<T> &msg, int wait_ms);
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_topic);
+    __T2T2_EVIL_NEW(t2t2_topic);
+};
+
+//////////////////////////// T2T2_REPLY_TOKEN ////////////////////////////
+
+/** identifies the caller waiting for the reply to a request. a
+ * request message type used with t2t2_rpc_client must have a public
+ * member named \c reply_token of this type.
+ * \param RepBaseT  the base class of the reply messages. */
+template <class RepBaseT>
+class t2t2_reply_token
+{
+    template <class clientRepBaseT> friend class t2t2_rpc_client;
+    __t2t2_rpc_client * client;
+    uint32_t slot;
+    uint32_t generation;
+    void set(__t2t2_rpc_client *c, uint32_t s, uint32_t g)
+    {
+        client = c;
+        slot = s;
+        generation = g;
+    }
+public:
+    t2t2_reply_token(void) : client(NULL), slot(0), generation(0) { }
+
+    /** true if this token came from an rpc call and hasn't
+     * been replied to yet. */
+    bool pending(void) const { return client != NULL; }
+
+    /** send the reply to the caller. this may be called from any
+     * thread, once per token.
+     * \param rep  the reply; this does a take() if the caller is still
+     *    waiting. if the caller has already timed out, the reply is
+     *    left in rep (and is released when rep is).
+     * \return true if delivered, false if the caller was gone.
+     * \note for call_async, the caller's callback runs on this thread
+     *    before reply() returns. */
+    template <class T> bool reply(pxfe_shared_ptr<T> &rep);
+};
+
+//////////////////////////// T2T2_RPC_CLIENT ////////////////////////////
+
+/** a request/reply helper for sending requests over a t2t2_queue and
+ * waiting for the replies. it has a fixed number of reply slots, so
+ * making a call doesn't allocate memory or create a reply queue.
+ * \param RepBaseT  the base class of the reply messages.
+ * \note request messages must have a public member
+ *    <tt>t2t2_reply_token<RepBaseT> reply_token;</tt>, which the server
+ *    uses to send its reply.
+ * \note the client must outlive any request it has sent, or the
+ *    server's reply will use a dangling token. */
+template <class RepBaseT>
+class t2t2_rpc_client
+{
+    __t2t2_rpc_client  core;
+    static void trampoline(void *reply, __t2t2_generic_fn fn, void *arg);
+public:
+    /** the signature of a completion callback for call_async.
+     * \param reply  the reply, or empty if the call timed out.
+     * \param arg  the arg given to call_async. */
+    typedef void (*callback_t)(pxfe_shared_ptr<RepBaseT> &reply, void *arg);
+
+    /** constructor.
+     * \param num_slots  the maximum number of calls (sync and async
+     *     together) that may be outstanding at once.
+     * \param pmattr  see t2t2_queue
+     * \param pcattr  see t2t2_queue */
+    t2t2_rpc_client(int num_slots,
+                    pthread_mutexattr_t *pmattr = NULL,
+                    pthread_condattr_t *pcattr = NULL);
+
+    /** send a request and wait for the reply.
+     * \param q  the queue to send the request to.
+     * \param req  the request; this does a take() like enqueue.
+     * \param timeout_ms  how long to wait for the reply: \ref wait_flag
+     * \return the reply, or empty if it timed out, there were no free
+     *     slots, or the enqueue failed. a reply arriving after the
+     *     timeout is released back to its pool. */
+    template <class ReqBaseT, class T>
+    pxfe_shared_ptr<RepBaseT> call(t2t2_queue<ReqBaseT> *q,
+                                   pxfe_shared_ptr<T> &req,
+                                   int timeout_ms);
+
+    /** send a request and return; the callback is called with the
+     * reply on the thread which replies, or with an empty reply from
+     * expire() if the timeout passes first.
+     * \param q  the queue to send the request to.
+     * \param req  the request; this does a take() like enqueue.
+     * \param timeout_ms  how long until the call expires; -1 is never.
+     * \param cb  the completion callback.
+     * \param arg  passed to the callback.
+     * \return true if the request was sent. */
+    template <class ReqBaseT, class T>
+    bool call_async(t2t2_queue<ReqBaseT> *q, pxfe_shared_ptr<T> &req,
+                    int timeout_ms, callback_t cb, void *arg);
+
+    /** complete any async calls whose timeout has passed, by calling
+     * their callbacks with an empty reply; call this periodically if
+     * you use call_async with timeouts.
+     * \return the number of calls expired. */
+    int expire(void);
+
+    /** retrieve statistics for this client. */
+    void get_stats(t2t2_rpc_stats &stats);
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_rpc_client);
+    __T2T2_EVIL_NEW(t2t2_rpc_client);
+    __T2T2_EVIL_DEFAULT_CONSTRUCTOR(t2t2_rpc_client);
+};
+
+//////////////////////////// T2T2_EXECUTOR ////////////////////////////
+
+#ifdef T2T2_ENABLE_COROUTINES
+
+/** interface to whatever runs the user's coroutines (a thread pool,
+ * an event loop, ...). the awaitables returned by async_dequeue and
+ * async_alloc post a suspended coroutine here when its message or
+ * buffer becomes available.
+ * \note the coroutine API requires C++20; define T2T2_ENABLE_COROUTINES
+ *    before including this file to enable it. */
+class t2t2_executor
+{
+public:
+    virtual ~t2t2_executor(void) { }
+    /** schedule a suspended coroutine to be resumed. this is called
+     * by whichever thread enqueued the message or released the
+     * buffer, so it must be thread safe. */
+    virtual void post(std::coroutine_handle<> h) = 0;
+    /** the executor which is running a coroutine on the calling
+     * thread (see resume()), or NULL if none. */
+    static t2t2_executor * current(void) { return *__current(); }
+protected:
+    /** implementations should resume coroutines with this,
+     * so that current() works inside the coroutine. */
+    void resume(std::coroutine_handle<> h)
+    {
+        t2t2_executor ** cur = __current();
+        t2t2_executor * prev = *cur;
+        *cur = this;
+        h.resume();
+        *cur = prev;
+    }
+private:
+    static t2t2_executor ** __current(void)
+    {
+        static thread_local t2t2_executor * cur = NULL;
+        return &cur;
+    }
+};
+
+/** a basic t2t2_executor: a run queue, serviced by one or more
+ * threads calling run() or run_one(). */
+class t2t2_simple_executor : public t2t2_executor
+{
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+    clockid_t        clk_id;
+    std::deque<std::coroutine_handle<>>  ready;
+    bool             stopping;
+public:
+    /** constructor; see t2t2_queue for pmattr and pcattr. */
+    t2t2_simple_executor(pthread_mutexattr_t *pmattr = NULL,
+                         pthread_condattr_t *pcattr = NULL);
+    virtual ~t2t2_simple_executor(void);
+    virtual void post(std::coroutine_handle<> h) override;
+    /** resume one posted coroutine.
+     * \param wait_ms  how long to wait for one: \ref wait_flag
+     * \return false if none was posted in time, or stop() was called. */
+    bool run_one(int wait_ms);
+    /** resume posted coroutines until stop() is called. */
+    void run(void);
+    /** make run() and run_one() return in all threads. */
+    void stop(void);
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_simple_executor);
+};
+
+//////////////////////// T2T2_DEQUEUE_AWAITABLE ////////////////////////
+
+/** returned by t2t2_queue::async_dequeue and
+ * t2t2_queue_set::async_dequeue; co_await it to get a
+ * pxfe_shared_ptr<BaseT>. */
+template <class BaseT>
+class t2t2_dequeue_awaitable : public __t2t2_coro_waiter
+{
+    __t2t2_queue     * q;
+    __t2t2_queue_set * qs;
+    int              * id;
+public:
+    t2t2_dequeue_awaitable(__t2t2_queue *_q, __t2t2_queue_set *_qs,
+                           int *_id, t2t2_executor *_ex)
+        : __t2t2_coro_waiter(_ex), q(_q), qs(_qs), id(_id) { }
+    // the check is done in await_suspend, to only lock once.
+    bool await_ready(void) { return false; }
+    bool await_suspend(std::coroutine_handle<> h);
+    pxfe_shared_ptr<BaseT> await_resume(void);
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_dequeue_awaitable);
+};
+
+///////////////////////// T2T2_ALLOC_AWAITABLE /////////////////////////
+
+/** returned by t2t2_pool::async_alloc; co_await it
+ * to get a pxfe_shared_ptr<T>. */
+template <class PoolT, class T, class... ArgTs>
+class t2t2_alloc_awaitable : public __t2t2_coro_waiter
+{
+    PoolT               * pool;
+    // where async_alloc was called, for T2T2_LEAK_TRACKING.
+    const void          * site;
+    // the quota class to charge (see t2t2_pool::async_alloc_prio).
+    int                   prio_class;
+    std::tuple<ArgTs...>  args;
+public:
+    template <class... ConstructorArgs>
+    t2t2_alloc_awaitable(PoolT *_pool, t2t2_executor *_ex,
+                         const void *_site, int _prio_class,
+                         ConstructorArgs&&... _args)
+        : __t2t2_coro_waiter(_ex), pool(_pool), site(_site),
+          prio_class(_prio_class),
+          args(std::forward<ConstructorArgs>(_args)...) { }
+    bool await_ready(void) { return false; }
+    bool await_suspend(std::coroutine_handle<> h);
+    pxfe_shared_ptr<T> await_resume(void);
+
+    __T2T2_EVIL_CONSTRUCTORS(t2t2_alloc_awaitable);
+};
+
+#endif /* T2T2_ENABLE_COROUTINES */
+
 #define __T2T2_INCLUDE_INTERNAL__ 2
 #include "thread2thread2_internal.h"
 #undef  __T2T2_INCLUDE_INTERNAL__
@@ -357,8 +2032,22 @@ private:
 ///////////////////////// STREAM OPS /////////////////////////
 
 // this has to be outside the namespace
+std::ostream &operator<<(std::ostream &strm,
+                         const Thread2Thread2::t2t2_lock_stats &stats);
 std::ostream &operator<<(std::ostream &strm,
                          const Thread2Thread2::t2t2_pool_stats &stats);
+std::ostream &operator<<(std::ostream &strm,
+                         const Thread2Thread2::t2t2_pool_class_stats &stats);
+std::ostream &operator<<(std::ostream &strm,
+                         const Thread2Thread2::t2t2_conflate_stats &stats);
+std::ostream &operator<<(std::ostream &strm,
+                         const Thread2Thread2::t2t2_queue_stats &stats);
+std::ostream &operator<<(std::ostream &strm,
+                         const Thread2Thread2::t2t2_histogram &hist);
+std::ostream &operator<<(std::ostream &strm,
+                         const Thread2Thread2::t2t2_rpc_stats &stats);
+std::ostream &operator<<(std::ostream &strm,
+                         const Thread2Thread2::t2t2_reclaim_stats &stats);
 
 #endif /* __T2T2_HEADER_FILE__ */
 
@@ -374,9 +2063,71 @@ Classes of interest provided by this library:
  <li> \ref Thread2Thread2::t2t2_pool
     <ul>
     <li> \ref Thread2Thread2::t2t2_pool_stats
+    <li> \ref Thread2Thread2::t2t2_pool_class_stats
+    <li> \ref Thread2Thread2::t2t2_histogram
+    <li> \ref Thread2Thread2::t2t2_lock_stats
     </ul>
+ <li> \ref Thread2Thread2::t2t2_var_pool
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_payload
+   </ul>
+ <li> \ref Thread2Thread2::t2t2_arena_pool
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_arena
+   <li> \ref Thread2Thread2::t2t2_arena_vector
+   </ul>
+ <li> \ref Thread2Thread2::t2t2_segment
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_segment_pool
+   <li> \ref Thread2Thread2::t2t2_seg_chain
+   </ul>
+ <li> \ref Thread2Thread2::t2t2_unique_msg
  <li> \ref Thread2Thread2::t2t2_queue
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_queue_stats
+   <li> \ref Thread2Thread2::t2t2_histogram
+   </ul>
+ <li> \ref Thread2Thread2::t2t2_deadline_queue
+ <li> \ref Thread2Thread2::t2t2_conflating_queue
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_conflate_stats
+   </ul>
  <li> \ref Thread2Thread2::t2t2_queue_set
+ <li> \ref Thread2Thread2::t2t2_dispatcher
+ <li> \ref Thread2Thread2::t2t2_topic
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_subscriber
+   </ul>
+ <li> \ref Thread2Thread2::t2t2_rpc_client
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_reply_token
+   <li> \ref Thread2Thread2::t2t2_rpc_stats
+   </ul>
+ <li> \ref Thread2Thread2::t2t2_reclaimer
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_reclaim_stats
+   </ul>
+ <li> \ref Thread2Thread2::t2t2_executor (with T2T2_ENABLE_COROUTINES)
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_simple_executor
+   </ul>
+ <li> \ref Thread2Thread2::t2t2_metrics_exporter
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_metrics_write
+   </ul>
+ <li> \ref Thread2Thread2::t2t2_hol_watchdog
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_hol_alert
+   </ul>
+ <li> \ref Thread2Thread2::t2t2_rt_section (with T2T2_RT_AUDIT)
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_rt_audit_stats
+   </ul>
+ <li> \ref Thread2Thread2::t2t2_leak_site (with T2T2_LEAK_TRACKING)
+ <li> \ref Thread2Thread2::t2t2_trace_enable (with T2T2_TRACING)
+   <ul>
+   <li> \ref Thread2Thread2::t2t2_trace_record
+   </ul>
  <li> \ref Thread2Thread2::t2t2_assert_handler
    <ul>
    <li> \ref Thread2Thread2::t2t2_error_t
@@ -395,6 +2146,23 @@ This API allows you to do the following:
           classes from a common base message class).
      </ul>
 
+  <li> Variable-length messages carry a trailing payload area sized at
+       alloc time, drawn from the smallest fitting bucket of a
+       multi-size pool, instead of a worst-case fixed array.
+
+  <li> A pool's buffers may be partitioned into reserved quotas per
+       priority class plus a shared region, so a flood of low
+       priority allocs can't starve high priority ones.
+
+  <li> A message's child objects and small vectors may be bump
+       allocated from an arena in the message's own buffer, instead
+       of from other pools; the arena is freed with the message.
+
+  <li> I/O data may be kept in refcounted pooled segments; a message
+       holds a chain of (segment, offset, length) ranges, which can
+       be shared with other messages without copying and handed
+       straight to writev or sendmsg as an iovec array.
+
   <li> Messages are true C++ objects, supporting constructors and
        virtual destructors and virtual methods supporting a heirarchy
        of message classes.
@@ -413,11 +2181,23 @@ This API allows you to do the following:
           last "shared pointer" reference is destructed.
      </ul>
 
+  <li> Messages with a single owner at a time (the common case) may
+       instead be passed with t2t2_unique_msg, a move-only pointer
+       which never touches the reference count atomically, and which
+       converts to a shared pointer when sharing is needed.
+
+  <li> Message destruction may be moved off a latency-sensitive
+       thread with a t2t2_reclaimer; dropped messages are destroyed
+       later in batches, on a reclaim thread or at a safe point, with
+       one pool lock per batch.
+
   <li> Message queues are declared using a base class, but may carry
        any message class derived from that base class. It is up to the
        user to figure out the type of the derived class when it
        arrives, but this is made easier with the automatic
-       dynamic_cast facility built into the shared pointers.
+       dynamic_cast facility built into the shared pointers, or
+       the faster t2t2_dispatcher which routes each message to a
+       handler for its type.
 
      <ul>
      <li> The shared pointer type has a copy-constructor that
@@ -448,6 +2228,48 @@ This API allows you to do the following:
 
      </ul>
 
+  <li> Deadline queues deliver messages in order of a per-message
+       deliver-at time, and hold each message until that time arrives.
+       They may be serviced alone or as members of a set.
+
+  <li> Conflating queues keep only the latest pending message for each
+       key, for feeds where stale updates are not worth processing.
+
+  <li> Topics deliver one message to many subscribers without copying
+       it; the message returns to its pool when the last subscriber
+       releases it.
+
+  <li> A request/reply helper sends requests over ordinary queues and
+       waits for the replies in preallocated slots, synchronously or
+       with a completion callback.
+
+  <li> With C++20 and T2T2_ENABLE_COROUTINES defined, coroutines can
+       co_await a queue, a queue set, or a pool; they are suspended
+       instead of blocking a thread, and are resumed on a
+       user-supplied executor.
+
+  <li> Pools, queues and queue sets may be registered by name, and
+       their stats exported periodically in Prometheus text format,
+       to a file or a Unix socket, without taking their locks.
+
+  <li> A watchdog thread can report any queue whose oldest message
+       has waited longer than that queue's threshold, without taking
+       the queue's lock to find out.
+
+  <li> With T2T2_RT_AUDIT defined, a thread can mark real-time
+       sections, inside which every pool growth, blocking wait and
+       wakeup of another thread is counted, and optionally asserted,
+       along with the pool or queue which did it.
+
+  <li> With T2T2_LEAK_TRACKING defined, every buffer a pool has handed
+       out is tracked with its call site, thread and age, so the
+       oldest ones can be listed when a pool seems to be leaking.
+
+  <li> With T2T2_TRACING defined, every alloc, enqueue, dequeue and
+       release can be traced into per-thread rings, and a snapshot
+       converted (by t2t2trace) into a Chrome/Perfetto timeline
+       which follows each message across threads.
+
   </ul>
 
 \section Rules Rules
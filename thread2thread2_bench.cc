@@ -0,0 +1,1381 @@
+
+#include "thread2thread2.h"
+#include <string.h>
+#include <time.h>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <initializer_list>
+
+using namespace std;
+
+namespace t2t2 = Thread2Thread2;
+
+// benchmarks for Thread2Thread2. unlike the test program, which is a
+// functional demo, this one prints numbers.
+//
+// usage: t2t2bench [-q] [-l] [-c file.csv] [-j file.json] [bench...]
+//   -q  quick: a tenth of the iterations of the sweeps
+//   -c  also write every result to a csv file
+//   -j  also write every result to a json file
+//   -l  list the benches
+// with no bench names, all of them are run.
+
+static uint64_t now_ns(void)
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// simulate a consumer doing some work on each message.
+static void spin_ns(uint64_t ns)
+{
+    uint64_t end = now_ns() + ns;
+    while (now_ns() < end)
+        ;
+}
+
+////////////////////////////// RESULTS //////////////////////////////
+
+// every number printed is also recorded here, so it can be written
+// out as csv and json to compare releases and catch regressions.
+// params say where in a sweep a result is, e.g. threads=4 size=64.
+
+struct bench_param {
+    const char * name;
+    long value;
+};
+
+struct bench_result {
+    std::string bench;
+    std::vector<bench_param> params;
+    std::string metric;
+    double value;
+};
+
+static std::vector<bench_result> results;
+
+static bool quick = false;
+
+// the sweeps use this on their iteration counts, for -q.
+static int iters(int n)
+{
+    return quick ? std::max(n / 10, 1) : n;
+}
+
+static void record(const std::string &bench, const char *metric,
+                   double value,
+                   std::initializer_list<bench_param> params = {})
+{
+    bench_result  r;
+    r.bench = bench;
+    r.params = params;
+    r.metric = metric;
+    r.value = value;
+    results.push_back(r);
+}
+
+// percentiles of a set of times in ns, in microseconds; sorts ns.
+struct bench_percentiles {
+    double p50, p90, p99, p999, max;
+};
+
+static bench_percentiles get_percentiles(std::vector<uint64_t> &ns)
+{
+    bench_percentiles  p = { 0, 0, 0, 0, 0 };
+    size_t n = ns.size();
+    if (n == 0)
+        return p;
+    std::sort(ns.begin(), ns.end());
+    p.p50  = ns[n / 2] / 1000.0;
+    p.p90  = ns[n * 90 / 100] / 1000.0;
+    p.p99  = ns[n * 99 / 100] / 1000.0;
+    p.p999 = ns[n * 999 / 1000] / 1000.0;
+    p.max  = ns[n - 1] / 1000.0;
+    return p;
+}
+
+static void record_percentiles(const std::string &bench,
+                               const bench_percentiles &p,
+                               std::initializer_list<bench_param> params = {})
+{
+    record(bench, "p50_us",  p.p50,  params);
+    record(bench, "p90_us",  p.p90,  params);
+    record(bench, "p99_us",  p.p99,  params);
+    record(bench, "p999_us", p.p999, params);
+    record(bench, "max_us",  p.max,  params);
+}
+
+static bool write_csv(const char *path)
+{
+    FILE * f = fopen(path, "w");
+    if (f == NULL)
+        return false;
+    fprintf(f, "bench,params,metric,value\n");
+    for (size_t ind = 0; ind < results.size(); ind++)
+    {
+        const bench_result &r = results[ind];
+        fprintf(f, "%s,", r.bench.c_str());
+        for (size_t p = 0; p < r.params.size(); p++)
+            fprintf(f, "%s%s=%ld", p ? ";" : "",
+                    r.params[p].name, r.params[p].value);
+        fprintf(f, ",%s,%.6g\n", r.metric.c_str(), r.value);
+    }
+    fclose(f);
+    return true;
+}
+
+static bool write_json(const char *path)
+{
+    FILE * f = fopen(path, "w");
+    if (f == NULL)
+        return false;
+    fprintf(f, "{\n  \"cpus\": %ld,\n  \"quick\": %s,\n"
+            "  \"results\": [\n",
+            sysconf(_SC_NPROCESSORS_ONLN), quick ? "true" : "false");
+    for (size_t ind = 0; ind < results.size(); ind++)
+    {
+        const bench_result &r = results[ind];
+        fprintf(f, "    { \"bench\": \"%s\", \"params\": {",
+                r.bench.c_str());
+        for (size_t p = 0; p < r.params.size(); p++)
+            fprintf(f, "%s \"%s\": %ld", p ? "," : "",
+                    r.params[p].name, r.params[p].value);
+        fprintf(f, " }, \"metric\": \"%s\", \"value\": ",
+                r.metric.c_str());
+        // json has no spelling for nan or inf.
+        if (std::isfinite(r.value))
+            fprintf(f, "%.6g", r.value);
+        else
+            fprintf(f, "null");
+        fprintf(f, " }%s\n", (ind + 1 < results.size()) ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+    return true;
+}
+
+class bench_msg : public t2t2::t2t2_message_base<bench_msg>
+{
+public:
+    // convenience
+    typedef t2t2::t2t2_pool<bench_msg> pool_t;
+    typedef t2t2::t2t2_queue<bench_msg> queue_t;
+    typedef t2t2::t2t2_conflating_queue<bench_msg> conflating_queue_t;
+    typedef pxfe_shared_ptr<bench_msg> sp_t;
+
+    uint64_t key;
+    uint64_t seq;
+    bench_msg(uint64_t _key, uint64_t _seq)
+        : key(_key), seq(_seq) { }
+};
+
+////////////////////////////// CONFLATION //////////////////////////////
+
+// a burst of updates over a small set of keys arrives while a
+// consumer is busy; compare how much work the consumer does to
+// catch up on a fifo queue vs a conflating queue.
+
+static const uint64_t CONFLATE_DONE_KEY = ~0ULL;
+
+// a fifo queue has no use for the key; it's only here so both
+// queue types can be driven by the same template.
+static bool conflate_enqueue(bench_msg::queue_t *q,
+                             bench_msg::sp_t &msg, uint64_t /*key*/)
+{
+    return q->enqueue(msg);
+}
+
+static bool conflate_enqueue(bench_msg::conflating_queue_t *q,
+                             bench_msg::sp_t &msg, uint64_t key)
+{
+    return q->enqueue(msg, key);
+}
+
+struct conflate_consumer_args {
+    bench_msg::queue_t * q;
+    uint64_t work_ns;
+    uint64_t consumed;
+    uint64_t busy_ns;
+};
+
+static void *conflate_consumer(void *arg)
+{
+    conflate_consumer_args * a = (conflate_consumer_args *) arg;
+    a->consumed = 0;
+    a->busy_ns = 0;
+    while (1)
+    {
+        bench_msg::sp_t  m = a->q->dequeue(t2t2::T2T2_WAIT_FOREVER);
+        if (m->key == CONFLATE_DONE_KEY)
+            break;
+        uint64_t start = now_ns();
+        spin_ns(a->work_ns);
+        a->busy_ns += now_ns() - start;
+        a->consumed ++;
+    }
+    return NULL;
+}
+
+template <class queue_t>
+static void bench_conflate_one(const char *mode, queue_t *q,
+                               bench_msg::pool_t *pool,
+                               int num_updates, int num_keys,
+                               uint64_t work_ns)
+{
+    conflate_consumer_args  args;
+    args.q = q;
+    args.work_ns = work_ns;
+
+    pthread_t id;
+    pthread_create(&id, NULL, &conflate_consumer, &args);
+
+    uint64_t start = now_ns();
+    for (int ind = 0; ind < num_updates; ind++)
+    {
+        bench_msg::sp_t  m;
+        uint64_t key = ind % num_keys;
+        if (pool->alloc(&m, t2t2::T2T2_GROW, key, ind))
+            conflate_enqueue(q, m, key);
+    }
+    bench_msg::sp_t  done;
+    if (pool->alloc(&done, t2t2::T2T2_GROW, CONFLATE_DONE_KEY, 0))
+        conflate_enqueue(q, done, CONFLATE_DONE_KEY);
+    pthread_join(id, NULL);
+    uint64_t elapsed = now_ns() - start;
+
+    t2t2::t2t2_pool_stats  pstats;
+    pool->get_stats(pstats);
+
+    printf("conflate: %-10s updates %d keys %d consumed %llu "
+           "consumer_busy_ms %.1f total_ms %.1f pool_bufs %d\n",
+           mode, num_updates, num_keys,
+           (unsigned long long) args.consumed,
+           args.busy_ns / 1e6, elapsed / 1e6, pstats.total_buffers);
+    std::string bench = std::string("conflate_") + mode;
+    record(bench, "consumed", args.consumed);
+    record(bench, "consumer_busy_ms", args.busy_ns / 1e6);
+    record(bench, "total_ms", elapsed / 1e6);
+}
+
+static void bench_conflate(void)
+{
+    const int num_updates = 200000;
+    const int num_keys = 64;
+    const uint64_t work_ns = 1000;
+
+    {
+        bench_msg::pool_t   pool(1000, 1000, NULL, NULL);
+        bench_msg::queue_t  q(NULL, NULL);
+        bench_conflate_one("fifo", &q, &pool,
+                           num_updates, num_keys, work_ns);
+    }
+    {
+        bench_msg::pool_t              pool(1000, 1000, NULL, NULL);
+        bench_msg::conflating_queue_t  q(num_keys);
+        bench_conflate_one("conflating", &q, &pool,
+                           num_updates, num_keys, work_ns);
+        t2t2::t2t2_conflate_stats  cstats;
+        q.get_stats(cstats);
+        cout << "conflate: conflating stats: " << cstats << endl;
+    }
+}
+
+////////////////////////////// DISPATCH //////////////////////////////
+
+// compare routing messages with switch + pxfe_shared_ptr casting
+// constructor (dynamic_cast) vs t2t2_dispatcher.
+
+class disp_base : public t2t2::t2t2_message_base<disp_base>
+{
+public:
+    typedef pxfe_shared_ptr<disp_base> sp_t;
+    enum msgtype { TYPE_B, TYPE_D1, TYPE_D2, TYPE_D3 } type;
+    uint64_t value;
+    disp_base(msgtype _type = TYPE_B) : type(_type), value(1) { }
+};
+
+class disp_d1 : public disp_base
+{
+public:
+    typedef pxfe_shared_ptr<disp_d1> sp_t;
+    uint64_t v1;
+    disp_d1(void) : disp_base(TYPE_D1), v1(2) { }
+};
+
+class disp_d2 : public disp_base
+{
+public:
+    typedef pxfe_shared_ptr<disp_d2> sp_t;
+    uint64_t v2;
+    disp_d2(void) : disp_base(TYPE_D2), v2(3) { }
+};
+
+class disp_d3 : public disp_d2
+{
+public:
+    typedef pxfe_shared_ptr<disp_d3> sp_t;
+    uint64_t v3;
+    disp_d3(void) { type = TYPE_D3; v3 = 4; }
+};
+
+typedef t2t2::t2t2_pool<disp_base,
+                        disp_d1, disp_d2, disp_d3> disp_pool_t;
+typedef t2t2::t2t2_dispatcher<disp_base,
+                              disp_d1, disp_d2, disp_d3> dispatcher_t;
+
+struct disp_handler
+{
+    uint64_t sum;
+    disp_handler(void) : sum(0) { }
+    void operator()(disp_base &m) { sum += m.value; }
+    void operator()(disp_d1 &m) { sum += m.v1; }
+    void operator()(disp_d2 &m) { sum += m.v2; }
+    void operator()(disp_d3 &m) { sum += m.v3; }
+};
+
+static uint64_t dispatch_dynamic_cast(disp_base::sp_t &mb)
+{
+    switch (mb->type)
+    {
+    case disp_base::TYPE_B:
+        return mb->value;
+    case disp_base::TYPE_D1:
+    {
+        disp_d1::sp_t  d1 = mb;
+        return d1 ? d1->v1 : 0;
+    }
+    case disp_base::TYPE_D2:
+    {
+        disp_d2::sp_t  d2 = mb;
+        return d2 ? d2->v2 : 0;
+    }
+    case disp_base::TYPE_D3:
+    {
+        disp_d3::sp_t  d3 = mb;
+        return d3 ? d3->v3 : 0;
+    }
+    }
+    return 0;
+}
+
+static void bench_dispatch(void)
+{
+    const int num_msgs = 64;
+    const int iterations = 100000;
+    disp_pool_t  pool(num_msgs, 1, NULL, NULL);
+    disp_base::sp_t  msgs[num_msgs];
+
+    for (int ind = 0; ind < num_msgs; ind++)
+    {
+        switch (ind % 4)
+        {
+        case 0: pool.alloc(&msgs[ind], t2t2::T2T2_NO_WAIT); break;
+        case 1: { disp_d1::sp_t m; pool.alloc(&m, t2t2::T2T2_NO_WAIT);
+                msgs[ind] = m; break; }
+        case 2: { disp_d2::sp_t m; pool.alloc(&m, t2t2::T2T2_NO_WAIT);
+                msgs[ind] = m; break; }
+        case 3: { disp_d3::sp_t m; pool.alloc(&m, t2t2::T2T2_NO_WAIT);
+                msgs[ind] = m; break; }
+        }
+    }
+
+    uint64_t sum = 0;
+    uint64_t start = now_ns();
+    for (int it = 0; it < iterations; it++)
+        for (int ind = 0; ind < num_msgs; ind++)
+            sum += dispatch_dynamic_cast(msgs[ind]);
+    uint64_t dc_ns = now_ns() - start;
+
+    disp_handler  handler;
+    start = now_ns();
+    for (int it = 0; it < iterations; it++)
+        for (int ind = 0; ind < num_msgs; ind++)
+            dispatcher_t::dispatch(handler, msgs[ind]);
+    uint64_t disp_ns = now_ns() - start;
+
+    double n = (double) iterations * num_msgs;
+    printf("dispatch: switch+dynamic_cast %.2f ns/msg (sum %llu)\n",
+           dc_ns / n, (unsigned long long) sum);
+    printf("dispatch: t2t2_dispatcher     %.2f ns/msg (sum %llu)\n",
+           disp_ns / n, (unsigned long long) handler.sum);
+    record("dispatch", "dynamic_cast_ns_per_msg", dc_ns / n);
+    record("dispatch", "dispatcher_ns_per_msg", disp_ns / n);
+}
+
+////////////////////////////// UNIQUE MSG //////////////////////////////
+
+// the alloc -> enqueue -> dequeue -> release cycle of a message with
+// a single owner, using pxfe_shared_ptr vs t2t2_unique_msg. single
+// threaded, so this is the bookkeeping cost, not the handoff cost.
+
+static void bench_unique(void)
+{
+    const int iterations = 2000000;
+    bench_msg::pool_t   pool(1, 1, NULL, NULL);
+    bench_msg::queue_t  q(NULL, NULL);
+    uint64_t sum = 0;
+
+    uint64_t start = now_ns();
+    for (int ind = 0; ind < iterations; ind++)
+    {
+        bench_msg::sp_t  m;
+        pool.alloc(&m, t2t2::T2T2_NO_WAIT, 0, ind);
+        q.enqueue(m);
+        bench_msg::sp_t  r = q.dequeue(t2t2::T2T2_NO_WAIT);
+        sum += r->seq;
+    }
+    uint64_t shared_ns = now_ns() - start;
+
+    start = now_ns();
+    for (int ind = 0; ind < iterations; ind++)
+    {
+        t2t2::t2t2_unique_msg<bench_msg>  m;
+        pool.alloc(&m, t2t2::T2T2_NO_WAIT, 0, ind);
+        q.enqueue(std::move(m));
+        t2t2::t2t2_unique_msg<bench_msg>  r =
+            q.dequeue_unique(t2t2::T2T2_NO_WAIT);
+        sum += r->seq;
+    }
+    uint64_t unique_ns = now_ns() - start;
+
+    printf("unique: pxfe_shared_ptr %.2f ns/cycle\n",
+           shared_ns / (double) iterations);
+    printf("unique: t2t2_unique_msg %.2f ns/cycle (sum %llu)\n",
+           unique_ns / (double) iterations, (unsigned long long) sum);
+    record("unique", "shared_ptr_ns_per_cycle",
+           shared_ns / (double) iterations);
+    record("unique", "unique_msg_ns_per_cycle",
+           unique_ns / (double) iterations);
+}
+
+////////////////////////////// SHARED PTR //////////////////////////////
+
+// the costs of taking and dropping a ref, and of the casting
+// constructors. the atomic loops show what the memory orders
+// themselves cost on this cpu; on x86 every atomic rmw is a full
+// barrier, so they come out the same, but on ARM they don't (see
+// 'make armcheck' to look at the code generated for ARM).
+
+static void bench_shared_ptr(void)
+{
+    const int iterations = 10000000;
+    disp_pool_t  pool(1, 1, NULL, NULL);
+    disp_d3::sp_t  d3 = pool.alloc<disp_d3>(t2t2::T2T2_NO_WAIT);
+    disp_base::sp_t  b = d3;
+    uint64_t sum = 0;
+
+    uint64_t start = now_ns();
+    for (int ind = 0; ind < iterations; ind++)
+    {
+        disp_d3::sp_t  c = d3;
+        sum += c->v3;
+    }
+    uint64_t copy_ns = now_ns() - start;
+
+    start = now_ns();
+    for (int ind = 0; ind < iterations; ind++)
+    {
+        disp_base::sp_t  c = d3;
+        sum += c->value;
+    }
+    uint64_t upcast_ns = now_ns() - start;
+
+    start = now_ns();
+    for (int ind = 0; ind < iterations; ind++)
+    {
+        disp_d3::sp_t  c = b;
+        sum += c->v3;
+    }
+    uint64_t downcast_ns = now_ns() - start;
+
+    std::atomic_int  counter(1);
+    start = now_ns();
+    for (int ind = 0; ind < iterations; ind++)
+    {
+        counter ++;
+        sum += counter --;
+    }
+    uint64_t seq_cst_ns = now_ns() - start;
+
+    start = now_ns();
+    for (int ind = 0; ind < iterations; ind++)
+    {
+        counter.fetch_add(1, std::memory_order_relaxed);
+        sum += counter.fetch_sub(1, std::memory_order_acq_rel);
+    }
+    uint64_t relaxed_ns = now_ns() - start;
+
+    double n = iterations;
+    printf("shared_ptr: copy+drop       %.2f ns\n", copy_ns / n);
+    printf("shared_ptr: upcast+drop     %.2f ns\n", upcast_ns / n);
+    printf("shared_ptr: downcast+drop   %.2f ns\n", downcast_ns / n);
+    printf("shared_ptr: atomic ++/-- seq_cst         %.2f ns\n",
+           seq_cst_ns / n);
+    printf("shared_ptr: atomic ++/-- relaxed/acq_rel %.2f ns "
+           "(sum %llu)\n", relaxed_ns / n, (unsigned long long) sum);
+    record("shared_ptr", "copy_ns", copy_ns / n);
+    record("shared_ptr", "upcast_ns", upcast_ns / n);
+    record("shared_ptr", "downcast_ns", downcast_ns / n);
+    record("shared_ptr", "atomic_seq_cst_ns", seq_cst_ns / n);
+    record("shared_ptr", "atomic_relaxed_ns", relaxed_ns / n);
+}
+
+////////////////////////////// EMPLACE //////////////////////////////
+
+// the producer side only: alloc then enqueue, vs emplace, vs
+// emplace_n in batches. the queue is drained between rounds,
+// outside the timed part.
+
+static void bench_emplace(void)
+{
+    const int rounds = 20000;
+    const int batch = 32;
+    bench_msg::pool_t   pool(batch, 1, NULL, NULL);
+    bench_msg::queue_t  q(NULL, NULL);
+    uint64_t alloc_ns = 0, emplace_ns = 0, emplace_n_ns = 0;
+    uint64_t start;
+    int ind, round;
+
+    for (round = 0; round < rounds; round++)
+    {
+        start = now_ns();
+        for (ind = 0; ind < batch; ind++)
+        {
+            bench_msg::sp_t  m;
+            if (pool.alloc(&m, t2t2::T2T2_NO_WAIT, 0, ind))
+                q.enqueue(m);
+        }
+        alloc_ns += now_ns() - start;
+        while (q.dequeue(t2t2::T2T2_NO_WAIT))
+            ;
+
+        start = now_ns();
+        for (ind = 0; ind < batch; ind++)
+            q.emplace<bench_msg>(&pool, t2t2::T2T2_NO_WAIT, 0, ind);
+        emplace_ns += now_ns() - start;
+        while (q.dequeue(t2t2::T2T2_NO_WAIT))
+            ;
+
+        start = now_ns();
+        q.emplace_n<bench_msg>(&pool, batch, t2t2::T2T2_NO_WAIT, 0, 0);
+        emplace_n_ns += now_ns() - start;
+        while (q.dequeue(t2t2::T2T2_NO_WAIT))
+            ;
+    }
+
+    double n = (double) rounds * batch;
+    printf("emplace: alloc+enqueue  %.2f ns/msg\n", alloc_ns / n);
+    printf("emplace: emplace        %.2f ns/msg\n", emplace_ns / n);
+    printf("emplace: emplace_n(%d)  %.2f ns/msg\n", batch,
+           emplace_n_ns / n);
+    record("emplace", "alloc_enqueue_ns_per_msg", alloc_ns / n);
+    record("emplace", "emplace_ns_per_msg", emplace_ns / n);
+    record("emplace", "emplace_n_ns_per_msg", emplace_n_ns / n,
+           { { "batch", batch } });
+}
+
+////////////////////////////// RECLAIM //////////////////////////////
+
+// a message with a heavy destructor (it holds references to other
+// messages); how long the consumer spends on each dequeue+drop,
+// destroying inline, vs handing off to a t2t2_reclaimer thread, vs
+// flushing at a "safe point" (outside the timed part) every 32
+// messages. note on a single cpu, the reclaim thread's work still
+// lands on the consumer whenever it gets scheduled.
+
+class reclaim_msg : public t2t2::t2t2_message_base<reclaim_msg>
+{
+public:
+    typedef t2t2::t2t2_pool<reclaim_msg> pool_t;
+    typedef t2t2::t2t2_queue<reclaim_msg> queue_t;
+    typedef pxfe_shared_ptr<reclaim_msg> sp_t;
+
+    static const int NUM_PARTS = 8;
+    bench_msg::sp_t  parts[NUM_PARTS];
+    reclaim_msg(void) { }
+};
+
+static void bench_reclaim_one(const char *mode, t2t2::t2t2_reclaimer *r,
+                              int safe_point_every = 0)
+{
+    const int iterations = 200000;
+    reclaim_msg::pool_t   pool(64, 64, NULL, NULL);
+    bench_msg::pool_t     partpool(64 * reclaim_msg::NUM_PARTS,
+                                   64, NULL, NULL);
+    reclaim_msg::queue_t  q(NULL, NULL);
+    uint64_t consumer_ns = 0;
+
+    if (r)
+        r->attach();
+    for (int ind = 0; ind < iterations; ind++)
+    {
+        reclaim_msg::sp_t  m;
+        if (!pool.alloc(&m, t2t2::T2T2_GROW))
+            continue;
+        for (int p = 0; p < reclaim_msg::NUM_PARTS; p++)
+            partpool.alloc(&m->parts[p], t2t2::T2T2_GROW, p, ind);
+        q.enqueue(m);
+
+        uint64_t start = now_ns();
+        reclaim_msg::sp_t  d = q.dequeue(t2t2::T2T2_NO_WAIT);
+        d.reset();
+        consumer_ns += now_ns() - start;
+        if (safe_point_every > 0 && (ind % safe_point_every) == 0)
+            r->flush();
+    }
+    if (r)
+    {
+        // the pools go away when this returns.
+        r->sync();
+        r->detach();
+    }
+
+    printf("reclaim: %-9s consumer dequeue+drop %.2f ns/msg\n",
+           mode, consumer_ns / (double) iterations);
+    record(std::string("reclaim_") + mode, "consumer_ns_per_msg",
+           consumer_ns / (double) iterations);
+}
+
+static void bench_reclaim(void)
+{
+    bench_reclaim_one("inline", NULL);
+    t2t2::t2t2_reclaim_stats  stats;
+    {
+        t2t2::t2t2_reclaimer  r(64);
+        bench_reclaim_one("deferred", &r);
+        r.get_stats(stats);
+    }
+    cout << "reclaim: " << stats << endl;
+    {
+        t2t2::t2t2_reclaimer  r(64, false);
+        bench_reclaim_one("safepoint", &r, 32);
+        r.get_stats(stats);
+    }
+    cout << "reclaim: " << stats << endl;
+}
+
+////////////////////////////// ARENA //////////////////////////////
+
+// build and drop a message with NUM_PARTS children: children from
+// their own pool (reclaim_msg, above) vs from the message's arena.
+
+struct arena_part {
+    uint64_t key;
+    uint64_t seq;
+};
+
+class arena_msg : public t2t2::t2t2_message_base<arena_msg>
+{
+public:
+    typedef t2t2::t2t2_arena_pool<arena_msg> pool_t;
+    typedef pxfe_shared_ptr<arena_msg> sp_t;
+
+    arena_part * parts[reclaim_msg::NUM_PARTS];
+    arena_msg(void) { }
+};
+
+static void bench_arena(void)
+{
+    const int iterations = 1000000;
+    const int nparts = reclaim_msg::NUM_PARTS;
+    uint64_t sum = 0;
+
+    reclaim_msg::pool_t  pool(1, 1, NULL, NULL);
+    bench_msg::pool_t    partpool(nparts, 1, NULL, NULL);
+    uint64_t start = now_ns();
+    for (int ind = 0; ind < iterations; ind++)
+    {
+        reclaim_msg::sp_t  m;
+        pool.alloc(&m, t2t2::T2T2_NO_WAIT);
+        for (int p = 0; p < nparts; p++)
+            partpool.alloc(&m->parts[p], t2t2::T2T2_NO_WAIT, p, ind);
+        sum += m->parts[nparts-1]->seq;
+    }
+    uint64_t pools_ns = now_ns() - start;
+
+    arena_msg::pool_t  apool(nparts * sizeof(arena_part), 1, 1, NULL, NULL);
+    start = now_ns();
+    for (int ind = 0; ind < iterations; ind++)
+    {
+        arena_msg::sp_t  m;
+        apool.alloc(&m, t2t2::T2T2_NO_WAIT);
+        t2t2::t2t2_arena  a = m->get_arena();
+        for (int p = 0; p < nparts; p++)
+        {
+            m->parts[p] = a.make<arena_part>();
+            m->parts[p]->key = p;
+            m->parts[p]->seq = ind;
+        }
+        sum += m->parts[nparts-1]->seq;
+    }
+    uint64_t arena_ns = now_ns() - start;
+
+    printf("arena: %d children from a pool  %.2f ns/msg\n",
+           nparts, pools_ns / (double) iterations);
+    printf("arena: %d children from arena   %.2f ns/msg (sum %llu)\n",
+           nparts, arena_ns / (double) iterations,
+           (unsigned long long) sum);
+    record("arena", "pools_ns_per_msg", pools_ns / (double) iterations,
+           { { "children", nparts } });
+    record("arena", "arena_ns_per_msg", arena_ns / (double) iterations,
+           { { "children", nparts } });
+}
+
+////////////////////////////// HANDOFF //////////////////////////////
+
+// more threads than buffers, each allocating with T2T2_WAIT_FOREVER,
+// holding the buffer a moment, and releasing it; the tail of the
+// alloc wait times, with and without fair handoff.
+
+struct handoff_args {
+    bench_msg::pool_t * pool;
+    int iterations;
+    std::vector<uint64_t> waits;
+};
+
+static void *handoff_thread(void *arg)
+{
+    handoff_args * a = (handoff_args *) arg;
+    a->waits.reserve(a->iterations);
+    for (int ind = 0; ind < a->iterations; ind++)
+    {
+        bench_msg::sp_t  m;
+        uint64_t start = now_ns();
+        a->pool->alloc(&m, t2t2::T2T2_WAIT_FOREVER, 0, ind);
+        a->waits.push_back(now_ns() - start);
+        spin_ns(1000);
+    }
+    return NULL;
+}
+
+static void bench_handoff_one(const char *mode, bool fair)
+{
+    const int num_threads = 8;
+    const int num_bufs = 2;
+    bench_msg::pool_t  pool(num_bufs, 1, NULL, NULL);
+    pool.set_fair_handoff(fair);
+    handoff_args  args[num_threads];
+    pthread_t     ids[num_threads];
+    int ind;
+
+    for (ind = 0; ind < num_threads; ind++)
+    {
+        args[ind].pool = &pool;
+        args[ind].iterations = 5000;
+        pthread_create(&ids[ind], NULL, &handoff_thread, &args[ind]);
+    }
+    std::vector<uint64_t>  waits;
+    for (ind = 0; ind < num_threads; ind++)
+    {
+        pthread_join(ids[ind], NULL);
+        waits.insert(waits.end(),
+                     args[ind].waits.begin(), args[ind].waits.end());
+    }
+    bench_percentiles  p = get_percentiles(waits);
+    printf("handoff: %-6s allocs %d p50 %.1f p99 %.1f p999 %.1f "
+           "max %.1f us\n", mode, (int) waits.size(),
+           p.p50, p.p99, p.p999, p.max);
+    record_percentiles(std::string("handoff_") + mode, p,
+                       { { "threads", num_threads },
+                         { "buffers", num_bufs } });
+}
+
+static void bench_handoff(void)
+{
+    bench_handoff_one("barge", false);
+    bench_handoff_one("fair", true);
+}
+
+////////////////////////////// SIZED MSG //////////////////////////////
+
+// the sweeps below use a message with a SIZE byte body, which the
+// constructor fills in, as a producer would; the consumers read it.
+
+static const uint64_t STOP_SEQ = ~0ULL;
+
+template <int SIZE>
+class sized_msg : public t2t2::t2t2_message_base<sized_msg<SIZE>>
+{
+public:
+    typedef t2t2::t2t2_pool<sized_msg> pool_t;
+    typedef t2t2::t2t2_queue<sized_msg> queue_t;
+    typedef pxfe_shared_ptr<sized_msg> sp_t;
+
+    uint64_t seq;
+    uint64_t stamp;
+    uint8_t  body[SIZE];
+    sized_msg(uint64_t _seq) : seq(_seq), stamp(0)
+    {
+        memset(body, (int) _seq, SIZE);
+    }
+};
+
+static const int thread_counts[] = { 1, 2, 4, 8 };
+static const int num_thread_counts =
+    sizeof(thread_counts) / sizeof(thread_counts[0]);
+
+////////////////////////////// POOL //////////////////////////////
+
+// alloc+release, from one thread, and then from several threads
+// sharing one pool (with enough buffers that nobody waits). the
+// contended number is wall time over all the threads' allocs.
+
+template <int SIZE>
+struct pool_args {
+    typename sized_msg<SIZE>::pool_t * pool;
+    pthread_barrier_t * barrier;
+    int iterations;
+};
+
+template <int SIZE>
+static void *pool_thread(void *arg)
+{
+    pool_args<SIZE> * a = (pool_args<SIZE> *) arg;
+    pthread_barrier_wait(a->barrier);
+    for (int ind = 0; ind < a->iterations; ind++)
+    {
+        typename sized_msg<SIZE>::sp_t  m =
+            a->pool->template alloc<sized_msg<SIZE>>(
+                t2t2::T2T2_WAIT_FOREVER, ind);
+    }
+    return NULL;
+}
+
+template <int SIZE>
+static void bench_pool_size(void)
+{
+    typedef sized_msg<SIZE> msg_t;
+    const int iterations = iters(1000000);
+
+    {
+        typename msg_t::pool_t  pool(1, 1, NULL, NULL);
+        uint64_t start = now_ns();
+        for (int ind = 0; ind < iterations; ind++)
+        {
+            typename msg_t::sp_t  m =
+                pool.template alloc<msg_t>(t2t2::T2T2_NO_WAIT, ind);
+        }
+        double ns = (now_ns() - start) / (double) iterations;
+        printf("pool: uncontended   size %4d           %.2f ns/op\n",
+               SIZE, ns);
+        record("pool_uncontended", "ns_per_op", ns, { { "size", SIZE } });
+    }
+
+    for (int tc = 0; tc < num_thread_counts; tc++)
+    {
+        int threads = thread_counts[tc];
+        typename msg_t::pool_t  pool(threads * 2, 1, NULL, NULL);
+        pthread_barrier_t  barrier;
+        pthread_barrier_init(&barrier, NULL, threads + 1);
+        std::vector<pool_args<SIZE>>  args(threads);
+        std::vector<pthread_t>  ids(threads);
+        for (int ind = 0; ind < threads; ind++)
+        {
+            args[ind].pool = &pool;
+            args[ind].barrier = &barrier;
+            args[ind].iterations = iterations / threads;
+            pthread_create(&ids[ind], NULL, &pool_thread<SIZE>, &args[ind]);
+        }
+        pthread_barrier_wait(&barrier);
+        uint64_t start = now_ns();
+        for (int ind = 0; ind < threads; ind++)
+            pthread_join(ids[ind], NULL);
+        double ns = (now_ns() - start) /
+            (double) (iterations / threads * threads);
+        pthread_barrier_destroy(&barrier);
+        printf("pool: contended     size %4d threads %d %.2f ns/op\n",
+               SIZE, threads, ns);
+        record("pool_contended", "ns_per_op", ns,
+               { { "threads", threads }, { "size", SIZE } });
+    }
+}
+
+static void bench_pool(void)
+{
+    bench_pool_size<64>();
+    bench_pool_size<1024>();
+    bench_pool_size<4096>();
+}
+
+////////////////////////////// QUEUE //////////////////////////////
+
+// throughput of producers allocating and enqueueing and consumers
+// dequeueing and dropping, through one queue: spsc, mpsc and mpmc.
+// the pool is smaller than the run, so producers which get too far
+// ahead wait for buffers, as they would in a real system.
+
+template <int SIZE>
+struct queue_args {
+    typename sized_msg<SIZE>::pool_t * pool;
+    typename sized_msg<SIZE>::queue_t * q;
+    pthread_barrier_t * barrier;
+    int count;           // producer: how many to send
+    uint64_t received;   // consumer: how many it got
+    uint64_t sum;        // consumer: so the reads aren't optimized away
+};
+
+template <int SIZE>
+static void *queue_producer(void *arg)
+{
+    queue_args<SIZE> * a = (queue_args<SIZE> *) arg;
+    pthread_barrier_wait(a->barrier);
+    for (int ind = 0; ind < a->count; ind++)
+    {
+        typename sized_msg<SIZE>::sp_t  m =
+            a->pool->template alloc<sized_msg<SIZE>>(
+                t2t2::T2T2_WAIT_FOREVER, ind);
+        a->q->enqueue(m);
+    }
+    return NULL;
+}
+
+template <int SIZE>
+static void *queue_consumer(void *arg)
+{
+    queue_args<SIZE> * a = (queue_args<SIZE> *) arg;
+    a->received = 0;
+    a->sum = 0;
+    pthread_barrier_wait(a->barrier);
+    while (1)
+    {
+        typename sized_msg<SIZE>::sp_t  m =
+            a->q->dequeue(t2t2::T2T2_WAIT_FOREVER);
+        if (m->seq == STOP_SEQ)
+            break;
+        a->sum += m->seq + m->body[SIZE-1];
+        a->received ++;
+    }
+    return NULL;
+}
+
+template <int SIZE>
+static void bench_queue_one(const char *bench, int producers, int consumers)
+{
+    typedef sized_msg<SIZE> msg_t;
+    const int total = iters(400000);
+    typename msg_t::pool_t   pool(1024, 1, NULL, NULL);
+    typename msg_t::queue_t  q(NULL, NULL);
+    pthread_barrier_t  barrier;
+    pthread_barrier_init(&barrier, NULL, producers + consumers + 1);
+    std::vector<queue_args<SIZE>>  pargs(producers), cargs(consumers);
+    std::vector<pthread_t>  pids(producers), cids(consumers);
+    int ind;
+
+    for (ind = 0; ind < consumers; ind++)
+    {
+        cargs[ind].q = &q;
+        cargs[ind].barrier = &barrier;
+        pthread_create(&cids[ind], NULL,
+                       &queue_consumer<SIZE>, &cargs[ind]);
+    }
+    for (ind = 0; ind < producers; ind++)
+    {
+        pargs[ind].pool = &pool;
+        pargs[ind].q = &q;
+        pargs[ind].barrier = &barrier;
+        pargs[ind].count = total / producers;
+        pthread_create(&pids[ind], NULL,
+                       &queue_producer<SIZE>, &pargs[ind]);
+    }
+    pthread_barrier_wait(&barrier);
+    uint64_t start = now_ns();
+    for (ind = 0; ind < producers; ind++)
+        pthread_join(pids[ind], NULL);
+    // one stop per consumer, behind everything else.
+    for (ind = 0; ind < consumers; ind++)
+    {
+        typename msg_t::sp_t  m =
+            pool.template alloc<msg_t>(t2t2::T2T2_WAIT_FOREVER, STOP_SEQ);
+        q.enqueue(m);
+    }
+    uint64_t received = 0;
+    for (ind = 0; ind < consumers; ind++)
+    {
+        pthread_join(cids[ind], NULL);
+        received += cargs[ind].received;
+    }
+    uint64_t elapsed = now_ns() - start;
+    pthread_barrier_destroy(&barrier);
+
+    double rate = received * 1e9 / elapsed;
+    printf("queue: %-4s size %4d producers %d consumers %d "
+           "%.0f msgs/s %.2f ns/msg\n", bench, SIZE, producers, consumers,
+           rate, elapsed / (double) received);
+    record(std::string("queue_") + bench, "msgs_per_sec", rate,
+           { { "producers", producers }, { "consumers", consumers },
+             { "size", SIZE } });
+}
+
+template <int SIZE>
+static void bench_queue_size(void)
+{
+    bench_queue_one<SIZE>("spsc", 1, 1);
+    for (int tc = 0; tc < num_thread_counts; tc++)
+        if (thread_counts[tc] > 1)
+            bench_queue_one<SIZE>("mpsc", thread_counts[tc], 1);
+    for (int tc = 0; tc < num_thread_counts; tc++)
+        if (thread_counts[tc] > 1)
+            bench_queue_one<SIZE>("mpmc", thread_counts[tc],
+                                  thread_counts[tc]);
+}
+
+static void bench_queue(void)
+{
+    bench_queue_size<64>();
+    bench_queue_size<1024>();
+    bench_queue_size<4096>();
+}
+
+////////////////////////////// LATENCY //////////////////////////////
+
+// one-way: a producer stamps each message just before enqueueing it,
+// and the consumer measures when it comes out; the producer sleeps
+// between messages so they don't queue up behind each other.
+// ping-pong: a message goes to an echo thread on one queue and comes
+// back on another; the round trip time.
+
+template <int SIZE>
+struct latency_args {
+    typename sized_msg<SIZE>::queue_t * q;
+    typename sized_msg<SIZE>::queue_t * reply_q;
+    std::vector<uint64_t> times;
+};
+
+template <int SIZE>
+static void *latency_consumer(void *arg)
+{
+    latency_args<SIZE> * a = (latency_args<SIZE> *) arg;
+    while (1)
+    {
+        typename sized_msg<SIZE>::sp_t  m =
+            a->q->dequeue(t2t2::T2T2_WAIT_FOREVER);
+        if (m->seq == STOP_SEQ)
+            break;
+        a->times.push_back(now_ns() - m->stamp);
+    }
+    return NULL;
+}
+
+template <int SIZE>
+static void *latency_echo(void *arg)
+{
+    latency_args<SIZE> * a = (latency_args<SIZE> *) arg;
+    while (1)
+    {
+        typename sized_msg<SIZE>::sp_t  m =
+            a->q->dequeue(t2t2::T2T2_WAIT_FOREVER);
+        bool stop = (m->seq == STOP_SEQ);
+        a->reply_q->enqueue(m);
+        if (stop)
+            break;
+    }
+    return NULL;
+}
+
+template <int SIZE>
+static void bench_latency_size(void)
+{
+    typedef sized_msg<SIZE> msg_t;
+    const int iterations = iters(20000);
+    typename msg_t::pool_t   pool(4, 1, NULL, NULL);
+    typename msg_t::queue_t  q(NULL, NULL), reply_q(NULL, NULL);
+    latency_args<SIZE>  args;
+    args.q = &q;
+    args.reply_q = &reply_q;
+    args.times.reserve(iterations);
+    pthread_t  id;
+    int ind;
+
+    pthread_create(&id, NULL, &latency_consumer<SIZE>, &args);
+    for (ind = 0; ind <= iterations; ind++)
+    {
+        typename msg_t::sp_t  m = pool.template alloc<msg_t>(
+            t2t2::T2T2_WAIT_FOREVER, (ind == iterations) ? STOP_SEQ : ind);
+        m->stamp = now_ns();
+        q.enqueue(m);
+        if (ind < iterations)
+            usleep(10);
+    }
+    pthread_join(id, NULL);
+    bench_percentiles  p = get_percentiles(args.times);
+    printf("latency: oneway   size %4d p50 %.1f p90 %.1f p99 %.1f "
+           "p999 %.1f max %.1f us\n", SIZE,
+           p.p50, p.p90, p.p99, p.p999, p.max);
+    record_percentiles("latency_oneway", p, { { "size", SIZE } });
+
+    args.times.clear();
+    pthread_create(&id, NULL, &latency_echo<SIZE>, &args);
+    for (ind = 0; ind <= iterations; ind++)
+    {
+        typename msg_t::sp_t  m = pool.template alloc<msg_t>(
+            t2t2::T2T2_WAIT_FOREVER, (ind == iterations) ? STOP_SEQ : ind);
+        uint64_t start = now_ns();
+        q.enqueue(m);
+        m = reply_q.dequeue(t2t2::T2T2_WAIT_FOREVER);
+        if (ind < iterations)
+            args.times.push_back(now_ns() - start);
+    }
+    pthread_join(id, NULL);
+    p = get_percentiles(args.times);
+    printf("latency: pingpong size %4d p50 %.1f p90 %.1f p99 %.1f "
+           "p999 %.1f max %.1f us\n", SIZE,
+           p.p50, p.p90, p.p99, p.p999, p.max);
+    record_percentiles("latency_pingpong", p, { { "size", SIZE } });
+}
+
+static void bench_latency(void)
+{
+    bench_latency_size<64>();
+    bench_latency_size<1024>();
+    bench_latency_size<4096>();
+}
+
+////////////////////////////// QUEUE SET //////////////////////////////
+
+// enqueue+dequeue through a queue_set as the set grows, with the
+// message on the first (highest priority) queue and on the last.
+
+static void bench_queue_set(void)
+{
+    const int iterations = iters(200000);
+    const int set_sizes[] = { 1, 2, 4, 8, 16, 32, 64 };
+    // (queues can't be made with new, or copied into a vector.)
+    std::list<bench_msg::queue_t>  queue_list;
+    std::vector<bench_msg::queue_t *>  queues;
+    for (int ind = 0; ind < 64; ind++)
+    {
+        queue_list.emplace_back(nullptr, nullptr);
+        queues.push_back(&queue_list.back());
+    }
+    bench_msg::pool_t   pool(1, 1, NULL, NULL);
+
+    for (size_t ss = 0; ss < sizeof(set_sizes)/sizeof(set_sizes[0]); ss++)
+    {
+        int num_queues = set_sizes[ss];
+        t2t2::t2t2_queue_set<bench_msg>  qset(NULL, NULL);
+        for (int ind = 0; ind < num_queues; ind++)
+            qset.add_queue(queues[ind], ind);
+
+        uint64_t ns[2];
+        for (int which = 0; which < 2; which++)
+        {
+            bench_msg::queue_t * q = queues[which ? num_queues - 1 : 0];
+            uint64_t start = now_ns();
+            for (int ind = 0; ind < iterations; ind++)
+            {
+                bench_msg::sp_t  m;
+                pool.alloc(&m, t2t2::T2T2_NO_WAIT, 0, ind);
+                q->enqueue(m);
+                m = qset.dequeue(t2t2::T2T2_NO_WAIT);
+            }
+            ns[which] = now_ns() - start;
+        }
+        for (int ind = 0; ind < num_queues; ind++)
+            qset.remove_queue(queues[ind]);
+
+        printf("queue_set: queues %2d first %.2f last %.2f ns/msg\n",
+               num_queues, ns[0] / (double) iterations,
+               ns[1] / (double) iterations);
+        record("queue_set", "first_ns_per_msg", ns[0] / (double) iterations,
+               { { "queues", num_queues } });
+        record("queue_set", "last_ns_per_msg", ns[1] / (double) iterations,
+               { { "queues", num_queues } });
+    }
+}
+
+////////////////////////////// GROW //////////////////////////////
+
+// allocs with T2T2_GROW from an empty pool, holding every message so
+// the pool keeps growing, vs the same allocs from a pool which
+// already has the buffers. the difference over the number of grows
+// is the cost of a grow.
+
+static void bench_grow(void)
+{
+    const int num_allocs = iters(65536);
+    const int grow_sizes[] = { 1, 16, 256 };
+    std::vector<bench_msg::sp_t>  held(num_allocs);
+
+    uint64_t base_ns;
+    {
+        bench_msg::pool_t  pool(num_allocs, 1, NULL, NULL);
+        uint64_t start = now_ns();
+        for (int ind = 0; ind < num_allocs; ind++)
+            pool.alloc(&held[ind], t2t2::T2T2_NO_WAIT, 0, ind);
+        base_ns = now_ns() - start;
+        for (int ind = 0; ind < num_allocs; ind++)
+            held[ind].reset();
+    }
+    printf("grow: prefilled         %.2f ns/alloc\n",
+           base_ns / (double) num_allocs);
+    record("grow", "ns_per_alloc", base_ns / (double) num_allocs,
+           { { "grow_by", 0 } });
+
+    for (size_t gs = 0; gs < sizeof(grow_sizes)/sizeof(grow_sizes[0]); gs++)
+    {
+        int grow_by = grow_sizes[gs];
+        bench_msg::pool_t  pool(0, grow_by, NULL, NULL);
+        uint64_t start = now_ns();
+        for (int ind = 0; ind < num_allocs; ind++)
+            pool.alloc(&held[ind], t2t2::T2T2_GROW, 0, ind);
+        uint64_t grow_ns = now_ns() - start;
+        for (int ind = 0; ind < num_allocs; ind++)
+            held[ind].reset();
+
+        t2t2::t2t2_pool_stats  stats;
+        pool.get_stats(stats);
+        double per_grow = stats.grows ?
+            ((double) grow_ns - (double) base_ns) / stats.grows : 0;
+        printf("grow: grow_by %3d grows %5d %.2f ns/alloc %.0f ns/grow\n",
+               grow_by, stats.grows, grow_ns / (double) num_allocs,
+               per_grow);
+        record("grow", "ns_per_alloc", grow_ns / (double) num_allocs,
+               { { "grow_by", grow_by } });
+        record("grow", "ns_per_grow", per_grow, { { "grow_by", grow_by } });
+    }
+}
+
+////////////////////////////// TIMING //////////////////////////////
+
+// what the delay and lifetime histograms cost: one thread allocs,
+// enqueues, dequeues and drops, with timing off and then on. only
+// with T2T2_TIMESTAMPS; without it there is nothing to measure.
+
+#ifdef T2T2_TIMESTAMPS
+static void bench_timing(void)
+{
+    typedef sized_msg<64> msg_t;
+    const int iterations = iters(1000000);
+
+    for (int on = 0; on < 2; on++)
+    {
+        msg_t::pool_t   pool(1, 1, NULL, NULL);
+        msg_t::queue_t  q(NULL, NULL);
+        if (on)
+        {
+            q.enable_delay_histogram();
+            pool.enable_lifetime_histogram();
+        }
+        uint64_t start = now_ns();
+        for (int ind = 0; ind < iterations; ind++)
+        {
+            q.enqueue(pool.alloc<msg_t>(t2t2::T2T2_NO_WAIT, ind));
+            q.dequeue(t2t2::T2T2_NO_WAIT);
+        }
+        double ns = (now_ns() - start) / (double) iterations;
+        printf("timing: histograms %-3s           %.2f ns/op\n",
+               on ? "on" : "off", ns);
+        record("timing", "ns_per_op", ns, { { "on", on } });
+        if (on)
+        {
+            t2t2::t2t2_histogram  hist;
+            q.get_delay_histogram(hist);
+            cout << "timing: delay    " << hist << endl;
+            pool.get_lifetime_histogram(hist);
+            cout << "timing: lifetime " << hist << endl;
+        }
+    }
+}
+#endif
+
+////////////////////////////// MAIN //////////////////////////////
+
+struct bench_entry {
+    const char * name;
+    void (*func)(void);
+};
+
+static const bench_entry benches[] = {
+    { "conflate",   &bench_conflate },
+    { "dispatch",   &bench_dispatch },
+    { "unique",     &bench_unique },
+    { "shared_ptr", &bench_shared_ptr },
+    { "emplace",    &bench_emplace },
+    { "reclaim",    &bench_reclaim },
+    { "arena",      &bench_arena },
+    { "handoff",    &bench_handoff },
+    { "pool",       &bench_pool },
+    { "queue",      &bench_queue },
+    { "latency",    &bench_latency },
+    { "queue_set",  &bench_queue_set },
+    { "grow",       &bench_grow },
+#ifdef T2T2_TIMESTAMPS
+    { "timing",     &bench_timing },
+#endif
+};
+static const int num_benches = sizeof(benches) / sizeof(benches[0]);
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: t2t2bench [-q] [-l] [-c file.csv] [-j file.json] "
+            "[bench...]\n");
+    exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+    const char * csv_path = NULL;
+    const char * json_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qlc:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'q':
+            quick = true;
+            break;
+        case 'l':
+            for (int ind = 0; ind < num_benches; ind++)
+                printf("%s\n", benches[ind].name);
+            return 0;
+        case 'c':
+            csv_path = optarg;
+            break;
+        case 'j':
+            json_path = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    // check the names before running anything.
+    for (int arg = optind; arg < argc; arg++)
+    {
+        int ind;
+        for (ind = 0; ind < num_benches; ind++)
+            if (strcmp(argv[arg], benches[ind].name) == 0)
+                break;
+        if (ind == num_benches)
+        {
+            fprintf(stderr, "unknown bench '%s' (see -l)\n", argv[arg]);
+            return 1;
+        }
+    }
+
+    for (int ind = 0; ind < num_benches; ind++)
+    {
+        bool run = (optind == argc);
+        for (int arg = optind; arg < argc; arg++)
+            if (strcmp(argv[arg], benches[ind].name) == 0)
+                run = true;
+        if (run)
+            benches[ind].func();
+    }
+
+    if (csv_path && !write_csv(csv_path))
+    {
+        fprintf(stderr, "can't write %s\n", csv_path);
+        return 1;
+    }
+    if (json_path && !write_json(json_path))
+    {
+        fprintf(stderr, "can't write %s\n", json_path);
+        return 1;
+    }
+    return 0;
+}
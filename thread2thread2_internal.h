@@ -59,11 +59,67 @@ struct largest_type<BaseT, T, U, Ts...>
     static const int size = sizeof(type);
 };
 
+// every type gets a unique address, which serves as a type identity
+// without RTTI. (template static members are merged by the linker,
+// so this is the same in every translation unit.)
+template <typename T>
+struct __t2t2_type_tag
+{
+    static const char tag;
+};
+
+template <typename T>
+const char __t2t2_type_tag<T>::tag = 0;
+
+// the position of T in the list Ts, or -1 if it isn't in the list.
+template <typename T, typename... Ts>
+struct __t2t2_type_index;
+
+template <typename T>
+struct __t2t2_type_index<T>
+{
+    static const int value = -1;
+};
+
+template <typename T, typename U, typename... Ts>
+struct __t2t2_type_index<T, U, Ts...>
+{
+    static const int next = __t2t2_type_index<T, Ts...>::value;
+    static const int value =
+        std::is_same<T, U>::value ? 0 : ((next < 0) ? -1 : (next + 1));
+};
+
 //////////////////////////// ERROR HANDLING ////////////////////////////
 
 #define __T2T2_ASSERT(err,fatal) \
     t2t2_assert_handler(t2t2_error_t::err,fatal, __FILE__, __LINE__)
 
+// see t2t2_rt_section. without T2T2_RT_AUDIT this is gone altogether.
+#ifdef T2T2_RT_AUDIT
+void __t2t2_rt_violation(t2t2_error_t e, const void *object,
+                         const char *filename, int lineno);
+#define __T2T2_RT_CHECK(cond,err,object)                                \
+    do {                                                                \
+        if (__t2t2_rt_depth > 0 && (cond))                              \
+            __t2t2_rt_violation(t2t2_error_t::err, object,              \
+                                __FILE__, __LINE__);                    \
+    } while (0)
+#else
+#define __T2T2_RT_CHECK(cond,err,object) do { } while (0)
+#endif
+
+// with T2T2_LEAK_TRACKING, the public alloc entry points are kept
+// out of line, so their return address is in the user's code; they
+// pass it down to __t2t2_pool::_alloc as the leak site. without it,
+// they inline as usual and the site is NULL.
+#ifdef T2T2_LEAK_TRACKING
+#define __T2T2_LEAK_NOINLINE __attribute__((noinline))
+#define __T2T2_LEAK_CALLER   __builtin_return_address(0)
+#else
+#define __T2T2_LEAK_NOINLINE
+#define __T2T2_LEAK_CALLER   NULL
+#endif
+
 //////////////////////////// __T2T2_LINKS ////////////////////////////
 
 // this can't really have a constructor because it gets pointer-cast
@@ -108,7 +164,7 @@ struct __t2t2_links
         item->prev = this;
         next->prev = item;
         next = item;
-        item->list = this;
+        item->list = owner();
     }
     // a queue should be a fifo to keep msgs in order, so
     // push to the back of the list and pop from the front.
@@ -123,7 +179,14 @@ struct __t2t2_links
         item->prev = prev;
         prev->next = item;
         prev = item;
-        item->list = this;
+        item->list = owner();
+    }
+    // a list head has list==NULL, and items on a list point to
+    // the head; so this returns the head no matter whether an item
+    // is being added relative to the head or to another item.
+    __t2t2_links<T> * owner(void)
+    {
+        return (list != NULL) ? list : this;
     }
     bool validate(T *item)
     {
@@ -152,9 +215,36 @@ struct __t2t2_links
 
 struct __t2t2_buffer_hdr : public __t2t2_links<__t2t2_buffer_hdr>
 {
+    // a buffer is only on one queue at a time, so these can overlap.
+    union {
+        // only meaningful while on a deadline-ordered queue: where
+        // this buffer's entry is in the queue's due heap.
+        size_t    due_index;
+        // only meaningful while on a conflating queue: the message's
+        // key, and the next buffer in the same key hash bucket.
+        struct {
+            uint64_t             key;
+            __t2t2_buffer_hdr  * next;
+        } conflate;
+        // only meaningful while waiting on a t2t2_reclaimer list:
+        // the object whose destructor hasn't been run yet.
+        pxfe_shared_ptr_base * reclaim_obj;
+    };
+#ifdef T2T2_TIMESTAMPS
+    // CLOCK_MONOTONIC ns when this buffer was last enqueued and
+    // allocated, or 0 if the queue (or pool) wasn't timing them.
+    // only built with T2T2_TIMESTAMPS, so untimed users don't pay
+    // for them in every buffer.
+    uint64_t  enqueue_ns;
+    uint64_t  alloc_ns;
+#endif
     void init(void)
     {
         __t2t2_links::init();
+#ifdef T2T2_TIMESTAMPS
+        enqueue_ns = 0;
+        alloc_ns = 0;
+#endif
     }
 } __attribute__ ((aligned (sizeof(void*))));
 
@@ -195,6 +285,28 @@ struct __t2t2_links_head : public __t2t2_links<T>
     }
 };
 
+//////////////////////////// __T2T2_ASYNC_WAITER ////////////////////////////
+
+// a consumer that waits on a queue without blocking a thread (e.g.
+// a suspended coroutine). waiters are served in fifo order: when a
+// buffer arrives, the first waiter is taken off the list, h (and id,
+// for a queue set) are filled in, and then wake is called with no
+// locks held. like a buffer hdr, this gets no constructor; the
+// owner must init() it.
+struct __t2t2_async_waiter : public __t2t2_links<__t2t2_async_waiter>
+{
+    __t2t2_buffer_hdr * h;
+    int    id;
+    void (*wake)(__t2t2_async_waiter *w);
+    void * arg;
+    void init(void)
+    {
+        __t2t2_links::init();
+        h = NULL;
+        id = -1;
+    }
+};
+
 //////////////////////////// __T2T2_TIMESPEC ////////////////////////////
 
 struct __t2t2_timespec : public timespec
@@ -213,60 +325,491 @@ struct __t2t2_timespec : public timespec
     {
         tv_sec += rhs.tv_sec;
         tv_nsec += rhs.tv_nsec;
-        if (tv_nsec > 1000000000)
+        if (tv_nsec >= 1000000000)
         {
             tv_nsec -= 1000000000;
             tv_sec += 1;
         }
         return *this;
     }
+    bool operator<(const timespec &rhs) const
+    {
+        return before(*this, rhs);
+    }
+    static bool before(const timespec &lhs, const timespec &rhs)
+    {
+        if (lhs.tv_sec != rhs.tv_sec)
+            return lhs.tv_sec < rhs.tv_sec;
+        return lhs.tv_nsec < rhs.tv_nsec;
+    }
+    uint64_t to_ns(void) const
+    {
+        return (uint64_t) tv_sec * 1000000000ULL + tv_nsec;
+    }
+};
+
+static inline uint64_t __t2t2_now_ns(void)
+{
+    timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//////////////////////////// __T2T2_TRACE ////////////////////////////
+
+// see t2t2_trace_enable. cond lets a caller skip objects it doesn't
+// want traced, at no cost while tracing is off.
+#ifdef T2T2_TRACING
+extern std::atomic<bool> __t2t2_trace_on;
+void __t2t2_trace(int event, const void *object, const void *msg);
+#define __T2T2_TRACE(cond,event,object,msg)                             \
+    do {                                                                \
+        if (__builtin_expect(                                           \
+                __t2t2_trace_on.load(std::memory_order_relaxed), 0)     \
+            && (cond))                                                  \
+            __t2t2_trace(event, object, msg);                           \
+    } while (0)
+#else
+#define __T2T2_TRACE(cond,event,object,msg) do { } while (0)
+#endif
+
+//////////////////////////// __T2T2_LOCK_PROF ////////////////////////////
+
+// contention stats for one mutex (see t2t2_lock_stats). with
+// T2T2_LOCK_PROFILING, every lock is tried first, and the clock is
+// only read for a wait if that fails; hold time costs two clock reads
+// per lock. everything here is only changed by the thread holding
+// the mutex. without it, this is empty and costs nothing.
+struct __t2t2_lock_prof
+{
+#ifdef T2T2_LOCK_PROFILING
+    t2t2_lock_stats  stats;
+    uint64_t         locked_at;
+    __t2t2_lock_prof(void) { memset(&stats, 0, sizeof(stats)); }
+    static void lock(__t2t2_lock_prof *p, pthread_mutex_t *m)
+    {
+        if (p == NULL)
+        {
+            pthread_mutex_lock(m);
+            return;
+        }
+        if (pthread_mutex_trylock(m) == 0)
+            p->locked_at = __t2t2_now_ns();
+        else
+        {
+            uint64_t start = __t2t2_now_ns();
+            pthread_mutex_lock(m);
+            p->locked_at = __t2t2_now_ns();
+            uint64_t waited = p->locked_at - start;
+            p->stats.contended ++;
+            p->stats.wait_ns += waited;
+            if (waited > p->stats.max_wait_ns)
+                p->stats.max_wait_ns = waited;
+        }
+        p->stats.acquisitions ++;
+    }
+    static void unlock(__t2t2_lock_prof *p, pthread_mutex_t *m)
+    {
+        if (p)
+            p->stats.hold_ns += __t2t2_now_ns() - p->locked_at;
+        pthread_mutex_unlock(m);
+    }
+    // a condition wait lets go of the mutex; stop and restart the
+    // hold time around it.
+    static void before_wait(__t2t2_lock_prof *p)
+    {
+        if (p)
+            p->stats.hold_ns += __t2t2_now_ns() - p->locked_at;
+    }
+    static void after_wait(__t2t2_lock_prof *p)
+    {
+        if (p)
+            p->locked_at = __t2t2_now_ns();
+    }
+    // the caller must hold the mutex.
+    void get(t2t2_lock_stats &_stats) const { _stats = stats; }
+#else
+    static void lock(__t2t2_lock_prof *, pthread_mutex_t *m)
+    {
+        pthread_mutex_lock(m);
+    }
+    static void unlock(__t2t2_lock_prof *, pthread_mutex_t *m)
+    {
+        pthread_mutex_unlock(m);
+    }
+    static void before_wait(__t2t2_lock_prof *) { }
+    static void after_wait(__t2t2_lock_prof *) { }
+    void get(t2t2_lock_stats &_stats) const
+    {
+        memset(&_stats, 0, sizeof(_stats));
+    }
+#endif
+};
+
+//////////////////////////// __T2T2_REGISTRY ////////////////////////////
+
+// see t2t2_metrics_write. the registry has its own mutex, which no
+// alloc, enqueue or dequeue ever takes.
+enum __t2t2_registry_kind
+{
+    __T2T2_REGISTRY_POOL,
+    __T2T2_REGISTRY_QUEUE,
+    __T2T2_REGISTRY_QUEUE_SET
+};
+// register obj under name, or rename it; NULL name unregisters it.
+// returns false if another object of this kind has the name.
+bool __t2t2_registry_set(__t2t2_registry_kind kind, const void *obj,
+                         const char *name);
+
+//////////////////////////// __T2T2_LOCKED_STAT ////////////////////////////
+
+// a statistic only changed with some mutex held, which may be read
+// without it (see t2t2_metrics_write). changes are a plain load and
+// store, not an atomic read-modify-write, so they cost no more than
+// an ordinary int's.
+template <class T>
+struct __t2t2_locked_stat
+{
+    std::atomic<T>  v;
+    __t2t2_locked_stat(void) : v(0) { }
+    void operator=(T n) { v.store(n, std::memory_order_relaxed); }
+    void operator+=(T n)
+    {
+        v.store(v.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+    }
+    void operator++(int) { *this += 1; }
+    void operator--(int) { *this += -1; }
+    operator T(void) const { return v.load(std::memory_order_relaxed); }
+};
+
+//////////////////////////// __T2T2_HISTOGRAM ////////////////////////////
+
+// the recording side of a t2t2_histogram. the counters are atomic so
+// any number of threads may record at once; a snapshot while they do
+// is only approximately consistent. count is the sum of counts[].
+struct __t2t2_histogram
+{
+    std::atomic<uint64_t>  counts[t2t2_histogram::NUM_BUCKETS];
+    std::atomic<uint64_t>  sum_ns;
+    std::atomic<uint64_t>  min_ns;
+    std::atomic<uint64_t>  max_ns;
+    __t2t2_histogram(void)
+    {
+        for (int ind = 0; ind < t2t2_histogram::NUM_BUCKETS; ind++)
+            counts[ind].store(0);
+        sum_ns.store(0);
+        min_ns.store(UINT64_MAX);
+        max_ns.store(0);
+    }
+    void record(uint64_t ns)
+    {
+        counts[t2t2_histogram::bucket_of(ns)].fetch_add(
+            1, std::memory_order_relaxed);
+        sum_ns.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t  v = min_ns.load(std::memory_order_relaxed);
+        while (ns < v && !min_ns.compare_exchange_weak(
+                   v, ns, std::memory_order_relaxed))
+            ;
+        v = max_ns.load(std::memory_order_relaxed);
+        while (ns > v && !max_ns.compare_exchange_weak(
+                   v, ns, std::memory_order_relaxed))
+            ;
+    }
+    // if reset, each counter is zeroed as it is read, so a value
+    // recorded meanwhile is in this snapshot or the next one.
+    void snapshot(t2t2_histogram &h, bool reset);
+};
+
+//////////////////////////// __T2T2_HEAD_SEQLOCK ////////////////////////////
+
+// a queue's head (its enqueue time and address) as seen by a
+// t2t2_hol_watchdog: written only with the queue's mutex locked,
+// read with no lock at all. a reader retries if the sequence number
+// was odd (a write in progress) or changed while it read.
+struct __t2t2_head_seqlock
+{
+    std::atomic<uint32_t>     seq;
+    std::atomic<uint64_t>     enqueue_ns;
+    std::atomic<const void *> msg;
+    void init(void)
+    {
+        seq.store(0);
+        enqueue_ns.store(0);
+        msg.store(NULL);
+    }
+    void write(uint64_t _enqueue_ns, const void *_msg)
+    {
+        uint32_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        enqueue_ns.store(_enqueue_ns, std::memory_order_relaxed);
+        msg.store(_msg, std::memory_order_relaxed);
+        seq.store(s + 2, std::memory_order_release);
+    }
+    void read(uint64_t *_enqueue_ns, const void **_msg) const
+    {
+        uint32_t s1, s2;
+        do {
+            s1 = seq.load(std::memory_order_acquire);
+            *_enqueue_ns = enqueue_ns.load(std::memory_order_relaxed);
+            *_msg = msg.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            s2 = seq.load(std::memory_order_relaxed);
+        } while ((s1 & 1) || s1 != s2);
+    }
 };
 
 //////////////////////////// __T2T2_QUEUE ////////////////////////////
 
+class t2t2_hol_watchdog; // forward
+class __t2t2_rpc_client; // forward
+class __t2t2_queue_set; // forward
+struct __t2t2_thread_waiter; // forward
+
 class __t2t2_queue : public __t2t2_links<__t2t2_queue>
 {
-    pthread_mutex_t   mutex;
+    mutable pthread_mutex_t mutex;
     pthread_cond_t    cond;
 
-    // these two pointers must only be accessed
+    // this pointer must only be accessed
     // or changed with &mutex locked.
-    pthread_mutex_t * psetmutex;
-    pthread_cond_t  * psetcond;
+    __t2t2_queue_set * pset;
 
     clockid_t         clk_id;
+    // if true, buffers are dequeued in deliver_at order, and a
+    // buffer can't be dequeued until its deliver_at time has passed.
+    bool              deadline_ordered;
     __t2t2_links_head<__t2t2_buffer_hdr> buffers;
+    // on a deadline-ordered queue, buffers is in arrival order, and
+    // due is a binary min-heap of the same buffers by deliver_at (the
+    // time, in the queue's clock, at which each becomes due), so
+    // deadlines arriving out of order (e.g. jittered back-offs) still
+    // cost O(log n) to insert or remove. seq breaks ties, so equal
+    // deadlines come out in fifo order. each buffer's due_index
+    // follows its entry around. due is reserved up front (see
+    // _reserve_due), so it only allocates if it outgrows that.
+    // protected by mutex.
+    struct due_entry {
+        timespec            deliver_at;
+        uint64_t            seq;
+        __t2t2_buffer_hdr * h;
+    };
+    std::vector<due_entry>  due;
+    uint64_t                due_seq;
+    // the heap's ordering: true if a is due after b.
+    static bool _due_after(const due_entry &a, const due_entry &b);
+    // these assume mutex is locked: move due[ind] up or down
+    // until the heap is in order again.
+    void _due_up(size_t ind);
+    void _due_down(size_t ind);
+    // non-NULL only on a conflating queue: a hash index of the pending
+    // buffers by key, chained through conflate.next. key_mask is
+    // the number of buckets - 1. the counters are protected by mutex.
+    __t2t2_buffer_hdr ** key_buckets;
+    uint32_t          key_mask;
+    uint64_t          keyed_enqueues;
+    uint64_t          conflated;
+    __t2t2_links_head<__t2t2_async_waiter> async_waiters;
+    // stats (see t2t2_queue_stats). these are only changed with
+    // mutex locked, but may be read without it.
+    std::atomic<int>  depth;
+    __t2t2_locked_stat<int>       high_water;
+    __t2t2_locked_stat<uint64_t>  enqueues;
+    __t2t2_locked_stat<uint64_t>  dequeues;
+    __t2t2_locked_stat<uint64_t>  timeouts;
+    __t2t2_locked_stat<uint64_t>  wait_ns;
+    // if timing, enqueues stamp each buffer's enqueue_ns, and
+    // dequeues record how long it waited in delay_hist, which
+    // is only changed with mutex locked.
+    std::atomic<bool>   timing;
+    __t2t2_histogram  * delay_hist;
+    // false for a pool's free list, whose traffic is traced
+    // as allocs and releases instead.
+    bool                traced;
+    // if true, the destructor has to unregister this queue.
+    bool                registered;
+    // while a t2t2_hol_watchdog watches this queue, watched is set,
+    // enqueues stamp enqueue_ns, and whenever the head changes it
+    // is published in head. watchdog is only changed with mutex
+    // locked, and by the watchdog.
+    std::atomic<bool>    watched;
+    t2t2_hol_watchdog  * watchdog;
+    __t2t2_head_seqlock  head;
+    // dequeuers blocked on cond, for t2t2_rt_section; changed
+    // only with mutex locked.
+    __t2t2_locked_stat<int>  sleepers;
+    // reported as the cause of a t2t2_rt_section violation:
+    // the queue itself, or the pool whose free list it is.
+    const void         * owner;
+    // enqueues which have picked up pset but not yet told it; see
+    // __t2t2_queue_set::_remove_queue. raised with mutex locked,
+    // lowered with the set's set_mutex locked.
+    std::atomic<int>     notifying;
+    // assumes mutex is locked. returns pset, counting this enqueue
+    // in notifying if there is one; the caller must then pass it
+    // to _notify once mutex is unlocked.
+    __t2t2_queue_set * _notify_set(void)
+    {
+        if (pset)
+            notifying.fetch_add(1);
+        return pset;
+    }
+#ifdef T2T2_TIMESTAMPS
+    void _stamp(__t2t2_buffer_hdr *h)
+    {
+        h->enqueue_ns = (timing.load(std::memory_order_relaxed) ||
+                         watched.load(std::memory_order_relaxed)) ?
+            __t2t2_now_ns() : 0;
+    }
+#else
+    void _stamp(__t2t2_buffer_hdr *) { }
+#endif
+    // assumes mutex is locked, and the head may have changed.
+    void _head_changed(void)
+    {
+        if (watched.load(std::memory_order_relaxed))
+            _publish_head();
+    }
+    void _publish_head(void);
+    // contention stats for mutex (see __t2t2_lock_prof).
+    mutable __t2t2_lock_prof  prof;
+    // a mutex locked for the life of the Lock. if prof is given, it
+    // is profiled, and waits on a condition should go through wait
+    // and timedwait so the hold time stays right.
     class Lock {
-        pthread_mutex_t *m;
+        pthread_mutex_t  *m;
+        __t2t2_lock_prof *prof;
     public:
-        Lock(pthread_mutex_t *_m) : m(_m) { pthread_mutex_lock(m); }
-        ~Lock(void) { pthread_mutex_unlock(m); }
+        Lock(pthread_mutex_t *_m, __t2t2_lock_prof *_prof = NULL)
+            : m(_m), prof(_prof) { __t2t2_lock_prof::lock(prof, m); }
+        ~Lock(void) { __t2t2_lock_prof::unlock(prof, m); }
+        // let go of the mutex for a while, e.g. to flush a reclaimer.
+        void unlock(void) { __t2t2_lock_prof::unlock(prof, m); }
+        void relock(void) { __t2t2_lock_prof::lock(prof, m); }
+        int wait(pthread_cond_t *c)
+        {
+            __t2t2_lock_prof::before_wait(prof);
+            int ret = pthread_cond_wait(c, m);
+            __t2t2_lock_prof::after_wait(prof);
+            return ret;
+        }
+        int timedwait(pthread_cond_t *c, const timespec *abstime)
+        {
+            __t2t2_lock_prof::before_wait(prof);
+            int ret = pthread_cond_timedwait(c, m, abstime);
+            __t2t2_lock_prof::after_wait(prof);
+            return ret;
+        }
     };
     friend class __t2t2_queue_set;
+    friend class __t2t2_rpc_client;
+    friend struct __t2t2_thread_waiter;
+    friend class t2t2_hol_watchdog;
     int id;
-    void set_pmutexpcond(pthread_mutex_t *nm = NULL,
-                         pthread_cond_t  *nc = NULL)
+    // also moves this queue's depth from the old set to the new.
+    void set_pset(__t2t2_queue_set *s = NULL);
+    bool _validate(__t2t2_buffer_hdr *h) { return buffers.validate(h); }
+    // assumes mutex is locked. returns the head buffer if it may be
+    // dequeued now, else NULL. if the head is only waiting for its
+    // deliver_at, *next_due is lowered to that time and *have_due set.
+    __t2t2_buffer_hdr * _get_ready(__t2t2_timespec *next_due,
+                                   bool *have_due);
+    __t2t2_buffer_hdr ** _key_bucket(uint64_t key)
     {
-        Lock l(&mutex);
-        psetmutex = nm;
-        psetcond = nc;
+        // fibonacci hashing, so sequential keys spread out.
+        uint64_t  hash = key * 0x9e3779b97f4a7c15ULL;
+        return &key_buckets[(hash >> 32) & key_mask];
     }
-    bool _validate(__t2t2_buffer_hdr *h) { return buffers.validate(h); }
+    // assumes mutex is locked. takes a buffer off this queue,
+    // including the key index if there is one.
+    void _remove(__t2t2_buffer_hdr *h);
+    // assumes mutex is locked, and n buffers were just added.
+    void _count_enqueues(int n);
+    // assumes mutex is locked; a dequeue which blocked at
+    // blocked_at is done blocking.
+    void _count_wait(const __t2t2_timespec &blocked_at);
+    // assumes mutex is locked, and a buffer was just added. if
+    // an async waiter is waiting, gives it the head buffer and
+    // returns it, so the caller can wake it after unlocking.
+    __t2t2_async_waiter * _serve_async(void);
+    // the second half of every enqueue, after mutex is unlocked.
+    void _notify(__t2t2_async_waiter *w, __t2t2_queue_set *s);
 public:
     __t2t2_queue(pthread_mutexattr_t *pmattr,
-                pthread_condattr_t  *pcattr);
+                pthread_condattr_t  *pcattr,
+                bool _deadline_ordered = false,
+                int _num_key_buckets = 0);
     ~__t2t2_queue(void);
 
-    bool _empty(void);
+    // these two don't take the mutex.
+    bool _empty(void) const
+    {
+        return depth.load(std::memory_order_acquire) == 0;
+    }
+    int _depth(void) const
+    {
+        return depth.load(std::memory_order_acquire);
+    }
+    void _get_stats(t2t2_queue_stats &_stats);
+    // _get_stats without the lock stats, which doesn't lock mutex;
+    // the numbers may be from slightly different moments.
+    void _peek_stats(t2t2_queue_stats &_stats) const;
+    void _get_lock_stats(t2t2_lock_stats &_stats) const;
+    void _set_traced(bool _traced) { traced = _traced; }
+    void _set_owner(const void *_owner) { owner = _owner; }
+    bool _set_registry_name(const char *name)
+    {
+        bool ok = __t2t2_registry_set(__T2T2_REGISTRY_QUEUE, this, name);
+        if (ok)
+            registered = (name != NULL);
+        return ok;
+    }
+    bool _enable_delay_histogram(bool enable);
+    void _get_delay_histogram(t2t2_histogram &hist, bool reset);
 
     // -1 = T2T2_WAIT_FOREVER : wait forever
     //  0 = T2T2_NO_WAIT      : dont wait, just return
     // >0                     : wait for some number of mS
     __t2t2_buffer_hdr *_dequeue(int wait_ms);
+    // like _dequeue, but if it has to wait, the caller joins the
+    // async waiters, so it gets a buffer in fifo order straight from
+    // the enqueue, and nobody can barge in and take it first.
+    // not for deadline-ordered queues or queues in a set.
+    __t2t2_buffer_hdr *_dequeue_fifo(int wait_ms);
+    // if a buffer is ready, returns true with it in w->h; otherwise
+    // w is added to the async waiters, and w->wake is called later
+    // (from the enqueuing thread) once w->h has been filled in.
+    // deadline-ordered queues are not supported, because nothing
+    // would wake w when a future deadline comes due.
+    bool _dequeue_async(__t2t2_async_waiter *w);
     // a pool should be a stack, to keep caches hotter.
     bool _enqueue(__t2t2_buffer_hdr *h);
     // a queue should be a fifo, to keep msgs in order.
+    // (on a deadline queue, this means "due now.")
     bool _enqueue_tail(__t2t2_buffer_hdr *h);
+    // moves every buffer on bufs to this queue, in order, under one
+    // lock of mutex; bufs is left empty. if tail, this is a batch of
+    // _enqueue_tail (a deadline queue still takes them one at a time,
+    // each one "due now"), otherwise a batch of _enqueue.
+    void _enqueue_list(__t2t2_links_head<__t2t2_buffer_hdr> *bufs,
+                       bool tail);
+    // a deadline queue dequeues by deliver_at, and equal
+    // deliver_at times come out in fifo order. O(log n).
+    bool _enqueue_deadline(__t2t2_buffer_hdr *h,
+                           const timespec &deliver_at);
+    // make room in due for this many messages.
+    void _reserve_due(int capacity);
+    // current time according to the clock used by this queue.
+    void _now(timespec *ts) const { clock_gettime(clk_id, ts); }
+    // on a conflating queue, if a buffer with the same key is pending,
+    // h takes its place in the queue and the old buffer is returned
+    // in *replaced for the caller to release; otherwise h goes on
+    // the tail and *replaced is NULL.
+    bool _enqueue_keyed(__t2t2_buffer_hdr *h, uint64_t key,
+                        __t2t2_buffer_hdr **replaced);
+    void _get_conflate_counts(uint64_t *_keyed_enqueues,
+                              uint64_t *_conflated);
 
     // return true if the buffer hdr is already on this
     // buffers list.
@@ -284,11 +827,40 @@ public:
 class __t2t2_queue_set
 {
     pthread_mutex_t   set_mutex;
+    __t2t2_lock_prof  set_prof;
+    // if true, the destructor has to unregister this set.
+    bool              registered;
+    // dequeuers blocked on set_cond; protected by set_mutex.
+    int               sleepers;
+    // _remove_queue callers waiting on set_cond for a member's
+    // notifying to drain; protected by set_mutex.
+    int               removers;
     pthread_cond_t    set_cond;
     clockid_t         clk_id;
     __t2t2_links_head<__t2t2_queue> qs;
     int set_size;
-    __t2t2_buffer_hdr * check_qs(int *id);
+    __t2t2_links_head<__t2t2_async_waiter> async_waiters;
+    // stats for the whole set. depth, high_water and enqueues are
+    // updated by the member queues under their own mutexes, so
+    // they're atomic; the rest are only changed with set_mutex
+    // locked, but may be read without it.
+    std::atomic<int>       depth;
+    std::atomic<int>       high_water;
+    std::atomic<uint64_t>  enqueues;
+    __t2t2_locked_stat<uint64_t>  dequeues;
+    __t2t2_locked_stat<uint64_t>  timeouts;
+    __t2t2_locked_stat<uint64_t>  wait_ns;
+    __t2t2_buffer_hdr * check_qs(int *id,
+                                 __t2t2_timespec *next_due,
+                                 bool *have_due);
+    friend class __t2t2_queue;
+    // called by a member queue after it has added a buffer
+    // (and unlocked itself). if from is given, this is the last
+    // _notify of an enqueue counted in from->notifying.
+    void _notify(__t2t2_queue *from);
+    // called by a member queue, with its mutex locked, when its
+    // depth changes by n; enqueued if that was an enqueue.
+    void _depth_changed(int n, bool enqueued = false);
 public:
     __t2t2_queue_set(pthread_mutexattr_t *pmattr = NULL,
                     pthread_condattr_t  *pcattr = NULL);
@@ -296,46 +868,491 @@ public:
     bool _add_queue(__t2t2_queue *q, int id);
     void _remove_queue(__t2t2_queue *q);
     int get_set_size(void) const { return set_size; }
+    // doesn't take any mutex.
+    int _depth(void) const
+    {
+        return depth.load(std::memory_order_acquire);
+    }
+    void _get_stats(t2t2_queue_stats &_stats);
+    // see __t2t2_queue::_peek_stats.
+    void _peek_stats(t2t2_queue_stats &_stats) const;
+    bool _set_registry_name(const char *name)
+    {
+        bool ok = __t2t2_registry_set(__T2T2_REGISTRY_QUEUE_SET,
+                                      this, name);
+        if (ok)
+            registered = (name != NULL);
+        return ok;
+    }
     __t2t2_buffer_hdr * _dequeue(int wait_ms, int *id);
+    // same as __t2t2_queue::_dequeue_async, but w->id is also set.
+    bool _dequeue_async(__t2t2_async_waiter *w);
+};
+
+//////////////////////////// __T2T2_ARENA ////////////////////////////
+
+// a destructor to run when an arena's message is released, for an
+// arena object which isn't trivially destructible. these are bump
+// allocated from the arena too.
+struct __t2t2_arena_dtor
+{
+    void (*fn)(void *obj);
+    void * obj;
+    __t2t2_arena_dtor * next;
+};
+
+// the start of each arena region (see t2t2_arena_pool); the
+// bump-allocated objects follow it.
+struct __t2t2_arena_hdr
+{
+    uint32_t  used;      // bytes in use, counting this hdr
+    uint32_t  capacity;  // bytes in the region, counting this hdr
+    __t2t2_arena_dtor * dtors; // most recently constructed first
+    void init(uint32_t _capacity)
+    {
+        used = sizeof(__t2t2_arena_hdr);
+        capacity = _capacity;
+        dtors = NULL;
+    }
+    void * alloc(size_t size, size_t align)
+    {
+        // align the address, not the offset; buffers
+        // are only 8 byte aligned.
+        uintptr_t base = (uintptr_t) this;
+        uintptr_t addr = (base + used + align - 1) & ~(uintptr_t)(align - 1);
+        size_t pos = addr - base;
+        // written so a huge size can't wrap around.
+        if (pos > capacity || size > capacity - pos)
+            return NULL;
+        used = (uint32_t) (pos + size);
+        return ((uint8_t*) this) + pos;
+    }
+    // run the registered destructors, newest first.
+    void destroy(void)
+    {
+        for (__t2t2_arena_dtor * d = dtors; d; d = d->next)
+            d->fn(d->obj);
+        dtors = NULL;
+    }
 };
 
 //////////////////////////// __T2T2_POOL ////////////////////////////
 
 struct __t2t2_memory_block; // forward
 
+// pool statistics are counted in shards, so threads allocating and
+// releasing at once don't all hit the same cache line. each thread
+// is given a shard the first time it counts something, round robin;
+// threads may share a shard, so the counters are still atomic, but
+// rarely contended. every counter only ever goes up, which lets
+// __t2t2_pool::get_stats take a consistent snapshot (see there).
+static const int T2T2_POOL_STAT_SHARDS = 16;
+
+struct __t2t2_pool_counts
+{
+    uint64_t  allocs;
+    uint64_t  releases;
+    uint64_t  alloc_bytes;
+    uint64_t  release_bytes;
+    uint64_t  alloc_fails;
+    uint64_t  grows;
+    uint64_t  double_frees;
+    static const int NUM = 7;
+};
+
+struct __t2t2_pool_shard
+{
+    // indexed like the fields of __t2t2_pool_counts.
+    std::atomic<uint64_t>  c[__t2t2_pool_counts::NUM];
+    // pad to a cache line; not alignas, since pools are often
+    // new'ed and C++11 new doesn't honor over-alignment.
+    char  pad[64 - __t2t2_pool_counts::NUM * sizeof(uint64_t)];
+    void add(int which, uint64_t n)
+    {
+        c[which].fetch_add(n, std::memory_order_release);
+    }
+};
+
+// this thread's shard index, or -1 until it needs one.
+extern thread_local int __t2t2_stat_shard;
+int __t2t2_assign_stat_shard(void);
+static inline int __t2t2_my_stat_shard(void)
+{
+    int s = __t2t2_stat_shard;
+    if (s < 0)
+        s = __t2t2_assign_stat_shard();
+    return s;
+}
+
+#ifdef T2T2_LEAK_TRACKING
+// where a pool keeps track of its buffers in use; see
+// __t2t2_pool::dump_outstanding. (it's in thread2thread2.cc.)
+struct __t2t2_leak_table;
+#endif
+
 /** base class for all t2t2_pool template objects. */
 class __t2t2_pool
 {
 protected:
-    t2t2_pool_stats  stats;
+    // the __t2t2_type_tag of each type in the pool's type list,
+    // indexed by the __type_index stored in each message.
+    const void * const * type_tags;
+    // where the payload area starts in each buffer (see t2t2_var_pool).
+    int payload_offset;
+    // if true, the payload area of each buffer is an arena
+    // (see t2t2_arena_pool), reset at each alloc.
+    bool arena;
+    // if true, waiting allocs are served in fifo order.
+    bool fair;
+    int buffer_size;
+    int payload_capacity;
+    __t2t2_pool_shard  shards[T2T2_POOL_STAT_SHARDS];
+    enum { ALLOCS, RELEASES, ALLOC_BYTES, RELEASE_BYTES,
+           ALLOC_FAILS, GROWS, DOUBLE_FREES };
+    void _count(int which, uint64_t n = 1)
+    {
+        shards[__t2t2_my_stat_shard()].add(which, n);
+    }
+    void _collect(__t2t2_pool_counts &counts) const;
     int bufs_to_add_when_growing;
+    // two threads may grow at once; grow_mutex protects memory_pool,
+    // and total_buffers is only changed with it locked.
+    mutable pthread_mutex_t grow_mutex;
+    __t2t2_locked_stat<int>  total_buffers;
     std::list<std::unique_ptr<__t2t2_memory_block>> memory_pool;
     __t2t2_queue q;
-    __t2t2_pool(int buffer_size,
+    // quotas (see set_class_quotas); num_classes is 0 if none.
+    // an alloc is charged against the quotas before it takes a
+    // buffer, and a release is uncharged after the buffer is back
+    // on q, so an alloc which was charged always finds a buffer.
+    // a class uses its own reserved buffers first, so its share of
+    // the shared region is always max(0, in_use - reserved).
+    // all of these are protected by quota_mutex.
+    int num_classes;
+    int shared_total;
+    int shared_in_use;
+    int quota_waiters;
+    // async allocs waiting for a quota, in the order they started;
+    // each one's id is the priority class it is to be charged to.
+    __t2t2_links_head<__t2t2_async_waiter> quota_async_waiters;
+    t2t2_pool_class_stats class_stats[T2T2_MAX_PRIO_CLASSES];
+    mutable pthread_mutex_t quota_mutex;
+    pthread_cond_t  quota_cond;
+    clockid_t       quota_clk_id;
+    // if lifetime_timing, allocs stamp each buffer's alloc_ns, and
+    // releases record how long it was out in lifetime_hist, which
+    // once created lives as long as the pool.
+    std::atomic<bool>                lifetime_timing;
+    std::atomic<__t2t2_histogram *>  lifetime_hist;
+    // if true, the destructor has to unregister this pool.
+    bool registered;
+    // with T2T2_LEAK_TRACKING, every alloc adds the buffer to leaks
+    // and every release takes it out again; the table is off to the
+    // side, so buffer headers stay the same size either way.
+#ifdef T2T2_LEAK_TRACKING
+    __t2t2_leak_table * leaks;
+    void _leak_alloc(void *ptr, const void *site_addr);
+    void _leak_release(void *ptr);
+#else
+    void _leak_alloc(void *, const void *) { }
+    void _leak_release(void *) { }
+#endif
+#ifdef T2T2_TIMESTAMPS
+    void _stamp_alloc(__t2t2_buffer_hdr *h)
+    {
+        h->alloc_ns = lifetime_timing.load(std::memory_order_acquire) ?
+            __t2t2_now_ns() : 0;
+    }
+#else
+    void _stamp_alloc(__t2t2_buffer_hdr *) { }
+#endif
+    // this function assumes quota_mutex is locked.
+    bool _quota_take(int prio_class);
+    bool _quota_charge(int prio_class, int wait_ms);
+    void _quota_uncharge(int prio_class);
+    // assumes quota_mutex is locked: charge every quota_async_waiter
+    // whose class now has room, moving it to served. then, with
+    // quota_mutex unlocked, _quota_wake_async gives each its buffer.
+    void _quota_serve_async(__t2t2_links_head<__t2t2_async_waiter> *served);
+    void _quota_wake_async(__t2t2_links_head<__t2t2_async_waiter> *served);
+    __t2t2_pool(int _buffer_size,
                int _num_bufs_init,
                int _bufs_to_add_when_growing,
                pthread_mutexattr_t *pmattr,
-               pthread_condattr_t *pcattr);
+               pthread_condattr_t *pcattr,
+               int _payload_capacity = 0);
     virtual ~__t2t2_pool(void);
 public:
-    int get_buffer_size(void) const { return stats.buffer_size; }
+    int get_buffer_size(void) const { return buffer_size; }
+    const void * const * get_type_tags(void) const { return type_tags; }
+    int get_payload_offset(void) const { return payload_offset; }
+    int get_payload_capacity(void) const { return payload_capacity; }
+    bool has_arena(void) const { return arena; }
+    __t2t2_arena_hdr * _get_arena(void *ptr) const
+    {
+        return (__t2t2_arena_hdr *) (((uint8_t*) ptr) + payload_offset);
+    }
     /** add more buffers to this pool.
      * \param num_bufs  the number of buffers to add to the pool. */
     void add_bufs(int num_bufs);
+    /** in fair mode, allocs which have to wait are queued in fifo
+     * order, and a released buffer is handed straight to the oldest
+     * one; without it, a woken alloc can lose the buffer to a thread
+     * which just arrived, so under overload some allocs may wait a
+     * very long time. fair mode costs a little more per wait.
+     * \note set this before any allocs are waiting. */
+    void set_fair_handoff(bool _fair) { fair = _fair; }
+    /** partition this pool's buffers into quotas per priority class.
+     * each class gets reserved[class] buffers which only it may use;
+     * the rest of the pool (and anything added later by add_bufs or
+     * T2T2_GROW) is a shared region any class may use once its own
+     * reserve is in use. see t2t2_pool::alloc_prio.
+     * \param _num_classes  1 to T2T2_MAX_PRIO_CLASSES.
+     * \return false if the classes don't fit, the reserves add up
+     *     to more than the pool's buffers, or any buffers are out.
+     * \note set this before any allocs; allocs which wait for a
+     *     quota are not served in fifo order (see set_fair_handoff). */
+    bool set_class_quotas(int _num_classes, const int *reserved);
+    bool has_quotas(void) const { return num_classes > 0; }
+    /** retrieve statistics about one priority class of this pool;
+     * all zeroes if the pool has no quotas or no such class. */
+    void get_class_stats(int prio_class, t2t2_pool_class_stats &_stats) const;
+    /** start (or stop) recording how long each buffer is out of
+     * this pool, from alloc to release, in a t2t2_histogram. while
+     * on, each alloc and release reads the clock once.
+     * \note a buffer alloced while this was off isn't recorded.
+     * \return false (and does nothing) if the library wasn't built
+     *     with T2T2_TIMESTAMPS, without which buffers carry no
+     *     alloc time. */
+    bool enable_lifetime_histogram(bool enable = true);
+    /** retrieve the lifetimes recorded so far (all zeroes if
+     * enable_lifetime_histogram was never called).
+     * \param reset  if true, start over from empty; a release which
+     *     happens meanwhile is counted in this snapshot or the next. */
+    void get_lifetime_histogram(t2t2_histogram &hist, bool reset = false);
     // wait (see enum wait_flag):
     // -2 = T2T2_GROW         : grow if empty
     // -1 = T2T2_WAIT_FOREVER : wait forever,
     //  0 = T2T2_NO_WAIT      : dont wait
     // >0                     : wait for some mS
-    void * _alloc(int wait_ms);
-    void release(void * ptr);
-    /** retrieve statistics about this pool */
+    // payload_len only counts toward stats; the caller must
+    // check it against payload_capacity. prio_class is the quota
+    // to charge, if the pool has quotas; the caller must store it
+    // in the message for release. site is where the user called
+    // the public alloc, for T2T2_LEAK_TRACKING (see
+    // __T2T2_LEAK_CALLER).
+    void * _alloc(int wait_ms, int payload_len = 0, int prio_class = 0,
+                  const void *site = NULL);
+    // like _alloc, but if the pool is empty (or prio_class is at its
+    // quota), w waits for a release (see __t2t2_queue::_dequeue_async).
+    // once w->h is filled in, the caller must pass it to
+    // _alloc_async_done.
+    bool _alloc_async(__t2t2_async_waiter *w, int prio_class = 0);
+    void * _alloc_async_done(__t2t2_buffer_hdr *h, const void *site = NULL);
+    void release(void * ptr, int payload_len = 0, int prio_class = 0);
+    // h is being released; record its lifetime if it was stamped.
+#ifdef T2T2_TIMESTAMPS
+    void _record_lifetime(__t2t2_buffer_hdr *h)
+    {
+        if (h->alloc_ns == 0)
+            return;
+        // alloc_ns is only set once lifetime_hist exists.
+        lifetime_hist.load(std::memory_order_acquire)->record(
+            __t2t2_now_ns() - h->alloc_ns);
+        h->alloc_ns = 0;
+    }
+#else
+    void _record_lifetime(__t2t2_buffer_hdr *) { }
+#endif
+    // release every buffer on bufs (whose destructors have already
+    // run) with one lock; payload_bytes is the sum of their
+    // payload_lens.
+    void release_list(__t2t2_links_head<__t2t2_buffer_hdr> *bufs,
+                      int count, int payload_bytes);
+    /** retrieve statistics about this pool. these are safe to take
+     * while other threads alloc and release, and consistent: they
+     * are what the counters were at some one moment during the call,
+     * unless the pool is so busy that they never hold still, in
+     * which case buffers_in_use is only approximate. */
     void get_stats(t2t2_pool_stats &_stats) const;
+    // get_stats without the lock stats, which takes no locks.
+    void _peek_stats(t2t2_pool_stats &_stats) const;
+    /** with T2T2_LEAK_TRACKING, list the buffers which have been out
+     * of this pool for at least older_than_ms, grouped by the site
+     * which alloced them (see t2t2_leak_site), the site holding the
+     * oldest buffer first; under each site, its oldest buffers, with
+     * the thread which alloced each one. this takes each part of the
+     * side table's lock in turn, not the pool's.
+     * \return how many buffers were listed; always 0 without
+     *     T2T2_LEAK_TRACKING. */
+    int dump_outstanding(int older_than_ms,
+                         std::ostream &out = std::cout) const;
+    /** register this pool under name, so its stats are written by
+     * t2t2_metrics_write and t2t2_metrics_exporter; NULL unregisters
+     * it. it is unregistered when destroyed.
+     * \return false if another pool has this name. */
+    bool set_registry_name(const char *name);
 
     __T2T2_EVIL_CONSTRUCTORS(__t2t2_pool);
     __T2T2_EVIL_DEFAULT_CONSTRUCTOR(__t2t2_pool);
 };
 
+//////////////////////////// __T2T2_RECLAIM ////////////////////////////
+
+class t2t2_reclaimer; // forward
+
+// the state of a thread attached to a t2t2_reclaimer: messages whose
+// last ref is dropped on this thread wait on pending (linked through
+// their buffer hdrs, so this never allocates) until the next flush.
+struct __t2t2_reclaim_thread
+{
+    t2t2_reclaimer * r;
+    __t2t2_links_head<__t2t2_buffer_hdr> pending;
+    int       num_pending;
+    // flush when num_pending gets this big; 0 means never.
+    int       flush_at;
+    // deferred since the last flush, for the reclaimer's stats.
+    uint64_t  deferred;
+    __t2t2_reclaim_thread(t2t2_reclaimer *_r, int _flush_at)
+        : r(_r), num_pending(0), flush_at(_flush_at), deferred(0) { }
+    void defer(__t2t2_buffer_hdr *h);
+};
+
+// non-NULL while this thread is attached to a reclaimer.
+extern thread_local __t2t2_reclaim_thread * __t2t2_reclaim_current;
+
+// true if this thread has deferred messages which it would hold on
+// to while it blocks. a dequeue or alloc about to block must first
+// drop its locks and __t2t2_reclaim_flush_pending, since what it is
+// waiting for may be one of those buffers. (not on the reclaim
+// thread itself, whose flush_at is 0.)
+inline bool __t2t2_reclaim_pending(void)
+{
+    __t2t2_reclaim_thread * rt = __t2t2_reclaim_current;
+    return rt != NULL && rt->flush_at > 0 && rt->num_pending > 0;
+}
+void __t2t2_reclaim_flush_pending(void);
+
+// while a reclaimer is running a batch of destructors on this thread,
+// the freed buffers are collected here, per pool, and then released
+// with one lock per pool instead of one per buffer.
+class __t2t2_release_batch
+{
+    static const int MAX_POOLS = 8;
+    struct entry {
+        __t2t2_pool * pool;
+        __t2t2_links_head<__t2t2_buffer_hdr> bufs;
+        int count;
+        int payload_bytes;
+    };
+    entry  entries[MAX_POOLS];
+    int    num_entries;
+public:
+    int    pool_locks;
+    __t2t2_release_batch(void) : num_entries(0), pool_locks(0) { }
+    // a batch with more than MAX_POOLS pools in it releases the
+    // extra pools' buffers one at a time, as it does the buffers
+    // of pools with quotas.
+    void add(__t2t2_pool *pool, void *ptr, int payload_len,
+             int prio_class);
+    void release_all(void);
+};
+
+// non-NULL while a reclaimer batch is running on this thread.
+extern thread_local __t2t2_release_batch * __t2t2_release_current;
+
+//////////////////////////// __T2T2_RPC_CLIENT ////////////////////////////
+
+// any function pointer type can be cast to another and back.
+typedef void (*__t2t2_generic_fn)(void);
+
+// the non-template part of t2t2_rpc_client; replies are passed
+// around as void* holding one ref on the user's reply message.
+class __t2t2_rpc_client
+{
+public:
+    // called with the reply (NULL if timed out) for async calls.
+    typedef void (*completion_t)(void *reply,
+                                 __t2t2_generic_fn fn, void *arg);
+private:
+    enum slot_state { SLOT_FREE, SLOT_SYNC, SLOT_ASYNC, SLOT_DONE };
+    struct slot {
+        pthread_cond_t    cond;
+        uint32_t          generation;
+        slot_state        state;
+        // a sync caller is blocked on cond.
+        bool              sleeping;
+        bool              expires;
+        __t2t2_timespec   expire_at;
+        void            * reply;
+        completion_t      completion;
+        __t2t2_generic_fn fn;
+        void            * arg;
+        slot            * next_free;
+    };
+    pthread_mutex_t   mutex;
+    clockid_t         clk_id;
+    int               num_slots;
+    slot            * slots;
+    slot            * free_slots;
+    t2t2_rpc_stats    stats;
+    // assumes mutex is locked. bumping the generation means any
+    // reply still carrying the old token will be discarded.
+    void _free_slot(slot *s);
+public:
+    __t2t2_rpc_client(int _num_slots,
+                      pthread_mutexattr_t *pmattr,
+                      pthread_condattr_t *pcattr);
+    ~__t2t2_rpc_client(void);
+    // get a slot for a new call; fills in slot/generation.
+    bool _start(uint32_t *slot_index, uint32_t *generation,
+                int timeout_ms, completion_t completion,
+                __t2t2_generic_fn fn, void *arg);
+    // give back a slot when a call couldn't be sent.
+    void _cancel(uint32_t slot_index, uint32_t generation);
+    // wait for a sync call's reply. returns NULL on timeout, or if
+    // slot_index and generation don't name a pending sync call.
+    void * _wait(uint32_t slot_index, uint32_t generation, int timeout_ms);
+    // deliver a reply; false means the call is gone (late reply)
+    // and the caller still owns the reply.
+    bool _complete(uint32_t slot_index, uint32_t generation, void *reply);
+    int  _expire(void);
+    void _get_stats(t2t2_rpc_stats &_stats);
+
+    __T2T2_EVIL_CONSTRUCTORS(__t2t2_rpc_client);
+    __T2T2_EVIL_DEFAULT_CONSTRUCTOR(__t2t2_rpc_client);
+};
+
+//////////////////////////// __T2T2_TOPIC_SNAPSHOT ////////////////////////
+
+// the list of subscribers to a t2t2_topic. it is never modified
+// once published; subscribe/unsubscribe build a new one and swap
+// it in, and publishers hold a ref on the one they are using.
+struct __t2t2_topic_snapshot : public pxfe_shared_ptr_base
+{
+    std::vector<void*>  subs;
+};
+
+//////////////////////////// __T2T2_CORO_WAITER ////////////////////////////
+
+#ifdef T2T2_ENABLE_COROUTINES
+
+class t2t2_executor; // forward
+
+// the part common to all awaitables: an async waiter which, when
+// woken, hands the suspended coroutine to an executor. it lives
+// in the coroutine frame, so it stays put while on a waiters list.
+struct __t2t2_coro_waiter
+{
+    __t2t2_async_waiter      w;
+    t2t2_executor          * ex;
+    std::coroutine_handle<>  handle;
+    __t2t2_coro_waiter(t2t2_executor *_ex);
+    static void wake(__t2t2_async_waiter *w);
+};
+
+#endif /* T2T2_ENABLE_COROUTINES */
+
 //////////////////////////////////////////////////////////////////
 
 #elif __T2T2_INCLUDE_INTERNAL__ == 2
@@ -344,6 +1361,7 @@ public:
 
 template <class BaseT, class... derivedTs>
 template <class T, typename... ConstructorArgs>
+__T2T2_LEAK_NOINLINE
 bool t2t2_pool<BaseT,derivedTs...> :: alloc(
     pxfe_shared_ptr<T> * ptr, int wait_ms,
     ConstructorArgs&&... args)
@@ -357,71 +1375,684 @@ bool t2t2_pool<BaseT,derivedTs...> :: alloc(
                   "allocated type must fit in pool buffer size, please "
                   "specify all message types in t2t2_pool<>!");
 
-    T * t = new(this,wait_ms)
+    T * t = new(this,wait_ms,__T2T2_LEAK_CALLER)
         T(std::forward<ConstructorArgs>(args)...);
+    if (t)
+    {
+        t->__type_index = __t2t2_type_index<T, BaseT, derivedTs...>::value;
+        t->__prio_class = 0;
+        t->__payload_len = 0;
+    }
     ptr->reset(t);
     return (t != NULL);
 }
 
-//////////////////////////// T2T2_QUEUE<> ////////////////////////////
-
-template <class BaseT>
-t2t2_queue<BaseT> :: t2t2_queue(pthread_mutexattr_t *pmattr /*= NULL*/,
-                              pthread_condattr_t  *pcattr /*= NULL*/)
-    : q(pmattr,pcattr)
+template <class BaseT, class... derivedTs>
+template <class T, typename... ConstructorArgs>
+__T2T2_LEAK_NOINLINE
+pxfe_shared_ptr<T> t2t2_pool<BaseT,derivedTs...> :: alloc(
+    int wait_ms, ConstructorArgs&&... args)
 {
+    pxfe_shared_ptr<T>  ret;
+    T * t = NULL;
+    void * buf = _alloc(wait_ms, 0, 0, __T2T2_LEAK_CALLER);
+    if (buf)
+    {
+        t = _construct<T>(buf, std::forward<ConstructorArgs>(args)...);
+        // nobody else can see it yet, so a plain store will do.
+        t->_set_use_count(1);
+        ret._give(t);
+    }
+    return ret;
 }
 
-template <class BaseT>
-template <class T>
-bool t2t2_queue<BaseT> :: enqueue(pxfe_shared_ptr<T> &_msg)
+template <class BaseT, class... derivedTs>
+template <class T, typename... ConstructorArgs>
+__T2T2_LEAK_NOINLINE
+bool t2t2_pool<BaseT,derivedTs...> :: alloc(
+    t2t2_unique_msg<T> * ptr, int wait_ms,
+    ConstructorArgs&&... args)
 {
-    bool ret = false;
-    static_assert(std::is_base_of<BaseT, T>::value == true,
-                  "enqueued type must be derived from "
-                  "base type of the queue");
-    BaseT * msg = _msg._take();
-    if (msg)
+    T * t = NULL;
+    void * buf = _alloc(wait_ms, 0, 0, __T2T2_LEAK_CALLER);
+    if (buf)
     {
-        __t2t2_buffer_hdr * h = (__t2t2_buffer_hdr *) msg;
-        h--;
-        h->ok();
-        ret = q._enqueue_tail(h);
+        t = _construct<T>(buf, std::forward<ConstructorArgs>(args)...);
+        // nobody else can see it yet, so a plain store will do.
+        t->_set_use_count(1);
     }
-    else
+    ptr->_give(t);
+    return (t != NULL);
+}
+
+template <class BaseT, class... derivedTs>
+template <class T, typename... ConstructorArgs>
+__T2T2_LEAK_NOINLINE
+pxfe_shared_ptr<T> t2t2_pool<BaseT,derivedTs...> :: alloc_prio(
+    int wait_ms, int prio_class, ConstructorArgs&&... args)
+{
+    pxfe_shared_ptr<T>  ret;
+    if (prio_class < 0 || num_classes == 0)
+        prio_class = 0;
+    else if (prio_class >= num_classes)
+        prio_class = num_classes - 1;
+    void * buf = _alloc(wait_ms, 0, prio_class, __T2T2_LEAK_CALLER);
+    if (buf)
     {
-        __T2T2_ASSERT(ENQUEUE_EMPTY_POINTER,false);
+        T * t = _construct<T>(buf, std::forward<ConstructorArgs>(args)...);
+        t->__prio_class = prio_class;
+        // nobody else can see it yet, so a plain store will do.
+        t->_set_use_count(1);
+        ret._give(t);
     }
     return ret;
 }
 
+template <class BaseT, class... derivedTs>
+const void * const t2t2_pool<BaseT,derivedTs...> :: type_list_tags[] = {
+    &__t2t2_type_tag<BaseT>::tag,
+    &__t2t2_type_tag<derivedTs>::tag...
+};
 
-template <class BaseT>
-bool t2t2_queue<BaseT> :: empty(void)
+template <class BaseT, class... derivedTs>
+template <class T, typename... ConstructorArgs>
+T * t2t2_pool<BaseT,derivedTs...> :: _construct(
+    void *buf, ConstructorArgs&&... args)
 {
-    return q._empty();
+    static_assert(std::is_base_of<t2t2_message_base<BaseT>,
+                  BaseT>::value == true,
+                  "allocated type must be derived from t2t2_message_base");
+    static_assert(std::is_base_of<BaseT, T>::value == true,
+                  "allocated type must be derived from base type");
+    static_assert(buffer_size >= sizeof(T),
+                  "allocated type must fit in pool buffer size, please "
+                  "specify all message types in t2t2_pool<>!");
+
+    T * t = new(this,buf) T(std::forward<ConstructorArgs>(args)...);
+    t->__type_index = __t2t2_type_index<T, BaseT, derivedTs...>::value;
+    t->__prio_class = 0;
+    t->__payload_len = 0;
+    return t;
 }
 
-template <class BaseT>
-pxfe_shared_ptr<BaseT>   t2t2_queue<BaseT> :: dequeue(int wait_ms)
+//////////////////////////// T2T2_VAR_POOL<> ////////////////////////////
+
+template <class BaseT, class... derivedTs>
+t2t2_var_pool<BaseT,derivedTs...> :: t2t2_var_pool(
+    int min_payload, int max_payload,
+    int _num_bufs_init,
+    int _bufs_to_add_when_growing /*= 1*/,
+    pthread_mutexattr_t *pmattr /*= NULL*/,
+    pthread_condattr_t *pcattr /*= NULL*/)
 {
-    pxfe_shared_ptr<BaseT>  ret;
-    __t2t2_buffer_hdr * h = q._dequeue(wait_ms);
-    if (h)
+    if (min_payload < 8)
+        min_payload = 8;
+    int cap = min_payload;
+    while (1)
     {
-        h++;
-        ret._give((BaseT*) h);
+        buckets.push_back(std::unique_ptr<bucket_t>(
+                              new bucket_t(pmattr, pcattr, cap,
+                                           _num_bufs_init,
+                                           _bufs_to_add_when_growing)));
+        if (cap >= max_payload)
+            break;
+        cap *= 2;
     }
-    return ret;
 }
 
-//////////////////////////// T2T2_QUEUE_SET<> ////////////////////////////
-
-template <class BaseT>
-t2t2_queue_set<BaseT> :: t2t2_queue_set(
-    pthread_mutexattr_t *pmattr /*= NULL*/,
-    pthread_condattr_t  *pcattr /*= NULL*/)
-    : qs(pmattr, pcattr)
+template <class BaseT, class... derivedTs>
+typename t2t2_var_pool<BaseT,derivedTs...>::bucket_t *
+t2t2_var_pool<BaseT,derivedTs...> :: find_bucket(int payload_len)
+{
+    // there aren't many buckets, and the small ones are
+    // the common case, so a linear search is fine.
+    for (size_t ind = 0; ind < buckets.size(); ind++)
+        if (buckets[ind]->get_payload_capacity() >= payload_len)
+            return buckets[ind].get();
+    return NULL;
+}
+
+template <class BaseT, class... derivedTs>
+bool t2t2_var_pool<BaseT,derivedTs...> :: set_registry_name(
+    const char *name)
+{
+    bool ok = true;
+    for (size_t ind = 0; ind < buckets.size(); ind++)
+    {
+        if (name == NULL)
+        {
+            buckets[ind]->set_registry_name(NULL);
+            continue;
+        }
+        std::ostringstream bucket_name;
+        bucket_name << name << "_" << buckets[ind]->get_payload_capacity();
+        if (!buckets[ind]->set_registry_name(bucket_name.str().c_str()))
+            ok = false;
+    }
+    return ok;
+}
+
+template <class BaseT, class... derivedTs>
+template <class T, typename... ConstructorArgs>
+__T2T2_LEAK_NOINLINE
+bool t2t2_var_pool<BaseT,derivedTs...> :: alloc_var(
+    pxfe_shared_ptr<T> * ptr, int wait_ms,
+    int payload_len, ConstructorArgs&&... args)
+{
+    bucket_t * b = find_bucket(payload_len);
+    if (b == NULL || payload_len < 0)
+    {
+        __T2T2_ASSERT(BUFFER_SIZE_TOO_BIG_FOR_POOL, false);
+        ptr->reset();
+        return false;
+    }
+    T * t = NULL;
+    void * buf = b->_alloc(wait_ms, payload_len, 0, __T2T2_LEAK_CALLER);
+    if (buf)
+    {
+        t = b->template _construct<T>(
+            buf, std::forward<ConstructorArgs>(args)...);
+        t->__payload_len = payload_len;
+        // nobody else can see it yet, so a plain store will do.
+        t->_set_use_count(1);
+    }
+    ptr->_give(t);
+    return (t != NULL);
+}
+
+#ifdef T2T2_ENABLE_COROUTINES
+
+template <class BaseT, class... derivedTs>
+template <class T, typename... ConstructorArgs>
+__T2T2_LEAK_NOINLINE
+t2t2_alloc_awaitable<t2t2_pool<BaseT,derivedTs...>, T,
+                     typename std::decay<ConstructorArgs>::type...>
+t2t2_pool<BaseT,derivedTs...> :: async_alloc(ConstructorArgs&&... args)
+{
+    return t2t2_alloc_awaitable<t2t2_pool, T,
+                                typename std::decay<ConstructorArgs>::type...>(
+        this, NULL, __T2T2_LEAK_CALLER, 0,
+        std::forward<ConstructorArgs>(args)...);
+}
+
+template <class BaseT, class... derivedTs>
+template <class T, typename... ConstructorArgs>
+__T2T2_LEAK_NOINLINE
+t2t2_alloc_awaitable<t2t2_pool<BaseT,derivedTs...>, T,
+                     typename std::decay<ConstructorArgs>::type...>
+t2t2_pool<BaseT,derivedTs...> :: async_alloc_prio(int prio_class,
+                                                  ConstructorArgs&&... args)
+{
+    if (prio_class < 0 || num_classes == 0)
+        prio_class = 0;
+    else if (prio_class >= num_classes)
+        prio_class = num_classes - 1;
+    return t2t2_alloc_awaitable<t2t2_pool, T,
+                                typename std::decay<ConstructorArgs>::type...>(
+        this, NULL, __T2T2_LEAK_CALLER, prio_class,
+        std::forward<ConstructorArgs>(args)...);
+}
+
+template <class BaseT, class... derivedTs>
+template <class T, typename... ConstructorArgs>
+__T2T2_LEAK_NOINLINE
+t2t2_alloc_awaitable<t2t2_pool<BaseT,derivedTs...>, T,
+                     typename std::decay<ConstructorArgs>::type...>
+t2t2_pool<BaseT,derivedTs...> :: async_alloc_on(t2t2_executor *ex,
+                                                ConstructorArgs&&... args)
+{
+    return t2t2_alloc_awaitable<t2t2_pool, T,
+                                typename std::decay<ConstructorArgs>::type...>(
+        this, ex, __T2T2_LEAK_CALLER, 0,
+        std::forward<ConstructorArgs>(args)...);
+}
+
+#endif /* T2T2_ENABLE_COROUTINES */
+
+//////////////////////////// T2T2_DISPATCHER<> ////////////////////////////
+
+template <class BaseT, class... derivedTs>
+template <class HandlerT, class T>
+//static
+void t2t2_dispatcher<BaseT,derivedTs...> :: invoke(HandlerT &handler,
+                                                   BaseT *msg)
+{
+    handler(*static_cast<T*>(msg));
+}
+
+template <class BaseT, class... derivedTs>
+template <class HandlerT>
+//static
+bool t2t2_dispatcher<BaseT,derivedTs...> :: dispatch(HandlerT &handler,
+                                                     BaseT *msg)
+{
+    typedef void (*handler_fn)(HandlerT &handler, BaseT *msg);
+    static const handler_fn table[] = {
+        &invoke<HandlerT, BaseT>,
+        &invoke<HandlerT, derivedTs>...
+    };
+    static const int num_types = sizeof(table) / sizeof(table[0]);
+
+    if (msg == NULL)
+        return false;
+    int idx = msg->__type_index;
+    const void * const * tags = msg->__pool->get_type_tags();
+    if (tags != pool_t::type_list_tags && idx >= 0)
+    {
+        // allocated from a pool with a different type list;
+        // look for the same type in our list.
+        const void * tag = tags[idx];
+        for (idx = num_types-1; idx >= 0; idx--)
+            if (pool_t::type_list_tags[idx] == tag)
+                break;
+    }
+    // types which aren't in our list go to the BaseT handler.
+    if (idx < 0)
+        idx = 0;
+    table[idx](handler, msg);
+    return true;
+}
+
+//////////////////////////// T2T2_UNIQUE_MSG<> ////////////////////////////
+
+// turn a dequeued buffer into a unique owner, checking that
+// the message really did have only one owner when enqueued.
+template <class BaseT>
+t2t2_unique_msg<BaseT> __t2t2_dequeued_unique(__t2t2_buffer_hdr *h)
+{
+    t2t2_unique_msg<BaseT>  ret;
+    if (h)
+    {
+        h++;
+        BaseT * msg = (BaseT*) h;
+        if (msg->use_count() != 1)
+        {
+            __T2T2_ASSERT(DEQUEUE_UNIQUE_SHARED_MSG,false);
+            // drop the queue's ref; the other owners still have theirs.
+            pxfe_shared_ptr<BaseT>  sp;
+            sp._give(msg);
+            return ret;
+        }
+        ret._give(msg);
+    }
+    return ret;
+}
+
+//////////////////////////// T2T2_ARENA<> ////////////////////////////
+
+template <class T, typename... ConstructorArgs>
+T * t2t2_arena :: make(ConstructorArgs&&... args)
+{
+    if (hdr == NULL)
+        return NULL;
+    // take the dtor node first, so a failure leaves nothing behind.
+    __t2t2_arena_dtor * d = NULL;
+    uint32_t save_used = hdr->used;
+    if (!std::is_trivially_destructible<T>::value)
+    {
+        d = (__t2t2_arena_dtor *) hdr->alloc(sizeof(__t2t2_arena_dtor),
+                                             alignof(__t2t2_arena_dtor));
+        if (d == NULL)
+            return NULL;
+    }
+    void * mem = hdr->alloc(sizeof(T), alignof(T));
+    if (mem == NULL)
+    {
+        hdr->used = save_used;
+        return NULL;
+    }
+    T * t = new(mem) T(std::forward<ConstructorArgs>(args)...);
+    if (d)
+    {
+        d->fn = &destroy_one<T>;
+        d->obj = t;
+        d->next = hdr->dtors;
+        hdr->dtors = d;
+    }
+    return t;
+}
+
+template <class T>
+T * t2t2_arena :: make_array(size_t n)
+{
+    static_assert(std::is_trivially_destructible<T>::value == true,
+                  "arena arrays must be trivially destructible");
+    if (hdr == NULL || n > hdr->capacity / sizeof(T))
+        return NULL;
+    T * mem = (T *) hdr->alloc(n * sizeof(T), alignof(T));
+    if (mem == NULL)
+        return NULL;
+    // not array new, which may want room for a count in front.
+    for (size_t ind = 0; ind < n; ind++)
+        new(&mem[ind]) T();
+    return mem;
+}
+
+template <class T>
+bool t2t2_arena_vector<T> :: push_back(const T &v)
+{
+    if (len == cap && !reserve((cap > 0) ? (cap * 2) : 4))
+        return false;
+    new(&items[len++]) T(v);
+    return true;
+}
+
+template <class T>
+bool t2t2_arena_vector<T> :: reserve(size_t n)
+{
+    if (n <= cap)
+        return true;
+    // bump allocators can't grow in place: move to a new array. the
+    // old one is wasted until the message is released, so reserve
+    // the right size up front if it's known.
+    if (n > arena.capacity() / sizeof(T))
+        return false;
+    T * newitems = (T *) arena.alloc(n * sizeof(T), alignof(T));
+    if (newitems == NULL)
+        return false;
+    for (size_t ind = 0; ind < len; ind++)
+        new(&newitems[ind]) T(std::move(items[ind]));
+    items = newitems;
+    cap = n;
+    return true;
+}
+
+//////////////////////////// T2T2_QUEUE<> ////////////////////////////
+
+template <class BaseT>
+t2t2_queue<BaseT> :: t2t2_queue(pthread_mutexattr_t *pmattr /*= NULL*/,
+                              pthread_condattr_t  *pcattr /*= NULL*/)
+    : q(pmattr,pcattr)
+{
+}
+
+template <class BaseT>
+t2t2_queue<BaseT> :: t2t2_queue(bool deadline_ordered,
+                                int num_key_buckets,
+                                pthread_mutexattr_t *pmattr,
+                                pthread_condattr_t  *pcattr)
+    : q(pmattr,pcattr,deadline_ordered,num_key_buckets)
+{
+}
+
+template <class BaseT>
+template <class T>
+bool t2t2_queue<BaseT> :: enqueue(pxfe_shared_ptr<T> &_msg)
+{
+    bool ret = false;
+    static_assert(std::is_base_of<BaseT, T>::value == true,
+                  "enqueued type must be derived from "
+                  "base type of the queue");
+    BaseT * msg = _msg._take();
+    if (msg)
+    {
+        __t2t2_buffer_hdr * h = (__t2t2_buffer_hdr *) msg;
+        h--;
+        h->ok();
+        ret = q._enqueue_tail(h);
+    }
+    else
+    {
+        __T2T2_ASSERT(ENQUEUE_EMPTY_POINTER,false);
+    }
+    return ret;
+}
+
+
+template <class BaseT>
+template <class T>
+bool t2t2_queue<BaseT> :: enqueue(pxfe_shared_ptr<T> &&msg)
+{
+    return enqueue(msg);
+}
+
+template <class BaseT>
+template <class T>
+bool t2t2_queue<BaseT> :: enqueue(t2t2_unique_msg<T> &&_msg)
+{
+    bool ret = false;
+    static_assert(std::is_base_of<BaseT, T>::value == true,
+                  "enqueued type must be derived from "
+                  "base type of the queue");
+    BaseT * msg = _msg._take();
+    if (msg)
+    {
+        __t2t2_buffer_hdr * h = (__t2t2_buffer_hdr *) msg;
+        h--;
+        h->ok();
+        ret = q._enqueue_tail(h);
+    }
+    else
+    {
+        __T2T2_ASSERT(ENQUEUE_EMPTY_POINTER,false);
+    }
+    return ret;
+}
+
+template <class BaseT>
+template <class T, class PoolT, typename... ConstructorArgs>
+__T2T2_LEAK_NOINLINE
+bool t2t2_queue<BaseT> :: emplace(PoolT *pool, int wait_ms,
+                                  ConstructorArgs&&... args)
+{
+    static_assert(std::is_base_of<BaseT, T>::value == true,
+                  "enqueued type must be derived from "
+                  "base type of the queue");
+    void * buf = pool->_alloc(wait_ms, 0, 0, __T2T2_LEAK_CALLER);
+    if (buf == NULL)
+        return false;
+    BaseT * msg = pool->template _construct<T>(
+        buf, std::forward<ConstructorArgs>(args)...);
+    // this is the queue's reference; nobody else can see it yet.
+    msg->_set_use_count(1);
+    __t2t2_buffer_hdr * h = (__t2t2_buffer_hdr *) msg;
+    h--;
+    return q._enqueue_tail(h);
+}
+
+template <class BaseT>
+template <class T, class PoolT, typename... ConstructorArgs>
+__T2T2_LEAK_NOINLINE
+int t2t2_queue<BaseT> :: emplace_n(PoolT *pool, int n, int wait_ms,
+                                   ConstructorArgs&&... args)
+{
+    static_assert(std::is_base_of<BaseT, T>::value == true,
+                  "enqueued type must be derived from "
+                  "base type of the queue");
+    __t2t2_links_head<__t2t2_buffer_hdr>  bufs;
+    const void * site = __T2T2_LEAK_CALLER;
+    int count;
+    for (count = 0; count < n; count++)
+    {
+        void * buf = pool->_alloc(wait_ms, 0, 0, site);
+        if (buf == NULL)
+            break;
+        // not forwarded: every message gets the same args.
+        BaseT * msg = pool->template _construct<T>(buf, args...);
+        msg->_set_use_count(1);
+        __t2t2_buffer_hdr * h = (__t2t2_buffer_hdr *) msg;
+        h--;
+        bufs.add_prev(h);
+    }
+    q._enqueue_list(&bufs, true);
+    return count;
+}
+
+template <class BaseT>
+bool t2t2_queue<BaseT> :: empty(void)
+{
+    return q._empty();
+}
+
+template <class BaseT>
+int t2t2_queue<BaseT> :: depth(void) const
+{
+    return q._depth();
+}
+
+template <class BaseT>
+void t2t2_queue<BaseT> :: get_stats(t2t2_queue_stats &stats)
+{
+    q._get_stats(stats);
+}
+
+template <class BaseT>
+bool t2t2_queue<BaseT> :: set_registry_name(const char *name)
+{
+    return q._set_registry_name(name);
+}
+
+template <class BaseT>
+bool t2t2_queue<BaseT> :: enable_delay_histogram(bool enable /*= true*/)
+{
+    return q._enable_delay_histogram(enable);
+}
+
+template <class BaseT>
+void t2t2_queue<BaseT> :: get_delay_histogram(t2t2_histogram &hist,
+                                              bool reset /*= false*/)
+{
+    q._get_delay_histogram(hist, reset);
+}
+
+template <class BaseT>
+pxfe_shared_ptr<BaseT>   t2t2_queue<BaseT> :: dequeue(int wait_ms)
+{
+    pxfe_shared_ptr<BaseT>  ret;
+    __t2t2_buffer_hdr * h = q._dequeue(wait_ms);
+    if (h)
+    {
+        h++;
+        ret._give((BaseT*) h);
+    }
+    return ret;
+}
+
+template <class BaseT>
+t2t2_unique_msg<BaseT>   t2t2_queue<BaseT> :: dequeue_unique(int wait_ms)
+{
+    return __t2t2_dequeued_unique<BaseT>(q._dequeue(wait_ms));
+}
+
+#ifdef T2T2_ENABLE_COROUTINES
+
+template <class BaseT>
+t2t2_dequeue_awaitable<BaseT> t2t2_queue<BaseT> :: async_dequeue(
+    t2t2_executor *ex /*= NULL*/)
+{
+    return t2t2_dequeue_awaitable<BaseT>(&q, NULL, NULL, ex);
+}
+
+#endif /* T2T2_ENABLE_COROUTINES */
+
+//////////////////////////// T2T2_DEADLINE_QUEUE<> //////////////////////////
+
+template <class BaseT>
+t2t2_deadline_queue<BaseT> :: t2t2_deadline_queue(
+    pthread_mutexattr_t *pmattr /*= NULL*/,
+    pthread_condattr_t  *pcattr /*= NULL*/,
+    int capacity /*= 256*/)
+    : t2t2_queue<BaseT>(true, 0, pmattr, pcattr)
+{
+    t2t2_queue<BaseT>::q._reserve_due(capacity);
+}
+
+template <class BaseT>
+template <class T>
+bool t2t2_deadline_queue<BaseT> :: enqueue(pxfe_shared_ptr<T> &_msg,
+                                           const timespec &deliver_at)
+{
+    bool ret = false;
+    static_assert(std::is_base_of<BaseT, T>::value == true,
+                  "enqueued type must be derived from "
+                  "base type of the queue");
+    BaseT * msg = _msg._take();
+    if (msg)
+    {
+        __t2t2_buffer_hdr * h = (__t2t2_buffer_hdr *) msg;
+        h--;
+        h->ok();
+        ret = t2t2_queue<BaseT>::q._enqueue_deadline(h, deliver_at);
+    }
+    else
+    {
+        __T2T2_ASSERT(ENQUEUE_EMPTY_POINTER,false);
+    }
+    return ret;
+}
+
+template <class BaseT>
+template <class T>
+bool t2t2_deadline_queue<BaseT> :: enqueue_in(pxfe_shared_ptr<T> &msg,
+                                              int delay_ms)
+{
+    __t2t2_timespec  deliver_at;
+    __t2t2_timespec  delay(delay_ms);
+    t2t2_queue<BaseT>::q._now(&deliver_at);
+    deliver_at += delay;
+    return enqueue(msg, deliver_at);
+}
+
+//////////////////////// T2T2_CONFLATING_QUEUE<> ////////////////////////
+
+template <class BaseT>
+t2t2_conflating_queue<BaseT> :: t2t2_conflating_queue(
+    int num_key_buckets /*= 256*/,
+    pthread_mutexattr_t *pmattr /*= NULL*/,
+    pthread_condattr_t  *pcattr /*= NULL*/)
+    : t2t2_queue<BaseT>(false, num_key_buckets, pmattr, pcattr)
+{
+}
+
+template <class BaseT>
+template <class T>
+bool t2t2_conflating_queue<BaseT> :: enqueue(pxfe_shared_ptr<T> &_msg,
+                                             uint64_t key)
+{
+    bool ret = false;
+    static_assert(std::is_base_of<BaseT, T>::value == true,
+                  "enqueued type must be derived from "
+                  "base type of the queue");
+    BaseT * msg = _msg._take();
+    if (msg)
+    {
+        __t2t2_buffer_hdr * h = (__t2t2_buffer_hdr *) msg;
+        __t2t2_buffer_hdr * replaced = NULL;
+        h--;
+        h->ok();
+        ret = t2t2_queue<BaseT>::q._enqueue_keyed(h, key, &replaced);
+        if (replaced)
+        {
+            // the queue was holding a ref on the stale message;
+            // drop it here, outside the queue lock, which
+            // returns it to its pool.
+            pxfe_shared_ptr<BaseT>  stale;
+            replaced++;
+            stale._give((BaseT*) replaced);
+        }
+    }
+    else
+    {
+        __T2T2_ASSERT(ENQUEUE_EMPTY_POINTER,false);
+    }
+    return ret;
+}
+
+template <class BaseT>
+void t2t2_conflating_queue<BaseT> :: get_stats(
+    t2t2_conflate_stats &stats)
+{
+    t2t2_queue<BaseT>::q._get_conflate_counts(&stats.keyed_enqueues,
+                                              &stats.conflated);
+}
+
+//////////////////////////// T2T2_QUEUE_SET<> ////////////////////////////
+
+template <class BaseT>
+t2t2_queue_set<BaseT> :: t2t2_queue_set(
+    pthread_mutexattr_t *pmattr /*= NULL*/,
+    pthread_condattr_t  *pcattr /*= NULL*/)
+    : qs(pmattr, pcattr)
 {
 }
 
@@ -431,34 +2062,726 @@ t2t2_queue_set<BaseT> :: ~t2t2_queue_set(void)
 }
 
 template <class BaseT>
-bool t2t2_queue_set<BaseT> :: add_queue(t2t2_queue<BaseT> *q, int id)
+bool t2t2_queue_set<BaseT> :: add_queue(t2t2_queue<BaseT> *q, int id)
+{
+    // __t2t2_queue_set does its own locking.
+    return qs._add_queue(&q->q, id);
+}
+
+template <class BaseT>
+void t2t2_queue_set<BaseT> :: remove_queue(t2t2_queue<BaseT> *q)
+{
+    // __t2t2_queue_set does its own locking.
+    qs._remove_queue(&q->q);
+}
+
+template <class BaseT>
+int t2t2_queue_set<BaseT> :: depth(void) const
+{
+    return qs._depth();
+}
+
+template <class BaseT>
+void t2t2_queue_set<BaseT> :: get_stats(t2t2_queue_stats &stats)
+{
+    qs._get_stats(stats);
+}
+
+template <class BaseT>
+bool t2t2_queue_set<BaseT> :: set_registry_name(const char *name)
+{
+    return qs._set_registry_name(name);
+}
+
+template <class BaseT>
+pxfe_shared_ptr<BaseT> t2t2_queue_set<BaseT> :: dequeue(int wait_ms,
+                                                      int *id /*= NULL*/)
+{
+    pxfe_shared_ptr<BaseT>  ret;
+    // __t2t2_queue_set does its own locking.
+    __t2t2_buffer_hdr * h = qs._dequeue(wait_ms,id);
+    if (h)
+    {
+        h++;
+        ret._give((BaseT*) h);
+    }
+    return ret;
+}
+
+template <class BaseT>
+t2t2_unique_msg<BaseT> t2t2_queue_set<BaseT> :: dequeue_unique(
+    int wait_ms, int *id /*= NULL*/)
 {
     // __t2t2_queue_set does its own locking.
-    return qs._add_queue(&q->q, id);
+    return __t2t2_dequeued_unique<BaseT>(qs._dequeue(wait_ms,id));
 }
 
+#ifdef T2T2_ENABLE_COROUTINES
+
 template <class BaseT>
-void t2t2_queue_set<BaseT> :: remove_queue(t2t2_queue<BaseT> *q)
+t2t2_dequeue_awaitable<BaseT> t2t2_queue_set<BaseT> :: async_dequeue(
+    int *id /*= NULL*/, t2t2_executor *ex /*= NULL*/)
 {
-    // __t2t2_queue_set does its own locking.
-    qs._remove_queue(&q->q);
+    return t2t2_dequeue_awaitable<BaseT>(NULL, &qs, id, ex);
+}
+
+#endif /* T2T2_ENABLE_COROUTINES */
+
+////////////////////////// T2T2_SEG_CHAIN<> //////////////////////////
+
+template <int max_segs>
+bool t2t2_seg_chain<max_segs> :: append(
+    const pxfe_shared_ptr<t2t2_segment> &seg,
+    size_t offset, size_t len)
+{
+    if (!seg || num_ranges >= max_segs)
+        return false;
+    size_t sz = seg->size();
+    if (offset > sz || len > sz - offset)
+        return false;
+    if (len == 0)
+        return true;
+    range &r = ranges[num_ranges++];
+    r.seg = seg;
+    r.offset = offset;
+    r.len = len;
+    total_len += len;
+    return true;
+}
+
+template <int max_segs>
+template <int otherMax>
+bool t2t2_seg_chain<max_segs> :: append(
+    const t2t2_seg_chain<otherMax> &other,
+    size_t offset, size_t len)
+{
+    if (offset > other.total_len || len > other.total_len - offset)
+        return false;
+    // note other may be this chain; only ranges below
+    // other_num are read, and only ranges above it are written.
+    int other_num = other.num_ranges;
+    int first = 0;
+    while (first < other_num && offset >= other.ranges[first].len)
+    {
+        offset -= other.ranges[first].len;
+        first++;
+    }
+    // count before changing anything, so a full
+    // chain is left as it was.
+    int needed = 0;
+    size_t remaining = len, skip = offset;
+    for (int ind = first; remaining > 0 && ind < other_num; ind++)
+    {
+        size_t l = other.ranges[ind].len - skip;
+        remaining -= (l < remaining) ? l : remaining;
+        skip = 0;
+        needed++;
+    }
+    if (num_ranges + needed > max_segs)
+        return false;
+    for (int ind = first; len > 0; ind++)
+    {
+        const typename t2t2_seg_chain<otherMax>::range &src =
+            other.ranges[ind];
+        size_t l = src.len - offset;
+        if (l > len)
+            l = len;
+        range &r = ranges[num_ranges++];
+        r.seg = src.seg;
+        r.offset = src.offset + offset;
+        r.len = l;
+        total_len += l;
+        len -= l;
+        offset = 0;
+    }
+    return true;
 }
 
+template <int max_segs>
+void t2t2_seg_chain<max_segs> :: consume(size_t n)
+{
+    if (n >= total_len)
+    {
+        clear();
+        return;
+    }
+    total_len -= n;
+    int drop = 0;
+    while (n >= ranges[drop].len)
+    {
+        n -= ranges[drop].len;
+        drop++;
+    }
+    ranges[drop].offset += n;
+    ranges[drop].len -= n;
+    if (drop == 0)
+        return;
+    int ind;
+    for (ind = drop; ind < num_ranges; ind++)
+        ranges[ind - drop] = std::move(ranges[ind]);
+    for (ind = num_ranges - drop; ind < num_ranges; ind++)
+        ranges[ind].seg.reset();
+    num_ranges -= drop;
+}
+
+template <int max_segs>
+void t2t2_seg_chain<max_segs> :: clear(void)
+{
+    for (int ind = 0; ind < num_ranges; ind++)
+        ranges[ind].seg.reset();
+    num_ranges = 0;
+    total_len = 0;
+}
+
+template <int max_segs>
+int t2t2_seg_chain<max_segs> :: get_iovec(
+    struct iovec *iov, int max_iov) const
+{
+    int ind;
+    for (ind = 0; ind < num_ranges && ind < max_iov; ind++)
+    {
+        const range &r = ranges[ind];
+        iov[ind].iov_base = r.seg->data() + r.offset;
+        iov[ind].iov_len = r.len;
+    }
+    return ind;
+}
+
+template <int max_segs>
+size_t t2t2_seg_chain<max_segs> :: copy_out(
+    void *buf, size_t offset, size_t len) const
+{
+    uint8_t * out = (uint8_t*) buf;
+    size_t copied = 0;
+    for (int ind = 0; ind < num_ranges && copied < len; ind++)
+    {
+        const range &r = ranges[ind];
+        if (offset >= r.len)
+        {
+            offset -= r.len;
+            continue;
+        }
+        size_t l = r.len - offset;
+        if (l > len - copied)
+            l = len - copied;
+        memcpy(out + copied, r.seg->data() + r.offset + offset, l);
+        copied += l;
+        offset = 0;
+    }
+    return copied;
+}
+
+//////////////////////////// T2T2_SUBSCRIBER<> ////////////////////////////
+
 template <class BaseT>
-pxfe_shared_ptr<BaseT> t2t2_queue_set<BaseT> :: dequeue(int wait_ms,
-                                                      int *id /*= NULL*/)
+t2t2_subscriber<BaseT> :: t2t2_subscriber(
+    int num_nodes,
+    pthread_mutexattr_t *pmattr /*= NULL*/,
+    pthread_condattr_t  *pcattr /*= NULL*/)
+    : nodes(num_nodes, 1, pmattr, pcattr), q(pmattr, pcattr), drops(0),
+      in_flight(0), closing(false), node_waiters(0)
+{
+    pthread_mutex_init(&close_mutex, pmattr);
+    pthread_cond_init(&close_cond, pcattr);
+    if (pcattr)
+        pthread_condattr_getclock(pcattr, &clk_id);
+    else
+        // the default condattr clock appears to be REALTIME
+        clk_id = CLOCK_REALTIME;
+}
+
+template <class BaseT>
+t2t2_subscriber<BaseT> :: ~t2t2_subscriber(void)
+{
+    // release our refs on anything never dequeued, so the messages
+    // go back to their pools and the nodes go back to ours.
+    while (dequeue(T2T2_NO_WAIT))
+        ;
+    pthread_mutex_destroy(&close_mutex);
+    pthread_cond_destroy(&close_cond);
+}
+
+template <class BaseT>
+bool t2t2_subscriber<BaseT> :: deliver(BaseT *msg, int wait_ms)
+{
+    pxfe_shared_ptr<delivery_t>  d;
+    bool ok = false;
+    // the node takes its own ref on msg. the pool's own wait can't
+    // be interrupted by unsubscribe, so a blocking wait is done here.
+    if (closing.load())
+        ;
+    else if (wait_ms == T2T2_NO_WAIT || wait_ms == T2T2_GROW)
+        nodes.alloc(&d, wait_ms, msg);
+    else
+        wait_node(&d, msg, wait_ms);
+    if (d)
+        ok = q.enqueue(d);
+    else
+        drops ++;
+    // this is the last touch of the subscriber, and close() can't
+    // see in_flight reach 0 until the unlock.
+    pthread_mutex_lock(&close_mutex);
+    if (--in_flight == 0 && closing.load())
+        pthread_cond_broadcast(&close_cond);
+    pthread_mutex_unlock(&close_mutex);
+    return ok;
+}
+
+template <class BaseT>
+bool t2t2_subscriber<BaseT> :: wait_node(pxfe_shared_ptr<delivery_t> *d,
+                                         BaseT *msg, int wait_ms)
+{
+    __t2t2_timespec  abstime;
+    if (wait_ms > 0)
+    {
+        __t2t2_timespec  t(wait_ms);
+        abstime.getNow(clk_id);
+        abstime += t;
+    }
+    pthread_mutex_lock(&close_mutex);
+    // counted before trying, so a node freed between the try and
+    // the wait still signals us (see dequeue).
+    node_waiters ++;
+    bool timed_out = false;
+    bool got;
+    while (!(got = nodes.alloc(d, T2T2_NO_WAIT, msg)) &&
+           !closing.load() && !timed_out)
+    {
+        __T2T2_RT_CHECK(true, RT_BLOCKING_WAIT, this);
+        if (wait_ms < 0)
+            pthread_cond_wait(&close_cond, &close_mutex);
+        else if (pthread_cond_timedwait(&close_cond, &close_mutex,
+                                        &abstime) == ETIMEDOUT)
+            timed_out = true;
+    }
+    node_waiters --;
+    pthread_mutex_unlock(&close_mutex);
+    return got;
+}
+
+template <class BaseT>
+void t2t2_subscriber<BaseT> :: close(void)
+{
+    pthread_mutex_lock(&close_mutex);
+    closing.store(true);
+    // wake publishers waiting for a node, so they give up.
+    pthread_cond_broadcast(&close_cond);
+    while (in_flight.load() > 0)
+        pthread_cond_wait(&close_cond, &close_mutex);
+    pthread_mutex_unlock(&close_mutex);
+}
+
+template <class BaseT>
+pxfe_shared_ptr<BaseT> t2t2_subscriber<BaseT> :: dequeue(int wait_ms)
 {
     pxfe_shared_ptr<BaseT>  ret;
-    // __t2t2_queue_set does its own locking.
-    __t2t2_buffer_hdr * h = qs._dequeue(wait_ms,id);
-    if (h)
+    pxfe_shared_ptr<delivery_t>  d = q.dequeue(wait_ms);
+    if (d)
+    {
+        // move the node's ref to the caller, and the node itself
+        // back to our pool.
+        ret._give(d->msg._take());
+        d.reset();
+        if (node_waiters.load() > 0)
+        {
+            __T2T2_RT_CHECK(true, RT_WAKEUP_SYSCALL, this);
+            pthread_mutex_lock(&close_mutex);
+            pthread_cond_broadcast(&close_cond);
+            pthread_mutex_unlock(&close_mutex);
+        }
+    }
+    return ret;
+}
+
+//////////////////////////// T2T2_TOPIC<> ////////////////////////////
+
+template <class BaseT>
+t2t2_topic<BaseT> :: t2t2_topic(pthread_mutexattr_t *pmattr /*= NULL*/)
+{
+    pthread_mutex_init(&snap_mutex, pmattr);
+    pthread_mutex_init(&writer_mutex, pmattr);
+    current.reset(new __t2t2_topic_snapshot);
+}
+
+template <class BaseT>
+t2t2_topic<BaseT> :: ~t2t2_topic(void)
+{
+    current.reset();
+    pthread_mutex_destroy(&snap_mutex);
+    pthread_mutex_destroy(&writer_mutex);
+}
+
+template <class BaseT>
+pxfe_shared_ptr<__t2t2_topic_snapshot> t2t2_topic<BaseT> :: get_snapshot(
+    bool publishing /*= false*/)
+{
+    pthread_mutex_lock(&snap_mutex);
+    pxfe_shared_ptr<__t2t2_topic_snapshot>  ret = current;
+    if (publishing)
+        // done under snap_mutex, so once unsubscribe has swapped
+        // a subscriber out, nobody new can count themselves in.
+        for (size_t ind = 0; ind < ret->subs.size(); ind++)
+            ((t2t2_subscriber<BaseT> *) ret->subs[ind])->in_flight ++;
+    pthread_mutex_unlock(&snap_mutex);
+    return ret;
+}
+
+template <class BaseT>
+pxfe_shared_ptr<__t2t2_topic_snapshot> t2t2_topic<BaseT> :: swap_snapshot(
+    __t2t2_topic_snapshot *next)
+{
+    pthread_mutex_lock(&snap_mutex);
+    pxfe_shared_ptr<__t2t2_topic_snapshot>  old = std::move(current);
+    current.reset(next);
+    pthread_mutex_unlock(&snap_mutex);
+    return old;
+}
+
+template <class BaseT>
+bool t2t2_topic<BaseT> :: subscribe(t2t2_subscriber<BaseT> *sub)
+{
+    pthread_mutex_lock(&writer_mutex);
+    __t2t2_topic_snapshot * next = new __t2t2_topic_snapshot;
+    next->subs = current->subs;
+    bool found = false;
+    for (size_t ind = 0; ind < next->subs.size(); ind++)
+        if (next->subs[ind] == sub)
+            found = true;
+    if (!found)
+    {
+        // it may be coming back after an unsubscribe.
+        sub->closing.store(false);
+        next->subs.push_back(sub);
+    }
+    swap_snapshot(next);
+    pthread_mutex_unlock(&writer_mutex);
+    return !found;
+}
+
+template <class BaseT>
+bool t2t2_topic<BaseT> :: unsubscribe(t2t2_subscriber<BaseT> *sub)
+{
+    pthread_mutex_lock(&writer_mutex);
+    __t2t2_topic_snapshot * next = new __t2t2_topic_snapshot;
+    bool found = false;
+    for (size_t ind = 0; ind < current->subs.size(); ind++)
+    {
+        if (current->subs[ind] == sub)
+            found = true;
+        else
+            next->subs.push_back(current->subs[ind]);
+    }
+    swap_snapshot(next);
+    pthread_mutex_unlock(&writer_mutex);
+    // a publisher that picked up the old snapshot may still be
+    // delivering to sub; make any waiting for a node give up, and
+    // wait for the rest to finish with it, so the caller may
+    // destroy sub when we return. publishers are never held up.
+    if (found)
+        sub->close();
+    return found;
+}
+
+template <class BaseT>
+int t2t2_topic<BaseT> :: num_subscribers(void)
+{
+    return (int) get_snapshot()->subs.size();
+}
+
+template <class BaseT>
+template <class T>
+int t2t2_topic<BaseT> :: publish(pxfe_shared_ptr<T> &_msg, int wait_ms)
+{
+    static_assert(std::is_base_of<BaseT, T>::value == true,
+                  "published type must be derived from "
+                  "base type of the topic");
+    pxfe_shared_ptr<BaseT>  msg;
+    msg._give(_msg._take());
+    if (!msg)
+    {
+        __T2T2_ASSERT(ENQUEUE_EMPTY_POINTER,false);
+        return 0;
+    }
+    int delivered = 0;
+    // every subscriber in snap counts us in_flight until its
+    // deliver returns.
+    pxfe_shared_ptr<__t2t2_topic_snapshot>  snap = get_snapshot(true);
+    for (size_t ind = 0; ind < snap->subs.size(); ind++)
+    {
+        t2t2_subscriber<BaseT> * sub =
+            (t2t2_subscriber<BaseT> *) snap->subs[ind];
+        if (sub->deliver(msg.get(), wait_ms))
+            delivered ++;
+    }
+    // our ref drops here; if nobody was subscribed, the
+    // message goes straight back to its pool.
+    return delivered;
+}
+
+//////////////////////////// T2T2_REPLY_TOKEN<> ////////////////////////////
+
+template <class RepBaseT>
+template <class T>
+bool t2t2_reply_token<RepBaseT> :: reply(pxfe_shared_ptr<T> &rep)
+{
+    static_assert(std::is_base_of<RepBaseT, T>::value == true,
+                  "reply type must be derived from the "
+                  "reply base type of the token");
+    if (client == NULL)
+        return false;
+    __t2t2_rpc_client * c = client;
+    // a token can only be used once.
+    client = NULL;
+    RepBaseT * r = rep._take();
+    if (c->_complete(slot, generation, r) == false)
+    {
+        // the caller gave up; rep drops the reply back to its pool.
+        rep._give(static_cast<T*>(r));
+        return false;
+    }
+    return true;
+}
+
+//////////////////////////// T2T2_RPC_CLIENT<> ////////////////////////////
+
+template <class RepBaseT>
+t2t2_rpc_client<RepBaseT> :: t2t2_rpc_client(
+    int num_slots,
+    pthread_mutexattr_t *pmattr /*= NULL*/,
+    pthread_condattr_t  *pcattr /*= NULL*/)
+    : core(num_slots, pmattr, pcattr)
+{
+}
+
+template <class RepBaseT>
+template <class ReqBaseT, class T>
+pxfe_shared_ptr<RepBaseT> t2t2_rpc_client<RepBaseT> :: call(
+    t2t2_queue<ReqBaseT> *q, pxfe_shared_ptr<T> &req, int timeout_ms)
+{
+    pxfe_shared_ptr<RepBaseT>  ret;
+    if (!req)
+    {
+        __T2T2_ASSERT(ENQUEUE_EMPTY_POINTER,false);
+        return ret;
+    }
+    uint32_t  slot, generation;
+    if (core._start(&slot, &generation, timeout_ms,
+                    NULL, NULL, NULL) == false)
+        return ret;
+    req->reply_token.set(&core, slot, generation);
+    // once it's enqueued, req belongs to the server.
+    if (q->enqueue(req) == false)
+    {
+        core._cancel(slot, generation);
+        return ret;
+    }
+    ret._give((RepBaseT*) core._wait(slot, generation, timeout_ms));
+    return ret;
+}
+
+template <class RepBaseT>
+//static
+void t2t2_rpc_client<RepBaseT> :: trampoline(void *reply,
+                                             __t2t2_generic_fn fn,
+                                             void *arg)
+{
+    pxfe_shared_ptr<RepBaseT>  rep;
+    rep._give((RepBaseT*) reply);
+    callback_t  cb = (callback_t) fn;
+    cb(rep, arg);
+}
+
+template <class RepBaseT>
+template <class ReqBaseT, class T>
+bool t2t2_rpc_client<RepBaseT> :: call_async(
+    t2t2_queue<ReqBaseT> *q, pxfe_shared_ptr<T> &req, int timeout_ms,
+    callback_t cb, void *arg)
+{
+    if (!req)
+    {
+        __T2T2_ASSERT(ENQUEUE_EMPTY_POINTER,false);
+        return false;
+    }
+    uint32_t  slot, generation;
+    if (core._start(&slot, &generation, timeout_ms, &trampoline,
+                    (__t2t2_generic_fn) cb, arg) == false)
+        return false;
+    req->reply_token.set(&core, slot, generation);
+    if (q->enqueue(req) == false)
+    {
+        core._cancel(slot, generation);
+        return false;
+    }
+    return true;
+}
+
+template <class RepBaseT>
+int t2t2_rpc_client<RepBaseT> :: expire(void)
+{
+    return core._expire();
+}
+
+template <class RepBaseT>
+void t2t2_rpc_client<RepBaseT> :: get_stats(t2t2_rpc_stats &stats)
+{
+    core._get_stats(stats);
+}
+
+#ifdef T2T2_ENABLE_COROUTINES
+
+//////////////////////////// __T2T2_CORO_WAITER ////////////////////////////
+
+inline __t2t2_coro_waiter :: __t2t2_coro_waiter(t2t2_executor *_ex)
+{
+    w.init();
+    w.wake = &wake;
+    w.arg = this;
+    ex = (_ex != NULL) ? _ex : t2t2_executor::current();
+}
+
+//static
+inline void __t2t2_coro_waiter :: wake(__t2t2_async_waiter *w)
+{
+    __t2t2_coro_waiter * cw = (__t2t2_coro_waiter *) w->arg;
+    // once posted, the coroutine may run and destroy this
+    // awaitable before post() even returns, so don't touch
+    // cw after this.
+    std::coroutine_handle<> h = cw->handle;
+    if (cw->ex)
+        cw->ex->post(h);
+    else
+        h.resume();
+}
+
+//////////////////////////// T2T2_SIMPLE_EXECUTOR ////////////////////////////
+
+inline t2t2_simple_executor :: t2t2_simple_executor(
+    pthread_mutexattr_t *pmattr /*= NULL*/,
+    pthread_condattr_t *pcattr /*= NULL*/)
+{
+    pthread_mutex_init(&mutex, pmattr);
+    pthread_cond_init(&cond, pcattr);
+    if (pcattr)
+        pthread_condattr_getclock(pcattr, &clk_id);
+    else
+        clk_id = CLOCK_REALTIME;
+    stopping = false;
+}
+
+inline t2t2_simple_executor :: ~t2t2_simple_executor(void)
+{
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+}
+
+inline void t2t2_simple_executor :: post(std::coroutine_handle<> h)
+{
+    pthread_mutex_lock(&mutex);
+    ready.push_back(h);
+    pthread_mutex_unlock(&mutex);
+    pthread_cond_signal(&cond);
+}
+
+inline bool t2t2_simple_executor :: run_one(int wait_ms)
+{
+    __t2t2_timespec  ts;
+    if (wait_ms > 0)
+    {
+        __t2t2_timespec t(wait_ms);
+        ts.getNow(clk_id);
+        ts += t;
+    }
+    pthread_mutex_lock(&mutex);
+    while (ready.empty() && !stopping && wait_ms != 0)
+    {
+        if (wait_ms < 0)
+            pthread_cond_wait(&cond, &mutex);
+        else if (pthread_cond_timedwait(&cond, &mutex, &ts) == ETIMEDOUT)
+            break;
+    }
+    if (ready.empty() || stopping)
+    {
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+    std::coroutine_handle<> h = ready.front();
+    ready.pop_front();
+    pthread_mutex_unlock(&mutex);
+    resume(h);
+    return true;
+}
+
+inline void t2t2_simple_executor :: run(void)
+{
+    while (run_one(T2T2_WAIT_FOREVER))
+        ;
+}
+
+inline void t2t2_simple_executor :: stop(void)
+{
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_mutex_unlock(&mutex);
+    pthread_cond_broadcast(&cond);
+}
+
+//////////////////////// T2T2_DEQUEUE_AWAITABLE<> ////////////////////////
+
+template <class BaseT>
+bool t2t2_dequeue_awaitable<BaseT> :: await_suspend(std::coroutine_handle<> h)
+{
+    handle = h;
+    // if a message is already there, don't suspend at all.
+    if (qs)
+        return !qs->_dequeue_async(&w);
+    return !q->_dequeue_async(&w);
+}
+
+template <class BaseT>
+pxfe_shared_ptr<BaseT> t2t2_dequeue_awaitable<BaseT> :: await_resume(void)
+{
+    pxfe_shared_ptr<BaseT>  ret;
+    if (id)
+        *id = w.id;
+    if (w.h)
     {
+        __t2t2_buffer_hdr * h = w.h;
         h++;
         ret._give((BaseT*) h);
     }
     return ret;
 }
 
+///////////////////////// T2T2_ALLOC_AWAITABLE<> /////////////////////////
+
+template <class PoolT, class T, class... ArgTs>
+bool t2t2_alloc_awaitable<PoolT,T,ArgTs...> :: await_suspend(
+    std::coroutine_handle<> h)
+{
+    handle = h;
+    return !pool->_alloc_async(&w, prio_class);
+}
+
+template <class PoolT, class T, class... ArgTs>
+pxfe_shared_ptr<T> t2t2_alloc_awaitable<PoolT,T,ArgTs...> :: await_resume(void)
+{
+    pxfe_shared_ptr<T>  ret;
+    // (only if the pool's queue refused the wait.)
+    if (w.h == NULL)
+        return ret;
+    void * buf = pool->_alloc_async_done(w.h, site);
+    // the args were copied in when the awaitable was made, and are
+    // used exactly once, so they can be moved into the constructor.
+    T * t = std::apply([this, buf](ArgTs &... a) {
+            return pool->template _construct<T>(buf, std::move(a)...);
+        }, args);
+    t->__prio_class = prio_class;
+    ret.reset(t);
+    return ret;
+}
+
+#endif /* T2T2_ENABLE_COROUTINES */
+
 //////////////////////////// T2T2_MESSAGE_BASE<> ////////////////////////////
 
 // NOTE
@@ -481,14 +2804,15 @@ template <class BaseT>
 void * t2t2_message_base<BaseT> :: operator new(
     size_t wanted_sz,
     __t2t2_pool *pool,
-    int wait_ms) throw ()
+    int wait_ms,
+    const void *site) throw ()
 {
     if (wanted_sz > pool->get_buffer_size())
     {
         __T2T2_ASSERT(BUFFER_SIZE_TOO_BIG_FOR_POOL, false);
         return NULL;
     }
-    void * ret = pool->_alloc(wait_ms);
+    void * ret = pool->_alloc(wait_ms, 0, 0, site);
     if (ret != NULL)
     {
         // there's a GCC bug!! for some reason, gcc 10.2.1
@@ -507,12 +2831,68 @@ void * t2t2_message_base<BaseT> :: operator new(
     return ret;
 }
 
+template <class BaseT>
+//static class method
+void * t2t2_message_base<BaseT> :: operator new(
+    size_t /*wanted_sz*/,
+    __t2t2_pool *pool,
+    void *buf) throw ()
+{
+    // no size check: this is only reached through t2t2_pool::_construct,
+    // whose static_assert has already made sure the type fits.
+    // (see above about volatile.)
+    volatile BaseT * obj = (volatile BaseT*) buf;
+    obj->__pool = pool;
+    return buf;
+}
+
 template <class BaseT>
 //static class method
 void t2t2_message_base<BaseT> :: operator delete(void *ptr)
 {
     BaseT * obj = (BaseT*) ptr;
-    obj->__pool->release(ptr);
+    if (obj->__pool->has_arena())
+        obj->__pool->_get_arena(ptr)->destroy();
+    __t2t2_release_batch * b = __t2t2_release_current;
+    if (b)
+        b->add(obj->__pool, ptr, obj->__payload_len, obj->__prio_class);
+    else
+        obj->__pool->release(ptr, obj->__payload_len, obj->__prio_class);
+}
+
+template <class BaseT>
+void t2t2_message_base<BaseT> :: _last_ref_dropped(void)
+{
+    __t2t2_reclaim_thread * rt = __t2t2_reclaim_current;
+    if (rt == NULL)
+    {
+        delete this;
+        return;
+    }
+    __t2t2_buffer_hdr * h = (__t2t2_buffer_hdr *) static_cast<BaseT*>(this);
+    h--;
+    h->reclaim_obj = this;
+    rt->defer(h);
+}
+
+template <class BaseT>
+t2t2_arena t2t2_message_base<BaseT> :: get_arena(void)
+{
+    if (!__pool->has_arena())
+        return t2t2_arena();
+    return t2t2_arena(__pool->_get_arena(static_cast<BaseT*>(this)));
+}
+
+template <class BaseT>
+t2t2_payload t2t2_message_base<BaseT> :: get_payload(void)
+{
+    t2t2_payload  ret;
+    ret.len = __payload_len;
+    ret.data = NULL;
+    if (ret.len > 0)
+        ret.data = ((uint8_t*) static_cast<BaseT*>(this)) +
+            __pool->get_payload_offset();
+    return ret;
 }
 
 //////////////////////////////////////////////////////////////////
@@ -3,6 +3,10 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <string.h>
+#include <sstream>
+#include <set>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 using namespace std;
 
@@ -64,6 +68,56 @@ public:
     }
 };
 
+// like my_data, but the bytes follow the object, sized per message.
+class my_packet : public t2t2::t2t2_message_base<my_packet>
+{
+public:
+    // convenience
+    typedef t2t2::t2t2_var_pool<my_packet> pool_t;
+    typedef pxfe_shared_ptr<my_packet> sp_t;
+
+    int port;
+    my_packet(int _port) : port(_port) { }
+};
+
+// carries its bytes by reference, in pooled segments.
+class my_netmsg : public t2t2::t2t2_message_base<my_netmsg>
+{
+public:
+    // convenience
+    typedef t2t2::t2t2_pool<my_netmsg> pool_t;
+    typedef pxfe_shared_ptr<my_netmsg> sp_t;
+
+    t2t2::t2t2_seg_chain<4>  body;
+    my_netmsg(void) { }
+};
+
+// holds its children in its own buffer's arena.
+class my_composite : public t2t2::t2t2_message_base<my_composite>
+{
+public:
+    // convenience
+    typedef t2t2::t2t2_arena_pool<my_composite> pool_t;
+    typedef pxfe_shared_ptr<my_composite> sp_t;
+
+    struct header {
+        int id;
+        char name[16];
+    };
+    // not trivially destructible, so the arena runs its destructor.
+    struct trailer {
+        int id;
+        trailer(int _id) : id(_id) { }
+        ~trailer(void) { printf("destructing arena trailer %d\n", id); }
+    };
+
+    header * hdr;
+    trailer * trl;
+    t2t2::t2t2_arena_vector<int>  values;
+    my_composite(void) : hdr(NULL), trl(NULL), values(get_arena()) { }
+    ~my_composite(void) { printf("destructing my_composite\n"); }
+};
+
 class my_message_derived1 : public my_message_base
 {
 public:
@@ -127,6 +181,24 @@ typedef t2t2::t2t2_pool<my_message_base,
                         my_message_derived1,
                         my_message_derived2> pool1and2_t;
 
+class my_request : public t2t2::t2t2_message_base<my_request>
+{
+public:
+    // convenience
+    typedef t2t2::t2t2_pool<my_request> pool_t;
+    typedef t2t2::t2t2_queue<my_request> queue_t;
+    typedef pxfe_shared_ptr<my_request> sp_t;
+
+    // required by t2t2_rpc_client: the replies are my_message_base.
+    t2t2::t2t2_reply_token<my_message_base>  reply_token;
+
+    // test hack: value==-1 tells the server to exit.
+    int value;
+    int delay_ms;
+    my_request(int _value, int _delay_ms)
+        : value(_value), delay_ms(_delay_ms) { }
+};
+
 template <class BaseT, class... derivedTs>
 void printstats(t2t2::t2t2_pool<BaseT,derivedTs...> *pool,
                 const char *what)
@@ -148,6 +220,43 @@ my_t2t2_assert_handler(t2t2::t2t2_error_t e, bool fatal,
 }
 
 void *reader_thread(void *arg);
+void deadline_queue_test(pool1and2_t *pool);
+void conflating_queue_test(pool1and2_t *pool);
+void topic_test(pool1and2_t *pool);
+void rpc_test(pool1and2_t *pool);
+void dispatcher_test(my_message_derived1::pool1_t *pool1,
+                     my_message_derived2::pool2_t *pool2,
+                     pool1and2_t *pool1and2);
+void unique_msg_test(pool1and2_t *pool);
+void shared_ptr_test(pool1and2_t *pool);
+void emplace_test(pool1and2_t *pool);
+void queue_stats_test(pool1and2_t *pool);
+void queue_set_remove_test(pool1and2_t *pool);
+void histogram_test(void);
+void reclaim_test(pool1and2_t *pool);
+void arena_test(void);
+void fair_handoff_test(void);
+void quota_test(void);
+void var_pool_test(void);
+void pool_stats_stress_test(void);
+#ifdef T2T2_LOCK_PROFILING
+void lock_profile_test(void);
+#endif
+#ifdef T2T2_TRACING
+void trace_test(void);
+#endif
+void segment_test(void);
+void metrics_test(void);
+void watchdog_test(void);
+#ifdef T2T2_RT_AUDIT
+void rt_audit_test(void);
+#endif
+#ifdef T2T2_LEAK_TRACKING
+void leak_test(void);
+#endif
+#ifdef T2T2_ENABLE_COROUTINES
+void coroutine_test(void);
+#endif
 
 int main(int argc, char ** argv)
 {
@@ -275,11 +384,53 @@ int main(int argc, char ** argv)
     // we can shut down gracefully.
     pthread_join(id, NULL);
 
+    t2t2::t2t2_queue_stats  qstats;
+    qset.get_stats(qstats);
+    cout << "qset stats: " << qstats << endl;
+
     printstats(&mypool1, "1");
     printstats(&mypool2, "2");
     printstats(&mypool1and2, "1and2");
     printstats(&datapool, "data");
 
+    deadline_queue_test(&mypool1and2);
+    conflating_queue_test(&mypool1and2);
+    topic_test(&mypool1and2);
+    rpc_test(&mypool1and2);
+    dispatcher_test(&mypool1, &mypool2, &mypool1and2);
+    unique_msg_test(&mypool1and2);
+    shared_ptr_test(&mypool1and2);
+    emplace_test(&mypool1and2);
+    queue_stats_test(&mypool1and2);
+    queue_set_remove_test(&mypool1and2);
+    histogram_test();
+    reclaim_test(&mypool1and2);
+    arena_test();
+    fair_handoff_test();
+    quota_test();
+    var_pool_test();
+    pool_stats_stress_test();
+#ifdef T2T2_LOCK_PROFILING
+    lock_profile_test();
+#endif
+#ifdef T2T2_TRACING
+    trace_test();
+#endif
+    segment_test();
+    metrics_test();
+    watchdog_test();
+#ifdef T2T2_RT_AUDIT
+    rt_audit_test();
+#endif
+#ifdef T2T2_LEAK_TRACKING
+    leak_test();
+#endif
+#ifdef T2T2_ENABLE_COROUTINES
+    coroutine_test();
+#endif
+
+    printstats(&mypool1and2, "1and2");
+
     return 0;
 }
 
@@ -349,3 +500,1584 @@ void *reader_thread(void *arg)
 
     return NULL;
 }
+
+// returns milliseconds since 'start'. this depends on timing, so
+// it's only compared against deadlines, never printed.
+static int elapsed_ms(const timespec &start)
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000 +
+        (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+static const char *due_str(const timespec &start, int delay_ms)
+{
+    return elapsed_ms(start) >= delay_ms ? "when due" : "EARLY";
+}
+
+void deadline_queue_test(pool1and2_t *pool)
+{
+    pthread_condattr_t   cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+
+    t2t2::t2t2_deadline_queue<my_message_base>  dq(NULL, &cattr);
+    my_message_base::queue_t                     fq(NULL, &cattr);
+    my_message_base::queue_set_t               dqset(NULL, &cattr);
+
+    pthread_condattr_destroy(&cattr);
+
+    printf("\nnow testing deadline queue:\n");
+
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // enqueue out of order; they should come out sorted by
+    // deadline, and not before they're due.
+    int delays[] = { 300, 100, 200 };
+    for (int ind = 0; ind < 3; ind++)
+    {
+        my_message_base::sp_t  spmb;
+        if (pool->alloc(&spmb, t2t2::T2T2_GROW, ind, delays[ind]))
+            dq.enqueue_in(spmb, delays[ind]);
+    }
+
+    my_message_base::sp_t  mb;
+    mb = dq.dequeue(t2t2::T2T2_NO_WAIT);
+    printf("DEADLINE immediate dequeue got %s\n", mb ? "MSG" : "NULL");
+
+    while ((mb = dq.dequeue(1000)))
+        printf("DEADLINE got a=%d delay=%d %s\n",
+               mb->a, mb->b, due_str(start, mb->b));
+
+    // jittered deadlines, all already due, with some repeats: they
+    // have to come out sorted, and repeats in the order enqueued.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const int NUM_JITTER = 64;
+    for (int ind = 0; ind < NUM_JITTER; ind++)
+    {
+        int offset_ms = (ind * 37) % 23;
+        timespec  at = start;
+        at.tv_sec -= 1;
+        at.tv_nsec += offset_ms * 1000000;
+        if (at.tv_nsec >= 1000000000)
+        {
+            at.tv_sec ++;
+            at.tv_nsec -= 1000000000;
+        }
+        my_message_base::sp_t  spmb;
+        if (pool->alloc(&spmb, t2t2::T2T2_GROW, ind, offset_ms))
+            dq.enqueue(spmb, at);
+    }
+    int got = 0, bad = 0, last_offset = -1, last_ind = -1;
+    while ((mb = dq.dequeue(t2t2::T2T2_NO_WAIT)))
+    {
+        if (mb->b < last_offset ||
+            (mb->b == last_offset && mb->a < last_ind))
+            bad ++;
+        last_offset = mb->b;
+        last_ind = mb->a;
+        got ++;
+    }
+    printf("DEADLINE jittered: got %d of %d, %d out of order\n",
+           got, NUM_JITTER, bad);
+
+    // now put it in a set with a fifo queue, and check that the
+    // set wakes up for the deadline even though nothing else
+    // was enqueued.
+    dqset.add_queue(&dq, 1);
+    dqset.add_queue(&fq, 2);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (pool->alloc(&mb, t2t2::T2T2_GROW, 10, 150))
+        dq.enqueue_in(mb, 150);
+    if (pool->alloc(&mb, t2t2::T2T2_GROW, 11, 0))
+        fq.enqueue(mb);
+
+    int qid = -1;
+    while ((mb = dqset.dequeue(1000, &qid)))
+        printf("DEADLINE SET got a=%d on queue %d %s\n",
+               mb->a, qid, due_str(start, mb->b));
+    printf("DEADLINE SET timed out %s\n",
+           elapsed_ms(start) >= 1000 ? "after waiting" : "EARLY");
+}
+
+void conflating_queue_test(pool1and2_t *pool)
+{
+    t2t2::t2t2_conflating_queue<my_message_base>  cq(16, NULL, NULL);
+
+    printf("\nnow testing conflating queue:\n");
+
+    // keys 1,2,1,3,2: should dequeue as key 1 (second value),
+    // key 2 (second value), key 3, and two stale messages
+    // should be released back to the pool at enqueue time.
+    int keys[] = { 1, 2, 1, 3, 2 };
+    for (int ind = 0; ind < 5; ind++)
+    {
+        my_message_base::sp_t  spmb;
+        if (pool->alloc(&spmb, t2t2::T2T2_GROW, keys[ind], ind))
+        {
+            printf("CONFLATE enqueue key %d value %d\n", keys[ind], ind);
+            cq.enqueue(spmb, keys[ind]);
+        }
+    }
+
+    printstats(pool, "1and2");
+
+    my_message_base::sp_t  mb;
+    while ((mb = cq.dequeue(t2t2::T2T2_NO_WAIT)))
+        printf("CONFLATE got key %d value %d\n", mb->a, mb->b);
+
+    t2t2::t2t2_conflate_stats  stats;
+    cq.get_stats(stats);
+    cout << "CONFLATE stats: " << stats << endl;
+}
+
+struct topic_publisher_args {
+    t2t2::t2t2_topic<my_message_base> * topic;
+    pool1and2_t * pool;
+    int delivered;
+};
+
+static void *topic_publisher(void *arg)
+{
+    topic_publisher_args * a = (topic_publisher_args *) arg;
+    my_message_base::sp_t  spmb;
+    if (a->pool->alloc(&spmb, t2t2::T2T2_GROW, 26, 27))
+        a->delivered = a->topic->publish(spmb, t2t2::T2T2_WAIT_FOREVER);
+    return NULL;
+}
+
+void topic_test(pool1and2_t *pool)
+{
+    t2t2::t2t2_topic<my_message_base>       topic(NULL);
+    t2t2::t2t2_subscriber<my_message_base>  sub1(4, NULL, NULL);
+    t2t2::t2t2_subscriber<my_message_base>  sub2(4, NULL, NULL);
+
+    printf("\nnow testing topic:\n");
+
+    topic.subscribe(&sub1);
+    topic.subscribe(&sub2);
+
+    my_message_base::sp_t  spmb;
+    if (pool->alloc(&spmb, t2t2::T2T2_GROW, 20, 21))
+        printf("TOPIC published to %d subscribers\n",
+               topic.publish(spmb, t2t2::T2T2_NO_WAIT));
+
+    // there is only one copy of the message, held by both subscribers.
+    printstats(pool, "1and2");
+
+    my_message_base::sp_t  m1 = sub1.dequeue(t2t2::T2T2_NO_WAIT);
+    my_message_base::sp_t  m2 = sub2.dequeue(t2t2::T2T2_NO_WAIT);
+    if (m1 && m2)
+        printf("TOPIC sub1 got a=%d, sub2 got a=%d, %s, use_count %d\n",
+               m1->a, m2->a,
+               (m1.get() == m2.get()) ? "same message" : "DIFFERENT",
+               m1->use_count());
+    m1.reset();
+    printf("TOPIC sub1 released it\n");
+    m2.reset();
+    printf("TOPIC sub2 released it\n");
+
+    topic.unsubscribe(&sub2);
+    if (pool->alloc(&spmb, t2t2::T2T2_GROW, 22, 23))
+        printf("TOPIC published to %d subscribers\n",
+               topic.publish(spmb, t2t2::T2T2_NO_WAIT));
+    printf("TOPIC sub2 %s\n",
+           sub2.dequeue(t2t2::T2T2_NO_WAIT) ? "GOT A MESSAGE" : "got nothing");
+    // sub1 still has the message pending; its destructor releases it.
+    topic.unsubscribe(&sub1);
+
+    // a publisher stuck waiting forever on a full subscriber must
+    // not hold up unsubscribing it.
+    t2t2::t2t2_subscriber<my_message_base>  sub3(1, NULL, NULL);
+    topic.subscribe(&sub3);
+    if (pool->alloc(&spmb, t2t2::T2T2_GROW, 24, 25))
+        topic.publish(spmb, t2t2::T2T2_NO_WAIT);
+    topic_publisher_args  args = { &topic, pool, -1 };
+    pthread_t  id;
+    pthread_create(&id, NULL, &topic_publisher, &args);
+    usleep(50000);
+    printf("TOPIC unsubscribing a full subscriber\n");
+    topic.unsubscribe(&sub3);
+    pthread_join(id, NULL);
+    printf("TOPIC blocked publisher gave up, delivered to %d\n",
+           args.delivered);
+}
+
+struct rpc_server_args {
+    my_request::queue_t * q;
+    pool1and2_t * pool;
+};
+
+void *rpc_server_thread(void *arg)
+{
+    rpc_server_args * a = (rpc_server_args *) arg;
+    while (1)
+    {
+        my_request::sp_t  req = a->q->dequeue(t2t2::T2T2_WAIT_FOREVER);
+        if (req->value == -1)
+            break;
+        if (req->delay_ms > 0)
+            usleep(req->delay_ms * 1000);
+        my_message_base::sp_t  rep;
+        if (a->pool->alloc(&rep, t2t2::T2T2_GROW, req->value, 0))
+            printf("RPC SERVER reply to %d %s\n", req->value,
+                   req->reply_token.reply(rep) ? "delivered" : "DISCARDED");
+    }
+    return NULL;
+}
+
+static void rpc_callback(my_message_base::sp_t &reply, void *arg)
+{
+    if (reply)
+        printf("RPC CALLBACK %s got reply %d\n", (char*) arg, reply->a);
+    else
+        printf("RPC CALLBACK %s timed out\n", (char*) arg);
+}
+
+void rpc_test(pool1and2_t *pool)
+{
+    my_request::pool_t                       reqpool(4, 1, NULL, NULL);
+    my_request::queue_t                      reqq(NULL, NULL);
+    t2t2::t2t2_rpc_client<my_message_base>   client(4, NULL, NULL);
+
+    printf("\nnow testing rpc:\n");
+
+    rpc_server_args  args;
+    args.q = &reqq;
+    args.pool = pool;
+    pthread_t id;
+    pthread_create(&id, NULL, &rpc_server_thread, &args);
+
+    my_request::sp_t  req;
+    my_message_base::sp_t  rep;
+
+    if (reqpool.alloc(&req, t2t2::T2T2_NO_WAIT, 30, 0))
+    {
+        rep = client.call(&reqq, req, 1000);
+        printf("RPC call 30 got %s %d\n", rep ? "reply" : "NOTHING",
+               rep ? rep->a : -1);
+        rep.reset();
+    }
+
+    // the server takes longer than we'll wait; the late reply
+    // should be discarded back to the pool.
+    if (reqpool.alloc(&req, t2t2::T2T2_NO_WAIT, 31, 200))
+    {
+        rep = client.call(&reqq, req, 50);
+        printf("RPC call 31 got %s\n", rep ? "A REPLY" : "timeout");
+    }
+    usleep(300000);
+
+    if (reqpool.alloc(&req, t2t2::T2T2_NO_WAIT, 32, 0))
+        client.call_async(&reqq, req, 1000,
+                          &rpc_callback, (void*) "call 32");
+    usleep(100000);
+
+    // this one expires before the server gets to it.
+    if (reqpool.alloc(&req, t2t2::T2T2_NO_WAIT, 33, 0))
+    {
+        // keep the server busy with a slow one first.
+        my_request::sp_t  slow;
+        if (reqpool.alloc(&slow, t2t2::T2T2_NO_WAIT, 34, 200))
+            client.call_async(&reqq, slow, -1,
+                              &rpc_callback, (void*) "call 34");
+        client.call_async(&reqq, req, 50, &rpc_callback, (void*) "call 33");
+    }
+    usleep(100000);
+    printf("RPC expired %d calls\n", client.expire());
+    usleep(300000);
+
+    if (reqpool.alloc(&req, t2t2::T2T2_NO_WAIT, -1, 0))
+        reqq.enqueue(req);
+    pthread_join(id, NULL);
+
+    t2t2::t2t2_rpc_stats  stats;
+    client.get_stats(stats);
+    cout << "RPC stats: " << stats << endl;
+    printstats(pool, "1and2");
+}
+
+struct my_handler
+{
+    void operator()(my_message_base &m)
+    {
+        printf("DISPATCH my_message_base a=%d\n", m.a);
+    }
+    void operator()(my_message_derived1 &m)
+    {
+        printf("DISPATCH my_message_derived1 a=%d c=%d\n", m.a, m.c);
+    }
+    void operator()(my_message_derived2 &m)
+    {
+        printf("DISPATCH my_message_derived2 a=%d e=%d\n", m.a, m.e);
+    }
+};
+
+void dispatcher_test(my_message_derived1::pool1_t *pool1,
+                     my_message_derived2::pool2_t *pool2,
+                     pool1and2_t *pool1and2)
+{
+    typedef t2t2::t2t2_dispatcher<my_message_base,
+                                  my_message_derived1,
+                                  my_message_derived2> dispatcher_t;
+    my_message_base::queue_t  q(NULL, NULL);
+    my_handler  handler;
+
+    printf("\nnow testing dispatcher:\n");
+
+    my_message_base::sp_t      spmb;
+    my_message_derived1::sp_t  spmd1;
+    my_message_derived2::sp_t  spmd2;
+
+    if (pool1and2->alloc(&spmb, t2t2::T2T2_GROW, 40, 0))
+        q.enqueue(spmb);
+    if (pool1and2->alloc(&spmd1, t2t2::T2T2_GROW, 41, 0, 1, 0))
+        q.enqueue(spmd1);
+    if (pool1and2->alloc(&spmd2, t2t2::T2T2_GROW, 42, 0, 2, 0, 0))
+        q.enqueue(spmd2);
+    // these two pools have a different type list than the
+    // dispatcher, but should still be routed correctly.
+    if (pool1->alloc(&spmd1, t2t2::T2T2_GROW, 43, 0, 3, 0))
+        q.enqueue(spmd1);
+    if (pool2->alloc(&spmd2, t2t2::T2T2_GROW, 44, 0, 4, 0, 0))
+        q.enqueue(spmd2);
+
+    my_message_base::sp_t  mb;
+    while ((mb = q.dequeue(t2t2::T2T2_NO_WAIT)))
+        dispatcher_t::dispatch(handler, mb);
+}
+
+void unique_msg_test(pool1and2_t *pool)
+{
+    typedef t2t2::t2t2_unique_msg<my_message_base> umb_t;
+    typedef t2t2::t2t2_unique_msg<my_message_derived1> umd1_t;
+    my_message_base::queue_t  q(NULL, NULL);
+
+    printf("\nnow testing unique_msg:\n");
+
+    umd1_t  md1;
+    if (pool->alloc(&md1, t2t2::T2T2_GROW, 60, 0, 1, 0))
+        q.enqueue(std::move(md1));
+    printf("UNIQUE after enqueue, md1 is %s\n", md1 ? "NOT EMPTY" : "empty");
+
+    umb_t  mb = q.dequeue_unique(t2t2::T2T2_NO_WAIT);
+    if (mb)
+        printf("UNIQUE dequeued a=%d use_count %d\n",
+               mb->a, mb->use_count());
+
+    umd1_t  d1 = mb.cast<my_message_derived1>();
+    printf("UNIQUE cast to derived1 %s, c=%d, mb is %s\n",
+           d1 ? "worked" : "FAILED", d1 ? d1->c : -1,
+           mb ? "NOT EMPTY" : "empty");
+
+    // share it for a while, then take it back once it's unique again.
+    my_message_derived1::sp_t  sp1 = d1.share();
+    my_message_derived1::sp_t  sp2 = sp1;
+    umd1_t  back(std::move(sp1));
+    printf("UNIQUE back from shared (use_count 2): %s\n",
+           back ? "GOT IT" : "refused");
+    sp2.reset();
+    umd1_t  back2(std::move(sp1));
+    printf("UNIQUE back from shared (use_count 1): %s\n",
+           back2 ? "got it" : "REFUSED");
+
+    // back to the pool, without any atomic decrement.
+    back2.reset();
+    printstats(pool, "1and2");
+}
+
+void shared_ptr_test(pool1and2_t *pool)
+{
+    my_message_base::queue_t  q(NULL, NULL);
+
+    printf("\nnow testing shared_ptr:\n");
+
+    my_message_derived2::sp_t  md2 =
+        pool->alloc<my_message_derived2>(t2t2::T2T2_GROW, 70, 0, 1, 2, 3);
+    if (!md2)
+        return;
+    my_message_derived2::sp_t  copy = md2;     // same type
+    my_message_base::sp_t      base = md2;     // upcast, static
+    my_message_derived1::sp_t  wrong = base;   // downcast, dynamic, fails
+    my_message_derived2::sp_t  right = base;   // downcast, dynamic, works
+    printf("SHARED use_count %d, wrong is %s, right is %s\n",
+           md2->use_count(), wrong ? "NOT EMPTY" : "empty",
+           right ? "ok" : "EMPTY");
+    copy = copy;
+    right.reset(right.get());
+    printf("SHARED use_count after self-assignments %d\n", md2->use_count());
+    copy.reset();
+    base.reset();
+    right.reset();
+
+    q.enqueue(std::move(md2));
+    printf("SHARED after enqueue(&&), md2 is %s\n",
+           md2 ? "NOT EMPTY" : "empty");
+    my_message_base::sp_t  mb = q.dequeue(t2t2::T2T2_NO_WAIT);
+    if (mb)
+        printf("SHARED dequeued a=%d use_count %d\n",
+               mb->a, mb->use_count());
+}
+
+void emplace_test(pool1and2_t *pool)
+{
+    my_message_base::queue_t  q(NULL, NULL);
+
+    printf("\nnow testing emplace:\n");
+
+    if (!q.emplace<my_message_derived1>(pool, t2t2::T2T2_GROW, 1, 2, 3, 4))
+        printf("EMPLACE FAILED\n");
+    int n = q.emplace_n<my_message_base>(pool, 3, t2t2::T2T2_GROW, 5, 6);
+    printf("EMPLACE emplace_n enqueued %d\n", n);
+
+    my_message_base::sp_t  mb;
+    while ((mb = q.dequeue(t2t2::T2T2_NO_WAIT)))
+        printf("EMPLACE dequeued type %d a=%d use_count %d\n",
+               mb->type, mb->a, mb->use_count());
+}
+
+void queue_stats_test(pool1and2_t *pool)
+{
+    my_message_base::queue_t  q(NULL, NULL);
+    t2t2::t2t2_queue_stats    stats;
+
+    printf("\nnow testing queue stats:\n");
+
+    q.emplace_n<my_message_base>(pool, 3, t2t2::T2T2_GROW, 1, 2);
+    q.dequeue(t2t2::T2T2_NO_WAIT);
+    printf("QSTATS depth %d after 3 in and 1 out\n", q.depth());
+    q.dequeue(t2t2::T2T2_NO_WAIT);
+    q.dequeue(t2t2::T2T2_NO_WAIT);
+    if (!q.dequeue(20))
+        printf("QSTATS timed dequeue timed out, as it should\n");
+    q.get_stats(stats);
+    printf("QSTATS depth %d highwater %d enqueues %d dequeues %d "
+           "timeouts %d waited %s\n",
+           stats.depth, stats.high_water, (int) stats.enqueues,
+           (int) stats.dequeues, (int) stats.timeouts,
+           (stats.wait_ns >= 20000000) ? "at least 20ms" : "TOO LITTLE");
+}
+
+struct set_remove_args {
+    pool1and2_t * pool;
+    my_message_base::queue_t * q;
+    static const int COUNT = 5000;
+};
+
+static void *set_remove_producer(void *arg)
+{
+    set_remove_args * a = (set_remove_args *) arg;
+    for (int ind = 0; ind < set_remove_args::COUNT; ind++)
+        a->q->emplace<my_message_base>(a->pool, t2t2::T2T2_GROW, ind, 0);
+    return NULL;
+}
+
+void queue_set_remove_test(pool1and2_t *pool)
+{
+    my_message_base::queue_t  q(NULL, NULL);
+    set_remove_args  args = { pool, &q };
+
+    printf("\nnow testing remove_queue under load:\n");
+
+    // every enqueue may be telling a set about its message just as
+    // that set is removed and destroyed; remove_queue has to wait
+    // for it. (the window is narrow, but asan or tsan may catch it
+    // if it doesn't.)
+    pthread_t  id;
+    pthread_create(&id, NULL, &set_remove_producer, &args);
+    int sets = 0;
+    while (q.depth() < set_remove_args::COUNT)
+    {
+        my_message_base::queue_set_t * qs =
+            new my_message_base::queue_set_t(NULL, NULL);
+        qs->add_queue(&q, 1);
+        sched_yield();
+        qs->remove_queue(&q);
+        delete qs;
+        sets ++;
+    }
+    pthread_join(id, NULL);
+    int got = 0;
+    while (q.dequeue(t2t2::T2T2_NO_WAIT))
+        got ++;
+    printf("QSET dequeued %d of %d after %s sets came and went\n",
+           got, set_remove_args::COUNT, sets > 0 ? "several" : "NO");
+}
+
+void histogram_test(void)
+{
+    pool1and2_t               pool(4, 0, NULL, NULL);
+    my_message_base::queue_t  q(NULL, NULL);
+    t2t2::t2t2_histogram      hist;
+
+    printf("\nnow testing delay and lifetime histograms:\n");
+
+    // bucket edges: exact below 16, then 16 per power of two.
+    printf("HIST buckets %d %d %d %d\n",
+           t2t2::t2t2_histogram::bucket_of(15),
+           t2t2::t2t2_histogram::bucket_of(16),
+           t2t2::t2t2_histogram::bucket_of(33),
+           (int) t2t2::t2t2_histogram::bucket_low(
+               t2t2::t2t2_histogram::bucket_of(1000000)));
+
+    bool delay_on = q.enable_delay_histogram();
+    bool lifetime_on = pool.enable_lifetime_histogram();
+    printf("HIST enabled: delay %d lifetime %d\n", delay_on, lifetime_on);
+    if (!delay_on || !lifetime_on)
+        // built without T2T2_TIMESTAMPS, so there's nothing to record.
+        return;
+    q.emplace_n<my_message_base>(&pool, 3, t2t2::T2T2_NO_WAIT, 1, 2);
+    usleep(10000);
+    while (q.dequeue(t2t2::T2T2_NO_WAIT))
+        ;
+    q.get_delay_histogram(hist, true);
+    printf("HIST delay count %d p50 %s\n", (int) hist.count,
+           (hist.percentile(50) >= 10000000) ? "at least 10ms" : "TOO LOW");
+    cout << "HIST delay: " << hist << endl;
+    q.get_delay_histogram(hist);
+    printf("HIST delay count %d after reset\n", (int) hist.count);
+
+    pool.get_lifetime_histogram(hist);
+    printf("HIST lifetime count %d min %s\n", (int) hist.count,
+           (hist.min_ns >= 10000000) ? "at least 10ms" : "TOO LOW");
+
+    q.enable_delay_histogram(false);
+    q.emplace_n<my_message_base>(&pool, 1, t2t2::T2T2_NO_WAIT, 1, 2);
+    q.dequeue(t2t2::T2T2_NO_WAIT);
+    q.get_delay_histogram(hist);
+    printf("HIST delay count %d while off\n", (int) hist.count);
+}
+
+struct reclaim_consumer_args {
+    my_message_base::queue_t * q;
+    t2t2::t2t2_reclaimer * r;
+    int got;
+};
+
+// drops everything it dequeues, deferring it to a reclaimer whose
+// batch is bigger than the whole pool.
+static void *reclaim_consumer(void *arg)
+{
+    reclaim_consumer_args * a = (reclaim_consumer_args *) arg;
+    a->r->attach();
+    my_message_base::sp_t  m;
+    while ((m = a->q->dequeue(1000)))
+    {
+        a->got ++;
+        m.reset();
+    }
+    a->r->detach();
+    return NULL;
+}
+
+void reclaim_test(pool1and2_t *pool)
+{
+    my_data::pool_t  datapool(2, 1, NULL, NULL);
+
+    printf("\nnow testing reclaimer (no thread):\n");
+    {
+        t2t2::t2t2_reclaimer  r(4, false);
+        r.attach();
+        for (int ind = 0; ind < 2; ind++)
+        {
+            my_message_derived1::sp_t  m;
+            pool->alloc(&m, t2t2::T2T2_GROW, ind, 0, 0, 0);
+            datapool.alloc(&m->data, t2t2::T2T2_NO_WAIT);
+        }
+        t2t2::t2t2_pool_stats  pstats;
+        datapool.get_stats(pstats);
+        printf("RECLAIM dropped 2, data inuse %d; flushing\n",
+               pstats.buffers_in_use);
+        r.flush();
+        datapool.get_stats(pstats);
+        printf("RECLAIM after flush, data inuse %d\n",
+               pstats.buffers_in_use);
+        r.detach();
+        t2t2::t2t2_reclaim_stats  stats;
+        r.get_stats(stats);
+        cout << "RECLAIM stats: " << stats << endl;
+    }
+
+    printf("\nnow testing reclaimer (thread):\n");
+    {
+        t2t2::t2t2_reclaimer  r(4);
+        r.attach();
+        my_message_base::queue_t  q(NULL, NULL);
+        q.emplace_n<my_message_base>(pool, 6, t2t2::T2T2_GROW, 7, 8);
+        // the 4th drop hands 4 to the thread, detach hands over 2.
+        while (q.dequeue(t2t2::T2T2_NO_WAIT))
+            ;
+        r.detach();
+        // the destructor waits for the thread to finish.
+    }
+
+    printf("\nnow testing reclaimer (pool smaller than a batch):\n");
+    {
+        pool1and2_t  small(4, 0, NULL, NULL);
+        my_message_base::queue_t  q(NULL, NULL);
+        t2t2::t2t2_reclaimer  r(64);
+        reclaim_consumer_args  args = { &q, &r, 0 };
+        pthread_t  id;
+        pthread_create(&id, NULL, &reclaim_consumer, &args);
+        // the consumer flushes before it blocks, or this runs dry.
+        int sent = 0;
+        for (int ind = 0; ind < 16; ind++)
+            if (q.emplace<my_message_base>(&small, 1000, ind, 0))
+                sent ++;
+        pthread_join(id, NULL);
+        r.sync();
+        t2t2::t2t2_pool_stats  pstats;
+        small.get_stats(pstats);
+        printf("RECLAIM small pool: sent %d, got %d, inuse %d\n",
+               sent, args.got, pstats.buffers_in_use);
+    }
+    printstats(pool, "RECLAIM 1and2");
+}
+
+void arena_test(void)
+{
+    my_composite::pool_t  pool(256, 1, 1, NULL, NULL);
+    my_composite::sp_t    m;
+
+    printf("\nnow testing arena:\n");
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        pool.alloc(&m, t2t2::T2T2_NO_WAIT);
+        if (!m)
+        {
+            printf("ARENA ALLOC FAILED\n");
+            return;
+        }
+        t2t2::t2t2_arena  a = m->get_arena();
+        printf("ARENA pass %d: used %d of %d\n",
+               pass, (int) a.used(), (int) a.capacity());
+        m->hdr = a.make<my_composite::header>();
+        m->hdr->id = pass;
+        strcpy(m->hdr->name, "composite");
+        m->trl = a.make<my_composite::trailer>(pass);
+        for (int ind = 0; ind < 10; ind++)
+            m->values.push_back(ind * ind);
+        int sum = 0;
+        for (int v : m->values)
+            sum += v;
+        printf("ARENA %s %d: %d values sum %d cap %d, used %d\n",
+               m->hdr->name, m->hdr->id, (int) m->values.size(), sum,
+               (int) m->values.capacity(), (int) a.used());
+        // a count whose byte size wraps around is simply too big.
+        if (a.make_array<uint64_t>(SIZE_MAX / 4) != NULL)
+            printf("ARENA HUGE ARRAY SUCCEEDED\n");
+        int n = 0;
+        while (a.make_array<char>(16) != NULL)
+            n++;
+        printf("ARENA filled with %d more, used %d\n",
+               n, (int) a.used());
+        m.reset();
+    }
+}
+
+struct fair_waiter_args {
+    my_data::pool_t * pool;
+    const char * name;
+};
+
+static void *fair_waiter(void *arg)
+{
+    fair_waiter_args * a = (fair_waiter_args *) arg;
+    my_data::sp_t  d;
+    if (a->pool->alloc(&d, t2t2::T2T2_WAIT_FOREVER))
+    {
+        printf("FAIR %s got the buffer\n", a->name);
+        usleep(20000);
+    }
+    return NULL;
+}
+
+void fair_handoff_test(void)
+{
+    my_data::pool_t  pool(1, 1, NULL, NULL);
+    pool.set_fair_handoff(true);
+    my_data::sp_t    held;
+
+    printf("\nnow testing fair handoff:\n");
+
+    pool.alloc(&held, t2t2::T2T2_NO_WAIT);
+    my_data::sp_t    none;
+    if (!pool.alloc(&none, 10))
+        printf("FAIR timed alloc failed, as it should\n");
+
+    // A starts waiting first, so it must get the buffer first.
+    fair_waiter_args  a = { &pool, "A" }, b = { &pool, "B" };
+    pthread_t  ida, idb;
+    pthread_create(&ida, NULL, &fair_waiter, &a);
+    usleep(20000);
+    pthread_create(&idb, NULL, &fair_waiter, &b);
+    usleep(20000);
+    printf("FAIR releasing\n");
+    held.reset();
+    pthread_join(ida, NULL);
+    pthread_join(idb, NULL);
+    printstats(&pool, "FAIR");
+}
+
+static void *quota_waiter(void *arg)
+{
+    my_data::pool_t * pool = (my_data::pool_t *) arg;
+    my_data::sp_t  d = pool->alloc_prio<my_data>(1000, 0);
+    printf("QUOTA bulk waiter %s\n", d ? "got a buffer" : "FAILED");
+    return NULL;
+}
+
+static void quota_assert_handler(t2t2::t2t2_error_t e, bool fatal,
+                                 const char * /*filename*/,
+                                 int /*lineno*/)
+{
+    printf("QUOTA assert %s, %s\n", t2t2::t2t2_error_types[(int)e],
+           fatal ? "FATAL" : "not fatal");
+}
+
+void quota_test(void)
+{
+    // class 0 is bulk data with no reserve, class 1 is control
+    // with 2 reserved; the other 4 are shared.
+    my_data::pool_t  pool(6, 1, NULL, NULL);
+    const int  reserved[2] = { 0, 2 };
+
+    printf("\nnow testing quotas:\n");
+
+    {
+        // with a buffer out, its release couldn't be uncharged.
+        my_data::sp_t  early = pool.alloc<my_data>(t2t2::T2T2_NO_WAIT);
+        printf("QUOTA set with a buffer out: %s\n",
+               pool.set_class_quotas(2, reserved) ? "ACCEPTED" : "refused");
+    }
+    if (!pool.set_class_quotas(2, reserved))
+    {
+        printf("QUOTA set_class_quotas FAILED\n");
+        return;
+    }
+
+    // the bulk flood takes the whole shared region and no more.
+    my_data::sp_t  bulk[6];
+    int got = 0;
+    for (int ind = 0; ind < 6; ind++)
+    {
+        bulk[ind] = pool.alloc_prio<my_data>(t2t2::T2T2_NO_WAIT, 0);
+        if (bulk[ind])
+            got ++;
+    }
+    printf("QUOTA bulk got %d of 6\n", got);
+
+    // control still gets its reserve without waiting.
+    my_data::sp_t  ctl1 = pool.alloc_prio<my_data>(t2t2::T2T2_NO_WAIT, 1);
+    my_data::sp_t  ctl2 = pool.alloc_prio<my_data>(t2t2::T2T2_NO_WAIT, 1);
+    my_data::sp_t  ctl3 = pool.alloc_prio<my_data>(t2t2::T2T2_NO_WAIT, 1);
+    printf("QUOTA control got %d %d %d\n",
+           (bool) ctl1, (bool) ctl2, (bool) ctl3);
+
+    // a bulk waiter isn't woken by control's reserve coming back,
+    // only by a shared buffer.
+    pthread_t  id;
+    pthread_create(&id, NULL, &quota_waiter, &pool);
+    usleep(20000);
+    ctl1.reset();
+    usleep(20000);
+    printf("QUOTA releasing a bulk buffer\n");
+    bulk[0].reset();
+    pthread_join(id, NULL);
+
+    for (int cls = 0; cls < 2; cls++)
+    {
+        t2t2::t2t2_pool_class_stats  stats;
+        pool.get_class_stats(cls, stats);
+        cout << "QUOTA class " << cls << ": " << stats << endl;
+    }
+
+    // a double free is refused, and must not give class 1's quota
+    // back a second time. (operator delete directly, so the
+    // destructor doesn't run twice.)
+    my_data * raw = ctl2.get();
+    ctl2.reset();
+    t2t2::t2t2_pool_class_stats  before, after;
+    pool.get_class_stats(1, before);
+    t2t2::t2t2_assert_handler_t  save = t2t2::t2t2_assert_handler;
+    t2t2::t2t2_assert_handler = &quota_assert_handler;
+    my_data::operator delete(raw);
+    t2t2::t2t2_assert_handler = save;
+    pool.get_class_stats(1, after);
+    printf("QUOTA double free: class 1 in_use %d -> %d\n",
+           before.in_use, after.in_use);
+}
+
+void var_pool_test(void)
+{
+    // payload buckets of 64, 128, 256, 512, 1024, 2048.
+    my_packet::pool_t  pool(64, 2000, 2, 1, NULL, NULL);
+    my_packet::sp_t    small, medium, big;
+
+    printf("\nnow testing var_pool:\n");
+
+    pool.alloc_var(&small, t2t2::T2T2_NO_WAIT, 60, 1);
+    pool.alloc_var(&medium, t2t2::T2T2_NO_WAIT, 200, 2);
+    pool.alloc_var(&big, t2t2::T2T2_NO_WAIT, 1500, 3);
+    if (!small || !medium || !big)
+    {
+        printf("VAR ALLOC FAILED\n");
+        return;
+    }
+    t2t2::t2t2_payload  p = small->get_payload();
+    memset(p.data, 'x', p.len);
+    printf("VAR small port %d payload len %d, starts %d bytes in\n",
+           small->port, (int) p.len,
+           (int) (p.data - (uint8_t*) small.get()));
+    printf("VAR medium len %d, big len %d\n",
+           (int) medium->get_payload().len, (int) big->get_payload().len);
+
+    for (int bucket = 0; bucket < pool.get_num_buckets(); bucket++)
+    {
+        t2t2::t2t2_pool_stats  stats;
+        pool.get_stats(bucket, stats);
+        if (stats.buffers_in_use > 0)
+            cout << "bucket " << bucket << ": " << stats << endl;
+    }
+}
+
+struct stress_args {
+    my_packet::pool_t * pool;
+    pthread_barrier_t * done;    // everyone is holding HOLD
+    pthread_barrier_t * checked; // main has looked, drop them
+    int  seed;
+    // ground truth, counted by each thread.
+    int  fails;
+    uint64_t  held_bytes;
+    static const int ITERATIONS = 20000;
+    static const int HOLD = 3;
+};
+
+static void *stress_thread(void *arg)
+{
+    stress_args * a = (stress_args *) arg;
+    my_packet::sp_t  held[stress_args::HOLD];
+    int lens[stress_args::HOLD] = { 0 };
+    a->fails = 0;
+    for (int ind = 0; ind < stress_args::ITERATIONS; ind++)
+    {
+        int slot = ind % stress_args::HOLD;
+        int len = 1 + (ind * 7 + a->seed) % 64;
+        held[slot].reset();
+        // grow now and then, and for the last few, so each
+        // thread ends up holding HOLD.
+        bool grow = (ind % 1000) == 999 ||
+            ind >= stress_args::ITERATIONS - stress_args::HOLD;
+        if (a->pool->alloc_var(&held[slot], grow ? t2t2::T2T2_GROW :
+                               t2t2::T2T2_NO_WAIT, len, ind))
+            lens[slot] = len;
+        else
+            a->fails ++;
+    }
+    a->held_bytes = 0;
+    for (int slot = 0; slot < stress_args::HOLD; slot++)
+        if (held[slot])
+            a->held_bytes += lens[slot];
+    pthread_barrier_wait(a->done);
+    pthread_barrier_wait(a->checked);
+    return NULL;
+}
+
+void pool_stats_stress_test(void)
+{
+    const int threads = 4;
+    // one bucket, 8 buffers to start, growing 4 at a time.
+    my_packet::pool_t  pool(64, 64, 8, 4, NULL, NULL);
+    pthread_barrier_t  done, checked;
+    stress_args        args[threads];
+    pthread_t          ids[threads];
+    t2t2::t2t2_pool_stats  stats;
+
+    printf("\nnow testing pool stats under contention:\n");
+
+    pthread_barrier_init(&done, NULL, threads + 1);
+    pthread_barrier_init(&checked, NULL, threads + 1);
+    for (int ind = 0; ind < threads; ind++)
+    {
+        args[ind].pool = &pool;
+        args[ind].done = &done;
+        args[ind].checked = &checked;
+        args[ind].seed = ind;
+        pthread_create(&ids[ind], NULL, &stress_thread, &args[ind]);
+    }
+    // snapshots taken while they run must always be plausible.
+    int bad = 0, polls = 0;
+    for (int ind = 0; ind < 200; ind++)
+    {
+        pool.get_stats(0, stats);
+        polls ++;
+        if (stats.buffers_in_use < 0 ||
+            stats.buffers_in_use > stats.total_buffers ||
+            stats.payload_bytes_in_use >
+                (uint64_t) stats.buffers_in_use * 64)
+            bad ++;
+        usleep(100);
+    }
+    pthread_barrier_wait(&done);
+
+    int fails = 0;
+    uint64_t held_bytes = 0;
+    for (int ind = 0; ind < threads; ind++)
+    {
+        fails += args[ind].fails;
+        held_bytes += args[ind].held_bytes;
+    }
+    pool.get_stats(0, stats);
+    printf("STRESS %d of %d snapshots while running were implausible\n",
+           bad, polls);
+    printf("STRESS inuse %s, payload bytes %s, allocfails %s, "
+           "total %s\n",
+           (stats.buffers_in_use == threads * stress_args::HOLD) ?
+               "ok" : "WRONG",
+           (stats.payload_bytes_in_use == held_bytes) ? "ok" : "WRONG",
+           (stats.alloc_fails == fails) ? "ok" : "WRONG",
+           (stats.total_buffers == 8 + 4 * stats.grows) ? "ok" : "WRONG");
+    pthread_barrier_wait(&checked);
+    for (int ind = 0; ind < threads; ind++)
+        pthread_join(ids[ind], NULL);
+    pthread_barrier_destroy(&done);
+    pthread_barrier_destroy(&checked);
+
+    pool.get_stats(0, stats);
+    printf("STRESS after all dropped: inuse %d payload bytes %d\n",
+           stats.buffers_in_use, (int) stats.payload_bytes_in_use);
+}
+
+#ifdef T2T2_LOCK_PROFILING
+struct lock_profile_args {
+    my_netmsg::pool_t * pool;
+    t2t2::t2t2_queue<my_netmsg> * q;
+    static const int COUNT = 10000;
+};
+
+static void *lock_profile_producer(void *arg)
+{
+    lock_profile_args * a = (lock_profile_args *) arg;
+    for (int ind = 0; ind < lock_profile_args::COUNT; ind++)
+        a->q->enqueue(a->pool->alloc<my_netmsg>(t2t2::T2T2_WAIT_FOREVER));
+    return NULL;
+}
+
+void lock_profile_test(void)
+{
+    my_netmsg::pool_t   pool(16, 1, NULL, NULL);
+    t2t2::t2t2_queue<my_netmsg>  q(NULL, NULL);
+    lock_profile_args   args;
+    pthread_t           id;
+    t2t2::t2t2_pool_stats   pstats;
+    t2t2::t2t2_queue_stats  qstats;
+
+    printf("\nnow testing lock profiling:\n");
+
+    args.pool = &pool;
+    args.q = &q;
+    pthread_create(&id, NULL, &lock_profile_producer, &args);
+    for (int ind = 0; ind < lock_profile_args::COUNT; ind++)
+        q.dequeue(t2t2::T2T2_WAIT_FOREVER);
+    pthread_join(id, NULL);
+
+    // each message locks the queue at least twice (enqueue and
+    // dequeue) and the pool's free list twice (alloc and release).
+    pool.get_stats(pstats);
+    q.get_stats(qstats);
+    printf("LOCKPROF pool locks %s, queue locks %s, held %s\n",
+           (pstats.lock.acquisitions >= 2 * lock_profile_args::COUNT) ?
+               "ok" : "TOO FEW",
+           (qstats.lock.acquisitions >= 2 * lock_profile_args::COUNT) ?
+               "ok" : "TOO FEW",
+           (qstats.lock.hold_ns > 0 && pstats.lock.hold_ns > 0) ?
+               "ok" : "NEVER");
+    cout << "LOCKPROF pool: " << pstats.lock << endl;
+    cout << "LOCKPROF queue: " << qstats.lock << endl;
+}
+#endif
+
+#ifdef T2T2_TRACING
+struct trace_args {
+    my_netmsg::pool_t * pool;
+    t2t2::t2t2_queue<my_netmsg> * q;
+};
+
+static void *trace_producer(void *arg)
+{
+    trace_args * a = (trace_args *) arg;
+    for (int ind = 0; ind < 3; ind++)
+        a->q->enqueue(a->pool->alloc<my_netmsg>(t2t2::T2T2_WAIT_FOREVER));
+    return NULL;
+}
+
+void trace_test(void)
+{
+    my_netmsg::pool_t   pool(4, 1, NULL, NULL);
+    t2t2::t2t2_queue<my_netmsg>  q(NULL, NULL);
+    trace_args          args;
+    pthread_t           id;
+    std::vector<t2t2::t2t2_trace_record>  records;
+
+    printf("\nnow testing tracing:\n");
+
+    // the pool's own buffers going onto its free list aren't traced.
+    t2t2::t2t2_trace_enable();
+    args.pool = &pool;
+    args.q = &q;
+    pthread_create(&id, NULL, &trace_producer, &args);
+    for (int ind = 0; ind < 3; ind++)
+        q.dequeue(t2t2::T2T2_WAIT_FOREVER);
+    pthread_join(id, NULL);
+    t2t2::t2t2_trace_enable(false);
+
+    t2t2::t2t2_trace_save("0log.trace");
+    t2t2::t2t2_trace_load("0log.trace", records);
+    int counts[5] = { 0 };
+    std::set<uint32_t>  tids;
+    for (auto &r : records)
+    {
+        counts[r.event < 5 ? r.event : 0] ++;
+        tids.insert(r.tid);
+    }
+    printf("TRACE alloc %d enqueue %d dequeue %d release %d, "
+           "%d threads\n",
+           counts[t2t2::T2T2_TRACE_ALLOC], counts[t2t2::T2T2_TRACE_ENQUEUE],
+           counts[t2t2::T2T2_TRACE_DEQUEUE], counts[t2t2::T2T2_TRACE_RELEASE],
+           (int) tids.size());
+    std::ostringstream  json;
+    t2t2::t2t2_trace_write_chrome(records, json);
+    std::string  js = json.str();
+    int flows = 0;
+    for (size_t pos = 0;
+         (pos = js.find("\"ph\":\"f\"", pos)) != std::string::npos; pos++)
+        flows ++;
+    printf("TRACE json %s, %d message flows\n",
+           js.find("{\"traceEvents\":[") == 0 ? "ok" : "BAD", flows);
+}
+#endif
+
+void segment_test(void)
+{
+    t2t2::t2t2_segment_pool  segpool(64, 256, 2, 1, NULL, NULL);
+    my_netmsg::pool_t        msgpool(2, 1, NULL, NULL);
+    pxfe_shared_ptr<t2t2::t2t2_segment>  hdr, data;
+    my_netmsg::sp_t          m1, m2;
+
+    printf("\nnow testing segments:\n");
+
+    segpool.alloc_var(&hdr, t2t2::T2T2_NO_WAIT, 8);
+    segpool.alloc_var(&data, t2t2::T2T2_NO_WAIT, 200);
+    msgpool.alloc(&m1, t2t2::T2T2_NO_WAIT);
+    msgpool.alloc(&m2, t2t2::T2T2_NO_WAIT);
+    if (!hdr || !data || !m1 || !m2)
+    {
+        printf("SEG ALLOC FAILED\n");
+        return;
+    }
+    memcpy(hdr->data(), "HDR:", 4);
+    for (size_t ind = 0; ind < data->size(); ind++)
+        data->data()[ind] = 'a' + (ind % 26);
+
+    m1->body.append(hdr, 0, 4);
+    m1->body.append(data, 0, 10);
+    m1->body.append(data, 100, 6);
+    // m2 shares m1's bytes, minus the header and one more byte.
+    m2->body.append(m1->body, 5, m1->body.length() - 5);
+    printf("SEG m1 len %d segs %d, m2 len %d segs %d, "
+           "data use_count %d\n",
+           (int) m1->body.length(), m1->body.num_segs(),
+           (int) m2->body.length(), m2->body.num_segs(),
+           data->use_count());
+
+    int fds[2];
+    if (pipe(fds) < 0)
+        return;
+    struct iovec iov[4];
+    int niov = m1->body.get_iovec(iov, 4);
+    ssize_t w = writev(fds[1], iov, niov);
+    char buf[64];
+    ssize_t r = read(fds[0], buf, sizeof(buf)-1);
+    buf[r > 0 ? r : 0] = 0;
+    printf("SEG m1 writev %d iovs %d bytes, read back '%s'\n",
+           niov, (int) w, buf);
+    size_t c = m2->body.copy_out(buf, 0, sizeof(buf)-1);
+    buf[c] = 0;
+    printf("SEG m2 copy_out '%s'\n", buf);
+    close(fds[0]);
+    close(fds[1]);
+
+    // as if writev had only taken 6 bytes.
+    m1->body.consume(6);
+    printf("SEG m1 after consume(6) len %d segs %d, "
+           "hdr use_count %d\n",
+           (int) m1->body.length(), m1->body.num_segs(),
+           hdr->use_count());
+
+    hdr.reset();
+    data.reset();
+    m1.reset();
+    t2t2::t2t2_pool_stats  stats;
+    segpool.get_stats(2, stats);
+    cout << "SEG data bucket while m2 holds it: " << stats << endl;
+    m2.reset();
+    segpool.get_stats(2, stats);
+    cout << "SEG data bucket after m2 released: " << stats << endl;
+}
+
+struct watchdog_seen {
+    int alerts;
+    int last_depth;
+    std::string last_name;
+};
+
+static void watchdog_callback(const t2t2::t2t2_hol_alert &alert, void *arg)
+{
+    watchdog_seen * seen = (watchdog_seen *) arg;
+    seen->alerts ++;
+    seen->last_depth = alert.depth;
+    seen->last_name = alert.name;
+}
+
+void watchdog_test(void)
+{
+    my_netmsg::pool_t   pool(4, 1, NULL, NULL);
+    t2t2::t2t2_queue<my_netmsg>  q(NULL, NULL);
+    watchdog_seen  seen = { 0, 0, "" };
+
+    printf("\nnow testing head-of-line watchdog:\n");
+
+    {
+        // a long period, so only check_now looks.
+        t2t2::t2t2_hol_watchdog  wd(3600 * 1000, &watchdog_callback, &seen);
+        // this one was waiting before the watch began.
+        q.enqueue(pool.alloc<my_netmsg>(t2t2::T2T2_NO_WAIT));
+        wd.watch(&q, 10, "stuck_q");
+        int first = wd.check_now();
+        usleep(30000);
+        q.enqueue(pool.alloc<my_netmsg>(t2t2::T2T2_NO_WAIT));
+        int late = wd.check_now();
+        int again = wd.check_now();
+        q.dequeue(t2t2::T2T2_NO_WAIT);
+        // the second message is the new head, and it's 30ms younger.
+        int next = wd.check_now();
+        usleep(30000);
+        int next_late = wd.check_now();
+        printf("WATCHDOG at once %d, late %d, again %d, "
+               "new head %d then %d\n",
+               first, late, again, next, next_late);
+        printf("WATCHDOG alerts %d, last on %s depth %d\n",
+               seen.alerts, seen.last_name.c_str(), seen.last_depth);
+        q.dequeue(t2t2::T2T2_NO_WAIT);
+    }
+
+    {
+        t2t2::t2t2_hol_watchdog  wd(5, &watchdog_callback, &seen);
+        seen.alerts = 0;
+        {
+            // destroyed while watched; it has to unwatch itself.
+            t2t2::t2t2_queue<my_netmsg>  q2(NULL, NULL);
+            wd.watch(&q2, 1000);
+        }
+        wd.watch(&q, 20, "thread_q");
+        q.enqueue(pool.alloc<my_netmsg>(t2t2::T2T2_NO_WAIT));
+        for (int tries = 0; tries < 100 && wd.get_alerts() == 0; tries++)
+            usleep(10000);
+        printf("WATCHDOG thread alerts %d on %s\n",
+               (int) wd.get_alerts(), seen.last_name.c_str());
+        q.dequeue(t2t2::T2T2_NO_WAIT);
+    }
+
+    {
+        // a conflated update takes over the old message's place,
+        // and how long it has waited there.
+        t2t2::t2t2_conflating_queue<my_netmsg>  cq(4, NULL, NULL);
+        t2t2::t2t2_hol_watchdog  wd(3600 * 1000, &watchdog_callback, &seen);
+        wd.watch(&cq, 20, "conflate_q");
+        my_netmsg::sp_t  m = pool.alloc<my_netmsg>(t2t2::T2T2_NO_WAIT);
+        cq.enqueue(m, 1);
+        usleep(30000);
+        m = pool.alloc<my_netmsg>(t2t2::T2T2_NO_WAIT);
+        cq.enqueue(m, 1);
+        printf("WATCHDOG conflated head late %d\n", wd.check_now());
+        cq.dequeue(t2t2::T2T2_NO_WAIT);
+    }
+}
+
+#ifdef T2T2_RT_AUDIT
+static int rt_audit_asserts;
+
+static void rt_audit_assert_handler(t2t2::t2t2_error_t e, bool fatal,
+                                    const char * /*filename*/,
+                                    int /*lineno*/)
+{
+    rt_audit_asserts ++;
+    printf("RT assert %s, %s\n", t2t2::t2t2_error_types[(int)e],
+           fatal ? "FATAL" : "not fatal");
+}
+
+static void *rt_audit_consumer(void *arg)
+{
+    t2t2::t2t2_queue<my_netmsg> * q = (t2t2::t2t2_queue<my_netmsg> *) arg;
+    q->dequeue(t2t2::T2T2_WAIT_FOREVER);
+    return NULL;
+}
+
+static void print_rt_stats(const char *what)
+{
+    t2t2::t2t2_rt_audit_stats  stats;
+    t2t2::t2t2_rt_get_audit_stats(stats, true);
+    printf("RT %s: growths %d waits %d wakeups %d, last %s\n", what,
+           (int) stats.heap_growths, (int) stats.blocking_waits,
+           (int) stats.wakeups,
+           t2t2::t2t2_error_types[(int) stats.last_error]);
+}
+
+void rt_audit_test(void)
+{
+    my_netmsg::pool_t   pool(1, 1, NULL, NULL);
+    t2t2::t2t2_queue<my_netmsg>  q(NULL, NULL);
+    my_netmsg::sp_t     m1, m2;
+    pthread_t           id;
+
+    printf("\nnow testing real-time auditing:\n");
+
+    // outside a section, nothing is counted.
+    pool.alloc(&m1, t2t2::T2T2_GROW);
+    pool.alloc(&m2, t2t2::T2T2_GROW);
+    m1.reset();
+    m2.reset();
+    print_rt_stats("outside");
+
+    {
+        t2t2::t2t2_rt_section  rt;
+        // the pool has 2 buffers now, so only the third grows it.
+        pool.alloc(&m1, t2t2::T2T2_GROW);
+        pool.alloc(&m2, t2t2::T2T2_GROW);
+        print_rt_stats("2 allocs, no growth");
+        my_netmsg::sp_t  m3;
+        pool.alloc(&m3, t2t2::T2T2_GROW);
+        t2t2::t2t2_rt_audit_stats  stats;
+        t2t2::t2t2_rt_get_audit_stats(stats);
+        printf("RT growth blamed on %s\n",
+               stats.last_object == (t2t2::__t2t2_pool *) &pool ?
+               "the pool" : "SOMETHING ELSE");
+        print_rt_stats("3rd alloc");
+        q.dequeue(t2t2::T2T2_NO_WAIT);
+        q.dequeue(1);
+        print_rt_stats("dequeue NO_WAIT then 1ms");
+
+        {
+            // a nested section doesn't end the outer one.
+            t2t2::t2t2_rt_section  inner;
+        }
+        pthread_create(&id, NULL, &rt_audit_consumer, &q);
+        usleep(50000);
+        q.enqueue(m3);
+        pthread_join(id, NULL);
+        q.enqueue(m1);
+        print_rt_stats("enqueues with and without a sleeper");
+
+        q.dequeue(t2t2::T2T2_NO_WAIT);
+        m2.reset();
+        rt_audit_asserts = 0;
+        t2t2::t2t2_assert_handler_t  save = t2t2::t2t2_assert_handler;
+        t2t2::t2t2_assert_handler = &rt_audit_assert_handler;
+        t2t2::t2t2_rt_audit_assert();
+        q.dequeue(1);
+        t2t2::t2t2_rt_audit_assert(false);
+        t2t2::t2t2_assert_handler = save;
+        printf("RT %d asserts\n", rt_audit_asserts);
+        print_rt_stats("asserted wait");
+    }
+    q.dequeue(1);
+    print_rt_stats("after the section");
+
+    {
+        // handing work to an idle reclaimer thread has to wake it.
+        t2t2::t2t2_reclaimer  r(4);
+        r.attach();
+        pool.alloc(&m1, t2t2::T2T2_GROW);
+        {
+            t2t2::t2t2_rt_section  rt;
+            m1.reset();
+            r.flush();
+        }
+        r.detach();
+        print_rt_stats("flush to an idle reclaimer");
+    }
+
+    {
+        // a deadline queue's index only grows past its capacity.
+        t2t2::t2t2_deadline_queue<my_netmsg>  dq(NULL, NULL, 2);
+        my_netmsg::sp_t  m3;
+        pool.alloc(&m1, t2t2::T2T2_GROW);
+        pool.alloc(&m2, t2t2::T2T2_GROW);
+        pool.alloc(&m3, t2t2::T2T2_GROW);
+        {
+            t2t2::t2t2_rt_section  rt;
+            dq.enqueue(m1);
+            dq.enqueue(m2);
+            print_rt_stats("2 deadline enqueues, capacity 2");
+            dq.enqueue(m3);
+            print_rt_stats("3rd deadline enqueue");
+        }
+        while (dq.dequeue(t2t2::T2T2_NO_WAIT))
+            ;
+    }
+}
+#endif
+
+#ifdef T2T2_LEAK_TRACKING
+static my_netmsg::sp_t leak_test_alloc(my_netmsg::pool_t *pool)
+{
+    T2T2_LEAK_SITE();
+    return pool->alloc<my_netmsg>(t2t2::T2T2_NO_WAIT);
+}
+
+void leak_test(void)
+{
+    my_netmsg::pool_t   pool(4, 1, NULL, NULL);
+    my_netmsg::sp_t     held[4];
+
+    printf("\nnow testing leak tracking:\n");
+
+    held[0] = leak_test_alloc(&pool);
+    held[1] = leak_test_alloc(&pool);
+    held[2] = leak_test_alloc(&pool);
+    held[3] = pool.alloc<my_netmsg>(t2t2::T2T2_NO_WAIT);
+    held[1].reset();
+    usleep(20000);
+
+    std::ostringstream  dump;
+    int count = pool.dump_outstanding(0, dump);
+    std::string  d = dump.str();
+    size_t named = d.find("thread2thread2_test.cc:");
+    printf("LEAK %d outstanding, named site %s, first listed %s\n",
+           count,
+           named == std::string::npos ? "MISSING" :
+           d.find(": 2 buffers", named) != std::string::npos ?
+           "has 2" : "WRONG COUNT",
+           d.find("  site ") == named - 7 ? "named" : "other");
+    printf("LEAK %d outstanding for 10 seconds\n",
+           pool.dump_outstanding(10000, dump));
+    cout << d;
+
+    // without a name, every call is its own site, even two calls
+    // to the same alloc.
+    my_netmsg::pool_t   pool2(4, 1, NULL, NULL);
+    my_netmsg::sp_t     a = pool2.alloc<my_netmsg>(t2t2::T2T2_NO_WAIT);
+    my_netmsg::sp_t     b = pool2.alloc<my_netmsg>(t2t2::T2T2_NO_WAIT);
+    t2t2::t2t2_unique_msg<my_netmsg>  c;
+    pool2.alloc(&c, t2t2::T2T2_NO_WAIT);
+    std::ostringstream  dump2;
+    count = pool2.dump_outstanding(0, dump2);
+    std::string  d2 = dump2.str();
+    int sites = 0;
+    for (size_t pos = d2.find("  site "); pos != std::string::npos;
+         pos = d2.find("  site ", pos + 1))
+        sites ++;
+    printf("LEAK %d outstanding at %d sites\n", count, sites);
+}
+#endif
+
+// print the lines of a metrics export which are about name.
+static void print_metrics(const std::string &text, const char *name)
+{
+    std::istringstream  lines(text);
+    std::string  line;
+    while (std::getline(lines, line))
+        if (line.find(name) != std::string::npos)
+            printf("METRICS %s\n", line.c_str());
+}
+
+void metrics_test(void)
+{
+    my_netmsg::pool_t   pool(4, 1, NULL, NULL);
+    t2t2::t2t2_queue<my_netmsg>  q1(NULL, NULL), q2(NULL, NULL);
+    t2t2::t2t2_queue_set<my_netmsg>  qset;
+
+    printf("\nnow testing metrics:\n");
+
+    qset.add_queue(&q1, 1);
+    pool.set_registry_name("netmsg");
+    q1.set_registry_name("in\"bound");
+    qset.set_registry_name("net_set");
+    printf("METRICS second q1 name %s\n",
+           q2.set_registry_name("in\"bound") ? "BAD" : "refused");
+    q1.enqueue(pool.alloc<my_netmsg>(t2t2::T2T2_NO_WAIT));
+    q1.enqueue(pool.alloc<my_netmsg>(t2t2::T2T2_NO_WAIT));
+    qset.dequeue(t2t2::T2T2_NO_WAIT);
+
+    std::ostringstream  text;
+    t2t2::t2t2_metrics_write(text);
+    print_metrics(text.str(), "t2t2_pool_buffers_in_use");
+    print_metrics(text.str(), "t2t2_queue_depth");
+    print_metrics(text.str(), "t2t2_queue_set_dequeues_total");
+
+    {
+        t2t2::t2t2_metrics_exporter  file_exp("0metrics.prom", 3600);
+        bool ok = file_exp.export_now();
+        FILE * f = fopen("0metrics.prom", "r");
+        char line[200];
+        int count = 0;
+        while (f && fgets(line, sizeof(line), f))
+            count ++;
+        if (f)
+            fclose(f);
+        unlink("0metrics.prom");
+        printf("METRICS file export %s, %d lines\n",
+               ok ? "ok" : "FAILED", count);
+    }
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un  sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, "0metrics.sock");
+    unlink(sa.sun_path);
+    bind(lfd, (struct sockaddr *) &sa, sizeof(sa));
+    listen(lfd, 1);
+    {
+        // the whole export fits in the socket buffer,
+        // so this can accept it after the fact.
+        t2t2::t2t2_metrics_exporter  sock_exp("0metrics.sock", 3600, true);
+        bool ok = sock_exp.export_now();
+        int fd = accept(lfd, NULL, NULL);
+        std::string  got;
+        char buf[512];
+        ssize_t cc;
+        while ((cc = read(fd, buf, sizeof(buf))) > 0)
+            got.append(buf, cc);
+        close(fd);
+        printf("METRICS socket export %s, %s\n",
+               ok ? "ok" : "FAILED",
+               got == text.str() ? "same text" : "DIFFERENT text");
+    }
+    close(lfd);
+    unlink("0metrics.sock");
+
+    qset.remove_queue(&q1);
+}
+
+#ifdef T2T2_ENABLE_COROUTINES
+
+// the smallest possible fire-and-forget coroutine type.
+struct coro_task
+{
+    struct promise_type
+    {
+        coro_task get_return_object(void) { return coro_task(); }
+        std::suspend_never initial_suspend(void) noexcept { return {}; }
+        std::suspend_never final_suspend(void) noexcept { return {}; }
+        void return_void(void) { }
+        void unhandled_exception(void) { abort(); }
+    };
+};
+
+static coro_task coro_consumer(my_message_base::queue_t *q,
+                               t2t2::t2t2_executor *ex,
+                               const char *name)
+{
+    while (1)
+    {
+        my_message_base::sp_t  mb = co_await q->async_dequeue(ex);
+        if (mb->a == -1)
+            break;
+        printf("CORO %s got a=%d\n", name, mb->a);
+    }
+    printf("CORO %s exiting\n", name);
+}
+
+static coro_task coro_allocator(pool1and2_t *pool,
+                                my_message_base::queue_t *q,
+                                t2t2::t2t2_executor *ex)
+{
+    printf("CORO allocator waiting for a buffer\n");
+    my_message_base::sp_t  mb =
+        co_await pool->async_alloc_on<my_message_base>(ex, 51, 0);
+    printf("CORO allocator got a buffer\n");
+    q->enqueue(mb);
+}
+
+static coro_task coro_quota_allocator(pool1and2_t *pool, int prio_class,
+                                      my_message_base::sp_t *out)
+{
+    *out = co_await pool->async_alloc_prio<my_message_base>(
+        prio_class, 60 + prio_class, 0);
+    printf("CORO class %d allocator got %s\n",
+           prio_class, *out ? "a buffer" : "NOTHING");
+}
+
+static void *executor_thread(void *arg)
+{
+    t2t2::t2t2_simple_executor * ex = (t2t2::t2t2_simple_executor *) arg;
+    ex->run();
+    return NULL;
+}
+
+void coroutine_test(void)
+{
+    pool1and2_t                 pool(1, 1, NULL, NULL);
+    my_message_base::queue_t    q(NULL, NULL);
+    t2t2::t2t2_simple_executor  ex(NULL, NULL);
+    pthread_t id;
+
+    printf("\nnow testing coroutines:\n");
+    pthread_create(&id, NULL, &executor_thread, &ex);
+
+    // both suspend right away, since q is empty.
+    coro_consumer(&q, &ex, "c1");
+    coro_consumer(&q, &ex, "c2");
+
+    // take the only buffer, so the allocator has to wait.
+    my_message_base::sp_t  held;
+    pool.alloc(&held, t2t2::T2T2_NO_WAIT, 50, 0);
+    coro_allocator(&pool, &q, &ex);
+    usleep(50000);
+
+    // c1 gets this; when c1 drops it, the buffer goes straight
+    // to the allocator, whose message goes to c2.
+    q.enqueue(held);
+    usleep(50000);
+
+    my_message_base::sp_t  spmb;
+    if (pool.alloc(&spmb, t2t2::T2T2_GROW, -1, 0))
+        q.enqueue(spmb);
+    if (pool.alloc(&spmb, t2t2::T2T2_GROW, -1, 0))
+        q.enqueue(spmb);
+    usleep(50000);
+
+    ex.stop();
+    pthread_join(id, NULL);
+    printstats(&pool, "coro");
+
+    // on a pool with quotas, an async alloc waits for its own class;
+    // with no executor, it resumes inside the release.
+    pool1and2_t  qpool(3, 0, NULL, NULL);
+    const int  reserved[2] = { 0, 1 };
+    qpool.set_class_quotas(2, reserved);
+    my_message_base::sp_t  bulk1, bulk2, got0, got1;
+    qpool.alloc(&bulk1, t2t2::T2T2_NO_WAIT, 1, 0);
+    qpool.alloc(&bulk2, t2t2::T2T2_NO_WAIT, 2, 0);
+    // class 0 has the whole shared region out, class 1 doesn't.
+    coro_quota_allocator(&qpool, 0, &got0);
+    coro_quota_allocator(&qpool, 1, &got1);
+    printf("CORO releasing a class 0 buffer\n");
+    bulk1.reset();
+    got0.reset();
+    got1.reset();
+    bulk2.reset();
+    for (int cls = 0; cls < 2; cls++)
+    {
+        t2t2::t2t2_pool_class_stats  stats;
+        qpool.get_class_stats(cls, stats);
+        cout << "CORO quota class " << cls << ": " << stats << endl;
+    }
+}
+
+#endif /* T2T2_ENABLE_COROUTINES */
@@ -0,0 +1,42 @@
+#include "thread2thread2.h"
+#include <fstream>
+
+using namespace std;
+
+namespace t2t2 = Thread2Thread2;
+
+// converts a trace saved by t2t2_trace_save into Chrome trace event
+// JSON, for chrome://tracing or ui.perfetto.dev.
+//
+// usage: t2t2trace trace.bin [trace.json]
+// with no output file, the JSON goes to stdout.
+
+int main(int argc, char ** argv)
+{
+    if (argc != 2 && argc != 3)
+    {
+        fprintf(stderr, "usage: t2t2trace trace.bin [trace.json]\n");
+        return 1;
+    }
+    std::vector<t2t2::t2t2_trace_record>  records;
+    if (!t2t2::t2t2_trace_load(argv[1], records))
+    {
+        fprintf(stderr, "t2t2trace: can't read a trace from %s\n", argv[1]);
+        return 1;
+    }
+    if (argc == 2)
+    {
+        t2t2::t2t2_trace_write_chrome(records, cout);
+        return 0;
+    }
+    ofstream  out(argv[2]);
+    if (!out)
+    {
+        fprintf(stderr, "t2t2trace: can't write %s\n", argv[2]);
+        return 1;
+    }
+    t2t2::t2t2_trace_write_chrome(records, out);
+    fprintf(stderr, "t2t2trace: %d events written to %s\n",
+            (int) records.size(), argv[2]);
+    return 0;
+}